@@ -0,0 +1,92 @@
+#!/bin/sh
+# compare the boot time of a Linux kernel booted with each supported method, results are written as
+# JSON lines like run.sh. The time is measured from the start of mkvm run until the guest prints
+# PATTERN on its serial console.
+# usage: boot_time.sh <mkvm> [options]
+#   --vmlinux FILE   uncompressed kernel with a PVH note, booted with the PVH ABI
+#   --bzimage FILE   compressed kernel, booted with the 64 bits Linux boot protocol
+#   --initrd FILE    initramfs given to every kernel
+#   --cmdline LINE   kernel command line (default: console=ttyS0)
+#   --pattern TEXT   line marking the end of the boot (default: Run /init as init process)
+#   --mem SIZE       guest memory (default: 256M)
+#   --runs N         boots per method, the median is reported (default: 5)
+#   --output FILE    JSON lines output (default: boot_time.json)
+
+MKVM=$1
+shift
+VMLINUX=
+BZIMAGE=
+INITRD=
+CMDLINE="console=ttyS0"
+PATTERN="Run /init as init process"
+MEM=256M
+RUNS=5
+OUTPUT=boot_time.json
+TIMEOUT=30
+FAILED=0
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+    --vmlinux) VMLINUX=$2 ;;
+    --bzimage) BZIMAGE=$2 ;;
+    --initrd) INITRD=$2 ;;
+    --cmdline) CMDLINE=$2 ;;
+    --pattern) PATTERN=$2 ;;
+    --mem) MEM=$2 ;;
+    --runs) RUNS=$2 ;;
+    --output) OUTPUT=$2 ;;
+    *)
+        echo "unknown option $1" >&2
+        exit 2
+        ;;
+    esac
+    shift 2
+done
+
+if [ -z "$MKVM" ] || [ -z "$VMLINUX$BZIMAGE" ]; then
+    echo "usage: boot_time.sh <mkvm> [--vmlinux FILE] [--bzimage FILE] [options]" >&2
+    exit 2
+fi
+
+now_us() {
+    echo $(($(date +%s%N) / 1000))
+}
+
+# boot_once <name> <kernel>, print the microseconds until PATTERN shows up on the console. The VM
+# is shut down from the reading side so the pipeline ends as soon as the pattern is found.
+boot_once() {
+    start=$(now_us)
+    LOGGER_LEVEL=ERROR timeout "$TIMEOUT" "$MKVM" run -n "$1" --mem="$MEM" --kernel="$2" \
+        ${INITRD:+--initrd="$INITRD"} --cmdline="$CMDLINE" </dev/null 2>/dev/null |
+        while IFS= read -r line; do
+            case "$line" in
+            *"$PATTERN"*)
+                echo $(($(now_us) - start))
+                "$MKVM" shutdown -n "$1" >/dev/null 2>&1
+                break
+                ;;
+            esac
+        done
+}
+
+# boot_method <method> <kernel>
+boot_method() {
+    samples=""
+    for run in $(seq "$RUNS"); do
+        value=$(boot_once "boot-$1-$$-$run" "$2")
+        if [ -z "$value" ]; then
+            echo "$1: \"$PATTERN\" not seen on the console" >&2
+            FAILED=1
+            return
+        fi
+        samples="$samples $value"
+    done
+
+    median=$(echo "$samples" | tr ' ' '\n' | sed '/^$/d' | sort -n | sed -n "$(((RUNS + 1) / 2))p")
+    printf '{"bench":"boot","metric":"%s_us","value":%s}\n' "$1" "$median" | tee -a "$OUTPUT"
+}
+
+: >"$OUTPUT"
+[ -n "$VMLINUX" ] && boot_method pvh "$VMLINUX"
+[ -n "$BZIMAGE" ] && boot_method bzimage "$BZIMAGE"
+exit $FAILED
@@ -0,0 +1,109 @@
+    .intel_syntax noprefix
+    .code64
+
+# cycles per clock read with each clock source a guest can use: rdtsc, kvmclock (rdtsc scaled by
+# the pvclock page KVM keeps up to date, no exit) and the PIT counter (three port accesses handled
+# by the in kernel PIT, the fallback when the TSC is not trusted)
+
+    .equ ITERATIONS, 100000
+    .equ PIT_ITERATIONS, 10000
+    .equ PIT_COUNTER0, 0x40
+    .equ PIT_COMMAND, 0x43
+    .equ MSR_KVM_SYSTEM_TIME_NEW, 0x4b564d01
+
+# struct pvclock_vcpu_time_info
+    .equ PVCLOCK_VERSION, 0
+    .equ PVCLOCK_TSC_TIMESTAMP, 8
+    .equ PVCLOCK_SYSTEM_TIME, 16
+    .equ PVCLOCK_TSC_TO_SYSTEM_MUL, 24
+    .equ PVCLOCK_TSC_SHIFT, 28
+
+.section .text._start, "ax"
+.global _start
+_start:
+    mov rsp, 0x80000
+    call bench_init
+
+    call bench_tsc
+    mov r12, rax
+    mov r13, ITERATIONS
+rdtsc_loop:
+    call bench_tsc
+    dec r13
+    jnz rdtsc_loop
+    call bench_tsc
+    sub rax, r12
+    mov rcx, ITERATIONS
+    call report
+
+    # bit 0 enables the clock, KVM fills the page before the next guest entry
+    mov ecx, MSR_KVM_SYSTEM_TIME_NEW
+    mov eax, offset pvclock
+    or eax, 1
+    xor edx, edx
+    wrmsr
+
+    call bench_tsc
+    mov r12, rax
+    mov r13, ITERATIONS
+kvmclock_loop:
+    call kvmclock_read
+    dec r13
+    jnz kvmclock_loop
+    call bench_tsc
+    sub rax, r12
+    mov rcx, ITERATIONS
+    call report
+
+    call bench_tsc
+    mov r12, rax
+    mov r13, PIT_ITERATIONS
+pit_loop:
+    mov al, 0 # latch counter 0
+    out PIT_COMMAND, al
+    in al, PIT_COUNTER0
+    in al, PIT_COUNTER0
+    dec r13
+    jnz pit_loop
+    call bench_tsc
+    sub rax, r12
+    mov rcx, PIT_ITERATIONS
+    call report
+    call bench_exit
+
+# report rax / rcx
+report:
+    xor edx, edx
+    div rcx
+    mov edi, eax
+    jmp bench_result
+
+# rax = guest time in ns, computed like pvclock_clocksource_read: the page is stable while its
+# version is even and unchanged
+kvmclock_read:
+    mov esi, [pvclock + PVCLOCK_VERSION]
+    test esi, 1
+    jnz kvmclock_read
+    call bench_tsc
+    sub rax, [pvclock + PVCLOCK_TSC_TIMESTAMP]
+    movsx ecx, byte ptr [pvclock + PVCLOCK_TSC_SHIFT]
+    test ecx, ecx
+    js kvmclock_shift_right
+    shl rax, cl
+    jmp kvmclock_scale
+kvmclock_shift_right:
+    neg ecx
+    shr rax, cl
+kvmclock_scale:
+    mov ecx, [pvclock + PVCLOCK_TSC_TO_SYSTEM_MUL]
+    mul rcx
+    shrd rax, rdx, 32
+    add rax, [pvclock + PVCLOCK_SYSTEM_TIME]
+    cmp esi, [pvclock + PVCLOCK_VERSION]
+    jne kvmclock_read
+    ret
+
+.data
+.balign 64
+pvclock:
+    .fill 32, 1, 0
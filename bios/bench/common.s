@@ -0,0 +1,154 @@
+    .intel_syntax noprefix
+    .code64
+
+# helpers shared by the benchmark guests, they only clobber rax, rcx, rdx, rsi and rdi
+
+    .equ BENCH_RESULT_PORT, 0xbe1
+    .equ BENCH_EXIT_PORT, 0xbe2
+
+# the guests build their own page tables, the first 4 GiB are identity mapped with 2 MiB pages
+    .equ BENCH_PML4, 0x10000
+    .global bench_pml4
+    .set bench_pml4, BENCH_PML4
+    .equ BENCH_PDPT, 0x11000
+    .equ BENCH_PD, 0x12000 # 4 tables
+
+    .equ MSR_APIC_BASE, 0x1b
+    .equ MSR_X2APIC_EOI, 0x80b
+    .equ MSR_X2APIC_SVR, 0x80f
+    .equ MSR_X2APIC_LINT0, 0x835
+    .equ MSR_X2APIC_LINT1, 0x836
+
+.text
+# load the GDT, the IDT and the page tables. The code segment is reloaded too, the selector set by
+# the VMM does not index the same descriptor in this GDT and iretq would reload it.
+.global bench_init
+bench_init:
+    lgdt [gdt_ptr]
+    push 0x8
+    lea rax, [rip + reload_cs]
+    push rax
+    retfq
+reload_cs:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    lidt [idt_ptr]
+
+    xor ecx, ecx
+pd_loop:
+    mov rax, rcx
+    shl rax, 21
+    or rax, 0x83 # present, writable, 2 MiB page
+    mov [BENCH_PD + rcx * 8], rax
+    inc rcx
+    cmp rcx, 2048
+    jne pd_loop
+
+    xor ecx, ecx
+pdpt_loop:
+    mov rax, rcx
+    shl rax, 12
+    add rax, BENCH_PD | 0x3
+    mov [BENCH_PDPT + rcx * 8], rax
+    inc rcx
+    cmp rcx, 4
+    jne pdpt_loop
+
+    mov qword ptr [BENCH_PML4], BENCH_PDPT | 0x3
+    mov rax, BENCH_PML4
+    mov cr3, rax
+    ret
+
+# switch the local APIC to x2APIC mode, enable it and mask the legacy interrupt lines
+.global bench_x2apic
+bench_x2apic:
+    mov ecx, MSR_APIC_BASE
+    rdmsr
+    or eax, 0xc00
+    wrmsr
+    xor edx, edx
+    mov ecx, MSR_X2APIC_SVR
+    mov eax, 0x1ff
+    wrmsr
+    mov ecx, MSR_X2APIC_LINT0
+    mov eax, 0x10000
+    wrmsr
+    mov ecx, MSR_X2APIC_LINT1
+    wrmsr
+    ret
+
+.global bench_eoi
+bench_eoi:
+    mov ecx, MSR_X2APIC_EOI
+    xor eax, eax
+    xor edx, edx
+    wrmsr
+    ret
+
+# install the interrupt gate of vector rdi, handler rsi
+.global bench_set_vector
+bench_set_vector:
+    shl rdi, 4
+    mov rax, rsi
+    and eax, 0xffff
+    or eax, 0x8 << 16 # code selector
+    mov rdx, 0x8e00 # present interrupt gate
+    shl rdx, 32
+    or rax, rdx
+    mov rdx, rsi
+    shr rdx, 16
+    and edx, 0xffff
+    shl rdx, 48
+    or rax, rdx
+    mov [idt + rdi], rax
+    mov rdx, rsi
+    shr rdx, 32
+    mov [idt + rdi + 8], rdx
+    ret
+
+# rax = TSC, ordered after the previous instructions
+.global bench_tsc
+bench_tsc:
+    lfence
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+# report the 32 bits value in edi
+.global bench_result
+bench_result:
+    mov eax, edi
+    mov dx, BENCH_RESULT_PORT
+    out dx, eax
+    ret
+
+.global bench_exit
+bench_exit:
+    mov dx, BENCH_EXIT_PORT
+    out dx, al
+exit_loop:
+    hlt
+    jmp exit_loop
+
+.data
+.balign 8
+gdt:
+    .quad 0
+    .quad 0x00af9a000000ffff # 0x08: 64 bits code
+    .quad 0x00cf92000000ffff # 0x10: data
+.global gdt_ptr
+gdt_ptr:
+    .word gdt_ptr - gdt - 1
+    .quad gdt
+
+.global idt_ptr
+idt_ptr:
+    .word 256 * 16 - 1
+    .quad idt
+
+.balign 16
+idt:
+    .fill 256 * 16, 1, 0
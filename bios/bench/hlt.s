@@ -0,0 +1,76 @@
+    .intel_syntax noprefix
+    .code64
+
+# cycles between the expiration of a TSC deadline timer armed before a hlt and the timer
+# interrupt handler, the halted vcpu wake up latency
+
+    .equ ITERATIONS, 1000
+    .equ DELAY, 20000 # cycles between the hlt and the deadline
+    .equ TIMER_VECTOR, 0x40
+    .equ MSR_X2APIC_LVT_TIMER, 0x832
+    .equ MSR_TSC_DEADLINE, 0x6e0
+
+.section .text._start, "ax"
+.global _start
+_start:
+    mov rsp, 0x80000
+    call bench_init
+    call bench_x2apic
+    mov edi, TIMER_VECTOR
+    mov rsi, offset timer_handler
+    call bench_set_vector
+
+    mov ecx, MSR_X2APIC_LVT_TIMER
+    mov eax, TIMER_VECTOR | (2 << 17) # TSC deadline mode
+    xor edx, edx
+    wrmsr
+
+    xor r14, r14
+    mov r13, ITERATIONS
+hlt_loop:
+    mov qword ptr [wake_tsc], 0
+    call bench_tsc
+    add rax, DELAY
+    mov r12, rax
+    mov rdx, rax
+    shr rdx, 32
+    mov ecx, MSR_TSC_DEADLINE
+    wrmsr
+    sti
+wait_timer:
+    hlt
+    cmp qword ptr [wake_tsc], 0
+    je wait_timer
+    cli
+    mov rax, [wake_tsc]
+    sub rax, r12
+    add r14, rax
+    dec r13
+    jnz hlt_loop
+
+    mov rax, r14
+    xor edx, edx
+    mov rcx, ITERATIONS
+    div rcx
+    mov edi, eax
+    call bench_result
+    call bench_exit
+
+timer_handler:
+    push rax
+    push rcx
+    push rdx
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov [wake_tsc], rax
+    call bench_eoi
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+
+.data
+.balign 8
+wake_tsc:
+    .quad 0
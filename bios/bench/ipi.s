@@ -0,0 +1,142 @@
+    .intel_syntax noprefix
+    .code64
+
+# cycles of an IPI round trip between two vcpus: vcpu 0 sends a fixed IPI to vcpu 1 and halts
+# until the handler of vcpu 1 sent one back. Both vcpus wait in hlt like an idle guest would, the
+# round trip includes two halted vcpu wake ups. vcpu 1 is started with INIT and SIPI.
+
+    .equ ITERATIONS, 1000
+    .equ PING_VECTOR, 0x42
+    .equ PONG_VECTOR, 0x41
+    .equ MSR_X2APIC_ICR, 0x830
+    .equ ICR_ASSERT, 1 << 14
+    .equ ICR_INIT, 5 << 8
+    .equ ICR_STARTUP, 6 << 8
+
+.section .text._start, "ax"
+.global _start
+_start:
+    mov rsp, 0x80000
+    call bench_init
+    call bench_x2apic
+    mov edi, PING_VECTOR
+    mov rsi, offset ping_handler
+    call bench_set_vector
+    mov edi, PONG_VECTOR
+    mov rsi, offset pong_handler
+    call bench_set_vector
+
+    mov ecx, MSR_X2APIC_ICR
+    mov edx, 1
+    mov eax, ICR_INIT | ICR_ASSERT
+    wrmsr
+    mov eax, offset ap_trampoline
+    shr eax, 12
+    or eax, ICR_STARTUP | ICR_ASSERT
+    wrmsr
+wait_ap:
+    pause
+    cmp dword ptr [ap_ready], 0
+    je wait_ap
+
+    call bench_tsc
+    mov r12, rax
+    mov r13, ITERATIONS
+ping_loop:
+    mov dword ptr [pong], 0
+    mov ecx, MSR_X2APIC_ICR
+    mov edx, 1
+    mov eax, PING_VECTOR | ICR_ASSERT
+    wrmsr
+wait_pong:
+    cli
+    cmp dword ptr [pong], 0
+    jne pong_received
+    sti # the interrupt shadow of sti keeps the wake up from being lost before hlt
+    hlt
+    jmp wait_pong
+pong_received:
+    dec r13
+    jnz ping_loop
+
+    call bench_tsc
+    sub rax, r12
+    xor edx, edx
+    mov rcx, ITERATIONS
+    div rcx
+    mov edi, eax
+    call bench_result
+    call bench_exit
+
+pong_handler:
+    push rax
+    push rcx
+    push rdx
+    mov dword ptr [pong], 1
+    call bench_eoi
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+
+ping_handler:
+    push rax
+    push rcx
+    push rdx
+    mov ecx, MSR_X2APIC_ICR
+    xor edx, edx
+    mov eax, PONG_VECTOR | ICR_ASSERT
+    wrmsr
+    call bench_eoi
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+
+# the startup IPI starts vcpu 1 in real mode at the start of this page, the image lives below
+# 64 KiB so a null data segment reaches every symbol
+    .att_syntax prefix
+    .code16
+.text
+    .balign 4096
+ap_trampoline:
+    cli
+    xorw %ax, %ax
+    movw %ax, %ds
+    lgdtl gdt_ptr
+    movl %cr4, %eax
+    orl $0x20, %eax # PAE
+    movl %eax, %cr4
+    movl $bench_pml4, %eax
+    movl %eax, %cr3
+    movl $0xc0000080, %ecx # EFER
+    rdmsr
+    orl $0x100, %eax # LME
+    wrmsr
+    movl %cr0, %eax
+    orl $0x80000001, %eax # PG | PE
+    movl %eax, %cr0
+    ljmpl $0x8, $ap_long
+
+    .intel_syntax noprefix
+    .code64
+ap_long:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov rsp, 0x70000
+    lidt [idt_ptr]
+    call bench_x2apic
+    mov dword ptr [ap_ready], 1
+    sti
+ap_loop:
+    hlt
+    jmp ap_loop
+
+.data
+.balign 4
+ap_ready:
+    .long 0
+pong:
+    .long 0
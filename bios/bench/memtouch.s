@@ -0,0 +1,49 @@
+    .intel_syntax noprefix
+    .code64
+
+# cycles per 4 KiB page, first for one write per page of untouched memory (EPT faults and host
+# page allocation) then to fill the same pages, the VM needs at least 36 MiB of memory
+
+    .equ REGION_START, 0x400000
+    .equ REGION_SIZE, 0x2000000
+    .equ PAGES, REGION_SIZE / 4096
+
+.section .text._start, "ax"
+.global _start
+_start:
+    mov rsp, 0x80000
+    call bench_init
+
+    call bench_tsc
+    mov r12, rax
+    mov rdi, REGION_START
+    mov r13, PAGES
+touch_loop:
+    mov byte ptr [rdi], 1
+    add rdi, 4096
+    dec r13
+    jnz touch_loop
+
+    call bench_tsc
+    sub rax, r12
+    xor edx, edx
+    mov rcx, PAGES
+    div rcx
+    mov edi, eax
+    call bench_result
+
+    call bench_tsc
+    mov r12, rax
+    mov rdi, REGION_START
+    mov rcx, REGION_SIZE / 8
+    xor eax, eax
+    rep stosq
+
+    call bench_tsc
+    sub rax, r12
+    xor edx, edx
+    mov rcx, PAGES
+    div rcx
+    mov edi, eax
+    call bench_result
+    call bench_exit
@@ -0,0 +1,32 @@
+    .intel_syntax noprefix
+    .code64
+
+# cycles of a write to a guest physical address without memory behind it, the EPT misconfig is
+# decoded by KVM and completed by the VMM
+
+    .equ ITERATIONS, 100000
+    .equ MMIO_ADDR, 0xd0000000
+
+.section .text._start, "ax"
+.global _start
+_start:
+    mov rsp, 0x80000
+    call bench_init
+
+    call bench_tsc
+    mov r12, rax
+    mov r13, ITERATIONS
+    mov rdi, MMIO_ADDR
+mmio_loop:
+    mov [rdi], r13d
+    dec r13
+    jnz mmio_loop
+
+    call bench_tsc
+    sub rax, r12
+    xor edx, edx
+    mov rcx, ITERATIONS
+    div rcx
+    mov edi, eax
+    call bench_result
+    call bench_exit
@@ -0,0 +1,31 @@
+    .intel_syntax noprefix
+    .code64
+
+# cycles of an out to a port the VMM ignores, a full exit to userspace and back
+
+    .equ ITERATIONS, 100000
+    .equ BENCH_NOP_PORT, 0xbe0
+
+.section .text._start, "ax"
+.global _start
+_start:
+    mov rsp, 0x80000
+    call bench_init
+
+    call bench_tsc
+    mov r12, rax
+    mov r13, ITERATIONS
+    mov dx, BENCH_NOP_PORT
+pio_loop:
+    out dx, al
+    dec r13
+    jnz pio_loop
+
+    call bench_tsc
+    sub rax, r12
+    xor edx, edx
+    mov rcx, ITERATIONS
+    div rcx
+    mov edi, eax
+    call bench_result
+    call bench_exit
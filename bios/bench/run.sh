@@ -0,0 +1,42 @@
+#!/bin/sh
+# run the benchmark guests and write their results as JSON lines
+# usage: run.sh <mkvm> <images directory> [output]
+
+MKVM=$1
+IMAGES=$2
+OUTPUT=${3:-bench.json}
+FAILED=0
+
+# run_guest <guest> <vcpus> <memory> <metrics...>, metrics are named in the order the guest
+# reports them
+run_guest() {
+    guest=$1
+    vcpus=$2
+    mem=$3
+    shift 3
+
+    values=$(LOGGER_LEVEL=ERROR timeout 60 "$MKVM" run -n "bench-$guest-$$" --vcpu="$vcpus" \
+        --mem="$mem" --kernel="$IMAGES/$guest.img" </dev/null | sed -n 's/^bench result: //p')
+
+    for metric in "$@"; do
+        value=$(echo "$values" | sed -n 1p)
+        values=$(echo "$values" | sed 1d)
+        if [ -z "$value" ]; then
+            echo "$guest: no result for $metric" >&2
+            FAILED=1
+            continue
+        fi
+        printf '{"bench":"%s","metric":"%s","value":%s}\n' "$guest" "$metric" "$value" |
+            tee -a "$OUTPUT"
+    done
+}
+
+: >"$OUTPUT"
+run_guest pio 1 4M cycles_per_exit
+run_guest mmio 1 4M cycles_per_exit
+run_guest hlt 1 4M wake_cycles
+run_guest memtouch 1 64M first_touch_cycles_per_page fill_cycles_per_page
+run_guest ipi 2 4M cycles_per_round_trip
+run_guest clock 1 4M rdtsc_cycles kvmclock_cycles pit_cycles
+
+exit $FAILED
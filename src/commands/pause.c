@@ -92,6 +92,12 @@ MiniKVMError mini_kvm_pause(int argc, char **argv) {
         goto close_socket;
     }
 
+    // another client may have changed the state since it was read
+    if (res.error != MINI_KVM_SUCCESS) {
+        INFO("pause: VM %s is no longer running, exiting ...", args.name);
+        goto close_socket;
+    }
+
     INFO("VM %s successfuly paused", args.name);
 
 close_socket:
@@ -6,8 +6,13 @@
 #include "core/errors.h"
 #include "core/filesystem.h"
 #include "core/logger.h"
+#include "core/probes.h"
 #include "ipc/ipc.h"
+#include "ipc/server.h"
+#include "kvm/acpi.h"
+#include "kvm/cpuid.h"
 #include "kvm/kvm.h"
+#include "kvm/loader.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -24,14 +29,15 @@
 #include <sys/un.h>
 #include <unistd.h>
 
-static volatile sig_atomic_t sig_status = 0;
-static void set_signal_status(int signo) { sig_status = signo; }
-
 static const struct option opts_def[] = {
     {"name", required_argument, NULL, 'n'},   {"log", optional_argument, NULL, 'l'},
     {"help", no_argument, NULL, 'h'},         {"vcpu", required_argument, NULL, 'v'},
     {"disk", required_argument, NULL, 'd'},   {"mem", required_argument, NULL, 'm'},
-    {"kernel", required_argument, NULL, 'k'}, {0, 0, 0, 0}};
+    {"kernel", required_argument, NULL, 'k'}, {"profile-startup", no_argument, NULL, 'p'},
+    {"cmdline", required_argument, NULL, 'c'}, {"initrd", required_argument, NULL, 'i'},
+    {"tsc-khz", required_argument, NULL, 't'}, {"cpu", required_argument, NULL, 'C'},
+    {"sync-regs", no_argument, NULL, 's'},
+    {0, 0, 0, 0}};
 
 static inline uint64_t aligned_to_pages(uint64_t mem_size) {
     return (mem_size % PAGE_SIZE == 0) ? mem_size : mem_size - mem_size % PAGE_SIZE + PAGE_SIZE;
@@ -80,6 +86,16 @@ void run_print_help() {
     printf("\t--log/-l: enable logging, can specify an output file with --log=output.txt\n");
     printf("\t--mem/-m: memory allocated to the virtual machine in bytes\n");
     printf("\t--vcpu/-v: number of vcpus dedicated to the virtual machine\n");
+    printf("\t--kernel/-k: kernel image, a flat binary, an ELF64 file or a Linux bzImage\n");
+    printf("\t--cmdline/-c: command line of a Linux kernel (default: " LINUX_DEFAULT_CMDLINE ")\n");
+    printf("\t--initrd/-i: initial ramdisk of a Linux kernel\n");
+    printf("\t--tsc-khz/-t: TSC frequency of the vcpus in kHz (default: host frequency)\n");
+    printf("\t--cpu/-C: CPU model and feature overrides, model[,+feature][,-feature]... "
+           "(default: " MINI_KVM_CPU_HOST ", --cpu=help lists them)\n");
+    printf("\t--sync-regs/-s: publish the registers after every exit, not only when status asks "
+           "for them\n");
+    printf("\t--profile-startup/-p: print the duration of each startup phase once the guest "
+           "starts\n");
     printf("\t--help/-h: print this message\n");
 }
 
@@ -87,11 +103,12 @@ MiniKVMError run_parse_args(int argc, char **argv, MiniKvmRunArgs *args) {
     MiniKVMError ret = 0;
     int32_t index = 0;
     char c = 0;
-    FILE *kernel_file = NULL;
+    struct stat kernel_stat = {0}, initrd_stat = {0};
     uint32_t name_len = 0;
+    uint64_t tsc_khz = 0;
 
     while (c != -1 && ret != MINI_KVM_ARGS_FAILED) {
-        c = getopt_long(argc, argv, "l::v:d:m:n:k:h", opts_def, &index);
+        c = getopt_long(argc, argv, "l::v:d:m:n:k:c:i:t:C:sph", opts_def, &index);
 
         // TODO: enable support for disk option
         switch (c) {
@@ -123,21 +140,55 @@ MiniKVMError run_parse_args(int argc, char **argv, MiniKvmRunArgs *args) {
             break;
 
         case 'k':
-            kernel_file = fopen(optarg, "rb");
-            if (kernel_file == NULL) {
+            // the image is not read here, load_kernel maps it in guest memory
+            args->kernel_fd = open(optarg, O_RDONLY | O_CLOEXEC);
+            if (args->kernel_fd < 0 || fstat(args->kernel_fd, &kernel_stat) < 0) {
                 ERROR("unable to open kernel code (%s)", strerror(errno));
                 ret = MINI_KVM_ARGS_FAILED;
+                break;
+            }
+            args->kernel_size = kernel_stat.st_size;
+            break;
+
+        case 'c':
+            args->cmdline = optarg;
+            break;
+
+        case 'i':
+            args->initrd_fd = open(optarg, O_RDONLY | O_CLOEXEC);
+            if (args->initrd_fd < 0 || fstat(args->initrd_fd, &initrd_stat) < 0) {
+                ERROR("unable to open initrd (%s)", strerror(errno));
+                ret = MINI_KVM_ARGS_FAILED;
+                break;
             }
+            args->initrd_size = initrd_stat.st_size;
+            break;
 
-            // trick to get the size in bytes of the file (needed for allocating correct mem size)
-            fseek(kernel_file, 0, SEEK_END);
-            args->kernel_size = ftell(kernel_file);
-            fseek(kernel_file, 0, SEEK_SET);
+        case 't':
+            mini_kvm_to_uint(optarg, strlen(optarg), &tsc_khz);
+            if (!mini_kvm_is_uint(optarg, strlen(optarg)) || tsc_khz == 0 || tsc_khz > UINT32_MAX) {
+                ERROR("--tsc-khz expect a frequency in kHz, got : %s", optarg);
+                ret = MINI_KVM_ARGS_FAILED;
+                break;
+            }
+            args->tsc_khz = tsc_khz;
+            break;
+
+        case 'C':
+            if (strcmp(optarg, "help") == 0) {
+                mini_kvm_cpuid_print_models(stdout);
+                ret = MINI_KVM_ARGS_FAILED;
+                break;
+            }
+            args->cpu = optarg;
+            break;
 
-            args->kernel_code = malloc(sizeof(uint8_t) * args->kernel_size);
-            fread(args->kernel_code, 1, args->kernel_size, kernel_file);
-            fclose(kernel_file);
+        case 's':
+            args->sync_regs = true;
+            break;
 
+        case 'p':
+            args->profile_startup = true;
             break;
 
         case 'h':
@@ -150,17 +201,26 @@ MiniKVMError run_parse_args(int argc, char **argv, MiniKvmRunArgs *args) {
 
     // set default vcpu number to one
     args->vcpu = (args->vcpu == 0) ? 1 : args->vcpu;
+    args->cmdline = (args->cmdline == NULL) ? LINUX_DEFAULT_CMDLINE : args->cmdline;
 
     return ret;
 }
 
+// Linux bzImages are booted with the 64 bits boot protocol and ELF images with a PVH note with the
+// PVH boot ABI. Other ELF images are placed at the physical address of their segments and other
+// files are flat binaries loaded at addr.
 static MiniKVMError load_kernel(Kvm *kvm, MiniKvmRunArgs *args, uint64_t addr) {
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+    uint64_t entry = addr, boot_params = 0;
+    bool pvh = false;
+    MiniKvmLinuxBoot boot = {args->cmdline, args->initrd_fd, args->initrd_size};
+
     if (kvm == NULL || args == NULL) {
         ERROR("kvm or args are initialized, unable to load kernel in guest memory");
         return MINI_KVM_INTERNAL_ERROR;
     }
 
-    if (args->kernel_code == NULL || args->kernel_size == 0) {
+    if (args->kernel_fd < 0 || args->kernel_size == 0) {
         ERROR("kernel code is empty");
         return MINI_KVM_INTERNAL_ERROR;
     }
@@ -170,10 +230,25 @@ static MiniKVMError load_kernel(Kvm *kvm, MiniKvmRunArgs *args, uint64_t addr) {
         return MINI_KVM_INTERNAL_ERROR;
     }
 
-    uint64_t *start = (uint64_t *)((uint8_t *)kvm->mem + addr);
-    memcpy(start, args->kernel_code, args->kernel_size);
+    if (mini_kvm_is_bzimage(args->kernel_fd)) {
+        ret = mini_kvm_load_bzimage(kvm, args->kernel_fd, args->kernel_size, &boot, &entry);
+        boot_params = LINUX_BOOT_PARAMS_ADDR;
+    } else if ((pvh = mini_kvm_is_pvh(args->kernel_fd, args->kernel_size))) {
+        ret = mini_kvm_load_pvh(kvm, args->kernel_fd, args->kernel_size, &boot, &entry);
+    } else if (mini_kvm_is_elf(args->kernel_fd)) {
+        ret = mini_kvm_load_elf(kvm, args->kernel_fd, args->kernel_size, &entry);
+    } else {
+        ret = mini_kvm_load_file(kvm, args->kernel_fd, 0, args->kernel_size, addr);
+    }
+    if (ret != MINI_KVM_SUCCESS) {
+        return ret;
+    }
+    MINI_KVM_PROBE(kernel_load, entry, args->kernel_size);
 
-    return MINI_KVM_SUCCESS;
+    if (pvh) {
+        return mini_kvm_set_entry_32(kvm, entry, PVH_START_INFO_ADDR);
+    }
+    return mini_kvm_set_entry(kvm, entry, boot_params);
 }
 
 static MiniKVMError init_filesystem(char *name, Kvm *kvm) {
@@ -239,22 +314,10 @@ close_main_dir:
     return ret;
 }
 
-static void run_set_signals() {
-    if (signal(SIGINT, set_signal_status) == SIG_ERR) {
-        WARN("unable to register to signal SIGINT");
-    }
-
-    if (signal(SIGTERM, set_signal_status) == SIG_ERR) {
-        WARN("unable to register to signal SIGINT");
-    }
-}
-
 static MiniKVMError run_main_loop(Kvm *kvm) {
     MiniKVMError ret = MINI_KVM_SUCCESS;
-    int32_t remote_sock = 0;
     struct sockaddr_un socket_addr = {0};
-    MiniKvmStatusCommand cmd = {0};
-    MiniKvmStatusResult res = {0};
+    MiniKvmServer server;
 
     // create main ipc socket
     ret = mini_kvm_ipc_create_socket(kvm, &socket_addr);
@@ -262,32 +325,24 @@ static MiniKVMError run_main_loop(Kvm *kvm) {
         goto out;
     }
 
+    // the server must be initialized before the vcpu threads are created, they inherit its signal
+    // mask
+    ret = mini_kvm_server_init(&server, kvm);
+    if (ret != MINI_KVM_SUCCESS) {
+        goto clean_server;
+    }
+    mini_kvm_startup_end(&kvm->startup, MINI_KVM_STARTUP_CONTROL);
+
     // start vm
     ret = mini_kvm_start_vm(kvm);
     if (ret != MINI_KVM_SUCCESS) {
-        goto out;
+        goto clean_server;
     }
 
-    while (kvm->state != MINI_KVM_SHUTDOWN) {
-        remote_sock = mini_kvm_ipc_receive_cmd(kvm);
-        if (remote_sock > 0) {
-            // commands are handled until the socket is closed by the remote
-            while (recv(remote_sock, &cmd, sizeof(MiniKvmStatusCommand), 0) > 0) {
-                mini_kvm_status_handle_command(kvm, &cmd, &res);
-                send(remote_sock, &res, sizeof(res), 0);
-            }
-        } else if (remote_sock < 0) {
-            WARN("unable to receive command");
-        }
-
-        if (sig_status == SIGINT || sig_status == SIGTERM) {
-            kvm->state = MINI_KVM_SHUTDOWN;
-            mini_kvm_send_sig(kvm, SIGVMSHUTDOWN);
-        }
-
-        usleep(100000);
-    }
+    ret = mini_kvm_server_run(&server);
 
+clean_server:
+    mini_kvm_server_clean(&server);
 out:
     return ret;
 }
@@ -295,12 +350,16 @@ out:
 MiniKVMError mini_kvm_run(int argc, char **argv) {
     MiniKVMError ret = 0;
     Kvm *kvm = NULL;
-    MiniKvmRunArgs args = {0};
+    MiniKvmRunArgs args = {.kernel_fd = -1, .initrd_fd = -1};
+    MiniKvmStartupProfile startup;
 
+    mini_kvm_startup_start(&startup);
     ret = run_parse_args(argc, argv, &args);
     if (ret != 0) {
         goto out;
     }
+    // the vcpu threads log from their exit loop, keep formatting and writes out of it
+    logger_start();
     INFO("mini_kvm: argument parsing successful, starts initialization");
 
     kvm = calloc(1, sizeof(Kvm));
@@ -309,54 +368,78 @@ MiniKVMError mini_kvm_run(int argc, char **argv) {
         ERROR("failed to allocate mini kvm struct");
         goto out;
     }
+    kvm->startup = startup;
+    kvm->profile_startup = args.profile_startup;
+    kvm->tsc_khz = args.tsc_khz;
+    kvm->sync_regs = args.sync_regs;
+    mini_kvm_startup_end(&kvm->startup, MINI_KVM_STARTUP_ARGS);
 
     ret = mini_kvm_setup_kvm(kvm, args.mem_size);
     if (ret != 0) {
         goto clean_kvm;
     }
 
-    for (uint32_t i = 0; i < args.vcpu; i++) {
-        ret = mini_kvm_add_vcpu(kvm);
-        if (ret != MINI_KVM_SUCCESS) {
-            goto clean_kvm;
-        }
+    // every vcpu gets the CPUID table of the VM when it is created
+    ret = mini_kvm_cpuid_apply(kvm, args.cpu);
+    if (ret != MINI_KVM_SUCCESS) {
+        goto clean_kvm;
     }
+    mini_kvm_startup_end(&kvm->startup, MINI_KVM_STARTUP_SETUP_KVM);
+
+    ret = mini_kvm_add_vcpus(kvm, args.vcpu);
+    if (ret != MINI_KVM_SUCCESS) {
+        goto clean_kvm;
+    }
+    mini_kvm_startup_end(&kvm->startup, MINI_KVM_STARTUP_VCPUS);
 
     ret = mini_kvm_configure_paging(kvm);
     if (ret != 0) {
         goto clean_kvm;
     }
+    mini_kvm_startup_end(&kvm->startup, MINI_KVM_STARTUP_PAGING);
     INFO("paging configured");
 
+    // the loaders pass the ACPI root pointer to Linux kernels
+    ret = mini_kvm_setup_acpi(kvm);
+    if (ret == MINI_KVM_SUCCESS) {
+        ret = mini_kvm_setup_mptable(kvm);
+    }
+    if (ret != MINI_KVM_SUCCESS) {
+        goto clean_kvm;
+    }
+    mini_kvm_startup_end(&kvm->startup, MINI_KVM_STARTUP_TABLES);
+
     ret = load_kernel(kvm, &args, BOOTLOADER_ADDR);
     if (ret != 0) {
         goto clean_kvm;
     }
+    mini_kvm_startup_end(&kvm->startup, MINI_KVM_STARTUP_LOAD_KERNEL);
     INFO("kernel loaded in guest memory");
 
     if (args.name != NULL && args.name[0] != '\0') {
         kvm->name = malloc(sizeof(char) * (strlen(args.name) + 1));
         strncpy(kvm->name, args.name, strlen(args.name) + 1);
         if (init_filesystem(args.name, kvm)) {
-            goto clean_kernel;
+            goto clean_kvm;
         }
         INFO("filesystem initialized for VM %s", args.name);
     }
+    mini_kvm_startup_end(&kvm->startup, MINI_KVM_STARTUP_FILESYSTEM);
 
-    run_set_signals();
     run_main_loop(kvm);
 
     if (args.name != NULL) {
         rmrf(kvm->fs_path);
     }
 
-clean_kernel:
-    if (args.kernel_code != NULL) {
-        free(args.kernel_code);
-    }
-
 clean_kvm:
     mini_kvm_clean_kvm(kvm);
 out:
+    if (args.kernel_fd >= 0) {
+        close(args.kernel_fd);
+    }
+    if (args.initrd_fd >= 0) {
+        close(args.initrd_fd);
+    }
     return ret;
 }
@@ -7,10 +7,17 @@
 typedef struct MiniKvmRunArgs {
     char *name;
     bool log_enabled;
+    bool profile_startup;
+    bool sync_regs; // publish the registers after every exit instead of on request
     uint32_t vcpu;
     uint64_t mem_size;
     uint64_t kernel_size;
-    uint8_t *kernel_code;
+    int32_t kernel_fd; // the image is mapped in guest memory by load_kernel, -1 if not given
+    char *cmdline;     // Linux kernels only
+    uint64_t initrd_size;
+    int32_t initrd_fd; // Linux kernels only, -1 if not given
+    uint32_t tsc_khz;  // 0 keeps the host TSC frequency
+    char *cpu;         // CPU model and feature overrides, NULL keeps the host model
 } MiniKvmRunArgs;
 
 #endif /* MINI_KVM_RUN_COMMAND */
@@ -8,7 +8,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -17,18 +16,30 @@
 #include "core/constants.h"
 #include "core/core.h"
 #include "core/errors.h"
+#include "core/hexdump.h"
 #include "core/logger.h"
+#include "core/probes.h"
+#include "core/sparse.h"
 #include "ipc/ipc.h"
+#include "kvm/binstats.h"
+#include "kvm/cpuid.h"
 #include "kvm/kvm.h"
 
 typedef MiniKVMError (*CommandHandler)(Kvm *, MiniKvmStatusCommand *, MiniKvmStatusResult *);
 
 static const int64_t MEM_RANGE_DEFAULTS[] = {0, -1, 2, 16};
+#define MEM_DUMP_CHUNK_SIZE (1 << 20)
+#define MEM_DUMP_MAX_LINE 4096 // chunks hold whole lines, the formatter buffer is sized by them
+#define MEM_SAVE_THREADS 4
 
 static const struct option opts_def[] = {
-    {"name", required_argument, NULL, 'n'}, {"vcpu", required_argument, NULL, 'v'},
-    {"regs", no_argument, NULL, 'r'},       {"mem", required_argument, NULL, 'm'},
-    {"help", no_argument, NULL, 'h'},       {0, 0, 0, 0}};
+    {"name", required_argument, NULL, 'n'},     {"vcpu", required_argument, NULL, 'v'},
+    {"regs", no_argument, NULL, 'r'},           {"mem", required_argument, NULL, 'm'},
+    {"raw", no_argument, NULL, 'R'},            {"ascii", no_argument, NULL, 'a'},
+    {"mem-save", required_argument, NULL, 's'}, {"stats", optional_argument, NULL, 'S'},
+    {"kvm-stats", no_argument, NULL, 'K'},      {"startup", no_argument, NULL, 'P'},
+    {"cpuid", no_argument, NULL, 'C'},          {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0}};
 
 static void status_print_help() {
     printf("USAGE:\n\tmini_kvm status [options] ...\n");
@@ -38,6 +49,15 @@ static void status_print_help() {
     printf("\t--vcpus/-v: specify a target VCPU list\n");
     printf(
         "\t--mem/-m: dump memory format is start_addr,[,end_addr][,word_size][,bytes_per_line]\n");
+    printf("\t--raw/-R: write the memory dump as raw bytes on stdout instead of formatting it\n");
+    printf("\t--ascii/-a: add an ASCII column to the formatted memory dump\n");
+    printf("\t--mem-save/-s: save the memory range given by --mem (all memory by default) to a "
+           "sparse file\n");
+    printf("\t--stats/-S[=reset]: show the VCPU exit counters and latency histograms, reset starts "
+           "a new measure period\n");
+    printf("\t--kvm-stats/-K: show the VM and VCPU statistics maintained by KVM\n");
+    printf("\t--startup/-P: show the duration of each startup phase of the VM\n");
+    printf("\t--cpuid/-C: show the CPUID table of the vcpus and the features it enables\n");
     printf("\t--help/-h: print this message\n");
 }
 
@@ -47,7 +67,7 @@ static MiniKVMError status_parse_args(int argc, char **argv, MiniKvmStatusArgs *
     char c = 0;
 
     while (c != -1 && ret != MINI_KVM_ARGS_FAILED) {
-        c = getopt_long(argc, argv, "n:v:rm:h", opts_def, &index);
+        c = getopt_long(argc, argv, "n:v:rm:Ras:S::KPCh", opts_def, &index);
 
         switch (c) {
         case 'n':
@@ -74,6 +94,40 @@ static MiniKVMError status_parse_args(int argc, char **argv, MiniKvmStatusArgs *
             args->cmds[args->cmd_count] = MINI_KVM_COMMAND_DUMP_MEM;
             args->cmd_count += 1;
             break;
+        case 'R':
+            args->raw = true;
+            break;
+        case 'a':
+            args->ascii = true;
+            break;
+        case 's':
+            args->mem_save = strdup(optarg);
+            break;
+        case 'S':
+            if (optarg != NULL && strcmp(optarg, "reset") != 0) {
+                ERROR("invalid stats option %s", optarg);
+                ret = MINI_KVM_ARGS_FAILED;
+            }
+            args->stats = true;
+            args->cmds[args->cmd_count] =
+                (optarg != NULL) ? MINI_KVM_COMMAND_RESET_STATS : MINI_KVM_COMMAND_SHOW_STATS;
+            args->cmd_count += 1;
+            break;
+        case 'K':
+            args->kvm_stats = true;
+            args->cmds[args->cmd_count] = MINI_KVM_COMMAND_SHOW_KVM_STATS;
+            args->cmd_count += 1;
+            break;
+        case 'P':
+            args->startup = true;
+            args->cmds[args->cmd_count] = MINI_KVM_COMMAND_SHOW_STARTUP;
+            args->cmd_count += 1;
+            break;
+        case 'C':
+            args->cpuid = true;
+            args->cmds[args->cmd_count] = MINI_KVM_COMMAND_SHOW_CPUID;
+            args->cmd_count += 1;
+            break;
         case 'h':
         case '?':
             ret = MINI_KVM_ARGS_FAILED;
@@ -82,8 +136,14 @@ static MiniKVMError status_parse_args(int argc, char **argv, MiniKvmStatusArgs *
     }
 
     // if no vcpu list was given, mini_kvm select all vcpus
-    if (args->vcpus == 0 && args->regs) {
-        args->vcpus = !0;
+    if (args->vcpus == 0 && (args->regs || args->stats || args->kvm_stats)) {
+        args->vcpus = ~0UL;
+    }
+
+    // saving memory without a range saves all of it
+    if (args->mem_save != NULL && args->mem_range == NULL) {
+        args->cmds[args->cmd_count] = MINI_KVM_COMMAND_DUMP_MEM;
+        args->cmd_count += 1;
     }
 
     // if no other command has been specified, fallback to show state command
@@ -101,21 +161,25 @@ static MiniKVMError status_build_command(MiniKvmStatusArgs *args, uint32_t cmd_i
 
     switch (type) {
     case MINI_KVM_COMMAND_SHOW_STATE:
+    case MINI_KVM_COMMAND_SHOW_STARTUP:
+    case MINI_KVM_COMMAND_SHOW_CPUID:
         cmd->type = type;
         break;
     case MINI_KVM_COMMAND_SHOW_REGS:
+    case MINI_KVM_COMMAND_SHOW_STATS:
+    case MINI_KVM_COMMAND_RESET_STATS:
+    case MINI_KVM_COMMAND_SHOW_KVM_STATS:
         cmd->type = type;
         cmd->vcpus = args->vcpus;
         break;
     case MINI_KVM_COMMAND_DUMP_MEM:
         cmd->type = type;
-        for (uint32_t i = 0; i < args->mem_range->len; i++) {
+        for (uint32_t i = 0; args->mem_range != NULL && i < args->mem_range->len; i++) {
             cmd->mem_range[i] = args->mem_range->tab[i];
         }
-        for (uint32_t i = args->mem_range->len; i < 4; i++) {
+        for (uint32_t i = (args->mem_range != NULL) ? args->mem_range->len : 0; i < 4; i++) {
             cmd->mem_range[i] = MEM_RANGE_DEFAULTS[i];
         }
-        cmd->pid = getpid();
         break;
     default:
         break;
@@ -143,17 +207,131 @@ out:
     return ret;
 }
 
-void status_handle_command_result(MiniKvmStatusArgs *args, MiniKvmStatusResult *res) {
+// receive the guest memory streamed after a dump reply and print it formatted or raw
+static MiniKVMError status_recv_mem(MiniKvmStatusArgs *args, int32_t sock,
+                                    MiniKvmStatusResult *res) {
+    uint64_t addr = res->mem_range[0], remaining = res->mem_range[1] - res->mem_range[0];
+    uint64_t line = res->mem_range[3];
+    uint64_t chunk_size = (line > 0) ? MEM_DUMP_CHUNK_SIZE - MEM_DUMP_CHUNK_SIZE % line : 0;
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+    MiniKvmHexDump dump = {0};
+    uint8_t *chunk = NULL;
+    uint64_t len = 0;
+
+    // a line longer than a chunk would never consume the range
+    if (chunk_size == 0) {
+        ERROR("invalid memory dump line of %ld bytes", res->mem_range[3]);
+        return MINI_KVM_STATUS_COMMAND_FAILED;
+    }
+
+    if (!args->raw) {
+        printf("mem dump: @%ld -> @%ld\n", res->mem_range[0], res->mem_range[1]);
+        fflush(stdout);
+    }
+
+    chunk = malloc(chunk_size);
+    ret = mini_kvm_hexdump_init(&dump, STDOUT_FILENO, res->mem_range[2], res->mem_range[3],
+                                args->ascii);
+    if (chunk == NULL || ret != MINI_KVM_SUCCESS) {
+        ERROR("unable to allocate memory dump buffers");
+        ret = MINI_KVM_FAILED_ALLOCATION;
+        goto out;
+    }
+
+    while (remaining > 0) {
+        len = (remaining < chunk_size) ? remaining : chunk_size;
+        if (mini_kvm_ipc_recv_data(sock, chunk, len) < 0) {
+            ret = MINI_KVM_STATUS_COMMAND_FAILED;
+            break;
+        }
+
+        if (args->raw) {
+            fwrite(chunk, 1, len, stdout);
+        } else if (mini_kvm_hexdump_write(&dump, chunk, addr, len) != MINI_KVM_SUCCESS) {
+            ret = MINI_KVM_STATUS_COMMAND_FAILED;
+            break;
+        }
+        addr += len;
+        remaining -= len;
+    }
+
+out:
+    fflush(stdout);
+    mini_kvm_hexdump_close(&dump);
+    free(chunk);
+    return ret;
+}
+
+// receive the guest memory streamed after a dump reply and write it to a sparse file, file offsets
+// are guest physical addresses
+static MiniKVMError status_save_mem(MiniKvmStatusArgs *args, int32_t sock,
+                                    MiniKvmStatusResult *res) {
+    uint64_t addr = res->mem_range[0], end = res->mem_range[1];
+    uint64_t start_ns = mini_kvm_now_ns(), elapsed = 0;
+    MiniKvmSparseWriter writer = {0};
+    MiniKvmSparseStats stats = {0};
+    MiniKvmSparseChunk *chunk = NULL;
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+    int32_t fd = -1;
+
+    fd = open(args->mem_save, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ERROR("unable to open %s (%s)", args->mem_save, strerror(errno));
+        return MINI_KVM_STATUS_COMMAND_FAILED;
+    }
+
+    ret = mini_kvm_sparse_writer_init(&writer, fd, end, MEM_SAVE_THREADS);
+    while (ret == MINI_KVM_SUCCESS && addr < end) {
+        chunk = mini_kvm_sparse_writer_get(&writer);
+        chunk->offset = addr;
+        chunk->len = (end - addr < MINI_KVM_SPARSE_BUFFER_SIZE) ? end - addr
+                                                                : MINI_KVM_SPARSE_BUFFER_SIZE;
+        if (mini_kvm_ipc_recv_data(sock, chunk->data, chunk->len) < 0) {
+            ret = MINI_KVM_STATUS_COMMAND_FAILED;
+            break;
+        }
+
+        mini_kvm_sparse_writer_submit(&writer, chunk);
+        addr += chunk->len;
+    }
+
+    if (mini_kvm_sparse_writer_finish(&writer, &stats) != MINI_KVM_SUCCESS || fsync(fd) < 0) {
+        ret = MINI_KVM_STATUS_COMMAND_FAILED;
+    }
+    close(fd);
+    elapsed = mini_kvm_now_ns() - start_ns;
+
+    if (ret == MINI_KVM_SUCCESS) {
+        printf("saved @%ld -> @%ld to %s in %.3f s (%.1f MB/s), %lu bytes written, %.2f%% sparse\n",
+               res->mem_range[0], res->mem_range[1], args->mem_save, elapsed / 1e9,
+               (end - res->mem_range[0]) / 1e6 / (elapsed / 1e9), stats.data_bytes,
+               100.0 * stats.hole_bytes / (end - res->mem_range[0]));
+    }
+
+    return ret;
+}
+
+MiniKVMError status_handle_command_result(MiniKvmStatusArgs *args, int32_t sock,
+                                          MiniKvmStatusResult *res) {
     if (res->error != MINI_KVM_SUCCESS) {
         switch (res->error) {
         case MINI_KVM_STATUS_CMD_VM_NOT_PAUSED:
             printf("VM %s is not paused, please pause the VM before sending request\n", args->name);
             break;
+        case MINI_KVM_STATUS_CMD_VM_NOT_RUNNING:
+            printf("VM %s is not running\n", args->name);
+            break;
+        case MINI_KVM_STATUS_CMD_INVALID_MEM_RANGE:
+            printf("invalid memory range for VM %s\n", args->name);
+            break;
+        case MINI_KVM_IPC_PROTOCOL_ERROR:
+            printf("VM %s rejected a malformed request\n", args->name);
+            break;
         default:
             break;
         }
 
-        return;
+        return MINI_KVM_SUCCESS;
     }
 
     switch (res->cmd_type) {
@@ -175,9 +353,37 @@ void status_handle_command_result(MiniKvmStatusArgs *args, MiniKvmStatusResult *
             mini_kvm_print_sregs(&res->sregs[index]);
         }
         break;
+    case MINI_KVM_COMMAND_SHOW_STATS:
+    case MINI_KVM_COMMAND_RESET_STATS:
+        for (uint64_t index = 0; index < MINI_KVM_MAX_VCPUS; index++) {
+            if ((res->vcpus & (1UL << index)) != 0) {
+                printf("VCPU %lu stats\n", index);
+                mini_kvm_print_stats(&res->stats[index]);
+            }
+        }
+        break;
+    case MINI_KVM_COMMAND_SHOW_KVM_STATS:
+        if (res->kvm_stats_len == 0) {
+            printf("KVM binary stats are not available\n");
+        }
+        mini_kvm_binstats_print(res->kvm_stats, res->kvm_stats_len);
+        break;
+    case MINI_KVM_COMMAND_SHOW_STARTUP:
+        mini_kvm_startup_print(&res->startup, stdout);
+        break;
+    case MINI_KVM_COMMAND_SHOW_CPUID:
+        mini_kvm_cpuid_print(res->cpuid, res->cpuid_len, stdout);
+        break;
+    case MINI_KVM_COMMAND_DUMP_MEM:
+        if (args->mem_save != NULL) {
+            return status_save_mem(args, sock, res);
+        }
+        return status_recv_mem(args, sock, res);
     default:
         break;
     }
+
+    return MINI_KVM_SUCCESS;
 }
 
 MiniKVMError mini_kvm_status(int argc, char **argv) {
@@ -214,7 +420,11 @@ MiniKVMError mini_kvm_status(int argc, char **argv) {
             goto close_socket;
         }
 
-        status_handle_command_result(&args, &res);
+        ret = status_handle_command_result(&args, sock, &res);
+        mini_kvm_status_clean_result(&res);
+        if (ret != 0) {
+            goto close_socket;
+        }
     }
 
 close_socket:
@@ -227,6 +437,7 @@ clean:
     if (args.mem_range) {
         vec_free(args.mem_range);
     }
+    free(args.mem_save);
 
     return ret;
 }
@@ -240,80 +451,182 @@ static MiniKVMError status_handle_cmd_state(Kvm *kvm,
 
 static MiniKVMError status_handle_regs(Kvm *kvm, MiniKvmStatusCommand *cmd,
                                        MiniKvmStatusResult *res) {
-    if (kvm->state != MINI_KVM_PAUSED) {
-        return MINI_KVM_STATUS_CMD_VM_NOT_PAUSED;
-    }
-
+    // only report the vcpus that exist
+    res->vcpus = 0;
     for (uint64_t index = 0; index < kvm->vcpus->len; index++) {
         if (!(cmd->vcpus & (1UL << index))) {
             continue;
         }
 
-        VCpu vcpu = kvm->vcpus->tab[index];
-        if (ioctl(vcpu.fd, KVM_GET_REGS, &res->regs)) {
-            ERROR("failed to vcpu %u registers (%s)", index, strerror(errno));
-            return MINI_KVM_INTERNAL_ERROR;
+        // vcpus publish their registers themselves, the guest keeps running
+        mini_kvm_vcpu_snapshot(&kvm->vcpus->tab[index], &res->regs[index], &res->sregs[index]);
+        res->vcpus |= 1UL << index;
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+static MiniKVMError status_handle_stats(Kvm *kvm, MiniKvmStatusCommand *cmd,
+                                        MiniKvmStatusResult *res) {
+    // resets take the VM lock for writing, they are the only writers of the stats base
+    res->vcpus = 0;
+    for (uint64_t index = 0; index < kvm->vcpus->len; index++) {
+        if (cmd->vcpus & (1UL << index)) {
+            mini_kvm_vcpu_stats(kvm, &kvm->vcpus->tab[index], &res->stats[index],
+                                cmd->type == MINI_KVM_COMMAND_RESET_STATS);
+            res->vcpus |= 1UL << index;
+        }
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+// sample the VM stats and the stats of the selected vcpus, each stats fd is read with one pread
+static MiniKVMError status_handle_kvm_stats(Kvm *kvm, MiniKvmStatusCommand *cmd,
+                                            MiniKvmStatusResult *res) {
+    size_t size = mini_kvm_binstats_encoded_size(&kvm->binstats), len = 0;
+
+    res->vcpus = 0;
+    for (uint64_t index = 0; index < kvm->vcpus->len; index++) {
+        if (cmd->vcpus & (1UL << index)) {
+            size += mini_kvm_binstats_encoded_size(&kvm->vcpus->tab[index].binstats);
+            res->vcpus |= 1UL << index;
+        }
+    }
+
+    if (size == 0) {
+        return MINI_KVM_SUCCESS;
+    }
+
+    res->kvm_stats = malloc(size);
+    if (res->kvm_stats == NULL) {
+        return MINI_KVM_FAILED_ALLOCATION;
+    }
+
+    len = mini_kvm_binstats_encode(&kvm->binstats, MINI_KVM_BINSTATS_VM_ID, res->kvm_stats);
+    for (uint64_t index = 0; index < kvm->vcpus->len; index++) {
+        if (res->vcpus & (1UL << index)) {
+            len += mini_kvm_binstats_encode(&kvm->vcpus->tab[index].binstats, index,
+                                            res->kvm_stats + len);
+        }
+    }
+    res->kvm_stats_len = len;
+
+    return MINI_KVM_SUCCESS;
+}
+
+static MiniKVMError status_handle_trace(Kvm *kvm, MiniKvmStatusCommand *cmd,
+                                        MiniKvmStatusResult *res) {
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+    VCpu *vcpu = NULL;
+
+    res->vcpus = (kvm->vcpus->len >= 64) ? ~0UL : (1UL << kvm->vcpus->len) - 1;
+    switch (cmd->type) {
+    case MINI_KVM_COMMAND_TRACE_START:
+        ret = mini_kvm_trace_start(kvm);
+        break;
+    case MINI_KVM_COMMAND_TRACE_STOP:
+        mini_kvm_trace_stop(kvm);
+        break;
+    default:
+        // a fetch returns the ring of the first requested vcpu
+        res->vcpus &= cmd->vcpus & -cmd->vcpus;
+        if (res->vcpus == 0) {
+            return MINI_KVM_SUCCESS;
+        }
+
+        vcpu = &kvm->vcpus->tab[__builtin_ctzl(res->vcpus)];
+        if (vcpu->trace == NULL) {
+            return MINI_KVM_SUCCESS;
         }
-        if (ioctl(vcpu.fd, KVM_GET_SREGS, &res->sregs)) {
-            ERROR("failed to vcpu %u sregisters (%s)", index, strerror(errno));
-            return MINI_KVM_INTERNAL_ERROR;
+
+        res->trace = malloc(MINI_KVM_TRACE_EVENTS * sizeof(MiniKvmTraceEvent));
+        if (res->trace == NULL) {
+            return MINI_KVM_FAILED_ALLOCATION;
         }
+        res->trace_len = mini_kvm_trace_ring_copy(vcpu->trace, res->trace);
+        return MINI_KVM_SUCCESS;
     }
 
+    // both clocks are sampled back to back, the client derives the TSC rate from a session
+    res->clock[0] = mini_kvm_rdtsc();
+    res->clock[1] = mini_kvm_now_ns();
+    return ret;
+}
+
+static MiniKVMError status_handle_startup(Kvm *kvm,
+                                          __attribute__((unused)) MiniKvmStatusCommand *cmd,
+                                          MiniKvmStatusResult *res) {
+    res->startup = kvm->startup;
+    // the first vcpu entering KVM_RUN may be writing its timestamp
+    res->startup.end_ns[MINI_KVM_STARTUP_FIRST_RUN] =
+        __atomic_load_n(&kvm->startup.end_ns[MINI_KVM_STARTUP_FIRST_RUN], __ATOMIC_RELAXED);
+    return MINI_KVM_SUCCESS;
+}
+
+// the table is not modified once the vcpus are created
+static MiniKVMError status_handle_cpuid(Kvm *kvm, __attribute__((unused)) MiniKvmStatusCommand *cmd,
+                                        MiniKvmStatusResult *res) {
+    size_t size = kvm->cpuid->nent * sizeof(struct kvm_cpuid_entry2);
+
+    res->cpuid = malloc(size);
+    if (res->cpuid == NULL) {
+        return MINI_KVM_FAILED_ALLOCATION;
+    }
+    memcpy(res->cpuid, kvm->cpuid->entries, size);
+    res->cpuid_len = kvm->cpuid->nent;
     return MINI_KVM_SUCCESS;
 }
 
-MiniKVMError status_handle_dump_mem(Kvm *kvm, MiniKvmStatusCommand *cmd,
-                                    __attribute__((unused)) MiniKvmStatusResult *res) {
-    int remote_stdoutfd;
-    char remote_stdoutpath[64];
+// validate and align the requested range, the memory itself is streamed by the server once the
+// reply is sent
+static MiniKVMError status_handle_dump_mem(Kvm *kvm, MiniKvmStatusCommand *cmd,
+                                           MiniKvmStatusResult *res) {
+    int64_t start = cmd->mem_range[0], end = cmd->mem_range[1];
+    int64_t word_size = cmd->mem_range[2], bytes_per_line = cmd->mem_range[3];
 
     if (kvm->state != MINI_KVM_PAUSED) {
         return MINI_KVM_STATUS_CMD_VM_NOT_PAUSED;
     }
 
-    snprintf(remote_stdoutpath, sizeof(remote_stdoutpath), "/proc/%d/fd/1", cmd->pid);
-    remote_stdoutfd = open(remote_stdoutpath, O_RDWR);
-    if (remote_stdoutfd != -1) {
-        mini_kvm_dump_mem(kvm, remote_stdoutfd, cmd->mem_range[0],
-                          (cmd->mem_range[1] == -1) ? kvm->mem_size : cmd->mem_range[1],
-                          cmd->mem_range[2], cmd->mem_range[3]);
-        close(remote_stdoutfd);
-    } else {
-        ERROR("failed to serve DUMP MEM command (%s)", strerror(errno));
-        return MINI_KVM_INTERNAL_ERROR;
+    if (word_size <= 0 || word_size > 8 || (word_size & (word_size - 1)) != 0 ||
+        bytes_per_line <= 0 || bytes_per_line > MEM_DUMP_MAX_LINE ||
+        bytes_per_line % word_size != 0) {
+        return MINI_KVM_STATUS_CMD_INVALID_MEM_RANGE;
+    }
+
+    // align start and end to word_size
+    end = (end == -1 || end > kvm->mem_size) ? kvm->mem_size : end;
+    start = start - start % word_size;
+    end = (end % word_size == 0) ? end : end - end % word_size + word_size;
+    end = (end > kvm->mem_size) ? kvm->mem_size : end;
+    if (start < 0 || start >= end) {
+        return MINI_KVM_STATUS_CMD_INVALID_MEM_RANGE;
     }
 
+    res->mem_range[0] = start;
+    res->mem_range[1] = end;
+    res->mem_range[2] = word_size;
+    res->mem_range[3] = bytes_per_line;
     return MINI_KVM_SUCCESS;
 }
 
 static MiniKVMError status_handle_pause(Kvm *kvm, __attribute__((unused)) MiniKvmStatusCommand *cmd,
                                         __attribute((unused)) MiniKvmStatusResult *res) {
-    kvm->state = MINI_KVM_PAUSED;
-    mini_kvm_send_sig(kvm, SIGVMPAUSE);
-    mini_kvm_pause_vm(kvm);
-
-    return MINI_KVM_SUCCESS;
+    return mini_kvm_pause_vm(kvm);
 }
 
 static MiniKVMError status_handle_resume(Kvm *kvm,
                                          __attribute__((unused)) MiniKvmStatusCommand *cmd,
                                          __attribute((unused)) MiniKvmStatusResult *res) {
-    kvm->state = MINI_KVM_RUNNING;
-    mini_kvm_send_sig(kvm, SIGVMRESUME);
-    mini_kvm_resume_vm(kvm);
-
-    return MINI_KVM_SUCCESS;
+    return mini_kvm_resume_vm(kvm);
 }
 
 static MiniKVMError status_handle_shutdown(Kvm *kvm,
                                            __attribute__((unused)) MiniKvmStatusCommand *cmd,
                                            __attribute((unused)) MiniKvmStatusResult *res) {
     kvm->state = MINI_KVM_SHUTDOWN;
-    mini_kvm_send_sig(kvm, SIGVMSHUTDOWN);
-    if (kvm->paused) {
-        mini_kvm_resume_vm(kvm);
-    }
+    mini_kvm_kick_vcpus(kvm, MINI_KVM_REQ_SHUTDOWN);
 
     return MINI_KVM_SUCCESS;
 }
@@ -334,15 +647,50 @@ MiniKVMError mini_kvm_status_handle_command(Kvm *kvm, MiniKvmStatusCommand *cmd,
         [MINI_KVM_COMMAND_SHOW_STATE] = status_handle_cmd_state,
         [MINI_KVM_COMMAND_SHOW_REGS] = status_handle_regs,
         [MINI_KVM_COMMAND_DUMP_MEM] = status_handle_dump_mem,
+        [MINI_KVM_COMMAND_SHOW_STATS] = status_handle_stats,
+        [MINI_KVM_COMMAND_RESET_STATS] = status_handle_stats,
+        [MINI_KVM_COMMAND_SHOW_KVM_STATS] = status_handle_kvm_stats,
+        [MINI_KVM_COMMAND_TRACE_START] = status_handle_trace,
+        [MINI_KVM_COMMAND_TRACE_STOP] = status_handle_trace,
+        [MINI_KVM_COMMAND_TRACE_FETCH] = status_handle_trace,
+        [MINI_KVM_COMMAND_SHOW_STARTUP] = status_handle_startup,
+        [MINI_KVM_COMMAND_SHOW_CPUID] = status_handle_cpuid,
+    };
+    // read-only commands run concurrently, commands changing the VM state are serialized
+    static const bool mutating[MINI_KVM_COMMAND_COUNT] = {
+        [MINI_KVM_COMMAND_PAUSE] = true,
+        [MINI_KVM_COMMAND_RESUME] = true,
+        [MINI_KVM_COMMAND_SHUTDOWN] = true,
+        [MINI_KVM_COMMAND_RESET_STATS] = true,
+        [MINI_KVM_COMMAND_TRACE_START] = true,
+        [MINI_KVM_COMMAND_TRACE_STOP] = true,
     };
     MiniKVMError ret = MINI_KVM_SUCCESS;
 
-    pthread_mutex_lock(&kvm->lock);
-    ret = handlers[cmd->type](kvm, cmd, res);
+    if (mutating[cmd->type]) {
+        pthread_rwlock_wrlock(&kvm->lock);
+    } else {
+        pthread_rwlock_rdlock(&kvm->lock);
+    }
     res->cmd_type = cmd->type;
     res->vcpus = cmd->vcpus;
+    MINI_KVM_PROBE(command, cmd->type, cmd->vcpus);
+    ret = handlers[cmd->type](kvm, cmd, res);
     res->error = ret;
-    pthread_mutex_unlock(&kvm->lock);
+    MINI_KVM_PROBE(command_done, cmd->type, ret);
+    pthread_rwlock_unlock(&kvm->lock);
 
     return ret;
 }
+
+void mini_kvm_status_clean_result(MiniKvmStatusResult *res) {
+    free(res->kvm_stats);
+    res->kvm_stats = NULL;
+    res->kvm_stats_len = 0;
+    free(res->trace);
+    res->trace = NULL;
+    res->trace_len = 0;
+    free(res->cpuid);
+    res->cpuid = NULL;
+    res->cpuid_len = 0;
+}
@@ -20,6 +20,14 @@ typedef enum MiniKvmStatusCommandType {
     MINI_KVM_COMMAND_SHOW_STATE,
     MINI_KVM_COMMAND_SHOW_REGS,
     MINI_KVM_COMMAND_DUMP_MEM,
+    MINI_KVM_COMMAND_SHOW_STATS,
+    MINI_KVM_COMMAND_RESET_STATS, // reply with the stats, then start a new measure period
+    MINI_KVM_COMMAND_SHOW_KVM_STATS,
+    MINI_KVM_COMMAND_TRACE_START,
+    MINI_KVM_COMMAND_TRACE_STOP,
+    MINI_KVM_COMMAND_TRACE_FETCH, // events of the first vcpu of the mask
+    MINI_KVM_COMMAND_SHOW_STARTUP,
+    MINI_KVM_COMMAND_SHOW_CPUID,
     MINI_KVM_COMMAND_COUNT,
 } MiniKvmStatusCommandType;
 
@@ -28,6 +36,13 @@ typedef struct MiniKvmStatusArgs {
     bool regs;
     vec_uint64_t *mem_range;
     uint64_t vcpus;
+    bool raw;
+    bool ascii;
+    char *mem_save;
+    bool stats;
+    bool kvm_stats;
+    bool startup;
+    bool cpuid;
     uint64_t cmd_count;
     MiniKvmStatusCommandType cmds[MINI_KVM_COMMAND_COUNT];
 } MiniKvmStatusArgs;
@@ -36,7 +51,6 @@ typedef struct MiniKvmStatusCommand {
     MiniKvmStatusCommandType type;
     uint64_t vcpus;
     int64_t mem_range[4];
-    int32_t pid;
 } MiniKvmStatusCommand;
 
 typedef struct MiniKvmStatusResult {
@@ -45,10 +59,27 @@ typedef struct MiniKvmStatusResult {
     uint64_t vcpus;
     struct kvm_regs regs[MINI_KVM_MAX_VCPUS];
     struct kvm_sregs sregs[MINI_KVM_MAX_VCPUS];
+    VCpuStats stats[MINI_KVM_MAX_VCPUS];
     VMState state;
+    // aligned range of a memory dump, its end - start bytes are streamed after the reply
+    int64_t mem_range[4];
+    // encoded KVM binary stats (see kvm/binstats.h), owned by the result
+    uint8_t *kvm_stats;
+    uint32_t kvm_stats_len;
+    // TSC and monotonic time in ns when a trace session starts or stops
+    uint64_t clock[2];
+    // events of a vcpu trace ring, owned by the result
+    MiniKvmTraceEvent *trace;
+    uint32_t trace_len;
+    MiniKvmStartupProfile startup;
+    // CPUID table set on every vcpu, owned by the result
+    struct kvm_cpuid_entry2 *cpuid;
+    uint32_t cpuid_len;
 } MiniKvmStatusResult;
 
 MiniKVMError mini_kvm_status_handle_command(Kvm *kvm, MiniKvmStatusCommand *cmd,
                                             MiniKvmStatusResult *res);
+// release the buffers owned by a result
+void mini_kvm_status_clean_result(MiniKvmStatusResult *res);
 
 #endif /* MINI_KVM_STATUS */
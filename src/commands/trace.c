@@ -0,0 +1,206 @@
+#include "trace.h"
+
+#include "commands.h"
+#include "commands/status.h"
+#include "core/core.h"
+#include "core/errors.h"
+#include "core/logger.h"
+#include "ipc/ipc.h"
+#include "kvm/kvm.h"
+#include "kvm/trace.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_DEFAULT_DURATION_MS 1000
+#define TRACE_DEFAULT_OUTPUT "trace.json"
+
+static const struct option opts_def[] = {{"name", required_argument, NULL, 'n'},
+                                         {"duration", required_argument, NULL, 'd'},
+                                         {"output", required_argument, NULL, 'o'},
+                                         {"help", no_argument, NULL, 'h'},
+                                         {0, 0, 0, 0}};
+
+static void trace_print_help() {
+    printf("USAGE:\n\tmini_kvm trace [options] ...\n");
+    printf("OPTIONS:\n");
+    printf("\t--name/-n: set the name of the virtual machine\n");
+    printf("\t--duration/-d: record the VCPU exits during this many milliseconds (default %d)\n",
+           TRACE_DEFAULT_DURATION_MS);
+    printf("\t--output/-o: write the Chrome trace JSON to this file (default %s)\n",
+           TRACE_DEFAULT_OUTPUT);
+    printf("\t--help/-h: print this message\n");
+}
+
+static MiniKVMError trace_parse_args(int argc, char **argv, MiniKvmTraceArgs *args) {
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+    int32_t index = 0;
+    char c = 0;
+
+    args->duration_ms = TRACE_DEFAULT_DURATION_MS;
+    while (c != -1 && ret != MINI_KVM_ARGS_FAILED) {
+        c = getopt_long(argc, argv, "n:d:o:h", opts_def, &index);
+
+        switch (c) {
+        case 'n':
+            args->name = strdup(optarg);
+            break;
+        case 'd':
+            if (mini_kvm_to_uint(optarg, strlen(optarg), &args->duration_ms) < 0) {
+                ERROR("--duration expects a number of milliseconds, got : %s", optarg);
+                ret = MINI_KVM_ARGS_FAILED;
+            }
+            break;
+        case 'o':
+            args->output = strdup(optarg);
+            break;
+        case 'h':
+        case '?':
+            ret = MINI_KVM_ARGS_FAILED;
+            break;
+        }
+    }
+
+    return ret;
+}
+
+static void trace_write_event(FILE *out, uint32_t vcpu, MiniKvmTraceEvent *event, double ns_per_tsc,
+                              uint64_t tsc_start) {
+    double entry_us = (int64_t)(event->entry_tsc - tsc_start) * ns_per_tsc / 1000.0;
+    double exit_us = (int64_t)(event->exit_tsc - tsc_start) * ns_per_tsc / 1000.0;
+
+    // time in guest, then the exit handling as its own slice
+    fprintf(out,
+            ",\n{\"name\":\"guest\",\"cat\":\"run\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+            "\"dur\":%.3f}",
+            vcpu, entry_us, exit_us - entry_us);
+    fprintf(out,
+            ",\n{\"name\":\"%s\",\"cat\":\"exit\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+            "\"dur\":%.3f",
+            mini_kvm_exit_reason_str(event->reason), vcpu, exit_us,
+            event->handle_cycles * ns_per_tsc / 1000.0);
+    if (event->reason == KVM_EXIT_IO || event->reason == KVM_EXIT_MMIO) {
+        fprintf(out, ",\"args\":{\"addr\":\"0x%lx\",\"size\":%u,\"write\":%s}", event->addr,
+                event->info & ~MINI_KVM_TRACE_WRITE,
+                (event->info & MINI_KVM_TRACE_WRITE) ? "true" : "false");
+    }
+    fprintf(out, "}");
+}
+
+// record the exits of every vcpu for the requested duration and write them in the Chrome trace
+// event format, the file can be opened in chrome://tracing or ui.perfetto.dev
+static MiniKVMError trace_record(MiniKvmTraceArgs *args, int32_t sock) {
+    MiniKvmStatusCommand cmd = {.type = MINI_KVM_COMMAND_TRACE_START};
+    MiniKvmStatusResult res = {0};
+    struct timespec duration = {.tv_sec = args->duration_ms / 1000,
+                                .tv_nsec = (args->duration_ms % 1000) * 1000000};
+    uint64_t start[2] = {0}, vcpus = 0, count = 0;
+    const char *path = (args->output != NULL) ? args->output : TRACE_DEFAULT_OUTPUT;
+    double ns_per_tsc = 0;
+    MiniKVMError ret = MINI_KVM_INTERNAL_ERROR;
+    FILE *out = NULL;
+
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS) {
+        ERROR("failed to start tracing");
+        return MINI_KVM_STATUS_COMMAND_FAILED;
+    }
+    memcpy(start, res.clock, sizeof(start));
+    vcpus = res.vcpus;
+
+    nanosleep(&duration, NULL);
+
+    cmd.type = MINI_KVM_COMMAND_TRACE_STOP;
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS) {
+        ERROR("failed to stop tracing");
+        return MINI_KVM_STATUS_COMMAND_FAILED;
+    }
+
+    // the session itself calibrates the TSC
+    ns_per_tsc = (res.clock[0] > start[0])
+                     ? (double)(res.clock[1] - start[1]) / (res.clock[0] - start[0])
+                     : 1.0;
+
+    out = fopen(path, "w");
+    if (out == NULL) {
+        ERROR("unable to open %s", path);
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"%s\"}}",
+            args->name);
+    for (uint32_t id = 0; id < MINI_KVM_MAX_VCPUS; id++) {
+        if ((vcpus & (1UL << id)) == 0) {
+            continue;
+        }
+
+        cmd.type = MINI_KVM_COMMAND_TRACE_FETCH;
+        cmd.vcpus = 1UL << id;
+        if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS) {
+            ERROR("failed to fetch vcpu %u trace", id);
+            goto out;
+        }
+
+        fprintf(out,
+                ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                "\"args\":{\"name\":\"vcpu %u\"}}",
+                id, id);
+        for (uint32_t i = 0; i < res.trace_len; i++) {
+            trace_write_event(out, id, &res.trace[i], ns_per_tsc, start[0]);
+        }
+        count += res.trace_len;
+        mini_kvm_status_clean_result(&res);
+    }
+    fprintf(out, "\n]}\n");
+    ret = MINI_KVM_SUCCESS;
+
+    INFO("%lu exits recorded in %lu ms written to %s", count, args->duration_ms, path);
+
+out:
+    mini_kvm_status_clean_result(&res);
+    fclose(out);
+    return ret;
+}
+
+MiniKVMError mini_kvm_trace(int argc, char **argv) {
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+    MiniKvmTraceArgs args = {0};
+    struct sockaddr_un addr = {0};
+    int32_t sock = 0;
+
+    ret = trace_parse_args(argc, argv, &args);
+    if (ret != MINI_KVM_SUCCESS) {
+        trace_print_help();
+        goto clean;
+    }
+
+    if (args.name == NULL) {
+        INFO("trace: no name was specified, exiting ...");
+        goto clean;
+    }
+
+    if (mini_kvm_check_vm(args.name) < 0) {
+        INFO("trace: VM %s is not running, exiting ...", args.name);
+        goto clean;
+    }
+
+    if ((sock = mini_kvm_ipc_connect(args.name, &addr)) < 0) {
+        ret = MINI_KVM_INTERNAL_ERROR;
+        goto clean;
+    }
+
+    ret = trace_record(&args, sock);
+    close(sock);
+
+clean:
+    free(args.name);
+    free(args.output);
+    return ret;
+}
@@ -0,0 +1,12 @@
+#ifndef MINI_KVM_TRACE_COMMAND_H
+#define MINI_KVM_TRACE_COMMAND_H
+
+#include <inttypes.h>
+
+typedef struct MiniKvmTraceArgs {
+    char *name;
+    uint64_t duration_ms;
+    char *output;
+} MiniKvmTraceArgs;
+
+#endif /* MINI_KVM_TRACE_COMMAND_H */
@@ -3,11 +3,32 @@
 
 #define MINI_KVM_FS_ROOT_PATH "/tmp/mini_kvm"
 #define MINI_KVM_MAX_VCPUS 64
+#define MINI_KVM_VCPU_CREATE_THREADS 8 // at most this many threads create vcpus at once
 
 #define PLM4_ADDR 0x1000
 #define PAGE_SIZE 0x1000
 #define MINIMUM_MEMORY_REQUIRED 0x5000
 #define BOOTLOADER_ADDR 0x4000
+#define BOOT_GDT_ADDR 0x500
+// the PDPT and the page directory of the first GiB follow the PML4, the page directories of the
+// next GiBs, only used without 1 GiB pages, are placed below the EBDA
+#define BOOT_PD_ADDR 0x80000
+#define BOOT_PD_MAX 31
+
+// Linux boot protocol layout: boot_params (zero page), command line and protected mode kernel
+#define LINUX_BOOT_PARAMS_ADDR 0x7000
+#define LINUX_CMDLINE_ADDR 0x20000
+#define LINUX_KERNEL_ADDR 0x100000
+#define LINUX_EBDA_ADDR 0x9fc00 // low RAM ends with the extended BIOS data area
+#define LINUX_DEFAULT_CMDLINE "console=ttyS0"
+#define PVH_START_INFO_ADDR 0x6000 // hvm_start_info, followed by the memory map and module list
+
+#define IOAPIC_PINS 24
+
+// io ports of the benchmark guests (bios/bench), the result port takes 32 bits values
+#define MINI_KVM_BENCH_NOP_PORT 0xbe0
+#define MINI_KVM_BENCH_RESULT_PORT 0xbe1
+#define MINI_KVM_BENCH_EXIT_PORT 0xbe2
 
 // control and msr constants
 #define CR0_PE 0x1
@@ -21,5 +42,17 @@
 #define PT_RW (1 << 1)
 #define PT_PRESENT (1 << 0)
 #define PT_PAGE_SIZE (1 << 7)
+#define PT_ENTRIES 512
+
+// cpuid constants
+#define CPUID_EXT_FEATURES 0x80000001
+#define CPUID_EXT_EDX_PDPE1GB (1 << 26)
+#define CPUID_EXT_MAX 0x80000000
+#define CPUID_EXT_POWER 0x80000007
+#define CPUID_EXT_POWER_EDX_INVTSC (1 << 8)
+#define CPUID_XSAVE 0xd // subleaf 0 lists the XSAVE state components, subleaf n describes one
+// hypervisor timing leaf: TSC and local APIC timer frequencies in kHz, as defined by VMware
+#define CPUID_TIMING_INFO 0x40000010
+#define KVM_APIC_BUS_KHZ 1000000 // the local APIC timer of KVM runs at 1 GHz
 
 #endif /*MINI_KVM_CONSTS_H*/
@@ -11,24 +11,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#define EAX 0
-#define EBX 1
-#define ECX 2
-#define EDX 3
 #define VENDOR_ID_LEN 13
 
 static uint32_t cpuid[4] = {0};
 static const char *vendor_name[] = {"GenuineIntel", "AuthenticAMD"};
 
 void native_cpuid(int32_t function, uint32_t *out) {
-    out[EAX] = function;
-    out[ECX] = 0;
+    out[CPUID_EAX] = function;
+    out[CPUID_ECX] = 0;
 
     asm volatile("cpuid"
-                 : "=a"(out[EBX]), "=b"(out[EBX]), "=c"(out[ECX]), "=d"(out[EDX])
-                 : "0"(out[EAX]), "2"(out[ECX])
+                 : "=a"(out[CPUID_EAX]), "=b"(out[CPUID_EBX]), "=c"(out[CPUID_ECX]),
+                   "=d"(out[CPUID_EDX])
+                 : "0"(out[CPUID_EAX]), "2"(out[CPUID_ECX])
                  : "memory");
 }
 
@@ -36,9 +34,9 @@ int32_t check_cpu_vendor(MiniKVMCPUVendor v) {
     char name[VENDOR_ID_LEN];
     native_cpuid(0, cpuid);
 
-    ((uint32_t *)name)[0] = cpuid[EBX];
-    ((uint32_t *)name)[1] = cpuid[EDX];
-    ((uint32_t *)name)[2] = cpuid[ECX];
+    ((uint32_t *)name)[0] = cpuid[CPUID_EBX];
+    ((uint32_t *)name)[1] = cpuid[CPUID_EDX];
+    ((uint32_t *)name)[2] = cpuid[CPUID_ECX];
     name[VENDOR_ID_LEN - 1] = '\0';
 
     return strncmp(vendor_name[v], name, VENDOR_ID_LEN) == 0;
@@ -164,3 +162,10 @@ MiniKVMError mini_kvm_parse_cpu_list(char *raw_list, uint64_t *cpu_list) {
     free(list);
     return ret;
 }
+
+uint64_t mini_kvm_now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
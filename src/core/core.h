@@ -12,11 +12,21 @@ typedef enum CPUVendor {
     AuthenticAMD,
 } MiniKVMCPUVendor;
 
+// registers of a host CPUID leaf, in the order they are stored by native_cpuid
+#define CPUID_EAX 0
+#define CPUID_EBX 1
+#define CPUID_ECX 2
+#define CPUID_EDX 3
+
+void native_cpuid(int32_t function, uint32_t *out);
 int32_t check_cpu_vendor(MiniKVMCPUVendor v);
 
 MiniKVMError mini_kvm_open_vm_fs(const char *path);
 int32_t mini_kvm_check_vm(char *name);
 
+// monotonic clock in nanoseconds
+uint64_t mini_kvm_now_ns();
+
 // === STRING UTILS ===
 
 // return true is str is a number (1234 => 1, hello => 0, 1234.1234 => 0)
@@ -20,6 +20,9 @@ typedef enum MiniKVMError {
     MINI_KVM_FAILED_RUN,
     MINI_KVM_STATUS_COMMAND_FAILED,
     MINI_KVM_STATUS_CMD_VM_NOT_PAUSED,
+    MINI_KVM_STATUS_CMD_INVALID_MEM_RANGE,
+    MINI_KVM_IPC_PROTOCOL_ERROR,
+    MINI_KVM_STATUS_CMD_VM_NOT_RUNNING,
 } MiniKVMError;
 
 #endif /* MINI_KVM_ERRORS_H */
@@ -0,0 +1,313 @@
+#include "hexdump.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "logger.h"
+
+static const char HEX_DIGITS[16] = "0123456789abcdef";
+
+// log2 of the word sizes, used to index the shuffle tables
+#define HEXDUMP_WORD_SIZES 4
+// a 16 bytes block is formatted in at most 48 chars (32 hex digits and 16 separators)
+#define HEXDUMP_BLOCK_OUT 48
+
+// Shuffle tables of the SIMD formatter, for each word size and each 16 chars of output:
+// - lo/hi select a hex digit in the first/second 16 digits of the block (0x80 selects nothing)
+// - space holds the word separators
+// hex digits are produced in memory order, selecting them in reverse order inside each word prints
+// the words as little endian values
+typedef struct HexDumpTables {
+    uint8_t lo[HEXDUMP_WORD_SIZES][3][16];
+    uint8_t hi[HEXDUMP_WORD_SIZES][3][16];
+    uint8_t space[HEXDUMP_WORD_SIZES][3][16];
+} HexDumpTables;
+
+typedef size_t (*HexDumpBlock)(const uint8_t *in, char *out, uint32_t word_log);
+
+static HexDumpTables tables __attribute__((aligned(16)));
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+// 32 bytes (AVX2) and 16 bytes (SSSE3) block formatters, NULL when the CPU lacks the extension
+static HexDumpBlock format_block32 = NULL;
+static HexDumpBlock format_block16 = NULL;
+static bool simd_disabled = false;
+
+static inline size_t hexdump_block_len(uint32_t word_log) { return 32 + (16 >> word_log); }
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3"))) static size_t hexdump_block_ssse3(const uint8_t *in, char *out,
+                                                                    uint32_t word_log) {
+    const __m128i digits = _mm_loadu_si128((const __m128i *)HEX_DIGITS);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i bytes = _mm_loadu_si128((const __m128i *)in);
+    __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+    __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(bytes, nibble));
+    __m128i first = _mm_unpacklo_epi8(high, low), second = _mm_unpackhi_epi8(high, low);
+
+    for (uint32_t i = 0; i < 3; i++) {
+        __m128i lo = _mm_load_si128((const __m128i *)tables.lo[word_log][i]);
+        __m128i hi = _mm_load_si128((const __m128i *)tables.hi[word_log][i]);
+        __m128i space = _mm_load_si128((const __m128i *)tables.space[word_log][i]);
+        __m128i chars = _mm_or_si128(_mm_shuffle_epi8(first, lo), _mm_shuffle_epi8(second, hi));
+        _mm_storeu_si128((__m128i *)(out + 16 * i), _mm_or_si128(chars, space));
+    }
+
+    return hexdump_block_len(word_log);
+}
+
+// same as the SSSE3 version on two blocks, each 128 bits lane formats one block
+__attribute__((target("avx2"))) static size_t hexdump_block_avx2(const uint8_t *in, char *out,
+                                                                  uint32_t word_log) {
+    const __m256i digits =
+        _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)HEX_DIGITS));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)in);
+    __m256i high =
+        _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+    __m256i low = _mm256_shuffle_epi8(digits, _mm256_and_si256(bytes, nibble));
+    __m256i first = _mm256_unpacklo_epi8(high, low), second = _mm256_unpackhi_epi8(high, low);
+    size_t len = hexdump_block_len(word_log);
+    __m256i chars[3];
+
+    for (uint32_t i = 0; i < 3; i++) {
+        __m256i lo =
+            _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)tables.lo[word_log][i]));
+        __m256i hi =
+            _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)tables.hi[word_log][i]));
+        __m256i space =
+            _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)tables.space[word_log][i]));
+        chars[i] = _mm256_or_si256(
+            _mm256_or_si256(_mm256_shuffle_epi8(first, lo), _mm256_shuffle_epi8(second, hi)),
+            space);
+    }
+
+    // the second block starts before the end of the first one's last store, store it last
+    for (uint32_t i = 0; i < 3; i++) {
+        _mm_storeu_si128((__m128i *)(out + 16 * i), _mm256_castsi256_si128(chars[i]));
+    }
+    for (uint32_t i = 0; i < 3; i++) {
+        _mm_storeu_si128((__m128i *)(out + len + 16 * i), _mm256_extracti128_si256(chars[i], 1));
+    }
+
+    return 2 * len;
+}
+
+static void hexdump_ascii_sse2(const uint8_t *in, char *out) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)in);
+    // bytes above 0x7f are negative and fail the first comparison
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(0x1f)),
+                                      _mm_cmplt_epi8(bytes, _mm_set1_epi8(0x7f)));
+    __m128i chars = _mm_or_si128(_mm_and_si128(printable, bytes),
+                                 _mm_andnot_si128(printable, _mm_set1_epi8('.')));
+    _mm_storeu_si128((__m128i *)out, chars);
+}
+#endif
+
+static void hexdump_init_tables() {
+    for (uint32_t word_log = 0; word_log < HEXDUMP_WORD_SIZES; word_log++) {
+        uint32_t word_size = 1 << word_log, word_len = 2 * word_size + 1;
+        size_t len = hexdump_block_len(word_log);
+
+        for (uint32_t pos = 0; pos < HEXDUMP_BLOCK_OUT; pos++) {
+            uint32_t word = pos / word_len, offset = pos % word_len;
+            uint32_t byte = word * word_size + (word_size - 1 - offset / 2);
+            uint32_t digit = 2 * byte + offset % 2;
+            uint8_t *lo = &tables.lo[word_log][pos / 16][pos % 16];
+            uint8_t *hi = &tables.hi[word_log][pos / 16][pos % 16];
+            uint8_t *space = &tables.space[word_log][pos / 16][pos % 16];
+
+            *lo = *hi = 0x80;
+            *space = 0;
+            if (pos >= len) {
+                continue;
+            }
+
+            if (offset == word_len - 1) {
+                *space = ' ';
+            } else if (digit < 16) {
+                *lo = digit;
+            } else {
+                *hi = digit - 16;
+            }
+        }
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        format_block32 = hexdump_block_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        format_block16 = hexdump_block_ssse3;
+    }
+#endif
+}
+
+void mini_kvm_hexdump_disable_simd(bool disable) { simd_disabled = disable; }
+
+// longest line the formatter can produce, the buffer always has room for one line
+static size_t hexdump_max_line(MiniKvmHexDump *dump) {
+    return 2 + 16 + 1 + 3 * dump->bytes_per_line + 2 + dump->bytes_per_line + 1 + HEXDUMP_BLOCK_OUT;
+}
+
+MiniKVMError mini_kvm_hexdump_init(MiniKvmHexDump *dump, int32_t fd, uint32_t word_size,
+                                   uint32_t bytes_per_line, bool ascii) {
+    pthread_once(&tables_once, hexdump_init_tables);
+
+    memset(dump, 0, sizeof(MiniKvmHexDump));
+    if (word_size == 0 || word_size > MINI_KVM_HEXDUMP_MAX_WORD_SIZE ||
+        (word_size & (word_size - 1)) != 0 || bytes_per_line == 0 ||
+        bytes_per_line % word_size != 0) {
+        return MINI_KVM_ARGS_FAILED;
+    }
+
+    dump->fd = fd;
+    dump->word_size = word_size;
+    dump->bytes_per_line = bytes_per_line;
+    dump->ascii = ascii;
+    dump->capacity = MINI_KVM_HEXDUMP_BUFFER_SIZE;
+    if (dump->capacity < 2 * hexdump_max_line(dump)) {
+        dump->capacity = 2 * hexdump_max_line(dump);
+    }
+
+    dump->buf = malloc(dump->capacity);
+    if (dump->buf == NULL) {
+        return MINI_KVM_FAILED_ALLOCATION;
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+MiniKVMError mini_kvm_hexdump_flush(MiniKvmHexDump *dump) {
+    size_t offset = 0;
+    ssize_t len = 0;
+
+    while (offset < dump->len) {
+        len = write(dump->fd, dump->buf + offset, dump->len - offset);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (len < 0) {
+            ERROR("unable to write memory dump (%s)", strerror(errno));
+            dump->len = 0;
+            return MINI_KVM_INTERNAL_ERROR;
+        }
+        offset += len;
+    }
+
+    dump->len = 0;
+    return MINI_KVM_SUCCESS;
+}
+
+MiniKVMError mini_kvm_hexdump_close(MiniKvmHexDump *dump) {
+    MiniKVMError ret = mini_kvm_hexdump_flush(dump);
+
+    free(dump->buf);
+    dump->buf = NULL;
+    return ret;
+}
+
+static char *hexdump_address(char *out, uint64_t addr) {
+    // at least 8 digits, as many as needed for larger addresses
+    int32_t digits = (addr >> 32) ? (67 - __builtin_clzl(addr)) / 4 : 8;
+
+    *out++ = '0';
+    *out++ = 'x';
+    for (int32_t i = digits - 1; i >= 0; i--) {
+        *out++ = HEX_DIGITS[(addr >> (4 * i)) & 0xf];
+    }
+    *out++ = '\t';
+
+    return out;
+}
+
+static char *hexdump_words(MiniKvmHexDump *dump, char *out, const uint8_t *data, size_t len) {
+    for (size_t word = 0; word < len; word += dump->word_size) {
+        for (int32_t byte = dump->word_size - 1; byte >= 0; byte--) {
+            *out++ = HEX_DIGITS[data[word + byte] >> 4];
+            *out++ = HEX_DIGITS[data[word + byte] & 0xf];
+        }
+        *out++ = ' ';
+    }
+
+    return out;
+}
+
+static char *hexdump_ascii(char *out, const uint8_t *data, size_t len) {
+    size_t i = 0;
+
+    *out++ = '|';
+#if defined(__x86_64__)
+    if (!simd_disabled) {
+        for (; i + 16 <= len; i += 16) {
+            hexdump_ascii_sse2(data + i, out + i);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        out[i] = (data[i] >= 0x20 && data[i] < 0x7f) ? data[i] : '.';
+    }
+    out += len;
+    *out++ = '|';
+
+    return out;
+}
+
+static char *hexdump_line(MiniKvmHexDump *dump, char *out, const uint8_t *data, uint64_t addr,
+                          size_t len) {
+    uint32_t word_log = __builtin_ctz(dump->word_size);
+    size_t offset = 0;
+
+    out = hexdump_address(out, addr);
+    if (!simd_disabled) {
+        for (; format_block32 != NULL && offset + 32 <= len; offset += 32) {
+            out += format_block32(data + offset, out, word_log);
+        }
+        for (; format_block16 != NULL && offset + 16 <= len; offset += 16) {
+            out += format_block16(data + offset, out, word_log);
+        }
+    }
+    out = hexdump_words(dump, out, data + offset, len - offset);
+
+    if (dump->ascii) {
+        // align the ASCII column of the last line
+        for (size_t pad = len; pad < dump->bytes_per_line; pad += dump->word_size) {
+            memset(out, ' ', 2 * dump->word_size + 1);
+            out += 2 * dump->word_size + 1;
+        }
+        out = hexdump_ascii(out, data, len);
+    }
+    *out++ = '\n';
+
+    return out;
+}
+
+MiniKVMError mini_kvm_hexdump_write(MiniKvmHexDump *dump, const uint8_t *data, uint64_t addr,
+                                    uint64_t len) {
+    size_t max_line = hexdump_max_line(dump);
+    uint64_t line_len = 0;
+
+    // ranges are aligned on word_size by the server, a trailing partial word is dropped
+    len -= len % dump->word_size;
+    for (uint64_t offset = 0; offset < len; offset += line_len) {
+        line_len = (len - offset < dump->bytes_per_line) ? len - offset : dump->bytes_per_line;
+        if (dump->capacity - dump->len < max_line &&
+            mini_kvm_hexdump_flush(dump) != MINI_KVM_SUCCESS) {
+            return MINI_KVM_INTERNAL_ERROR;
+        }
+
+        dump->len = hexdump_line(dump, dump->buf + dump->len, data + offset, addr + offset,
+                                 line_len) -
+                    dump->buf;
+    }
+
+    return MINI_KVM_SUCCESS;
+}
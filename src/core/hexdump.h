@@ -0,0 +1,46 @@
+#ifndef MINI_KVM_HEXDUMP_H
+#define MINI_KVM_HEXDUMP_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "errors.h"
+
+// Buffered memory dump formatter
+//
+// Each line starts with the address of its first byte followed by bytes_per_line bytes grouped in
+// words of word_size bytes. Words are printed as little endian values (most significant byte
+// first), an optional ASCII column shows the printable bytes of the line. Lines are formatted in a
+// large buffer with SSSE3/AVX2 nibble to hex conversion when the CPU supports it and the buffer is
+// written to fd in large blocks.
+
+#define MINI_KVM_HEXDUMP_BUFFER_SIZE (1 << 20)
+#define MINI_KVM_HEXDUMP_MAX_WORD_SIZE 8
+
+typedef struct MiniKvmHexDump {
+    int32_t fd;
+    uint32_t word_size;
+    uint32_t bytes_per_line;
+    bool ascii;
+
+    char *buf;
+    size_t len;
+    size_t capacity;
+} MiniKvmHexDump;
+
+// word_size must be a power of 2 up to MINI_KVM_HEXDUMP_MAX_WORD_SIZE and bytes_per_line a
+// multiple of word_size
+MiniKVMError mini_kvm_hexdump_init(MiniKvmHexDump *dump, int32_t fd, uint32_t word_size,
+                                   uint32_t bytes_per_line, bool ascii);
+// format len bytes located at address addr, data is split in lines starting at addr
+MiniKVMError mini_kvm_hexdump_write(MiniKvmHexDump *dump, const uint8_t *data, uint64_t addr,
+                                    uint64_t len);
+MiniKVMError mini_kvm_hexdump_flush(MiniKvmHexDump *dump);
+// flush the remaining lines and release the buffer
+MiniKVMError mini_kvm_hexdump_close(MiniKvmHexDump *dump);
+
+// force the scalar formatter, used by tests and benchmarks to compare implementations
+void mini_kvm_hexdump_disable_simd(bool disable);
+
+#endif /* MINI_KVM_HEXDUMP_H */
@@ -1,19 +1,79 @@
 #include "logger.h"
 
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <time.h>
+#include <unistd.h>
+
+#define LOGGER_RING_SIZE (64 * 1024) // per thread, in bytes
+#define LOGGER_RECORD_MAX 4096
+#define LOGGER_STR_MAX 256   // longer string arguments are truncated
+#define LOGGER_TEXT_MAX 1024 // records of formats that cannot be deferred are formatted eagerly
+#define LOGGER_LINE_MAX 2048 // formatted records are truncated
+#define LOGGER_FLUSH_MS 50   // longest time a record waits in its ring
+
+// layout of the arguments of a call site
+enum {
+    LAYOUT_UNKNOWN = 0,
+    LAYOUT_PARSING,
+    LAYOUT_READY,
+    LAYOUT_TEXT, // the format uses specifiers we do not defer
+};
+
+enum {
+    ARG_INT = 0,
+    ARG_LONG,
+    ARG_DOUBLE,
+    ARG_PTR,
+    ARG_STR,
+    ARG_UNSUPPORTED,
+};
+
+#define RECORD_PAD (1 << 0)  // skip to the start of the ring
+#define RECORD_TEXT (1 << 1) // the payload is the formatted message
+
+// records are 8 bytes aligned, arguments are stored in 8 bytes slots and strings as their length
+// followed by their NUL terminated bytes padded to 8 bytes
+typedef struct LoggerRecord {
+    uint32_t size;
+    uint32_t flags;
+    LoggerSite *site;
+    uint64_t time_ns;
+} LoggerRecord;
+
+// single producer, single consumer ring owned by a thread
+typedef struct LoggerRing {
+    _Atomic uint64_t tail __attribute__((aligned(64))); // bytes written by the owner
+    _Atomic uint64_t head __attribute__((aligned(64))); // bytes written out by the consumer
+    atomic_bool closed;
+    uint8_t data[LOGGER_RING_SIZE] __attribute__((aligned(64)));
+} LoggerRing;
 
 typedef struct LoggerState {
     FILE *output;
     bool enable_color;
-    LoggerLevel level;
     time_t timer;
-    pthread_mutex_t lock;
+    char time_buf[16];
+    pthread_mutex_t lock; // output and formatting
+
+    pthread_mutex_t rings_lock;
+    LoggerRing **rings;
+    uint32_t nb_rings;
+    uint32_t rings_capacity;
+
+    pthread_t thread;
+    atomic_bool running;
+    atomic_bool stopping;
+    int32_t wake_fd;
+    pthread_mutex_t flush_lock;
+    pthread_cond_t flushed;
 } LoggerState;
 
 static const char *level_str[] = {
@@ -31,13 +91,23 @@ static const char *level_color[] = {
     "\e[0m",    // reset
 };
 
+_Atomic int32_t logger_level = LogTrace;
+
 static LoggerState state = {
     .output = NULL,
     .enable_color = true,
-    .level = LogTrace,
+    .timer = -1,
     .lock = PTHREAD_MUTEX_INITIALIZER,
+    .rings_lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake_fd = -1,
+    .flush_lock = PTHREAD_MUTEX_INITIALIZER,
+    .flushed = PTHREAD_COND_INITIALIZER,
 };
 
+static __thread LoggerRing *local_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
 static LoggerLevel parse_log_env() {
     const char *char_level = getenv("LOGGER_LEVEL");
     LoggerLevel level = LogTrace;
@@ -61,15 +131,7 @@ static LoggerLevel parse_log_env() {
     return level;
 }
 
-void logger_init(const char *path) {
-    pthread_mutex_lock(&state.lock);
-    logger_set_output(path);
-    state.level = parse_log_env();
-    state.timer = time(NULL);
-    pthread_mutex_unlock(&state.lock);
-}
-
-void logger_set_output(const char *path) {
+static void set_output(const char *path) {
     if (state.output != stdout && state.output != NULL) {
         fclose(state.output);
     }
@@ -82,51 +144,596 @@ void logger_set_output(const char *path) {
     }
 }
 
-void logger_set_level(LoggerLevel level) {
+void logger_init(const char *path) {
     pthread_mutex_lock(&state.lock);
-    state.level = level;
+    set_output(path);
+    atomic_store_explicit(&logger_level, parse_log_env(), memory_order_relaxed);
     pthread_mutex_unlock(&state.lock);
 }
 
-void log_log(LoggerLevel lvl, const char *file, int line, const char *fmt, ...) {
+void logger_set_output(const char *path) {
+    logger_flush();
     pthread_mutex_lock(&state.lock);
+    set_output(path);
+    pthread_mutex_unlock(&state.lock);
+}
+
+void logger_set_level(LoggerLevel level) {
+    atomic_store_explicit(&logger_level, level, memory_order_relaxed);
+}
+
+// find the next conversion specification of fmt, its start is stored in start and its argument
+// type in type. Returns the end of the specification or NULL once the format is exhausted
+static const char *next_spec(const char *fmt, const char **start, uint8_t *type) {
+    bool is_long = false, is_wide = false;
 
-    if (lvl < state.level) {
-        pthread_mutex_unlock(&state.lock);
+    while (*fmt != '\0' && (fmt[0] != '%' || fmt[1] == '%')) {
+        fmt += (fmt[0] == '%') ? 2 : 1;
+    }
+    if (*fmt == '\0') {
+        return NULL;
+    }
+
+    *start = fmt++;
+    *type = ARG_UNSUPPORTED;
+    fmt += strspn(fmt, "-+ #0'");
+    if (*fmt == '*') {
+        return fmt + 1;
+    }
+    fmt += strspn(fmt, "0123456789");
+    if (*fmt == '.') {
+        fmt++;
+        if (*fmt == '*') {
+            return fmt + 1;
+        }
+        fmt += strspn(fmt, "0123456789");
+    }
+
+    for (; *fmt != '\0' && strchr("hlLqjzt", *fmt) != NULL; fmt++) {
+        is_long |= (*fmt != 'h' && *fmt != 'L');
+        is_wide |= (*fmt == 'L');
+    }
+
+    switch (*fmt) {
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        *type = is_long ? ARG_LONG : ARG_INT;
+        break;
+    case 'c':
+        *type = is_long ? ARG_UNSUPPORTED : ARG_INT;
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        *type = is_wide ? ARG_UNSUPPORTED : ARG_DOUBLE;
+        break;
+    case 's':
+        *type = is_long ? ARG_UNSUPPORTED : ARG_STR;
+        break;
+    case 'p':
+        *type = ARG_PTR;
+        break;
+    case '\0':
+        return fmt;
+    }
+
+    return fmt + 1;
+}
+
+static void site_parse(LoggerSite *site, const char *fmt) {
+    uint32_t expected = LAYOUT_UNKNOWN, layout = LAYOUT_READY;
+    const char *start = NULL;
+    uint8_t type = 0;
+
+    if (!atomic_compare_exchange_strong(&site->layout_state, &expected, LAYOUT_PARSING)) {
         return;
     }
 
-    // format level string
-    char level_buf[21];
+    site->fmt = fmt;
+    site->nargs = 0;
+    while ((fmt = next_spec(fmt, &start, &type)) != NULL) {
+        if (type == ARG_UNSUPPORTED || site->nargs == LOGGER_MAX_ARGS) {
+            layout = LAYOUT_TEXT;
+            break;
+        }
+        site->types[site->nargs++] = type;
+    }
+
+    atomic_store_explicit(&site->layout_state, layout, memory_order_release);
+}
+
+static uint32_t encode_str(uint8_t *buf, const char *str, uint64_t max) {
+    uint64_t len = (str != NULL) ? strnlen(str, max) : UINT64_MAX;
+    uint32_t size = sizeof(uint64_t);
+
+    memcpy(buf, &len, sizeof(len));
+    if (str != NULL) {
+        memcpy(buf + size, str, len);
+        buf[size + len] = '\0';
+        size += (len + 1 + 7) & ~7UL;
+    }
+    return size;
+}
+
+// write the record of a log call in buf, returns its size
+static uint32_t record_encode(uint8_t *buf, LoggerSite *site, const char *fmt, va_list ap) {
+    LoggerRecord *record = (LoggerRecord *)buf;
+    uint32_t size = sizeof(LoggerRecord);
+    struct timespec ts;
+    char text[LOGGER_TEXT_MAX];
+    uint64_t slot = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->site = site;
+    record->time_ns = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    record->flags = 0;
+
+    if (atomic_load_explicit(&site->layout_state, memory_order_acquire) != LAYOUT_READY) {
+        vsnprintf(text, sizeof(text), fmt, ap);
+        record->flags = RECORD_TEXT;
+        record->size = size + encode_str(buf + size, text, sizeof(text) - 1);
+        return record->size;
+    }
+
+    for (uint8_t i = 0; i < site->nargs; i++) {
+        switch (site->types[i]) {
+        case ARG_INT:
+            slot = (uint64_t)(int64_t)va_arg(ap, int);
+            break;
+        case ARG_LONG:
+            slot = va_arg(ap, uint64_t);
+            break;
+        case ARG_DOUBLE: {
+            double value = va_arg(ap, double);
+            memcpy(&slot, &value, sizeof(slot));
+            break;
+        }
+        case ARG_PTR:
+            slot = (uint64_t)va_arg(ap, void *);
+            break;
+        case ARG_STR:
+            size += encode_str(buf + size, va_arg(ap, const char *), LOGGER_STR_MAX);
+            continue;
+        }
+        memcpy(buf + size, &slot, sizeof(slot));
+        size += sizeof(slot);
+    }
+
+    record->size = size;
+    return size;
+}
+
+// print an unsigned integer in base 10 or 16, the common specifications skip snprintf
+static uint32_t format_uint(char *buf, uint64_t value, uint32_t base, const char *digits) {
+    char tmp[20];
+    uint32_t len = 0;
+
+    do {
+        tmp[len++] = digits[value % base];
+        value /= base;
+    } while (value != 0);
+
+    for (uint32_t i = 0; i < len; i++) {
+        buf[i] = tmp[len - 1 - i];
+    }
+    return len;
+}
+
+// print one conversion specification with the argument stored at *arg in line, *arg is moved to
+// the next argument. Returns the number of bytes written
+static uint32_t format_arg(char *line, uint32_t size, const char *start, const char *end,
+                           uint8_t type, const uint8_t **arg) {
+    char spec[32];
+    uint64_t slot = 0;
+    double value = 0;
+    int32_t len = 0;
+    bool plain = (end - start == 2) || (end - start == 3 && start[1] == 'l');
+
+    const char *str = (const char *)*arg + sizeof(slot);
+
+    memcpy(&slot, *arg, sizeof(slot));
+    *arg += sizeof(slot);
+    if (type == ARG_STR && slot != UINT64_MAX) {
+        *arg += (slot + 1 + 7) & ~7UL;
+    }
+    if (size <= 1) {
+        return 0;
+    }
+
+    if (type == ARG_STR) {
+        str = (slot != UINT64_MAX) ? str : "(null)";
+        if (plain && slot != UINT64_MAX && slot < size) {
+            memcpy(line, str, slot);
+            return slot;
+        }
+        snprintf(spec, sizeof(spec), "%.*s", (int)(end - start), start);
+        len = snprintf(line, size, spec, str);
+        return (len < 0) ? 0 : ((uint32_t)len < size ? (uint32_t)len : size - 1);
+    }
+
+    if (plain && size > 20 && (type == ARG_INT || type == ARG_LONG)) {
+        slot = (type == ARG_INT && end[-1] != 'd' && end[-1] != 'i') ? (uint32_t)slot : slot;
+        switch (end[-1]) {
+        case 'u':
+            return format_uint(line, slot, 10, "0123456789");
+        case 'x':
+            return format_uint(line, slot, 16, "0123456789abcdef");
+        case 'X':
+            return format_uint(line, slot, 16, "0123456789ABCDEF");
+        case 'd':
+        case 'i':
+            if ((int64_t)slot < 0) {
+                line[0] = '-';
+                return 1 + format_uint(line + 1, -(uint64_t)slot, 10, "0123456789");
+            }
+            return format_uint(line, slot, 10, "0123456789");
+        }
+    }
+
+    snprintf(spec, sizeof(spec), "%.*s", (int)(end - start), start);
+    switch (type) {
+    case ARG_INT:
+        len = snprintf(line, size, spec, (int)slot);
+        break;
+    case ARG_LONG:
+        len = snprintf(line, size, spec, slot);
+        break;
+    case ARG_DOUBLE:
+        memcpy(&value, &slot, sizeof(value));
+        len = snprintf(line, size, spec, value);
+        break;
+    case ARG_PTR:
+        len = snprintf(line, size, spec, (void *)slot);
+        break;
+    }
+    return (len < 0) ? 0 : ((uint32_t)len < size ? (uint32_t)len : size - 1);
+}
+
+// format a record in line, a newline terminated string of at most LOGGER_LINE_MAX bytes. Returns
+// its length, state.lock must be held
+static uint32_t record_format(char *line, const LoggerRecord *record) {
+    const LoggerSite *site = record->site;
+    const uint8_t *arg = (const uint8_t *)(record + 1);
+    const char *fmt = site->fmt, *start = NULL, *end = NULL;
+    const char *file = strrchr(site->file, '/') ? strrchr(site->file, '/') + 1 : site->file;
+    time_t sec = record->time_ns / 1000000000UL;
+    uint32_t len = 0, size = LOGGER_LINE_MAX - 1; // room for the newline
+    uint8_t type = 0, i = 0;
+
+    // localtime is only called once per second of logs
+    if (sec != state.timer) {
+        state.timer = sec;
+        strftime(state.time_buf, sizeof(state.time_buf), "%H:%M:%S", localtime(&state.timer));
+    }
+
     if (state.enable_color) {
-        sprintf(level_buf, "%s%s%s", level_color[lvl], level_str[lvl], level_color[4]);
+        len = snprintf(line, size, "[%s] %s%s%s %s:%d ", state.time_buf, level_color[site->level],
+                       level_str[site->level], level_color[4], file, site->line);
+    } else {
+        len = snprintf(line, size, "[%s] %s %s:%d ", state.time_buf, level_str[site->level], file,
+                       site->line);
+    }
+
+    if (record->flags & RECORD_TEXT) {
+        fmt = (const char *)arg + sizeof(uint64_t);
+        end = fmt + strlen(fmt);
+        start = end;
     } else {
-        sprintf(level_buf, "%s", level_str[lvl]);
+        while ((end = next_spec(fmt, &start, &type)) != NULL && i < site->nargs) {
+            for (; fmt < start && len < size; fmt++) {
+                line[len++] = *fmt;
+                fmt += (fmt[0] == '%' && fmt[1] == '%');
+            }
+            len += format_arg(line + len, size - len, start, end, site->types[i++], &arg);
+            fmt = end;
+        }
+        start = fmt + strlen(fmt);
+    }
+
+    // literal text left, %% are unescaped
+    for (; fmt < start && len < size; fmt++) {
+        line[len++] = *fmt;
+        fmt += (!(record->flags & RECORD_TEXT) && fmt[0] == '%' && fmt[1] == '%');
+    }
+    line[len++] = '\n';
+    return len;
+}
+
+static FILE *logger_output() { return (state.output != NULL) ? state.output : stdout; }
+
+static void logger_wake() {
+    uint64_t one = 1;
+
+    if (write(state.wake_fd, &one, sizeof(one)) < 0) {
+        // the counter is already set, the consumer will wake up
+    }
+}
+
+// wait for the consumer to write out the ring up to pos, returns false if it stopped before
+static bool ring_wait(LoggerRing *ring, uint64_t pos) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&state.flush_lock);
+    while (atomic_load_explicit(&ring->head, memory_order_acquire) < pos &&
+           atomic_load_explicit(&state.running, memory_order_acquire)) {
+        logger_wake();
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 10000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&state.flushed, &state.flush_lock, &deadline);
+    }
+    pthread_mutex_unlock(&state.flush_lock);
+
+    return atomic_load_explicit(&ring->head, memory_order_acquire) >= pos;
+}
+
+static void ring_release(void *ring) {
+    local_ring = NULL;
+    atomic_store_explicit(&((LoggerRing *)ring)->closed, true, memory_order_release);
+}
+
+static void ring_key_create() { pthread_key_create(&ring_key, ring_release); }
+
+static LoggerRing *ring_get() {
+    LoggerRing *ring = local_ring, **rings = NULL;
+
+    if (ring != NULL) {
+        return ring;
+    }
+
+    ring = aligned_alloc(64, sizeof(LoggerRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, false);
+
+    pthread_mutex_lock(&state.rings_lock);
+    if (state.nb_rings == state.rings_capacity) {
+        rings = realloc(state.rings, sizeof(LoggerRing *) * (state.rings_capacity * 2 + 8));
+        if (rings == NULL) {
+            pthread_mutex_unlock(&state.rings_lock);
+            free(ring);
+            return NULL;
+        }
+        state.rings = rings;
+        state.rings_capacity = state.rings_capacity * 2 + 8;
+    }
+    state.rings[state.nb_rings++] = ring;
+    pthread_mutex_unlock(&state.rings_lock);
+
+    pthread_once(&ring_key_once, ring_key_create);
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+// append a record to the ring of the calling thread, returns false if the record was not queued
+static bool ring_push(const uint8_t *record, uint32_t size, bool wait) {
+    LoggerRing *ring = ring_get();
+    uint64_t tail = 0, head = 0, pad = 0, offset = 0;
+
+    if (ring == NULL) {
+        return false;
     }
 
-    // format time string
-    char time_buf[13];
-    state.timer = time(NULL);
-    struct tm *tm_info = localtime(&state.timer);
-    strftime(time_buf, 26, "%H:%M:%S", tm_info);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    offset = tail % LOGGER_RING_SIZE;
+    pad = (LOGGER_RING_SIZE - offset < size) ? LOGGER_RING_SIZE - offset : 0;
 
-    // format metadata string
-    fprintf(state.output, "[%s] %s %s:%d ", time_buf, level_buf, file, line);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail + pad + size - head > LOGGER_RING_SIZE) {
+        // the ring is full, block until the consumer catches up
+        if (!ring_wait(ring, tail + pad + size - LOGGER_RING_SIZE)) {
+            return false;
+        }
+    }
+
+    if (pad != 0) {
+        ((LoggerRecord *)&ring->data[offset])->size = pad;
+        ((LoggerRecord *)&ring->data[offset])->flags = RECORD_PAD;
+        offset = 0;
+    }
+    memcpy(&ring->data[offset], record, size);
+    atomic_store_explicit(&ring->tail, tail + pad + size, memory_order_release);
 
-    // add user info
+    if (wait) {
+        ring_wait(ring, tail + pad + size);
+    } else if (tail - head < LOGGER_RING_SIZE / 4 &&
+               tail + pad + size - head >= LOGGER_RING_SIZE / 4) {
+        logger_wake();
+    }
+
+    return true;
+}
+
+void log_log(LoggerSite *site, const char *fmt, ...) {
+    uint8_t record[LOGGER_RECORD_MAX] __attribute__((aligned(8)));
+    char line[LOGGER_LINE_MAX];
+    uint32_t size = 0;
     va_list args;
+
+    if (atomic_load_explicit(&site->layout_state, memory_order_acquire) == LAYOUT_UNKNOWN) {
+        site_parse(site, fmt);
+    }
+
     va_start(args, fmt);
-    vfprintf(state.output, fmt, args);
+    size = record_encode(record, site, fmt, args);
     va_end(args);
 
-    fprintf(state.output, "\n");
-    fflush(state.output);
+    if (atomic_load_explicit(&state.running, memory_order_acquire) &&
+        ring_push(record, size, site->level >= LogError)) {
+        return;
+    }
 
+    // synchronous path, before logger_start and after logger_stop
+    pthread_mutex_lock(&state.lock);
+    size = record_format(line, (LoggerRecord *)record);
+    fwrite(line, 1, size, logger_output());
+    fflush(logger_output());
+    pthread_mutex_unlock(&state.lock);
+}
+
+// write out every record queued so far, records of different threads are merged by timestamp
+static void logger_drain() {
+    static LoggerRing **rings = NULL;
+    static uint64_t *pos = NULL, *end = NULL;
+    static uint32_t capacity = 0;
+    static char line[LOGGER_LINE_MAX];
+    const LoggerRecord *record = NULL, *next = NULL;
+    uint32_t nb_rings = 0, best = 0, len = 0;
+    bool written = false;
+
+    pthread_mutex_lock(&state.rings_lock);
+    if (capacity < state.nb_rings) {
+        capacity = state.rings_capacity;
+        rings = realloc(rings, sizeof(LoggerRing *) * capacity);
+        pos = realloc(pos, sizeof(uint64_t) * capacity);
+        end = realloc(end, sizeof(uint64_t) * capacity);
+    }
+    nb_rings = state.nb_rings;
+    memcpy(rings, state.rings, sizeof(LoggerRing *) * nb_rings);
+    pthread_mutex_unlock(&state.rings_lock);
+
+    for (uint32_t i = 0; i < nb_rings; i++) {
+        pos[i] = atomic_load_explicit(&rings[i]->head, memory_order_relaxed);
+        end[i] = atomic_load_explicit(&rings[i]->tail, memory_order_acquire);
+    }
+
+    pthread_mutex_lock(&state.lock);
+    while (true) {
+        record = NULL;
+        for (uint32_t i = 0; i < nb_rings; i++) {
+            while (pos[i] < end[i]) {
+                next = (const LoggerRecord *)&rings[i]->data[pos[i] % LOGGER_RING_SIZE];
+                if (!(next->flags & RECORD_PAD)) {
+                    break;
+                }
+                pos[i] += next->size;
+            }
+            if (pos[i] < end[i] && (record == NULL || next->time_ns < record->time_ns)) {
+                record = next;
+                best = i;
+            }
+        }
+        if (record == NULL) {
+            break;
+        }
+
+        len = record_format(line, record);
+        fwrite(line, 1, len, logger_output());
+        pos[best] += record->size;
+        written = true;
+    }
+    if (written) {
+        fflush(logger_output());
+    }
+    pthread_mutex_unlock(&state.lock);
+
+    pthread_mutex_lock(&state.flush_lock);
+    for (uint32_t i = 0; i < nb_rings; i++) {
+        atomic_store_explicit(&rings[i]->head, pos[i], memory_order_release);
+    }
+    pthread_cond_broadcast(&state.flushed);
+    pthread_mutex_unlock(&state.flush_lock);
+
+    // rings of exited threads are freed once drained
+    pthread_mutex_lock(&state.rings_lock);
+    for (uint32_t i = 0; i < state.nb_rings; i++) {
+        LoggerRing *ring = state.rings[i];
+        if (atomic_load_explicit(&ring->closed, memory_order_acquire) &&
+            atomic_load_explicit(&ring->head, memory_order_relaxed) ==
+                atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+            state.rings[i--] = state.rings[--state.nb_rings];
+            free(ring);
+        }
+    }
+    pthread_mutex_unlock(&state.rings_lock);
+}
+
+static void *logger_thread_run(void *arg) {
+    struct pollfd pfd = {.fd = state.wake_fd, .events = POLLIN};
+    uint64_t count = 0;
+    (void)arg;
+
+    while (!atomic_load_explicit(&state.stopping, memory_order_acquire)) {
+        logger_drain();
+        if (poll(&pfd, 1, LOGGER_FLUSH_MS) > 0 && read(state.wake_fd, &count, sizeof(count)) < 0) {
+            break;
+        }
+    }
+    logger_drain();
+
+    return NULL;
+}
+
+static void logger_register_stop() { atexit(logger_stop); }
+
+void logger_start() {
+    static pthread_once_t stop_once = PTHREAD_ONCE_INIT;
+    sigset_t all, old;
+
+    if (atomic_load(&state.running)) {
+        return;
+    }
+
+    if (state.wake_fd < 0 && (state.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        return;
+    }
+
+    // signals such as the vcpu kick are meant for the other threads
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    atomic_store(&state.stopping, false);
+    if (pthread_create(&state.thread, NULL, logger_thread_run, NULL) == 0) {
+        atomic_store(&state.running, true);
+        pthread_once(&stop_once, logger_register_stop);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void logger_flush() {
+    LoggerRing *ring = local_ring;
+
+    if (atomic_load(&state.running) && ring != NULL) {
+        ring_wait(ring, atomic_load_explicit(&ring->tail, memory_order_relaxed));
+        return;
+    }
+
+    pthread_mutex_lock(&state.lock);
+    fflush(logger_output());
     pthread_mutex_unlock(&state.lock);
 }
 
 void logger_stop() {
-    if (state.output != stdout) {
+    if (atomic_load(&state.running)) {
+        atomic_store(&state.stopping, true);
+        logger_wake();
+        pthread_join(state.thread, NULL);
+        atomic_store(&state.running, false);
+        // records queued while the thread was exiting
+        logger_drain();
+    }
+
+    pthread_mutex_lock(&state.lock);
+    if (state.output != stdout && state.output != NULL) {
         fclose(state.output);
+        state.output = NULL;
+    } else {
+        fflush(logger_output());
     }
+    pthread_mutex_unlock(&state.lock);
 }
@@ -1,7 +1,10 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <inttypes.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 
 #define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
 
@@ -13,15 +16,53 @@ typedef enum LoggerLevel {
     LogDisable,
 } LoggerLevel;
 
+#define LOGGER_MAX_ARGS 8
+
+// Asynchronous logger
+//
+// Once logger_start() has been called, a log call only copies its raw arguments (and the strings
+// they point to) in a ring owned by the calling thread, a background thread formats the records of
+// every ring in timestamp order and writes them in batches. Errors wait for their record to be
+// written. Before logger_start() and after logger_stop() records are written synchronously.
+
+// a log call site, the layout of its format arguments is parsed on first use
+typedef struct LoggerSite {
+    const char *file;
+    int32_t line;
+    LoggerLevel level;
+    const char *fmt;
+    _Atomic uint32_t layout_state;
+    uint8_t nargs;
+    uint8_t types[LOGGER_MAX_ARGS];
+} LoggerSite;
+
+extern _Atomic int32_t logger_level;
+
+static inline bool logger_enabled(LoggerLevel lvl) {
+    return (int32_t)lvl >= atomic_load_explicit(&logger_level, memory_order_relaxed);
+}
+
 void logger_init(const char *path);
+// start the background thread, logger_stop is called at exit
+void logger_start();
 void logger_set_level(LoggerLevel lvl);
 void logger_set_output(const char *path);
-void log_log(LoggerLevel lvl, const char *file, int line, const char *fmt, ...);
+void log_log(LoggerSite *site, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+// wait until every record logged by the calling thread has been written
+void logger_flush();
 void logger_stop();
 
-#define TRACE(...) log_log(LogTrace, __FILENAME__, __LINE__, __VA_ARGS__)
-#define INFO(...) log_log(LogInfo, __FILENAME__, __LINE__, __VA_ARGS__)
-#define WARN(...) log_log(LogWarn, __FILENAME__, __LINE__, __VA_ARGS__)
-#define ERROR(...) log_log(LogError, __FILENAME__, __LINE__, __VA_ARGS__)
+#define LOGGER_LOG(lvl, ...)                                                                       \
+    do {                                                                                           \
+        static LoggerSite logger_site = {.file = __FILE__, .line = __LINE__, .level = lvl};        \
+        if (logger_enabled(lvl)) {                                                                 \
+            log_log(&logger_site, __VA_ARGS__);                                                    \
+        }                                                                                          \
+    } while (0)
+
+#define TRACE(...) LOGGER_LOG(LogTrace, __VA_ARGS__)
+#define INFO(...) LOGGER_LOG(LogInfo, __VA_ARGS__)
+#define WARN(...) LOGGER_LOG(LogWarn, __VA_ARGS__)
+#define ERROR(...) LOGGER_LOG(LogError, __VA_ARGS__)
 
 #endif /* LOG_H */
@@ -0,0 +1,114 @@
+#ifndef MINI_KVM_PROBES_H
+#define MINI_KVM_PROBES_H
+
+// USDT static probes
+//
+// Each probe is a single nop in the code and a SystemTap SDT note in .note.stapsdt describing its
+// location and arguments, the format sys/sdt.h emits, so perf, bpftrace and friends find them
+// without any runtime registration:
+//
+//     bpftrace -l 'usdt:./mkvm:mini_kvm:*'
+//     bpftrace -e 'usdt:./mkvm:mini_kvm:exit_io { @[arg1] = count(); }'
+//
+// Probes are compiled out when the build is configured with -DMINI_KVM_PROBES=OFF.
+//
+// provider mini_kvm, arguments in order:
+//   run_entry(vcpu)                         before KVM_RUN
+//   run_exit(vcpu, exit_reason, ret)        after KVM_RUN, exit_reason is KVM_EXIT_INTR when the
+//                                           run was interrupted by a kick, ret is the ioctl result
+//   exit_io(vcpu, port, size, direction, count)
+//   exit_mmio(vcpu, phys_addr, len, is_write)
+//   exit_hlt(vcpu)
+//   exit_shutdown(vcpu)
+//   exit_internal_error(vcpu, suberror)
+//   exit_intr(vcpu)
+//   exit_fail_entry(vcpu, hardware_entry_failure_reason)
+//   exit_unknown(vcpu, hardware_exit_reason)
+//   exit_other(vcpu, exit_reason)           exits without a handler
+//   vcpu_park(vcpu), vcpu_unpark(vcpu)      a vcpu stops and restarts running for a pause
+//   vm_pause(nb_vcpus), vm_paused(nb_vcpus) pause requested, every vcpu is parked
+//   vm_resume(nb_vcpus)
+//   command(type, vcpus)                    a control command is dispatched, type is a
+//                                           MiniKvmStatusCommandType
+//   command_done(type, error)               the command handler returned a MiniKVMError
+//   kernel_load(entry, size)                the kernel image was placed in guest memory
+
+#ifdef MINI_KVM_PROBES
+
+// negative sizes mark signed arguments
+#define MINI_KVM_PROBE_SIZE(x)                                                                     \
+    _Generic((x),                                                                                  \
+        signed char: -1,                                                                           \
+        short: -2,                                                                                 \
+        int: -4,                                                                                   \
+        long: -8,                                                                                  \
+        long long: -8,                                                                             \
+        default: (int)sizeof(x))
+
+#define MINI_KVM_PROBE_OP(n, x) [s##n] "n"(MINI_KVM_PROBE_SIZE(x)), [a##n] "nor"(x)
+#define MINI_KVM_PROBE_ARG(n) "%c[s" #n "]@%[a" #n "]"
+
+#define MINI_KVM_PROBE_ASM(name, args, ...)                                                        \
+    __asm__ __volatile__("990: nop\n"                                                              \
+                         ".pushsection .note.stapsdt,\"?\",\"note\"\n"                             \
+                         ".balign 4\n"                                                             \
+                         ".4byte 992f-991f, 994f-993f, 3\n"                                        \
+                         "991: .asciz \"stapsdt\"\n"                                               \
+                         "992: .balign 4\n"                                                        \
+                         "993: .8byte 990b\n"                                                      \
+                         ".8byte _.stapsdt.base\n"                                                 \
+                         ".8byte 0\n"                                                              \
+                         ".asciz \"mini_kvm\"\n"                                                   \
+                         ".asciz \"" #name "\"\n"                                                  \
+                         ".asciz \"" args "\"\n"                                                   \
+                         "994: .balign 4\n"                                                        \
+                         ".popsection\n"                                                           \
+                         ".ifndef _.stapsdt.base\n"                                                \
+                         ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"   \
+                         ".weak _.stapsdt.base\n"                                                  \
+                         ".hidden _.stapsdt.base\n"                                                \
+                         "_.stapsdt.base: .space 1\n"                                              \
+                         ".size _.stapsdt.base, 1\n"                                               \
+                         ".popsection\n"                                                           \
+                         ".endif\n" ::__VA_ARGS__)
+
+#define MINI_KVM_PROBE_1(name, a)                                                                  \
+    MINI_KVM_PROBE_ASM(name, MINI_KVM_PROBE_ARG(0), MINI_KVM_PROBE_OP(0, a))
+#define MINI_KVM_PROBE_2(name, a, b)                                                               \
+    MINI_KVM_PROBE_ASM(name, MINI_KVM_PROBE_ARG(0) " " MINI_KVM_PROBE_ARG(1),                      \
+                       MINI_KVM_PROBE_OP(0, a), MINI_KVM_PROBE_OP(1, b))
+#define MINI_KVM_PROBE_3(name, a, b, c)                                                            \
+    MINI_KVM_PROBE_ASM(name,                                                                       \
+                       MINI_KVM_PROBE_ARG(0) " " MINI_KVM_PROBE_ARG(1) " " MINI_KVM_PROBE_ARG(2),  \
+                       MINI_KVM_PROBE_OP(0, a), MINI_KVM_PROBE_OP(1, b), MINI_KVM_PROBE_OP(2, c))
+#define MINI_KVM_PROBE_4(name, a, b, c, d)                                                         \
+    MINI_KVM_PROBE_ASM(name,                                                                       \
+                       MINI_KVM_PROBE_ARG(0) " " MINI_KVM_PROBE_ARG(1) " " MINI_KVM_PROBE_ARG(2)   \
+                                             " " MINI_KVM_PROBE_ARG(3),                            \
+                       MINI_KVM_PROBE_OP(0, a), MINI_KVM_PROBE_OP(1, b), MINI_KVM_PROBE_OP(2, c),  \
+                       MINI_KVM_PROBE_OP(3, d))
+#define MINI_KVM_PROBE_5(name, a, b, c, d, e)                                                      \
+    MINI_KVM_PROBE_ASM(name,                                                                       \
+                       MINI_KVM_PROBE_ARG(0) " " MINI_KVM_PROBE_ARG(1) " " MINI_KVM_PROBE_ARG(2)   \
+                                             " " MINI_KVM_PROBE_ARG(3) " " MINI_KVM_PROBE_ARG(4),  \
+                       MINI_KVM_PROBE_OP(0, a), MINI_KVM_PROBE_OP(1, b), MINI_KVM_PROBE_OP(2, c),  \
+                       MINI_KVM_PROBE_OP(3, d), MINI_KVM_PROBE_OP(4, e))
+
+#define MINI_KVM_PROBE_COUNT(...) MINI_KVM_PROBE_COUNT_(__VA_ARGS__, 5, 4, 3, 2, 1, 0)
+#define MINI_KVM_PROBE_COUNT_(a, b, c, d, e, n, ...) n
+#define MINI_KVM_PROBE_N(name, n, ...) MINI_KVM_PROBE_##n(name, __VA_ARGS__)
+#define MINI_KVM_PROBE_N_(name, n, ...) MINI_KVM_PROBE_N(name, n, __VA_ARGS__)
+
+// MINI_KVM_PROBE(name, args...) with 1 to 5 integer or pointer arguments
+#define MINI_KVM_PROBE(name, ...)                                                                  \
+    MINI_KVM_PROBE_N_(name, MINI_KVM_PROBE_COUNT(__VA_ARGS__), __VA_ARGS__)
+
+#else
+
+#define MINI_KVM_PROBE(name, ...)                                                                  \
+    do {                                                                                           \
+    } while (0)
+
+#endif /* MINI_KVM_PROBES */
+
+#endif /* MINI_KVM_PROBES_H */
@@ -0,0 +1,277 @@
+#include "sparse.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "logger.h"
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static bool sparse_is_zero_avx2(const uint8_t *data, size_t len) {
+    size_t i = 0;
+
+    // or four vectors together before testing, pages are tested at memory bandwidth
+    for (; i + 128 <= len; i += 128) {
+        __m256i acc = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(data + i)),
+                            _mm256_loadu_si256((const __m256i *)(data + i + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(data + i + 64)),
+                            _mm256_loadu_si256((const __m256i *)(data + i + 96))));
+        if (!_mm256_testz_si256(acc, acc)) {
+            return false;
+        }
+    }
+
+    for (; i < len; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool sparse_is_zero_sse2(const uint8_t *data, size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i acc =
+            _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(data + i)),
+                                      _mm_loadu_si128((const __m128i *)(data + i + 16))),
+                         _mm_or_si128(_mm_loadu_si128((const __m128i *)(data + i + 32)),
+                                      _mm_loadu_si128((const __m128i *)(data + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+            return false;
+        }
+    }
+
+    for (; i < len; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+#endif
+
+bool mini_kvm_is_zero(const uint8_t *data, size_t len) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        return sparse_is_zero_avx2(data, len);
+    }
+    return sparse_is_zero_sse2(data, len);
+#else
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+#endif
+}
+
+static int32_t sparse_pwrite(int32_t fd, const uint8_t *data, size_t len, uint64_t offset) {
+    ssize_t written = 0;
+
+    while (len > 0) {
+        written = pwrite(fd, data, len, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written < 0) {
+            ERROR("unable to write sparse file (%s)", strerror(errno));
+            return -1;
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+
+    return 0;
+}
+
+// write the runs of non zero pages of a chunk, pages are aligned on file offsets
+static int32_t sparse_write_chunk(MiniKvmSparseWriter *writer, MiniKvmSparseChunk *chunk,
+                                  MiniKvmSparseStats *stats) {
+    size_t run_start = 0, page_len = 0;
+    bool in_run = false;
+
+    for (size_t offset = 0; offset < chunk->len; offset += page_len) {
+        page_len = MINI_KVM_SPARSE_PAGE_SIZE - (chunk->offset + offset) % MINI_KVM_SPARSE_PAGE_SIZE;
+        page_len = (chunk->len - offset < page_len) ? chunk->len - offset : page_len;
+
+        if (!mini_kvm_is_zero(chunk->data + offset, page_len)) {
+            run_start = in_run ? run_start : offset;
+            in_run = true;
+            continue;
+        }
+
+        stats->hole_bytes += page_len;
+        if (in_run) {
+            stats->data_bytes += offset - run_start;
+            if (sparse_pwrite(writer->fd, chunk->data + run_start, offset - run_start,
+                              chunk->offset + run_start) < 0) {
+                return -1;
+            }
+        }
+        in_run = false;
+    }
+
+    if (in_run) {
+        stats->data_bytes += chunk->len - run_start;
+        return sparse_pwrite(writer->fd, chunk->data + run_start, chunk->len - run_start,
+                             chunk->offset + run_start);
+    }
+
+    return 0;
+}
+
+static void *sparse_thread_run(void *args) {
+    MiniKvmSparseWriter *writer = args;
+    MiniKvmSparseStats stats = {0};
+    MiniKvmSparseChunk *chunk = NULL;
+    int32_t ret = 0;
+
+    while (true) {
+        pthread_mutex_lock(&writer->lock);
+        while (writer->pending == NULL && !writer->stop) {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        }
+
+        if (writer->pending == NULL) {
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+
+        chunk = writer->pending;
+        writer->pending = chunk->next;
+        if (writer->pending == NULL) {
+            writer->pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&writer->lock);
+
+        ret = sparse_write_chunk(writer, chunk, &stats);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->failed |= (ret < 0);
+        chunk->next = writer->free;
+        writer->free = chunk;
+        pthread_cond_broadcast(&writer->cond);
+        pthread_mutex_unlock(&writer->lock);
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->stats.data_bytes += stats.data_bytes;
+    writer->stats.hole_bytes += stats.hole_bytes;
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+MiniKVMError mini_kvm_sparse_writer_init(MiniKvmSparseWriter *writer, int32_t fd, uint64_t size,
+                                         uint32_t nb_threads) {
+    uint32_t nb_chunks = 0;
+
+    memset(writer, 0, sizeof(MiniKvmSparseWriter));
+    writer->fd = fd;
+    writer->nb_threads = (nb_threads == 0) ? 1 : nb_threads;
+    if (writer->nb_threads > MINI_KVM_SPARSE_MAX_THREADS) {
+        writer->nb_threads = MINI_KVM_SPARSE_MAX_THREADS;
+    }
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+
+    // the file is sized first, pages never written are holes
+    if (ftruncate(fd, size) < 0) {
+        ERROR("unable to resize sparse file (%s)", strerror(errno));
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    // two chunks per thread so the producer can fill one while the other is written
+    nb_chunks = 2 * writer->nb_threads;
+    writer->chunks = calloc(nb_chunks, sizeof(MiniKvmSparseChunk));
+    if (writer->chunks == NULL) {
+        return MINI_KVM_FAILED_ALLOCATION;
+    }
+    for (uint32_t i = 0; i < nb_chunks; i++) {
+        writer->chunks[i].data = malloc(MINI_KVM_SPARSE_BUFFER_SIZE);
+        if (writer->chunks[i].data == NULL) {
+            return MINI_KVM_FAILED_ALLOCATION;
+        }
+        writer->chunks[i].next = writer->free;
+        writer->free = &writer->chunks[i];
+    }
+
+    for (uint32_t i = 0; i < writer->nb_threads; i++) {
+        if (pthread_create(&writer->threads[i], NULL, sparse_thread_run, writer) != 0) {
+            ERROR("unable to create sparse writer thread %u", i);
+            return MINI_KVM_INTERNAL_ERROR;
+        }
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+MiniKvmSparseChunk *mini_kvm_sparse_writer_get(MiniKvmSparseWriter *writer) {
+    MiniKvmSparseChunk *chunk = NULL;
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->free == NULL) {
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    chunk = writer->free;
+    writer->free = chunk->next;
+    pthread_mutex_unlock(&writer->lock);
+
+    chunk->next = NULL;
+    return chunk;
+}
+
+void mini_kvm_sparse_writer_submit(MiniKvmSparseWriter *writer, MiniKvmSparseChunk *chunk) {
+    pthread_mutex_lock(&writer->lock);
+    chunk->next = NULL;
+    if (writer->pending_tail != NULL) {
+        writer->pending_tail->next = chunk;
+    } else {
+        writer->pending = chunk;
+    }
+    writer->pending_tail = chunk;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+MiniKVMError mini_kvm_sparse_writer_finish(MiniKvmSparseWriter *writer, MiniKvmSparseStats *stats) {
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = true;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+
+    for (uint32_t i = 0; i < writer->nb_threads; i++) {
+        if (writer->threads[i]) {
+            pthread_join(writer->threads[i], NULL);
+        }
+    }
+
+    if (writer->chunks != NULL) {
+        for (uint32_t i = 0; i < 2 * writer->nb_threads; i++) {
+            free(writer->chunks[i].data);
+        }
+        free(writer->chunks);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->cond);
+
+    if (stats != NULL) {
+        *stats = writer->stats;
+    }
+
+    return writer->failed ? MINI_KVM_INTERNAL_ERROR : MINI_KVM_SUCCESS;
+}
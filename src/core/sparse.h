@@ -0,0 +1,62 @@
+#ifndef MINI_KVM_SPARSE_H
+#define MINI_KVM_SPARSE_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "errors.h"
+
+// Parallel sparse file writer
+//
+// Buffers are handed to a pool of threads which skip the zero pages and pwrite the other ones at
+// their offset. The file is sized up front so skipped pages stay holes and take no disk space.
+
+#define MINI_KVM_SPARSE_PAGE_SIZE 4096
+#define MINI_KVM_SPARSE_BUFFER_SIZE (4 << 20)
+#define MINI_KVM_SPARSE_MAX_THREADS 16
+
+typedef struct MiniKvmSparseChunk {
+    uint8_t *data;
+    uint64_t offset;
+    size_t len;
+    struct MiniKvmSparseChunk *next;
+} MiniKvmSparseChunk;
+
+typedef struct MiniKvmSparseStats {
+    uint64_t data_bytes; // bytes written
+    uint64_t hole_bytes; // zero bytes left as holes
+} MiniKvmSparseStats;
+
+typedef struct MiniKvmSparseWriter {
+    int32_t fd;
+    uint32_t nb_threads;
+    pthread_t threads[MINI_KVM_SPARSE_MAX_THREADS];
+
+    // chunks cycle between the free list, the pending list and the writer threads
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    MiniKvmSparseChunk *chunks;
+    MiniKvmSparseChunk *free;
+    MiniKvmSparseChunk *pending;
+    MiniKvmSparseChunk *pending_tail;
+    bool stop;
+    bool failed;
+
+    MiniKvmSparseStats stats;
+} MiniKvmSparseWriter;
+
+// returns true if the len bytes at data are all zeroes
+bool mini_kvm_is_zero(const uint8_t *data, size_t len);
+
+// write a file of size bytes to fd, every byte not submitted reads as zero
+MiniKVMError mini_kvm_sparse_writer_init(MiniKvmSparseWriter *writer, int32_t fd, uint64_t size,
+                                         uint32_t nb_threads);
+// wait for a free chunk, its data can hold MINI_KVM_SPARSE_BUFFER_SIZE bytes
+MiniKvmSparseChunk *mini_kvm_sparse_writer_get(MiniKvmSparseWriter *writer);
+void mini_kvm_sparse_writer_submit(MiniKvmSparseWriter *writer, MiniKvmSparseChunk *chunk);
+// wait for the submitted chunks to be written and release the writer
+MiniKVMError mini_kvm_sparse_writer_finish(MiniKvmSparseWriter *writer, MiniKvmSparseStats *stats);
+
+#endif /* MINI_KVM_SPARSE_H */
@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
 #include "ipc.h"
 
 #include <errno.h>
 #include <inttypes.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -31,7 +34,7 @@ int32_t mini_kvm_ipc_create_socket(Kvm *kvm, struct sockaddr_un *addr) {
         goto close_socket;
     }
 
-    if (listen(kvm->sock, 0) < 0) {
+    if (listen(kvm->sock, SOMAXCONN) < 0) {
         ERROR("unable to listen to socket (%s)", strerror(errno));
         ret = MINI_KVM_FAILED_SOCKET_CREATION;
         goto close_socket;
@@ -49,8 +52,9 @@ int32_t mini_kvm_ipc_receive_cmd(Kvm *kvm) {
     struct sockaddr_un remote_addr = {0};
     int32_t remote_sock = 0;
 
-    remote_sock = accept(kvm->sock, (struct sockaddr *)&remote_addr, &SOCKET_SIZE);
-    if (remote_sock < 0 && errno == EAGAIN) {
+    remote_sock = accept4(kvm->sock, (struct sockaddr *)&remote_addr, &SOCKET_SIZE,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (remote_sock < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
         return 0;
     }
 
@@ -87,14 +91,106 @@ out:
     return sock;
 }
 
+static int32_t ipc_send_all(int32_t sock, const uint8_t *data, size_t len) {
+    ssize_t sent = 0;
+
+    while (len > 0) {
+        sent = send(sock, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (sent < 0) {
+            ERROR("unable to send command to status socket (%s)", strerror(errno));
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+
+    return 0;
+}
+
+static int32_t ipc_recv_all(int32_t sock, uint8_t *data, size_t len) {
+    ssize_t received = 0;
+
+    while (len > 0) {
+        received = recv(sock, data, len, MSG_WAITALL);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (received <= 0) {
+            ERROR("unable to recv msg on status socket (%s)",
+                  (received == 0) ? "connection closed" : strerror(errno));
+            return -1;
+        }
+        data += received;
+        len -= received;
+    }
+
+    return 0;
+}
+
+int32_t mini_kvm_ipc_send_request(int32_t sock, uint32_t id, MiniKvmStatusCommand *cmd) {
+    MiniKvmBuffer buf = {0};
+    int32_t ret = 0;
+
+    mini_kvm_proto_encode_cmd(&buf, id, cmd);
+    ret = ipc_send_all(sock, buf.data, buf.len);
+    mini_kvm_buffer_free(&buf);
+
+    return ret;
+}
+
+int32_t mini_kvm_ipc_recv_result(int32_t sock, uint32_t *id, MiniKvmStatusResult *res) {
+    MiniKvmBuffer buf = {0};
+    MiniKvmMsgHeader header;
+    int32_t ret = -1;
+
+    if (ipc_recv_all(sock, (uint8_t *)&header, sizeof(MiniKvmMsgHeader)) < 0) {
+        return -1;
+    }
+
+    if (mini_kvm_proto_frame_size((uint8_t *)&header, SIZE_MAX) < 0) {
+        ERROR("invalid reply received on status socket");
+        return -1;
+    }
+
+    mini_kvm_buffer_append(&buf, &header, sizeof(MiniKvmMsgHeader));
+    mini_kvm_buffer_reserve(&buf, header.len);
+    if (ipc_recv_all(sock, buf.data + buf.len, header.len) < 0) {
+        goto out;
+    }
+
+    memset(res, 0, sizeof(MiniKvmStatusResult));
+    if (mini_kvm_proto_decode_result(buf.data, id, res) != MINI_KVM_SUCCESS) {
+        ERROR("invalid reply received on status socket");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    mini_kvm_buffer_free(&buf);
+    return ret;
+}
+
+int32_t mini_kvm_ipc_recv_data(int32_t sock, void *data, size_t len) {
+    return ipc_recv_all(sock, data, len);
+}
+
 int32_t mini_kvm_ipc_send_cmd(int32_t sock, MiniKvmStatusCommand *cmd, MiniKvmStatusResult *res) {
-    if (send(sock, cmd, sizeof(MiniKvmStatusCommand), 0) < 0) {
-        ERROR("unable to send command to status socket (%s)", strerror(errno));
+    static _Atomic uint32_t next_id = 0;
+    uint32_t id = atomic_fetch_add(&next_id, 1);
+    uint32_t res_id = 0;
+
+    if (mini_kvm_ipc_send_request(sock, id, cmd) < 0 ||
+        mini_kvm_ipc_recv_result(sock, &res_id, res) < 0) {
         return -1;
     }
 
-    if (recv(sock, res, sizeof(MiniKvmStatusResult), 0) < -1) {
-        ERROR("unable to recv msg on status socket (%s)", strerror(errno));
+    if (res_id != id) {
+        ERROR("unexpected reply %u received for request %u", res_id, id);
         return -1;
     }
 
@@ -5,6 +5,7 @@
 #include <sys/un.h>
 
 #include "commands/status.h"
+#include "ipc/protocol.h"
 
 // server side functions
 int32_t mini_kvm_ipc_create_socket(Kvm *kvm, struct sockaddr_un *addr);
@@ -13,5 +14,10 @@ int32_t mini_kvm_ipc_receive_cmd(Kvm *kvm);
 // client side functions
 int32_t mini_kvm_ipc_connect(char *name, struct sockaddr_un *addr);
 int32_t mini_kvm_ipc_send_cmd(int32_t sock, MiniKvmStatusCommand *cmd, MiniKvmStatusResult *res);
+// pipelined requests, replies come back in request order and carry the id of their request
+int32_t mini_kvm_ipc_send_request(int32_t sock, uint32_t id, MiniKvmStatusCommand *cmd);
+int32_t mini_kvm_ipc_recv_result(int32_t sock, uint32_t *id, MiniKvmStatusResult *res);
+// raw data streamed after a reply (memory dumps)
+int32_t mini_kvm_ipc_recv_data(int32_t sock, void *data, size_t len);
 
 #endif /* MINI_KVM_IPC_H */
@@ -0,0 +1,342 @@
+#include "protocol.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/constants.h"
+#include "core/logger.h"
+
+void mini_kvm_buffer_reserve(MiniKvmBuffer *buf, size_t len) {
+    size_t capacity = (buf->capacity == 0) ? 256 : buf->capacity;
+
+    if (buf->len + len <= buf->capacity) {
+        return;
+    }
+
+    while (capacity < buf->len + len) {
+        capacity <<= 1;
+    }
+    buf->data = realloc(buf->data, capacity);
+    buf->capacity = capacity;
+}
+
+void mini_kvm_buffer_append(MiniKvmBuffer *buf, const void *data, size_t len) {
+    mini_kvm_buffer_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+void mini_kvm_buffer_consume(MiniKvmBuffer *buf, size_t len) {
+    len = (len > buf->len) ? buf->len : len;
+    memmove(buf->data, buf->data + len, buf->len - len);
+    buf->len -= len;
+}
+
+void mini_kvm_buffer_free(MiniKvmBuffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->capacity = 0;
+}
+
+static size_t proto_begin(MiniKvmBuffer *buf, uint32_t id, uint8_t type, int32_t error) {
+    MiniKvmMsgHeader header = {
+        .magic = MINI_KVM_PROTO_MAGIC,
+        .version = MINI_KVM_PROTO_VERSION,
+        .type = type,
+        .id = id,
+        .len = 0,
+        .error = error,
+    };
+    size_t offset = buf->len;
+
+    mini_kvm_buffer_append(buf, &header, sizeof(MiniKvmMsgHeader));
+    return offset;
+}
+
+static void proto_section(MiniKvmBuffer *buf, MiniKvmSectionType type, uint16_t index,
+                          const void *data, uint32_t len) {
+    MiniKvmMsgSection section = {.type = type, .index = index, .len = len};
+
+    mini_kvm_buffer_append(buf, &section, sizeof(MiniKvmMsgSection));
+    mini_kvm_buffer_append(buf, data, len);
+}
+
+// patch the payload length once every section has been appended
+static void proto_end(MiniKvmBuffer *buf, size_t offset) {
+    MiniKvmMsgHeader *header = (MiniKvmMsgHeader *)(buf->data + offset);
+    header->len = buf->len - offset - sizeof(MiniKvmMsgHeader);
+}
+
+void mini_kvm_proto_encode_cmd(MiniKvmBuffer *buf, uint32_t id, MiniKvmStatusCommand *cmd) {
+    size_t offset = proto_begin(buf, id, cmd->type, MINI_KVM_SUCCESS);
+
+    switch (cmd->type) {
+    case MINI_KVM_COMMAND_SHOW_REGS:
+    case MINI_KVM_COMMAND_SHOW_STATS:
+    case MINI_KVM_COMMAND_RESET_STATS:
+    case MINI_KVM_COMMAND_SHOW_KVM_STATS:
+    case MINI_KVM_COMMAND_TRACE_FETCH:
+        proto_section(buf, MINI_KVM_SECTION_VCPUS, 0, &cmd->vcpus, sizeof(uint64_t));
+        break;
+    case MINI_KVM_COMMAND_DUMP_MEM:
+        proto_section(buf, MINI_KVM_SECTION_MEM_RANGE, 0, cmd->mem_range, sizeof(cmd->mem_range));
+        break;
+    default:
+        break;
+    }
+
+    proto_end(buf, offset);
+}
+
+void mini_kvm_proto_encode_result(MiniKvmBuffer *buf, uint32_t id, MiniKvmStatusResult *res) {
+    size_t offset = proto_begin(buf, id, res->cmd_type, res->error);
+    uint32_t state = res->state;
+
+    if (res->error != MINI_KVM_SUCCESS) {
+        proto_end(buf, offset);
+        return;
+    }
+
+    switch (res->cmd_type) {
+    case MINI_KVM_COMMAND_SHOW_STATE:
+        proto_section(buf, MINI_KVM_SECTION_STATE, 0, &state, sizeof(uint32_t));
+        break;
+    case MINI_KVM_COMMAND_SHOW_REGS:
+        proto_section(buf, MINI_KVM_SECTION_VCPUS, 0, &res->vcpus, sizeof(uint64_t));
+        for (uint16_t index = 0; index < MINI_KVM_MAX_VCPUS; index++) {
+            if ((res->vcpus & (1UL << index)) == 0) {
+                continue;
+            }
+            proto_section(buf, MINI_KVM_SECTION_REGS, index, &res->regs[index],
+                          sizeof(struct kvm_regs));
+            proto_section(buf, MINI_KVM_SECTION_SREGS, index, &res->sregs[index],
+                          sizeof(struct kvm_sregs));
+        }
+        break;
+    case MINI_KVM_COMMAND_DUMP_MEM:
+        proto_section(buf, MINI_KVM_SECTION_MEM_RANGE, 0, res->mem_range, sizeof(res->mem_range));
+        break;
+    case MINI_KVM_COMMAND_SHOW_STATS:
+    case MINI_KVM_COMMAND_RESET_STATS:
+        proto_section(buf, MINI_KVM_SECTION_VCPUS, 0, &res->vcpus, sizeof(uint64_t));
+        for (uint16_t index = 0; index < MINI_KVM_MAX_VCPUS; index++) {
+            if ((res->vcpus & (1UL << index)) != 0) {
+                proto_section(buf, MINI_KVM_SECTION_STATS, index, &res->stats[index],
+                              sizeof(VCpuStats));
+            }
+        }
+        break;
+    case MINI_KVM_COMMAND_SHOW_KVM_STATS:
+        proto_section(buf, MINI_KVM_SECTION_VCPUS, 0, &res->vcpus, sizeof(uint64_t));
+        if (res->kvm_stats_len > 0) {
+            proto_section(buf, MINI_KVM_SECTION_KVM_STATS, 0, res->kvm_stats, res->kvm_stats_len);
+        }
+        break;
+    case MINI_KVM_COMMAND_TRACE_START:
+    case MINI_KVM_COMMAND_TRACE_STOP:
+        proto_section(buf, MINI_KVM_SECTION_VCPUS, 0, &res->vcpus, sizeof(uint64_t));
+        proto_section(buf, MINI_KVM_SECTION_CLOCK, 0, res->clock, sizeof(res->clock));
+        break;
+    case MINI_KVM_COMMAND_TRACE_FETCH:
+        proto_section(buf, MINI_KVM_SECTION_VCPUS, 0, &res->vcpus, sizeof(uint64_t));
+        if (res->trace_len > 0) {
+            proto_section(buf, MINI_KVM_SECTION_TRACE, __builtin_ctzl(res->vcpus), res->trace,
+                          res->trace_len * sizeof(MiniKvmTraceEvent));
+        }
+        break;
+    case MINI_KVM_COMMAND_SHOW_STARTUP:
+        proto_section(buf, MINI_KVM_SECTION_STARTUP, 0, &res->startup,
+                      sizeof(MiniKvmStartupProfile));
+        break;
+    case MINI_KVM_COMMAND_SHOW_CPUID:
+        proto_section(buf, MINI_KVM_SECTION_CPUID, 0, res->cpuid,
+                      res->cpuid_len * sizeof(struct kvm_cpuid_entry2));
+        break;
+    default:
+        break;
+    }
+
+    proto_end(buf, offset);
+}
+
+int64_t mini_kvm_proto_frame_size(const uint8_t *data, size_t len) {
+    MiniKvmMsgHeader header;
+
+    if (len < sizeof(MiniKvmMsgHeader)) {
+        return 0;
+    }
+
+    memcpy(&header, data, sizeof(MiniKvmMsgHeader));
+    if (header.magic != MINI_KVM_PROTO_MAGIC || header.version != MINI_KVM_PROTO_VERSION ||
+        header.len > MINI_KVM_PROTO_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    if (len < sizeof(MiniKvmMsgHeader) + header.len) {
+        return 0;
+    }
+
+    return sizeof(MiniKvmMsgHeader) + header.len;
+}
+
+// copy a section in dst, sections with an unexpected size are rejected
+static MiniKVMError proto_copy(void *dst, size_t dst_len, const MiniKvmMsgSection *section,
+                               const uint8_t *data) {
+    if (section->len != dst_len) {
+        WARN("ipc: invalid section %u of size %u", section->type, section->len);
+        return MINI_KVM_IPC_PROTOCOL_ERROR;
+    }
+
+    memcpy(dst, data, dst_len);
+    return MINI_KVM_SUCCESS;
+}
+
+typedef MiniKVMError (*SectionHandler)(void *, const MiniKvmMsgSection *, const uint8_t *);
+
+// iterate over the payload sections of a frame, unknown sections are skipped
+static MiniKVMError proto_for_each_section(const uint8_t *frame, SectionHandler handler,
+                                           void *ctx) {
+    const MiniKvmMsgHeader *header = (const MiniKvmMsgHeader *)frame;
+    const uint8_t *payload = frame + sizeof(MiniKvmMsgHeader);
+    MiniKvmMsgSection section;
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+    uint32_t offset = 0;
+
+    while (offset < header->len) {
+        if (header->len - offset < sizeof(MiniKvmMsgSection)) {
+            return MINI_KVM_IPC_PROTOCOL_ERROR;
+        }
+
+        memcpy(&section, payload + offset, sizeof(MiniKvmMsgSection));
+        offset += sizeof(MiniKvmMsgSection);
+        if (header->len - offset < section.len) {
+            return MINI_KVM_IPC_PROTOCOL_ERROR;
+        }
+
+        ret = handler(ctx, &section, payload + offset);
+        if (ret != MINI_KVM_SUCCESS) {
+            return ret;
+        }
+        offset += section.len;
+    }
+
+    return ret;
+}
+
+static MiniKVMError proto_cmd_section(void *ctx, const MiniKvmMsgSection *section,
+                                      const uint8_t *data) {
+    MiniKvmStatusCommand *cmd = ctx;
+
+    switch (section->type) {
+    case MINI_KVM_SECTION_VCPUS:
+        return proto_copy(&cmd->vcpus, sizeof(uint64_t), section, data);
+    case MINI_KVM_SECTION_MEM_RANGE:
+        return proto_copy(cmd->mem_range, sizeof(cmd->mem_range), section, data);
+    default:
+        return MINI_KVM_SUCCESS;
+    }
+}
+
+static MiniKVMError proto_result_section(void *ctx, const MiniKvmMsgSection *section,
+                                         const uint8_t *data) {
+    MiniKvmStatusResult *res = ctx;
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+    uint32_t state = 0;
+
+    if ((section->type == MINI_KVM_SECTION_REGS || section->type == MINI_KVM_SECTION_SREGS ||
+         section->type == MINI_KVM_SECTION_STATS) &&
+        section->index >= MINI_KVM_MAX_VCPUS) {
+        return MINI_KVM_IPC_PROTOCOL_ERROR;
+    }
+
+    switch (section->type) {
+    case MINI_KVM_SECTION_STATE:
+        ret = proto_copy(&state, sizeof(uint32_t), section, data);
+        res->state = state;
+        break;
+    case MINI_KVM_SECTION_VCPUS:
+        ret = proto_copy(&res->vcpus, sizeof(uint64_t), section, data);
+        break;
+    case MINI_KVM_SECTION_MEM_RANGE:
+        ret = proto_copy(res->mem_range, sizeof(res->mem_range), section, data);
+        break;
+    case MINI_KVM_SECTION_REGS:
+        ret = proto_copy(&res->regs[section->index], sizeof(struct kvm_regs), section, data);
+        break;
+    case MINI_KVM_SECTION_SREGS:
+        ret = proto_copy(&res->sregs[section->index], sizeof(struct kvm_sregs), section, data);
+        break;
+    case MINI_KVM_SECTION_STATS:
+        ret = proto_copy(&res->stats[section->index], sizeof(VCpuStats), section, data);
+        break;
+    case MINI_KVM_SECTION_KVM_STATS:
+        free(res->kvm_stats);
+        res->kvm_stats = malloc(section->len);
+        if (res->kvm_stats == NULL) {
+            return MINI_KVM_FAILED_ALLOCATION;
+        }
+        memcpy(res->kvm_stats, data, section->len);
+        res->kvm_stats_len = section->len;
+        break;
+    case MINI_KVM_SECTION_CLOCK:
+        ret = proto_copy(res->clock, sizeof(res->clock), section, data);
+        break;
+    case MINI_KVM_SECTION_TRACE:
+        if (section->len % sizeof(MiniKvmTraceEvent) != 0) {
+            return MINI_KVM_IPC_PROTOCOL_ERROR;
+        }
+        free(res->trace);
+        res->trace = malloc(section->len);
+        if (res->trace == NULL) {
+            return MINI_KVM_FAILED_ALLOCATION;
+        }
+        memcpy(res->trace, data, section->len);
+        res->trace_len = section->len / sizeof(MiniKvmTraceEvent);
+        break;
+    case MINI_KVM_SECTION_STARTUP:
+        ret = proto_copy(&res->startup, sizeof(MiniKvmStartupProfile), section, data);
+        break;
+    case MINI_KVM_SECTION_CPUID:
+        if (section->len % sizeof(struct kvm_cpuid_entry2) != 0) {
+            return MINI_KVM_IPC_PROTOCOL_ERROR;
+        }
+        free(res->cpuid);
+        res->cpuid = malloc(section->len);
+        if (res->cpuid == NULL && section->len > 0) {
+            return MINI_KVM_FAILED_ALLOCATION;
+        }
+        memcpy(res->cpuid, data, section->len);
+        res->cpuid_len = section->len / sizeof(struct kvm_cpuid_entry2);
+        break;
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+MiniKVMError mini_kvm_proto_decode_cmd(const uint8_t *frame, uint32_t *id,
+                                       MiniKvmStatusCommand *cmd) {
+    const MiniKvmMsgHeader *header = (const MiniKvmMsgHeader *)frame;
+
+    // the type is kept even when invalid, the error reply echoes it
+    *id = header->id;
+    memset(cmd, 0, sizeof(MiniKvmStatusCommand));
+    cmd->type = header->type;
+    if (header->type >= MINI_KVM_COMMAND_COUNT) {
+        return MINI_KVM_IPC_PROTOCOL_ERROR;
+    }
+
+    return proto_for_each_section(frame, proto_cmd_section, cmd);
+}
+
+MiniKVMError mini_kvm_proto_decode_result(const uint8_t *frame, uint32_t *id,
+                                          MiniKvmStatusResult *res) {
+    const MiniKvmMsgHeader *header = (const MiniKvmMsgHeader *)frame;
+
+    *id = header->id;
+    res->cmd_type = header->type;
+    res->error = header->error;
+    return proto_for_each_section(frame, proto_result_section, res);
+}
@@ -0,0 +1,78 @@
+#ifndef MINI_KVM_PROTOCOL_H
+#define MINI_KVM_PROTOCOL_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "commands/status.h"
+#include "core/errors.h"
+
+// Control socket wire protocol
+//
+// Every message is a frame made of a fixed header followed by `len` bytes of payload. The payload
+// is a sequence of typed sections (section header + data), a message only carries the sections it
+// needs (a state query reply is a single 4 bytes section). Requests carry an id echoed by the
+// reply so a client can pipeline several requests on the same connection, replies are sent in
+// request order. All fields are in host byte order, the socket is local.
+//
+// A successful memory dump reply carries the aligned MEM_RANGE it covers and is immediately
+// followed by the end - start raw bytes of guest memory, outside of any frame.
+
+#define MINI_KVM_PROTO_MAGIC 0x4b4d // "MK"
+#define MINI_KVM_PROTO_VERSION 1
+#define MINI_KVM_PROTO_MAX_PAYLOAD (1 << 20)
+
+typedef struct __attribute__((packed)) MiniKvmMsgHeader {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t type; // MiniKvmStatusCommandType
+    uint32_t id;
+    uint32_t len;  // payload length in bytes
+    int32_t error; // MiniKVMError, only meaningful in replies
+} MiniKvmMsgHeader;
+
+typedef enum MiniKvmSectionType {
+    MINI_KVM_SECTION_NONE = 0,
+    MINI_KVM_SECTION_STATE,     // uint32_t VMState
+    MINI_KVM_SECTION_VCPUS,     // uint64_t vcpu mask
+    MINI_KVM_SECTION_MEM_RANGE, // int64_t[4] start, end, word size, bytes per line
+    MINI_KVM_SECTION_REGS,      // struct kvm_regs, index is the vcpu id
+    MINI_KVM_SECTION_SREGS,     // struct kvm_sregs, index is the vcpu id
+    MINI_KVM_SECTION_STATS,     // VCpuStats, index is the vcpu id
+    MINI_KVM_SECTION_KVM_STATS, // KVM binary stats groups, variable size
+    MINI_KVM_SECTION_CLOCK,     // uint64_t[2] TSC and monotonic time in ns
+    MINI_KVM_SECTION_TRACE,     // MiniKvmTraceEvent array, index is the vcpu id
+    MINI_KVM_SECTION_STARTUP,   // MiniKvmStartupProfile
+    MINI_KVM_SECTION_CPUID,     // struct kvm_cpuid_entry2 array
+} MiniKvmSectionType;
+
+typedef struct __attribute__((packed)) MiniKvmMsgSection {
+    uint16_t type;
+    uint16_t index;
+    uint32_t len;
+} MiniKvmMsgSection;
+
+typedef struct MiniKvmBuffer {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+} MiniKvmBuffer;
+
+void mini_kvm_buffer_reserve(MiniKvmBuffer *buf, size_t len);
+void mini_kvm_buffer_append(MiniKvmBuffer *buf, const void *data, size_t len);
+// drop the first len bytes of the buffer
+void mini_kvm_buffer_consume(MiniKvmBuffer *buf, size_t len);
+void mini_kvm_buffer_free(MiniKvmBuffer *buf);
+
+void mini_kvm_proto_encode_cmd(MiniKvmBuffer *buf, uint32_t id, MiniKvmStatusCommand *cmd);
+void mini_kvm_proto_encode_result(MiniKvmBuffer *buf, uint32_t id, MiniKvmStatusResult *res);
+
+// returns the size of the first complete frame in data, 0 if more bytes are needed and -1 if the
+// frame is invalid
+int64_t mini_kvm_proto_frame_size(const uint8_t *data, size_t len);
+MiniKVMError mini_kvm_proto_decode_cmd(const uint8_t *frame, uint32_t *id,
+                                       MiniKvmStatusCommand *cmd);
+MiniKVMError mini_kvm_proto_decode_result(const uint8_t *frame, uint32_t *id,
+                                          MiniKvmStatusResult *res);
+
+#endif /* MINI_KVM_PROTOCOL_H */
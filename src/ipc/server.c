@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "core/logger.h"
+#include "ipc/ipc.h"
+
+// SIGINT and SIGTERM are blocked before the vcpu and worker threads are spawned (they inherit the
+// mask) and are read from a signalfd by the event loop
+static int32_t server_setup_signals() {
+    sigset_t set;
+    int32_t fd = -1;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+        WARN("unable to block SIGINT and SIGTERM");
+        return -1;
+    }
+
+    // without a signalfd nothing reads them, the default handlers must stop the VMM again
+    fd = signalfd(-1, &set, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (fd < 0) {
+        WARN("unable to create signalfd (%s)", strerror(errno));
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        return -1;
+    }
+
+    return fd;
+}
+
+// every fd is registered with a pointer to its own storage, client connections start with their fd
+// so the pointer identifies the event source
+static int32_t server_epoll_ctl(MiniKvmServer *server, int32_t op, int32_t *fd, uint32_t events) {
+    struct epoll_event event = {.events = events, .data.ptr = fd};
+
+    if (epoll_ctl(server->epoll_fd, op, *fd, &event) < 0) {
+        ERROR("unable to register fd %d in epoll (%s)", *fd, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void server_close_conn(MiniKvmServer *server, MiniKvmConn *conn) {
+    if (conn->prev_conn != NULL) {
+        conn->prev_conn->next_conn = conn->next_conn;
+    } else {
+        server->conns = conn->next_conn;
+    }
+    if (conn->next_conn != NULL) {
+        conn->next_conn->prev_conn = conn->prev_conn;
+    }
+
+    close(conn->fd);
+    if (conn->pipe[0] >= 0) {
+        close(conn->pipe[0]);
+        close(conn->pipe[1]);
+    }
+    mini_kvm_buffer_free(&conn->rbuf);
+    mini_kvm_buffer_free(&conn->wbuf);
+    free(conn);
+}
+
+// poll for writes while replies are pending and for reads while the request backlog is small
+static void server_update_events(MiniKvmServer *server, MiniKvmConn *conn) {
+    uint32_t events = 0;
+
+    if (conn->rbuf.len < MINI_KVM_CONN_MAX_PENDING) {
+        events |= EPOLLIN;
+    }
+    if (conn->wbuf.len > 0 || conn->state == MINI_KVM_CONN_STREAMING) {
+        events |= EPOLLOUT;
+    }
+
+    if (events != conn->events) {
+        server_epoll_ctl(server, EPOLL_CTL_MOD, &conn->fd, events);
+        conn->events = events;
+    }
+}
+
+static void server_accept(MiniKvmServer *server) {
+    int32_t remote_sock = 0;
+    MiniKvmConn *conn = NULL;
+
+    while ((remote_sock = mini_kvm_ipc_receive_cmd(server->kvm)) > 0) {
+        conn = calloc(1, sizeof(MiniKvmConn));
+        if (conn == NULL) {
+            ERROR("failed to allocate client connection");
+            close(remote_sock);
+            continue;
+        }
+
+        conn->fd = remote_sock;
+        conn->pipe[0] = -1;
+        conn->pipe[1] = -1;
+        conn->state = MINI_KVM_CONN_READING;
+        conn->events = EPOLLIN;
+        if (server_epoll_ctl(server, EPOLL_CTL_ADD, &conn->fd, conn->events) < 0) {
+            close(remote_sock);
+            free(conn);
+            continue;
+        }
+
+        conn->next_conn = server->conns;
+        if (server->conns != NULL) {
+            server->conns->prev_conn = conn;
+        }
+        server->conns = conn;
+    }
+
+    if (remote_sock < 0) {
+        WARN("unable to receive command");
+    }
+}
+
+static void server_handle_signal(MiniKvmServer *server) {
+    struct signalfd_siginfo info = {0};
+
+    while (read(server->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM) {
+            INFO("received signal %d, shutting down", info.ssi_signo);
+            server->kvm->state = MINI_KVM_SHUTDOWN;
+            mini_kvm_kick_vcpus(server->kvm, MINI_KVM_REQ_SHUTDOWN);
+        }
+    }
+}
+
+static void server_push_job(MiniKvmServer *server, MiniKvmConn *conn) {
+    pthread_mutex_lock(&server->lock);
+    conn->next = NULL;
+    if (server->jobs_tail != NULL) {
+        server->jobs_tail->next = conn;
+    } else {
+        server->jobs = conn;
+    }
+    server->jobs_tail = conn;
+    pthread_cond_signal(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// hand the next complete request to a worker, malformed requests are answered with an error
+static int32_t server_dispatch(MiniKvmServer *server, MiniKvmConn *conn) {
+    int64_t frame_size = 0;
+
+    while (conn->state == MINI_KVM_CONN_READING) {
+        frame_size = mini_kvm_proto_frame_size(conn->rbuf.data, conn->rbuf.len);
+        if (frame_size == 0) {
+            return 0;
+        }
+
+        if (frame_size < 0) {
+            WARN("invalid frame received, closing connection");
+            server_close_conn(server, conn);
+            return -1;
+        }
+
+        memset(&conn->res, 0, sizeof(MiniKvmStatusResult));
+        conn->res.error = mini_kvm_proto_decode_cmd(conn->rbuf.data, &conn->id, &conn->cmd);
+        mini_kvm_buffer_consume(&conn->rbuf, frame_size);
+        if (conn->res.error != MINI_KVM_SUCCESS) {
+            conn->res.cmd_type = conn->cmd.type;
+            mini_kvm_proto_encode_result(&conn->wbuf, conn->id, &conn->res);
+            mini_kvm_status_clean_result(&conn->res);
+            continue;
+        }
+
+        conn->state = MINI_KVM_CONN_EXECUTING;
+        server_push_job(server, conn);
+    }
+
+    return 0;
+}
+
+static int32_t server_write(MiniKvmServer *server, MiniKvmConn *conn) {
+    ssize_t len = 0;
+
+    while (conn->wbuf.len > 0) {
+        len = send(conn->fd, conn->wbuf.data, conn->wbuf.len, MSG_NOSIGNAL);
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        if (len < 0) {
+            server_close_conn(server, conn);
+            return -1;
+        }
+        mini_kvm_buffer_consume(&conn->wbuf, len);
+    }
+
+    return 0;
+}
+
+// start streaming the memory range of a dump reply, guest pages are mapped in a pipe with vmsplice
+// and moved to the socket with splice so they are never copied in userspace
+static int32_t server_start_stream(MiniKvmServer *server, MiniKvmConn *conn) {
+    int32_t pipe_size = 0;
+
+    if (conn->pipe[0] < 0) {
+        if (pipe2(conn->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+            ERROR("unable to create stream pipe (%s)", strerror(errno));
+            conn->pipe[0] = -1;
+            conn->pipe[1] = -1;
+            return -1;
+        }
+
+        // larger pipes need less syscalls, the request may be capped by pipe-max-size
+        fcntl(conn->pipe[1], F_SETPIPE_SZ, MINI_KVM_CONN_PIPE_SIZE);
+        pipe_size = fcntl(conn->pipe[1], F_GETPIPE_SZ);
+        conn->pipe_size = (pipe_size > 0) ? pipe_size : 4096;
+    }
+
+    conn->stream = (uint8_t *)server->kvm->mem + conn->res.mem_range[0];
+    conn->stream_len = conn->res.mem_range[1] - conn->res.mem_range[0];
+    conn->pipe_len = 0;
+    conn->state = MINI_KVM_CONN_STREAMING;
+    return 0;
+}
+
+static int32_t server_stream(MiniKvmServer *server, MiniKvmConn *conn) {
+    struct iovec iov = {0};
+    ssize_t len = 0;
+
+    while (conn->stream_len > 0 || conn->pipe_len > 0) {
+        if (conn->pipe_len == 0) {
+            iov.iov_base = (void *)conn->stream;
+            iov.iov_len = (conn->stream_len < conn->pipe_size) ? conn->stream_len : conn->pipe_size;
+            len = vmsplice(conn->pipe[1], &iov, 1, SPLICE_F_NONBLOCK);
+            if (len < 0) {
+                ERROR("unable to map guest memory in stream pipe (%s)", strerror(errno));
+                server_close_conn(server, conn);
+                return -1;
+            }
+            conn->stream += len;
+            conn->stream_len -= len;
+            conn->pipe_len = len;
+        }
+
+        len = splice(conn->pipe[0], NULL, conn->fd, NULL, conn->pipe_len,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+
+        if (len <= 0) {
+            server_close_conn(server, conn);
+            return -1;
+        }
+        conn->pipe_len -= len;
+    }
+
+    conn->state = MINI_KVM_CONN_READING;
+    return 0;
+}
+
+// send pending replies and streamed memory, then move on to the next pipelined request
+static int32_t server_flush(MiniKvmServer *server, MiniKvmConn *conn) {
+    while (true) {
+        if (server_write(server, conn) < 0) {
+            return -1;
+        }
+        if (conn->wbuf.len > 0) {
+            return 0;
+        }
+
+        if (conn->state == MINI_KVM_CONN_STREAMING && server_stream(server, conn) < 0) {
+            return -1;
+        }
+        if (conn->state != MINI_KVM_CONN_READING) {
+            return 0;
+        }
+
+        if (server_dispatch(server, conn) < 0) {
+            return -1;
+        }
+        if (conn->wbuf.len == 0) {
+            return 0;
+        }
+    }
+}
+
+static void server_read(MiniKvmServer *server, MiniKvmConn *conn) {
+    ssize_t len = 0;
+
+    while (conn->rbuf.len < MINI_KVM_CONN_MAX_PENDING) {
+        mini_kvm_buffer_reserve(&conn->rbuf, 4096);
+        len = recv(conn->fd, conn->rbuf.data + conn->rbuf.len,
+                   conn->rbuf.capacity - conn->rbuf.len, 0);
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        // the remote closed the connection, a worker may still own it
+        if (len <= 0) {
+            if (conn->state == MINI_KVM_CONN_EXECUTING) {
+                epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+                conn->closing = true;
+            } else {
+                server_close_conn(server, conn);
+            }
+            return;
+        }
+        conn->rbuf.len += len;
+    }
+
+    if (server_flush(server, conn) < 0) {
+        return;
+    }
+    server_update_events(server, conn);
+}
+
+static void server_handle_done(MiniKvmServer *server) {
+    MiniKvmConn *conn = NULL, *next = NULL;
+    uint64_t counter = 0;
+
+    if (read(server->done_fd, &counter, sizeof(uint64_t)) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    conn = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    for (; conn != NULL; conn = next) {
+        next = conn->next;
+        if (conn->closing) {
+            server_close_conn(server, conn);
+            continue;
+        }
+
+        mini_kvm_proto_encode_result(&conn->wbuf, conn->id, &conn->res);
+        mini_kvm_status_clean_result(&conn->res);
+        conn->state = MINI_KVM_CONN_READING;
+        if (conn->res.cmd_type == MINI_KVM_COMMAND_DUMP_MEM &&
+            conn->res.error == MINI_KVM_SUCCESS && server_start_stream(server, conn) < 0) {
+            server_close_conn(server, conn);
+            continue;
+        }
+
+        if (server_flush(server, conn) < 0) {
+            continue;
+        }
+        server_update_events(server, conn);
+    }
+}
+
+static void server_handle_conn(MiniKvmServer *server, MiniKvmConn *conn, uint32_t events) {
+    if (conn->closing) {
+        return;
+    }
+
+    if ((events & EPOLLOUT) && server_flush(server, conn) < 0) {
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        server_read(server, conn);
+    } else {
+        server_update_events(server, conn);
+    }
+}
+
+static void *server_worker_run(void *args) {
+    MiniKvmServer *server = (MiniKvmServer *)args;
+    MiniKvmConn *conn = NULL;
+    uint64_t counter = 1;
+
+    while (true) {
+        pthread_mutex_lock(&server->lock);
+        while (server->jobs == NULL && !server->stop) {
+            pthread_cond_wait(&server->cond, &server->lock);
+        }
+
+        if (server->stop) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+
+        conn = server->jobs;
+        server->jobs = conn->next;
+        if (server->jobs == NULL) {
+            server->jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        memset(&conn->res, 0, sizeof(MiniKvmStatusResult));
+        mini_kvm_status_handle_command(server->kvm, &conn->cmd, &conn->res);
+
+        pthread_mutex_lock(&server->lock);
+        conn->next = server->done;
+        server->done = conn;
+        pthread_mutex_unlock(&server->lock);
+        if (write(server->done_fd, &counter, sizeof(uint64_t)) < 0) {
+            WARN("unable to signal a finished command (%s)", strerror(errno));
+        }
+    }
+
+    return NULL;
+}
+
+MiniKVMError mini_kvm_server_init(MiniKvmServer *server, Kvm *kvm) {
+    memset(server, 0, sizeof(MiniKvmServer));
+    server->kvm = kvm;
+    server->epoll_fd = -1;
+    server->done_fd = -1;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->cond, NULL);
+
+    server->signal_fd = server_setup_signals();
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll_fd < 0) {
+        ERROR("unable to create epoll instance (%s)", strerror(errno));
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    server->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (server->done_fd < 0) {
+        ERROR("unable to create server eventfd (%s)", strerror(errno));
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    if (server_epoll_ctl(server, EPOLL_CTL_ADD, &kvm->sock, EPOLLIN) < 0 ||
+        server_epoll_ctl(server, EPOLL_CTL_ADD, &kvm->event_fd, EPOLLIN) < 0 ||
+        server_epoll_ctl(server, EPOLL_CTL_ADD, &server->done_fd, EPOLLIN) < 0 ||
+        (server->signal_fd >= 0 &&
+         server_epoll_ctl(server, EPOLL_CTL_ADD, &server->signal_fd, EPOLLIN) < 0)) {
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    for (uint32_t i = 0; i < MINI_KVM_SERVER_WORKERS; i++) {
+        if (pthread_create(&server->workers[i], NULL, server_worker_run, server) != 0) {
+            ERROR("unable to create server worker %u", i);
+            return MINI_KVM_INTERNAL_ERROR;
+        }
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+MiniKVMError mini_kvm_server_run(MiniKvmServer *server) {
+    struct epoll_event events[MINI_KVM_SERVER_MAX_EVENTS];
+    Kvm *kvm = server->kvm;
+    int32_t nb_events = 0;
+    uint64_t counter = 0;
+
+    while (kvm->state != MINI_KVM_SHUTDOWN) {
+        nb_events = epoll_wait(server->epoll_fd, events, MINI_KVM_SERVER_MAX_EVENTS, -1);
+        if (nb_events < 0 && errno != EINTR) {
+            ERROR("epoll wait failed (%s)", strerror(errno));
+            kvm->state = MINI_KVM_SHUTDOWN;
+            mini_kvm_kick_vcpus(kvm, MINI_KVM_REQ_SHUTDOWN);
+            return MINI_KVM_INTERNAL_ERROR;
+        }
+
+        for (int32_t i = 0; i < nb_events; i++) {
+            int32_t *source = events[i].data.ptr;
+
+            if (source == &kvm->sock) {
+                server_accept(server);
+            } else if (source == &server->signal_fd) {
+                server_handle_signal(server);
+            } else if (source == &kvm->event_fd) {
+                // vcpus only signal this eventfd when the VM is shutting down
+                read(kvm->event_fd, &counter, sizeof(uint64_t));
+            } else if (source != &server->done_fd) {
+                server_handle_conn(server, (MiniKvmConn *)source, events[i].events);
+            }
+        }
+
+        // results are flushed last, connections owned by a worker are never closed by the pass
+        // above so none of the events of this batch can point to a connection closed here
+        server_handle_done(server);
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+void mini_kvm_server_clean(MiniKvmServer *server) {
+    pthread_mutex_lock(&server->lock);
+    server->stop = true;
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+
+    for (uint32_t i = 0; i < MINI_KVM_SERVER_WORKERS; i++) {
+        if (server->workers[i]) {
+            pthread_join(server->workers[i], NULL);
+        }
+    }
+
+    while (server->conns != NULL) {
+        server_close_conn(server, server->conns);
+    }
+
+    if (server->epoll_fd >= 0) {
+        close(server->epoll_fd);
+    }
+    if (server->signal_fd >= 0) {
+        close(server->signal_fd);
+    }
+    if (server->done_fd >= 0) {
+        close(server->done_fd);
+    }
+}
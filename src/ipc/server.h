@@ -0,0 +1,77 @@
+#ifndef MINI_KVM_SERVER_H
+#define MINI_KVM_SERVER_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "commands/status.h"
+#include "core/errors.h"
+#include "ipc/protocol.h"
+#include "kvm/kvm.h"
+
+#define MINI_KVM_SERVER_WORKERS 4
+#define MINI_KVM_SERVER_MAX_EVENTS 64
+
+typedef enum MiniKvmConnState {
+    MINI_KVM_CONN_READING = 0,
+    MINI_KVM_CONN_EXECUTING,
+    MINI_KVM_CONN_STREAMING,
+} MiniKvmConnState;
+
+// pause reading a connection when this many bytes of pipelined requests are waiting
+#define MINI_KVM_CONN_MAX_PENDING (2 * MINI_KVM_PROTO_MAX_PAYLOAD)
+// size requested for the pipe used to splice guest memory to a client
+#define MINI_KVM_CONN_PIPE_SIZE (1 << 20)
+
+// state of a single client connection, a connection is either reading requests, waiting for a
+// worker to execute one or streaming guest memory after a dump reply. Pipelined requests wait in
+// rbuf and are executed one at a time so replies are sent in request order.
+typedef struct MiniKvmConn {
+    int32_t fd;
+    MiniKvmConnState state;
+    uint32_t events;
+    bool closing;
+    MiniKvmBuffer rbuf;
+    MiniKvmBuffer wbuf;
+
+    uint32_t id;
+    MiniKvmStatusCommand cmd;
+    MiniKvmStatusResult res;
+
+    // guest memory left to stream, pages are vmspliced in pipe then spliced to the socket
+    const uint8_t *stream;
+    uint64_t stream_len;
+    int32_t pipe[2];
+    size_t pipe_size;
+    size_t pipe_len;
+
+    struct MiniKvmConn *next; // job or done list
+    struct MiniKvmConn *prev_conn;
+    struct MiniKvmConn *next_conn;
+} MiniKvmConn;
+
+typedef struct MiniKvmServer {
+    Kvm *kvm;
+    int32_t epoll_fd;
+    int32_t signal_fd;
+    int32_t done_fd;
+    MiniKvmConn *conns;
+
+    // commands are executed by the workers, results are handed back to the event loop through the
+    // done list and done_fd
+    pthread_t workers[MINI_KVM_SERVER_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    MiniKvmConn *jobs;
+    MiniKvmConn *jobs_tail;
+    MiniKvmConn *done;
+    bool stop;
+} MiniKvmServer;
+
+MiniKVMError mini_kvm_server_init(MiniKvmServer *server, Kvm *kvm);
+MiniKVMError mini_kvm_server_run(MiniKvmServer *server);
+void mini_kvm_server_clean(MiniKvmServer *server);
+
+#endif /* MINI_KVM_SERVER_H */
@@ -0,0 +1,209 @@
+#include "acpi.h"
+
+#include <linux/kvm.h>
+#include <string.h>
+
+#include "core/logger.h"
+
+#define ACPI_OEM_ID "MINKVM"
+#define ACPI_OEM_TABLE_ID "MINIKVM "
+#define ACPI_CREATOR_ID "MKVM"
+#define ACPI_TABLE_ALIGN 16
+
+#define ACPI_FADT_REVISION 6
+#define ACPI_FADT_MINOR_REVISION 5
+#define ACPI_FADT_HW_REDUCED (1 << 20)
+#define ACPI_FADT_PWR_BUTTON (1 << 4)
+#define ACPI_FADT_SLP_BUTTON (1 << 5)
+#define ACPI_IAPC_VGA_NOT_PRESENT (1 << 2)
+#define ACPI_IAPC_MSI_NOT_SUPPORTED (1 << 3)
+#define ACPI_MADT_PCAT_COMPAT 1
+#define ACPI_MADT_ENABLED 1
+
+#define MP_SPEC_REV 4
+#define MP_APIC_VERSION 0x14
+#define MP_IOAPIC_VERSION 0x11
+#define MP_CPU_ENABLED 1
+#define MP_CPU_BSP 2
+#define MP_INT 0
+#define MP_NMI 1
+#define MP_EXTINT 3
+#define MP_ALL_APICS 0xff
+#define MP_ISA_IRQS 16
+
+#define CPUID_SIGNATURE 1
+
+static uint8_t acpi_checksum(void *data, uint64_t len) {
+    uint8_t sum = 0;
+
+    for (uint64_t i = 0; i < len; i++) {
+        sum += ((uint8_t *)data)[i];
+    }
+
+    return -sum;
+}
+
+// the IOAPIC takes the first ID after the vcpus
+static uint8_t ioapic_id(Kvm *kvm) { return kvm->vcpus->len; }
+
+static void acpi_header(AcpiHeader *header, const char *signature, uint32_t length,
+                        uint8_t revision) {
+    memcpy(header->signature, signature, 4);
+    header->length = length;
+    header->revision = revision;
+    memcpy(header->oem_id, ACPI_OEM_ID, 6);
+    memcpy(header->oem_table_id, ACPI_OEM_TABLE_ID, 8);
+    header->oem_revision = 1;
+    memcpy(header->creator_id, ACPI_CREATOR_ID, 4);
+    header->creator_revision = 1;
+    header->checksum = acpi_checksum(header, length);
+}
+
+static uint64_t acpi_align(uint64_t addr) {
+    return (addr + ACPI_TABLE_ALIGN - 1) & ~(ACPI_TABLE_ALIGN - 1UL);
+}
+
+static uint32_t acpi_write_madt(Kvm *kvm, uint8_t *table) {
+    AcpiMadt *madt = (AcpiMadt *)table;
+    uint8_t *entry = table + sizeof(AcpiMadt);
+
+    madt->lapic_addr = LAPIC_ADDR;
+    madt->flags = ACPI_MADT_PCAT_COMPAT;
+    for (uint32_t i = 0; i < kvm->vcpus->len; i++, entry += sizeof(AcpiMadtLapic)) {
+        *(AcpiMadtLapic *)entry = (AcpiMadtLapic){
+            ACPI_MADT_LAPIC, sizeof(AcpiMadtLapic), i, kvm->vcpus->tab[i].id, ACPI_MADT_ENABLED};
+    }
+
+    *(AcpiMadtIoapic *)entry = (AcpiMadtIoapic){
+        ACPI_MADT_IOAPIC, sizeof(AcpiMadtIoapic), ioapic_id(kvm), 0, IOAPIC_ADDR, 0};
+    entry += sizeof(AcpiMadtIoapic);
+
+    // LINT1 of every processor is the NMI input
+    *(AcpiMadtLapicNmi *)entry =
+        (AcpiMadtLapicNmi){ACPI_MADT_LAPIC_NMI, sizeof(AcpiMadtLapicNmi), 0xff, 0, 1};
+    entry += sizeof(AcpiMadtLapicNmi);
+
+    acpi_header(&madt->header, "APIC", entry - table, 5);
+    return entry - table;
+}
+
+MiniKVMError mini_kvm_setup_acpi(Kvm *kvm) {
+    uint8_t *mem = (uint8_t *)kvm->mem;
+    AcpiRsdp *rsdp = (AcpiRsdp *)(mem + ACPI_RSDP_ADDR);
+    uint64_t xsdt_addr = acpi_align(ACPI_RSDP_ADDR + sizeof(AcpiRsdp));
+    uint64_t *xsdt_entries = (uint64_t *)(mem + xsdt_addr + sizeof(AcpiHeader));
+    uint64_t dsdt_addr = acpi_align(xsdt_addr + sizeof(AcpiHeader) + 2 * sizeof(uint64_t));
+    uint64_t fadt_addr = acpi_align(dsdt_addr + sizeof(AcpiHeader));
+    uint64_t madt_addr = acpi_align(fadt_addr + sizeof(AcpiFadt));
+    AcpiFadt *fadt = (AcpiFadt *)(mem + fadt_addr);
+    uint32_t madt_len = sizeof(AcpiMadt) + kvm->vcpus->len * sizeof(AcpiMadtLapic) +
+                        sizeof(AcpiMadtIoapic) + sizeof(AcpiMadtLapicNmi);
+
+    kvm->rsdp_addr = 0;
+    if ((uint64_t)kvm->mem_size < madt_addr + madt_len) {
+        INFO("no ACPI tables, guest memory ends below 0x%lx", madt_addr + madt_len);
+        return MINI_KVM_SUCCESS;
+    }
+    memset(mem + ACPI_RSDP_ADDR, 0, madt_addr + madt_len - ACPI_RSDP_ADDR);
+
+    // the DSDT is empty, the FADT declares a hardware reduced platform without legacy devices
+    acpi_header((AcpiHeader *)(mem + dsdt_addr), "DSDT", sizeof(AcpiHeader), 2);
+    fadt->x_dsdt = dsdt_addr;
+    fadt->flags = ACPI_FADT_HW_REDUCED | ACPI_FADT_PWR_BUTTON | ACPI_FADT_SLP_BUTTON;
+    fadt->iapc_boot_arch = ACPI_IAPC_VGA_NOT_PRESENT | ACPI_IAPC_MSI_NOT_SUPPORTED;
+    fadt->minor_version = ACPI_FADT_MINOR_REVISION;
+    memcpy(&fadt->hypervisor_id, "MINI_KVM", 8);
+    acpi_header(&fadt->header, "FACP", sizeof(AcpiFadt), ACPI_FADT_REVISION);
+
+    acpi_write_madt(kvm, mem + madt_addr);
+
+    xsdt_entries[0] = fadt_addr;
+    xsdt_entries[1] = madt_addr;
+    acpi_header((AcpiHeader *)(mem + xsdt_addr), "XSDT",
+                sizeof(AcpiHeader) + 2 * sizeof(uint64_t), 1);
+
+    memcpy(rsdp->signature, "RSD PTR ", 8);
+    memcpy(rsdp->oem_id, ACPI_OEM_ID, 6);
+    rsdp->revision = 2;
+    rsdp->length = sizeof(AcpiRsdp);
+    rsdp->xsdt_addr = xsdt_addr;
+    rsdp->checksum = acpi_checksum(rsdp, 20); // ACPI 1.0 part
+    rsdp->ext_checksum = acpi_checksum(rsdp, sizeof(AcpiRsdp));
+
+    kvm->rsdp_addr = ACPI_RSDP_ADDR;
+    INFO("ACPI tables written at 0x%x for %lu vcpus", ACPI_RSDP_ADDR, kvm->vcpus->len);
+
+    return MINI_KVM_SUCCESS;
+}
+
+static uint8_t *mp_write_processors(Kvm *kvm, uint8_t *entry) {
+    struct kvm_cpuid_entry2 *cpuid = mini_kvm_find_cpuid(kvm, CPUID_SIGNATURE, 0);
+
+    for (uint32_t i = 0; i < kvm->vcpus->len; i++, entry += sizeof(MpProcessor)) {
+        *(MpProcessor *)entry = (MpProcessor){
+            .type = MP_PROCESSOR,
+            .apic_id = kvm->vcpus->tab[i].id,
+            .apic_version = MP_APIC_VERSION,
+            .flags = MP_CPU_ENABLED | ((i == 0) ? MP_CPU_BSP : 0),
+            .signature = (cpuid != NULL) ? cpuid->eax : 0,
+            .features = (cpuid != NULL) ? cpuid->edx : 0,
+        };
+    }
+
+    return entry;
+}
+
+// ISA interrupts are wired to the IOAPIC pin of the same number, the PIC output to LINT0 and NMIs
+// to LINT1
+static uint8_t *mp_write_interrupts(Kvm *kvm, uint8_t *entry) {
+    for (uint8_t irq = 0; irq < MP_ISA_IRQS; irq++, entry += sizeof(MpInterrupt)) {
+        *(MpInterrupt *)entry =
+            (MpInterrupt){MP_IO_INTERRUPT, MP_INT, 0, 0, irq, ioapic_id(kvm), irq};
+    }
+
+    *(MpInterrupt *)entry = (MpInterrupt){MP_LOCAL_INTERRUPT, MP_EXTINT, 0, 0, 0, MP_ALL_APICS, 0};
+    entry += sizeof(MpInterrupt);
+    *(MpInterrupt *)entry = (MpInterrupt){MP_LOCAL_INTERRUPT, MP_NMI, 0, 0, 0, MP_ALL_APICS, 1};
+
+    return entry + sizeof(MpInterrupt);
+}
+
+MiniKVMError mini_kvm_setup_mptable(Kvm *kvm) {
+    uint8_t *mem = (uint8_t *)kvm->mem;
+    MpFloating *floating = (MpFloating *)(mem + MPTABLE_ADDR);
+    MpConfig *config = (MpConfig *)(floating + 1);
+    uint8_t *entry = (uint8_t *)(config + 1);
+    uint64_t len = sizeof(MpFloating) + sizeof(MpConfig) + kvm->vcpus->len * sizeof(MpProcessor) +
+                   sizeof(MpBus) + sizeof(MpIoapic) + (MP_ISA_IRQS + 2) * sizeof(MpInterrupt);
+
+    if ((uint64_t)kvm->mem_size < MPTABLE_ADDR + len) {
+        INFO("no MP table, guest memory ends below 0x%lx", MPTABLE_ADDR + len);
+        return MINI_KVM_SUCCESS;
+    }
+    memset(floating, 0, len);
+
+    entry = mp_write_processors(kvm, entry);
+    *(MpBus *)entry = (MpBus){MP_BUS, 0, "ISA   "};
+    entry += sizeof(MpBus);
+    *(MpIoapic *)entry = (MpIoapic){MP_IOAPIC, ioapic_id(kvm), MP_IOAPIC_VERSION, 1, IOAPIC_ADDR};
+    entry += sizeof(MpIoapic);
+    entry = mp_write_interrupts(kvm, entry);
+
+    memcpy(config->signature, "PCMP", 4);
+    config->length = entry - (uint8_t *)config;
+    config->spec_rev = MP_SPEC_REV;
+    memcpy(config->oem_id, "MINI_KVM", 8);
+    memcpy(config->product_id, "MINI_KVM VM ", 12);
+    config->entries = kvm->vcpus->len + 2 + MP_ISA_IRQS + 2;
+    config->lapic_addr = LAPIC_ADDR;
+    config->checksum = acpi_checksum(config, config->length);
+
+    memcpy(floating->signature, "_MP_", 4);
+    floating->config_addr = MPTABLE_ADDR + sizeof(MpFloating);
+    floating->length = 1;
+    floating->spec_rev = MP_SPEC_REV;
+    floating->checksum = acpi_checksum(floating, sizeof(MpFloating));
+    INFO("MP table written at 0x%x", MPTABLE_ADDR);
+
+    return MINI_KVM_SUCCESS;
+}
@@ -0,0 +1,169 @@
+#ifndef MINI_KVM_ACPI_H
+#define MINI_KVM_ACPI_H
+
+#include <inttypes.h>
+
+#include "core/errors.h"
+#include "kvm/kvm.h"
+
+// Firmware tables describing the vcpus and the interrupt controllers
+//
+// There is no firmware, the VMM writes the tables a BIOS would leave in the legacy BIOS area: ACPI
+// (RSDP, XSDT, a hardware reduced FADT with an empty DSDT and the MADT) and an Intel MP table for
+// kernels booted without ACPI. Every vcpu is listed with its APIC ID equal to its index, the in
+// kernel IOAPIC follows them.
+
+#define ACPI_RSDP_ADDR 0xe0000
+#define MPTABLE_ADDR 0xf0000
+#define LAPIC_ADDR 0xfee00000
+#define IOAPIC_ADDR 0xfec00000
+
+typedef struct __attribute__((packed)) AcpiRsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+    uint32_t length;
+    uint64_t xsdt_addr;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} AcpiRsdp;
+
+typedef struct __attribute__((packed)) AcpiHeader {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    char creator_id[4];
+    uint32_t creator_revision;
+} AcpiHeader;
+
+typedef struct __attribute__((packed)) AcpiFadt {
+    AcpiHeader header;
+    uint32_t firmware_ctrl;
+    uint32_t dsdt;
+    uint8_t reserved0[65];
+    uint16_t iapc_boot_arch;
+    uint8_t reserved1;
+    uint32_t flags;
+    uint8_t reserved2[15];
+    uint8_t minor_version;
+    uint64_t x_firmware_ctrl;
+    uint64_t x_dsdt;
+    uint8_t reserved3[120];
+    uint64_t hypervisor_id;
+} AcpiFadt;
+
+typedef struct __attribute__((packed)) AcpiMadt {
+    AcpiHeader header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+} AcpiMadt;
+
+// MADT entries start with their type and length
+#define ACPI_MADT_LAPIC 0
+#define ACPI_MADT_IOAPIC 1
+#define ACPI_MADT_LAPIC_NMI 4
+
+typedef struct __attribute__((packed)) AcpiMadtLapic {
+    uint8_t type;
+    uint8_t length;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} AcpiMadtLapic;
+
+typedef struct __attribute__((packed)) AcpiMadtIoapic {
+    uint8_t type;
+    uint8_t length;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t addr;
+    uint32_t gsi_base;
+} AcpiMadtIoapic;
+
+typedef struct __attribute__((packed)) AcpiMadtLapicNmi {
+    uint8_t type;
+    uint8_t length;
+    uint8_t processor_id;
+    uint16_t flags;
+    uint8_t lint;
+} AcpiMadtLapicNmi;
+
+typedef struct __attribute__((packed)) MpFloating {
+    char signature[4];
+    uint32_t config_addr;
+    uint8_t length; // in 16 bytes units
+    uint8_t spec_rev;
+    uint8_t checksum;
+    uint8_t features[5];
+} MpFloating;
+
+typedef struct __attribute__((packed)) MpConfig {
+    char signature[4];
+    uint16_t length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entries;
+    uint32_t lapic_addr;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} MpConfig;
+
+// MP configuration entries start with their type, processors are 20 bytes long, the others 8
+#define MP_PROCESSOR 0
+#define MP_BUS 1
+#define MP_IOAPIC 2
+#define MP_IO_INTERRUPT 3
+#define MP_LOCAL_INTERRUPT 4
+
+typedef struct __attribute__((packed)) MpProcessor {
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} MpProcessor;
+
+typedef struct __attribute__((packed)) MpBus {
+    uint8_t type;
+    uint8_t id;
+    char name[6];
+} MpBus;
+
+typedef struct __attribute__((packed)) MpIoapic {
+    uint8_t type;
+    uint8_t id;
+    uint8_t version;
+    uint8_t flags;
+    uint32_t addr;
+} MpIoapic;
+
+typedef struct __attribute__((packed)) MpInterrupt {
+    uint8_t type;
+    uint8_t irq_type;
+    uint16_t flags;
+    uint8_t src_bus;
+    uint8_t src_irq;
+    uint8_t dst_apic;
+    uint8_t dst_pin;
+} MpInterrupt;
+
+// write the ACPI tables at ACPI_RSDP_ADDR and set kvm->rsdp_addr, VMs without memory at this
+// address boot without ACPI
+MiniKVMError mini_kvm_setup_acpi(Kvm *kvm);
+// write the MP floating pointer and configuration table at MPTABLE_ADDR
+MiniKVMError mini_kvm_setup_mptable(Kvm *kvm);
+
+#endif /* MINI_KVM_ACPI_H */
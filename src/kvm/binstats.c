@@ -0,0 +1,269 @@
+#include "binstats.h"
+
+#include <errno.h>
+#include <linux/kvm.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "core/logger.h"
+
+static int32_t binstats_pread(int32_t fd, void *data, size_t len, off_t offset) {
+    ssize_t ret = 0;
+
+    while (len > 0) {
+        ret = pread(fd, data, len, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        data = (uint8_t *)data + ret;
+        len -= ret;
+        offset += ret;
+    }
+
+    return 0;
+}
+
+MiniKVMError mini_kvm_binstats_open(MiniKvmBinStats *stats, int32_t fd) {
+    struct kvm_stats_header header;
+    struct kvm_stats_desc *desc = NULL;
+    size_t desc_size = 0;
+    uint8_t *descs = NULL;
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+
+    memset(stats, 0, sizeof(MiniKvmBinStats));
+    stats->fd = ioctl(fd, KVM_GET_STATS_FD, NULL);
+    if (stats->fd < 0) {
+        WARN("binary stats are not available (%s)", strerror(errno));
+        return MINI_KVM_SUCCESS;
+    }
+
+    if (binstats_pread(stats->fd, &header, sizeof(header), 0) < 0) {
+        ERROR("failed to read binary stats header (%s)", strerror(errno));
+        ret = MINI_KVM_INTERNAL_ERROR;
+        goto fail;
+    }
+
+    // every descriptor is followed by its name, read them all at once
+    desc_size = sizeof(struct kvm_stats_desc) + header.name_size;
+    descs = malloc(header.num_desc * desc_size);
+    stats->entries = calloc(header.num_desc, sizeof(MiniKvmBinStatsEntry));
+    stats->offsets = calloc(header.num_desc, sizeof(uint32_t));
+    if (descs == NULL || stats->entries == NULL || stats->offsets == NULL) {
+        ret = MINI_KVM_FAILED_ALLOCATION;
+        goto fail;
+    }
+
+    if (binstats_pread(stats->fd, descs, header.num_desc * desc_size, header.desc_offset) < 0) {
+        ERROR("failed to read binary stats descriptors (%s)", strerror(errno));
+        ret = MINI_KVM_INTERNAL_ERROR;
+        goto fail;
+    }
+
+    for (uint32_t i = 0; i < header.num_desc; i++) {
+        desc = (struct kvm_stats_desc *)(descs + i * desc_size);
+        MiniKvmBinStatsEntry *entry = &stats->entries[i];
+
+        snprintf(entry->name, MINI_KVM_BINSTATS_NAME_SIZE, "%.*s", (int)header.name_size,
+                 desc->name);
+        entry->flags = desc->flags;
+        entry->exponent = desc->exponent;
+        entry->size = desc->size;
+        stats->offsets[i] = desc->offset;
+        if (desc->offset + desc->size * sizeof(uint64_t) > stats->data_size) {
+            stats->data_size = desc->offset + desc->size * sizeof(uint64_t);
+        }
+    }
+    stats->count = header.num_desc;
+    stats->data_offset = header.data_offset;
+    free(descs);
+
+    return MINI_KVM_SUCCESS;
+
+fail:
+    close(stats->fd);
+    free(descs);
+    free(stats->entries);
+    free(stats->offsets);
+    memset(stats, 0, sizeof(MiniKvmBinStats));
+    stats->fd = -1;
+    return ret;
+}
+
+void mini_kvm_binstats_close(MiniKvmBinStats *stats) {
+    // entries are only allocated once the fd is open, a zeroed struct is never opened
+    if (stats->entries != NULL) {
+        close(stats->fd);
+    }
+    free(stats->entries);
+    free(stats->offsets);
+    memset(stats, 0, sizeof(MiniKvmBinStats));
+    stats->fd = -1;
+}
+
+size_t mini_kvm_binstats_encoded_size(MiniKvmBinStats *stats) {
+    size_t size = 0;
+
+    if (stats->fd < 0) {
+        return 0;
+    }
+
+    size = sizeof(MiniKvmBinStatsGroup);
+    for (uint32_t i = 0; i < stats->count; i++) {
+        size += sizeof(MiniKvmBinStatsEntry) + stats->entries[i].size * sizeof(uint64_t);
+    }
+
+    return size;
+}
+
+size_t mini_kvm_binstats_encode(MiniKvmBinStats *stats, uint32_t id, uint8_t *out) {
+    MiniKvmBinStatsGroup group = {.id = id, .count = stats->count};
+    uint8_t *data = NULL, *start = out;
+    size_t len = 0;
+
+    if (stats->fd < 0 || (data = malloc(stats->data_size)) == NULL) {
+        return 0;
+    }
+
+    // a single read samples every stat
+    if (binstats_pread(stats->fd, data, stats->data_size, stats->data_offset) < 0) {
+        WARN("failed to sample binary stats (%s)", strerror(errno));
+        free(data);
+        return 0;
+    }
+
+    memcpy(out, &group, sizeof(MiniKvmBinStatsGroup));
+    out += sizeof(MiniKvmBinStatsGroup);
+    for (uint32_t i = 0; i < stats->count; i++) {
+        len = stats->entries[i].size * sizeof(uint64_t);
+        memcpy(out, &stats->entries[i], sizeof(MiniKvmBinStatsEntry));
+        memcpy(out + sizeof(MiniKvmBinStatsEntry), data + stats->offsets[i], len);
+        out += sizeof(MiniKvmBinStatsEntry) + len;
+    }
+    free(data);
+
+    return out - start;
+}
+
+typedef void (*BinStatsVisitor)(void *ctx, const MiniKvmBinStatsGroup *group,
+                                const MiniKvmBinStatsEntry *entry, const uint64_t *values);
+
+// walk the entries of encoded data, groups are reported with a NULL entry before their entries
+static void binstats_for_each(const uint8_t *data, size_t len, BinStatsVisitor visitor,
+                              void *ctx) {
+    MiniKvmBinStatsGroup group;
+    MiniKvmBinStatsEntry entry;
+    size_t offset = 0, values_len = 0;
+
+    while (len - offset >= sizeof(MiniKvmBinStatsGroup)) {
+        memcpy(&group, data + offset, sizeof(MiniKvmBinStatsGroup));
+        offset += sizeof(MiniKvmBinStatsGroup);
+        visitor(ctx, &group, NULL, NULL);
+
+        for (uint32_t i = 0; i < group.count; i++) {
+            if (len - offset < sizeof(MiniKvmBinStatsEntry)) {
+                return;
+            }
+            memcpy(&entry, data + offset, sizeof(MiniKvmBinStatsEntry));
+            offset += sizeof(MiniKvmBinStatsEntry);
+
+            values_len = entry.size * sizeof(uint64_t);
+            if (len - offset < values_len) {
+                return;
+            }
+            entry.name[MINI_KVM_BINSTATS_NAME_SIZE - 1] = '\0';
+            visitor(ctx, &group, &entry, (const uint64_t *)(data + offset));
+            offset += values_len;
+        }
+    }
+}
+
+struct BinStatsFind {
+    uint32_t id;
+    const char *name;
+    const uint64_t *values;
+    uint16_t size;
+};
+
+static void binstats_find_visitor(void *ctx, const MiniKvmBinStatsGroup *group,
+                                  const MiniKvmBinStatsEntry *entry, const uint64_t *values) {
+    struct BinStatsFind *find = ctx;
+
+    if (entry != NULL && find->values == NULL && group->id == find->id &&
+        strcmp(entry->name, find->name) == 0) {
+        find->values = values;
+        find->size = entry->size;
+    }
+}
+
+const uint64_t *mini_kvm_binstats_find(const uint8_t *data, size_t len, uint32_t id,
+                                       const char *name, uint16_t *size) {
+    struct BinStatsFind find = {.id = id, .name = name};
+
+    binstats_for_each(data, len, binstats_find_visitor, &find);
+    if (size != NULL) {
+        *size = find.size;
+    }
+    return find.values;
+}
+
+static const char *binstats_unit(uint32_t flags, int16_t exponent) {
+    switch (flags & KVM_STATS_UNIT_MASK) {
+    case KVM_STATS_UNIT_BYTES:
+        return (exponent == 0) ? " bytes" : " pages";
+    case KVM_STATS_UNIT_SECONDS:
+        return (exponent == -9) ? " ns" : (exponent == -6) ? " us" : " s";
+    case KVM_STATS_UNIT_CYCLES:
+        return " cycles";
+    default:
+        return "";
+    }
+}
+
+static void binstats_print_visitor(__attribute__((unused)) void *ctx,
+                                   const MiniKvmBinStatsGroup *group,
+                                   const MiniKvmBinStatsEntry *entry, const uint64_t *values) {
+    const char *unit = NULL;
+    uint32_t type = 0;
+    bool header = false;
+
+    if (entry == NULL) {
+        if (group->id == MINI_KVM_BINSTATS_VM_ID) {
+            printf("VM kvm stats\n");
+        } else {
+            printf("VCPU %u kvm stats\n", group->id);
+        }
+        return;
+    }
+
+    unit = binstats_unit(entry->flags, entry->exponent);
+    type = entry->flags & KVM_STATS_TYPE_MASK;
+    if (type != KVM_STATS_TYPE_LINEAR_HIST && type != KVM_STATS_TYPE_LOG_HIST) {
+        printf("  %-40s %lu%s%s\n", entry->name, values[0], unit,
+               (type == KVM_STATS_TYPE_PEAK) ? " (peak)" : "");
+        return;
+    }
+
+    // histograms are only printed if some bucket is not empty
+    for (uint16_t i = 0; i < entry->size; i++) {
+        if (values[i] == 0) {
+            continue;
+        }
+        if (!header) {
+            printf("  %s (%s buckets)\n", entry->name,
+                   (type == KVM_STATS_TYPE_LOG_HIST) ? "log2" : "linear");
+            header = true;
+        }
+        printf("    [%2u] %lu\n", i, values[i]);
+    }
+}
+
+void mini_kvm_binstats_print(const uint8_t *data, size_t len) {
+    binstats_for_each(data, len, binstats_print_visitor, NULL);
+}
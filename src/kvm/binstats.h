@@ -0,0 +1,56 @@
+#ifndef MINI_KVM_BINSTATS_H
+#define MINI_KVM_BINSTATS_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "core/errors.h"
+
+// KVM binary statistics (KVM_GET_STATS_FD)
+//
+// The VM and each vcpu expose a file made of a header, the stats descriptors and a data block of
+// uint64_t values. Descriptors never change, they are read once when the fd is opened and a sample
+// is a single pread of the data block.
+//
+// Samples are encoded for the status socket as groups: a MiniKvmBinStatsGroup followed by count
+// entries, each entry is a MiniKvmBinStatsEntry followed by its size uint64_t values.
+
+#define MINI_KVM_BINSTATS_NAME_SIZE 48
+#define MINI_KVM_BINSTATS_VM_ID 0xffffffff // group id of the VM stats, vcpu groups use the vcpu id
+
+typedef struct __attribute__((packed)) MiniKvmBinStatsGroup {
+    uint32_t id;
+    uint32_t count;
+} MiniKvmBinStatsGroup;
+
+typedef struct __attribute__((packed)) MiniKvmBinStatsEntry {
+    char name[MINI_KVM_BINSTATS_NAME_SIZE];
+    uint32_t flags; // KVM_STATS_TYPE_*, KVM_STATS_UNIT_* and KVM_STATS_BASE_*
+    int16_t exponent;
+    uint16_t size; // number of values, histograms have one value per bucket
+} MiniKvmBinStatsEntry;
+
+typedef struct MiniKvmBinStats {
+    int32_t fd; // -1 if the kernel does not expose binary stats
+    uint32_t count;
+    MiniKvmBinStatsEntry *entries;
+    uint32_t *offsets; // offset of the entries values in the data block
+    uint32_t data_offset;
+    uint32_t data_size;
+} MiniKvmBinStats;
+
+// open the stats of a VM or vcpu fd and read their descriptors
+MiniKVMError mini_kvm_binstats_open(MiniKvmBinStats *stats, int32_t fd);
+void mini_kvm_binstats_close(MiniKvmBinStats *stats);
+
+// size of an encoded sample, 0 if no stats are available
+size_t mini_kvm_binstats_encoded_size(MiniKvmBinStats *stats);
+// sample the stats and encode them as a group at out, returns the encoded size or 0 on failure
+size_t mini_kvm_binstats_encode(MiniKvmBinStats *stats, uint32_t id, uint8_t *out);
+
+// returns the values of the named stat of group id in encoded data, NULL if it is not found
+const uint64_t *mini_kvm_binstats_find(const uint8_t *data, size_t len, uint32_t id,
+                                       const char *name, uint16_t *size);
+void mini_kvm_binstats_print(const uint8_t *data, size_t len);
+
+#endif /* MINI_KVM_BINSTATS_H */
@@ -0,0 +1,379 @@
+#include "cpuid.h"
+
+#include <asm/kvm_para.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "core/constants.h"
+#include "core/core.h"
+#include "core/logger.h"
+
+#define CPUID_SPEC_MAX_LEN 1024
+#define CPU_MODEL_MAX_LISTS 4
+#define XSAVE_X87_SSE 0x3     // state components every x86-64 CPU has
+#define XSAVE_LEGACY_SIZE 576 // legacy region and XSAVE header
+#define XSAVE_MAX_COMPONENTS 64
+
+typedef struct CpuidFeature {
+    const char *name;
+    uint32_t function;
+    uint32_t index;
+    uint8_t reg; // CPUID_EAX, CPUID_EBX, CPUID_ECX or CPUID_EDX
+    uint32_t mask;
+    bool vmm; // hint set by the VMM, KVM does not report it as supported
+} CpuidFeature;
+
+#define CPU_FEATURE(name, function, reg, mask) {name, function, 0, reg, mask, false}
+#define PV_FEATURE(name, bit) {name, KVM_CPUID_FEATURES, 0, CPUID_EAX, 1 << (bit), false}
+
+// feature names follow /proc/cpuinfo for the CPU and QEMU for the paravirtual leaf
+static const CpuidFeature FEATURES[] = {
+    CPU_FEATURE("sse3", 0x1, CPUID_ECX, 1 << 0),
+    CPU_FEATURE("pclmulqdq", 0x1, CPUID_ECX, 1 << 1),
+    CPU_FEATURE("ssse3", 0x1, CPUID_ECX, 1 << 9),
+    CPU_FEATURE("fma", 0x1, CPUID_ECX, 1 << 12),
+    CPU_FEATURE("cx16", 0x1, CPUID_ECX, 1 << 13),
+    CPU_FEATURE("pcid", 0x1, CPUID_ECX, 1 << 17),
+    CPU_FEATURE("sse4.1", 0x1, CPUID_ECX, 1 << 19),
+    CPU_FEATURE("sse4.2", 0x1, CPUID_ECX, 1 << 20),
+    CPU_FEATURE("x2apic", 0x1, CPUID_ECX, 1 << 21),
+    CPU_FEATURE("movbe", 0x1, CPUID_ECX, 1 << 22),
+    CPU_FEATURE("popcnt", 0x1, CPUID_ECX, 1 << 23),
+    CPU_FEATURE("tsc-deadline", 0x1, CPUID_ECX, 1 << 24),
+    CPU_FEATURE("aes", 0x1, CPUID_ECX, 1 << 25),
+    CPU_FEATURE("xsave", 0x1, CPUID_ECX, 1 << 26),
+    CPU_FEATURE("avx", 0x1, CPUID_ECX, 1 << 28),
+    CPU_FEATURE("f16c", 0x1, CPUID_ECX, 1 << 29),
+    CPU_FEATURE("rdrand", 0x1, CPUID_ECX, 1 << 30),
+    CPU_FEATURE("fsgsbase", 0x7, CPUID_EBX, 1 << 0),
+    CPU_FEATURE("bmi1", 0x7, CPUID_EBX, 1 << 3),
+    CPU_FEATURE("avx2", 0x7, CPUID_EBX, 1 << 5),
+    CPU_FEATURE("smep", 0x7, CPUID_EBX, 1 << 7),
+    CPU_FEATURE("bmi2", 0x7, CPUID_EBX, 1 << 8),
+    CPU_FEATURE("erms", 0x7, CPUID_EBX, 1 << 9),
+    CPU_FEATURE("invpcid", 0x7, CPUID_EBX, 1 << 10),
+    CPU_FEATURE("avx512f", 0x7, CPUID_EBX, 1 << 16),
+    CPU_FEATURE("avx512dq", 0x7, CPUID_EBX, 1 << 17),
+    CPU_FEATURE("rdseed", 0x7, CPUID_EBX, 1 << 18),
+    CPU_FEATURE("adx", 0x7, CPUID_EBX, 1 << 19),
+    CPU_FEATURE("smap", 0x7, CPUID_EBX, 1 << 20),
+    CPU_FEATURE("clflushopt", 0x7, CPUID_EBX, 1 << 23),
+    CPU_FEATURE("avx512cd", 0x7, CPUID_EBX, 1 << 28),
+    CPU_FEATURE("sha_ni", 0x7, CPUID_EBX, 1 << 29),
+    CPU_FEATURE("avx512bw", 0x7, CPUID_EBX, 1 << 30),
+    CPU_FEATURE("avx512vl", 0x7, CPUID_EBX, 1U << 31),
+    CPU_FEATURE("pku", 0x7, CPUID_ECX, 1 << 3),
+    CPU_FEATURE("vaes", 0x7, CPUID_ECX, 1 << 9),
+    CPU_FEATURE("la57", 0x7, CPUID_ECX, 1 << 16),
+    CPU_FEATURE("lahf_lm", CPUID_EXT_FEATURES, CPUID_ECX, 1 << 0),
+    CPU_FEATURE("abm", CPUID_EXT_FEATURES, CPUID_ECX, 1 << 5),
+    CPU_FEATURE("pdpe1gb", CPUID_EXT_FEATURES, CPUID_EDX, CPUID_EXT_EDX_PDPE1GB),
+    CPU_FEATURE("invtsc", CPUID_EXT_POWER, CPUID_EDX, CPUID_EXT_POWER_EDX_INVTSC),
+    {"kvmclock", KVM_CPUID_FEATURES, 0, CPUID_EAX,
+     (1 << KVM_FEATURE_CLOCKSOURCE) | (1 << KVM_FEATURE_CLOCKSOURCE2), false},
+    PV_FEATURE("kvm-nopiodelay", KVM_FEATURE_NOP_IO_DELAY),
+    PV_FEATURE("kvm-asyncpf", KVM_FEATURE_ASYNC_PF),
+    PV_FEATURE("kvm-steal-time", KVM_FEATURE_STEAL_TIME),
+    PV_FEATURE("kvm-pv-eoi", KVM_FEATURE_PV_EOI),
+    PV_FEATURE("kvm-pv-unhalt", KVM_FEATURE_PV_UNHALT),
+    PV_FEATURE("kvm-pv-tlb-flush", KVM_FEATURE_PV_TLB_FLUSH),
+    PV_FEATURE("kvm-pv-ipi", KVM_FEATURE_PV_SEND_IPI),
+    PV_FEATURE("kvm-poll-control", KVM_FEATURE_POLL_CONTROL),
+    PV_FEATURE("kvm-pv-sched-yield", KVM_FEATURE_PV_SCHED_YIELD),
+    PV_FEATURE("kvm-asyncpf-int", KVM_FEATURE_ASYNC_PF_INT),
+    PV_FEATURE("kvm-msi-ext-dest-id", KVM_FEATURE_MSI_EXT_DEST_ID),
+    PV_FEATURE("kvmclock-stable-bit", KVM_FEATURE_CLOCKSOURCE_STABLE_BIT),
+    // vcpus are pinned to dedicated host CPUs, guests can poll instead of using PV spinlocks
+    {"kvm-hint-dedicated", KVM_CPUID_FEATURES, 0, CPUID_EDX, 1 << KVM_HINTS_REALTIME, true},
+};
+#define NB_FEATURES (sizeof(FEATURES) / sizeof(FEATURES[0]))
+
+// every named model has the local APIC features and the paravirtual features KVM handles on its
+// own, the x86-64 microarchitecture levels add the CPU features on top of the x86-64 baseline
+static const char *const MODEL_BASE[] = {
+    "x2apic", "tsc-deadline", "kvmclock", "kvmclock-stable-bit", "kvm-nopiodelay", "kvm-asyncpf",
+    "kvm-steal-time", "kvm-pv-eoi", "kvm-pv-unhalt", "kvm-pv-ipi", "kvm-pv-tlb-flush",
+    "kvm-pv-sched-yield", NULL,
+};
+static const char *const MODEL_V2[] = {
+    "cx16", "lahf_lm", "popcnt", "sse3", "sse4.1", "sse4.2", "ssse3", NULL,
+};
+static const char *const MODEL_V3[] = {
+    "avx", "avx2", "bmi1", "bmi2", "f16c", "fma", "abm", "movbe", "xsave", NULL,
+};
+static const char *const MODEL_V4[] = {
+    "avx512f", "avx512bw", "avx512cd", "avx512dq", "avx512vl", NULL,
+};
+
+typedef struct CpuModel {
+    const char *name;
+    const char *const *lists[CPU_MODEL_MAX_LISTS];
+} CpuModel;
+
+static const CpuModel MODELS[] = {
+    {"x86-64-v2", {MODEL_BASE, MODEL_V2}},
+    {"x86-64-v3", {MODEL_BASE, MODEL_V2, MODEL_V3}},
+    {"x86-64-v4", {MODEL_BASE, MODEL_V2, MODEL_V3, MODEL_V4}},
+};
+#define NB_MODELS (sizeof(MODELS) / sizeof(MODELS[0]))
+
+// named models are whitelists: in these registers only the baseline bits and the enabled features
+// are kept, whatever KVM reports
+typedef struct CpuidBaseline {
+    uint32_t function;
+    uint8_t reg;
+    uint32_t mask;
+} CpuidBaseline;
+
+static const CpuidBaseline MODEL_BASELINE[] = {
+    {0x1, CPUID_ECX, 1U << 31},   // hypervisor
+    {0x1, CPUID_EDX, 0x078bfbff}, // fpu to pse36, clflush, mmx, fxsr, sse, sse2
+    {0x7, CPUID_EBX, 0},
+    {0x7, CPUID_ECX, 0},
+    {0x7, CPUID_EDX, 0},
+    {CPUID_EXT_FEATURES, CPUID_ECX, 0},
+    {CPUID_EXT_FEATURES, CPUID_EDX, 0x20100800}, // syscall, nx, lm
+};
+#define NB_MODEL_BASELINE (sizeof(MODEL_BASELINE) / sizeof(MODEL_BASELINE[0]))
+
+// XSAVE state components of the features that have one, x87 and SSE are always kept
+typedef struct CpuidXsave {
+    const char *feature;
+    uint64_t components;
+} CpuidXsave;
+
+static const CpuidXsave XSAVE_COMPONENTS[] = {
+    {"avx", 1 << 2},     // upper halves of YMM0-15
+    {"avx512f", 7 << 5}, // opmask, upper halves of ZMM0-15, ZMM16-31
+    {"pku", 1 << 9},     // PKRU
+};
+#define NB_XSAVE_COMPONENTS (sizeof(XSAVE_COMPONENTS) / sizeof(XSAVE_COMPONENTS[0]))
+
+typedef enum CpuidState { CPUID_KEEP = 0, CPUID_ON, CPUID_OFF } CpuidState;
+
+static uint32_t *cpuid_reg(struct kvm_cpuid_entry2 *entry, uint8_t reg) {
+    switch (reg) {
+    case CPUID_EAX:
+        return &entry->eax;
+    case CPUID_EBX:
+        return &entry->ebx;
+    case CPUID_ECX:
+        return &entry->ecx;
+    default:
+        return &entry->edx;
+    }
+}
+
+static int32_t cpuid_feature_index(const char *name) {
+    for (uint32_t i = 0; i < NB_FEATURES; i++) {
+        if (strcmp(FEATURES[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static MiniKVMError cpuid_select_model(const char *name, CpuidState *states) {
+    const CpuModel *model = NULL;
+
+    if (strcmp(name, MINI_KVM_CPU_HOST) == 0) {
+        return MINI_KVM_SUCCESS;
+    }
+
+    for (uint32_t i = 0; i < NB_MODELS && model == NULL; i++) {
+        model = (strcmp(MODELS[i].name, name) == 0) ? &MODELS[i] : NULL;
+    }
+    if (model == NULL) {
+        ERROR("unknown CPU model %s", name);
+        return MINI_KVM_ARGS_FAILED;
+    }
+
+    for (uint32_t i = 0; i < NB_FEATURES; i++) {
+        states[i] = CPUID_OFF;
+    }
+    for (uint32_t i = 0; i < CPU_MODEL_MAX_LISTS && model->lists[i] != NULL; i++) {
+        for (const char *const *feature = model->lists[i]; *feature != NULL; feature++) {
+            states[cpuid_feature_index(*feature)] = CPUID_ON;
+        }
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+// a model or a +feature cannot enable what KVM does not support, the VM would not match the model
+static MiniKVMError cpuid_set_features(Kvm *kvm, const CpuidState *states) {
+    struct kvm_cpuid_entry2 *entry = NULL;
+    uint32_t *reg = NULL;
+    bool supported = false;
+
+    for (uint32_t i = 0; i < NB_FEATURES; i++) {
+        const CpuidFeature *feature = &FEATURES[i];
+
+        entry = mini_kvm_find_cpuid(kvm, feature->function, feature->index);
+        reg = (entry != NULL) ? cpuid_reg(entry, feature->reg) : NULL;
+        supported = reg != NULL && (feature->vmm || (*reg & feature->mask) == feature->mask);
+        if (states[i] == CPUID_ON && !supported) {
+            ERROR("CPU feature %s is not supported by KVM", feature->name);
+            return MINI_KVM_ARGS_FAILED;
+        }
+
+        if (states[i] == CPUID_ON) {
+            *reg |= feature->mask;
+        } else if (states[i] == CPUID_OFF && reg != NULL) {
+            *reg &= ~feature->mask;
+        }
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+// clear the bits of the whitelisted registers that are neither baseline nor enabled features
+static void cpuid_mask_model(Kvm *kvm, const CpuidState *states) {
+    struct kvm_cpuid_entry2 *entry = NULL;
+    uint32_t allowed = 0;
+
+    for (uint32_t i = 0; i < NB_MODEL_BASELINE; i++) {
+        const CpuidBaseline *baseline = &MODEL_BASELINE[i];
+
+        if ((entry = mini_kvm_find_cpuid(kvm, baseline->function, 0)) == NULL) {
+            continue;
+        }
+        allowed = baseline->mask;
+        for (uint32_t j = 0; j < NB_FEATURES; j++) {
+            if (states[j] == CPUID_ON && FEATURES[j].function == baseline->function &&
+                FEATURES[j].index == 0 && FEATURES[j].reg == baseline->reg) {
+                allowed |= FEATURES[j].mask;
+            }
+        }
+        *cpuid_reg(entry, baseline->reg) &= allowed;
+    }
+
+    // the other subleaves of leaf 0x7 have no model feature
+    for (uint32_t i = 0; i < kvm->cpuid->nent; i++) {
+        entry = &kvm->cpuid->entries[i];
+        if (entry->function == 0x7 && entry->index != 0) {
+            entry->eax = entry->ebx = entry->ecx = entry->edx = 0;
+        }
+    }
+}
+
+// keep the XSAVE state components of the enabled features, drop the subleaves of the others and
+// the optimized and supervisor XSAVE variants, which not every host of the model has
+static void cpuid_trim_xsave(Kvm *kvm, const CpuidState *states) {
+    struct kvm_cpuid_entry2 *entries = kvm->cpuid->entries, *entry = NULL;
+    uint64_t components = XSAVE_X87_SSE;
+    uint32_t size = XSAVE_LEGACY_SIZE, nent = 0;
+
+    for (uint32_t i = 0; i < NB_XSAVE_COMPONENTS; i++) {
+        if (states[cpuid_feature_index(XSAVE_COMPONENTS[i].feature)] == CPUID_ON) {
+            components |= XSAVE_COMPONENTS[i].components;
+        }
+    }
+
+    for (uint32_t i = 0; i < kvm->cpuid->nent; i++) {
+        entry = &entries[i];
+        if (entry->function == CPUID_XSAVE && entry->index >= 2) {
+            if (entry->index >= XSAVE_MAX_COMPONENTS || !(components & (1UL << entry->index))) {
+                continue;
+            }
+            // eax is the size of the component and ebx its offset in the standard format
+            size = (entry->ebx + entry->eax > size) ? entry->ebx + entry->eax : size;
+        }
+        entries[nent++] = *entry;
+    }
+    kvm->cpuid->nent = nent;
+
+    if ((entry = mini_kvm_find_cpuid(kvm, CPUID_XSAVE, 0)) != NULL) {
+        entry->eax &= (uint32_t)components;
+        entry->edx &= (uint32_t)(components >> 32);
+        entry->ebx = XSAVE_LEGACY_SIZE; // KVM updates it when the guest sets XCR0
+        entry->ecx = size;
+    }
+    if ((entry = mini_kvm_find_cpuid(kvm, CPUID_XSAVE, 1)) != NULL) {
+        entry->eax = 0;
+        entry->ecx = 0;
+        entry->edx = 0;
+    }
+}
+
+MiniKVMError mini_kvm_cpuid_apply(Kvm *kvm, const char *spec) {
+    CpuidState states[NB_FEATURES] = {0};
+    char buffer[CPUID_SPEC_MAX_LEN];
+    char *token = NULL, *save = NULL;
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+    int32_t index = 0;
+
+    if (spec == NULL || strcmp(spec, MINI_KVM_CPU_HOST) == 0) {
+        return MINI_KVM_SUCCESS;
+    }
+    if (strlen(spec) >= CPUID_SPEC_MAX_LEN) {
+        ERROR("CPU model is too long");
+        return MINI_KVM_ARGS_FAILED;
+    }
+    strcpy(buffer, spec);
+
+    // the model comes first, then the overrides in order
+    token = strtok_r(buffer, ",", &save);
+    if ((ret = cpuid_select_model((token != NULL) ? token : "", states)) != MINI_KVM_SUCCESS) {
+        return ret;
+    }
+
+    while ((token = strtok_r(NULL, ",", &save)) != NULL) {
+        index = cpuid_feature_index(token + 1);
+        if ((token[0] != '+' && token[0] != '-') || index < 0) {
+            ERROR("invalid CPU feature %s, expected +feature or -feature", token);
+            return MINI_KVM_ARGS_FAILED;
+        }
+        states[index] = (token[0] == '+') ? CPUID_ON : CPUID_OFF;
+    }
+
+    if ((ret = cpuid_set_features(kvm, states)) != MINI_KVM_SUCCESS) {
+        return ret;
+    }
+    if (strcmp(buffer, MINI_KVM_CPU_HOST) != 0) {
+        cpuid_mask_model(kvm, states);
+        cpuid_trim_xsave(kvm, states);
+    }
+    INFO("CPU model %s applied", spec);
+
+    return MINI_KVM_SUCCESS;
+}
+
+void mini_kvm_cpuid_print_models(FILE *out) {
+    fprintf(out, "CPU models: %s", MINI_KVM_CPU_HOST);
+    for (uint32_t i = 0; i < NB_MODELS; i++) {
+        fprintf(out, " %s", MODELS[i].name);
+    }
+    fprintf(out, "\nCPU features:");
+    for (uint32_t i = 0; i < NB_FEATURES; i++) {
+        fprintf(out, " %s", FEATURES[i].name);
+    }
+    fprintf(out, "\n");
+}
+
+void mini_kvm_cpuid_print(const struct kvm_cpuid_entry2 *entries, uint32_t count, FILE *out) {
+    struct kvm_cpuid_entry2 entry;
+
+    fprintf(out, "%-10s %-5s %-10s %-10s %-10s %s\n", "function", "index", "eax", "ebx", "ecx",
+            "edx");
+    for (uint32_t i = 0; i < count; i++) {
+        fprintf(out, "0x%08x %-5u 0x%08x 0x%08x 0x%08x 0x%08x\n", entries[i].function,
+                entries[i].index, entries[i].eax, entries[i].ebx, entries[i].ecx, entries[i].edx);
+    }
+
+    fprintf(out, "features:");
+    for (uint32_t i = 0; i < NB_FEATURES; i++) {
+        for (uint32_t j = 0; j < count; j++) {
+            if (entries[j].function != FEATURES[i].function ||
+                entries[j].index != FEATURES[i].index) {
+                continue;
+            }
+            entry = entries[j];
+            if ((*cpuid_reg(&entry, FEATURES[i].reg) & FEATURES[i].mask) == FEATURES[i].mask) {
+                fprintf(out, " %s", FEATURES[i].name);
+            }
+            break;
+        }
+    }
+    fprintf(out, "\n");
+}
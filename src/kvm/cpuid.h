@@ -0,0 +1,24 @@
+#ifndef MINI_KVM_CPUID_H
+#define MINI_KVM_CPUID_H
+
+#include <inttypes.h>
+#include <linux/kvm.h>
+#include <stdio.h>
+
+#include "core/errors.h"
+#include "kvm/kvm.h"
+
+// model keeping every feature KVM supports, the default
+#define MINI_KVM_CPU_HOST "host"
+
+// restrict the CPUID table of the VM to a CPU model, spec is "model[,+feature][,-feature]...".
+// Named models are built from a whitelist: the feature bits of leaves 0x1, 0x7 and 0x80000001 are
+// the x86-64 baseline and the model features, and leaf 0xD only lists their XSAVE components.
+// Must be called before the vcpus are created, they all get the resulting table.
+MiniKVMError mini_kvm_cpuid_apply(Kvm *kvm, const char *spec);
+// print the models and the feature names accepted in a spec
+void mini_kvm_cpuid_print_models(FILE *out);
+// print a CPUID table and the known features it enables
+void mini_kvm_cpuid_print(const struct kvm_cpuid_entry2 *entries, uint32_t count, FILE *out);
+
+#endif /* MINI_KVM_CPUID_H */
@@ -0,0 +1,217 @@
+#include "irq.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "core/constants.h"
+#include "core/logger.h"
+
+#define ISA_IRQS 16
+#define MAX_ROUTES (ISA_IRQS + MINI_KVM_MAX_GSI)
+
+static bool irq_used(MiniKvmIrq *irq, uint32_t gsi) {
+    return (irq->used[gsi / 64] >> (gsi % 64)) & 1;
+}
+
+static void irq_set_used(MiniKvmIrq *irq, uint32_t gsi, bool used) {
+    if (used) {
+        irq->used[gsi / 64] |= 1UL << (gsi % 64);
+    } else {
+        irq->used[gsi / 64] &= ~(1UL << (gsi % 64));
+    }
+}
+
+static void irq_add_route(MiniKvmIrq *irq, struct kvm_irq_routing_entry entry) {
+    irq->routing->entries[irq->routing->nr++] = entry;
+    irq->dirty = true;
+}
+
+static struct kvm_irq_routing_entry *irq_find_msi(MiniKvmIrq *irq, uint32_t gsi) {
+    for (uint32_t i = 0; i < irq->routing->nr; i++) {
+        if (irq->routing->entries[i].gsi == gsi &&
+            irq->routing->entries[i].type == KVM_IRQ_ROUTING_MSI) {
+            return &irq->routing->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void irq_remove_msi(MiniKvmIrq *irq, uint32_t gsi) {
+    struct kvm_irq_routing_entry *entry = irq_find_msi(irq, gsi);
+
+    if (entry != NULL) {
+        *entry = irq->routing->entries[--irq->routing->nr];
+        irq->dirty = true;
+    }
+}
+
+MiniKVMError mini_kvm_irq_init(MiniKvmIrq *irq, int32_t vm_fd) {
+    irq->routing = calloc(1, sizeof(struct kvm_irq_routing) +
+                                 MAX_ROUTES * sizeof(struct kvm_irq_routing_entry));
+    if (irq->routing == NULL) {
+        ERROR("failed to allocate the irq routing table");
+        return MINI_KVM_FAILED_ALLOCATION;
+    }
+    irq->vm_fd = vm_fd;
+    pthread_mutex_init(&irq->lock, NULL);
+
+    for (uint32_t gsi = 0; gsi < IOAPIC_PINS; gsi++) {
+        irq_add_route(irq, (struct kvm_irq_routing_entry){
+                               .gsi = gsi,
+                               .type = KVM_IRQ_ROUTING_IRQCHIP,
+                               .u.irqchip = {.irqchip = KVM_IRQCHIP_IOAPIC, .pin = gsi},
+                           });
+        if (gsi < ISA_IRQS) {
+            irq_add_route(irq, (struct kvm_irq_routing_entry){
+                                   .gsi = gsi,
+                                   .type = KVM_IRQ_ROUTING_IRQCHIP,
+                                   .u.irqchip = {.irqchip = (gsi < 8) ? KVM_IRQCHIP_PIC_MASTER
+                                                                      : KVM_IRQCHIP_PIC_SLAVE,
+                                                 .pin = gsi % 8},
+                               });
+        }
+    }
+
+    // the ISA interrupts belong to the legacy devices, the other pins are allocated on demand
+    for (uint32_t gsi = 0; gsi < ISA_IRQS; gsi++) {
+        irq_set_used(irq, gsi, true);
+    }
+    // this is the routing KVM starts with, there is nothing to install yet
+    irq->dirty = false;
+
+    return MINI_KVM_SUCCESS;
+}
+
+void mini_kvm_irq_clean(MiniKvmIrq *irq) {
+    if (irq->routing != NULL) {
+        pthread_mutex_destroy(&irq->lock);
+        free(irq->routing);
+        irq->routing = NULL;
+    }
+}
+
+MiniKVMError mini_kvm_irq_alloc_pin(MiniKvmIrq *irq, uint32_t *gsi) {
+    MiniKVMError ret = MINI_KVM_INTERNAL_ERROR;
+
+    pthread_mutex_lock(&irq->lock);
+    for (uint32_t pin = ISA_IRQS; pin < IOAPIC_PINS; pin++) {
+        if (!irq_used(irq, pin)) {
+            irq_set_used(irq, pin, true);
+            *gsi = pin;
+            ret = MINI_KVM_SUCCESS;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&irq->lock);
+
+    if (ret != MINI_KVM_SUCCESS) {
+        ERROR("no free IOAPIC pin");
+    }
+    return ret;
+}
+
+MiniKVMError mini_kvm_irq_alloc_msi(MiniKvmIrq *irq, uint32_t count, uint32_t *first_gsi) {
+    MiniKVMError ret = MINI_KVM_INTERNAL_ERROR;
+    uint32_t run = 0;
+
+    pthread_mutex_lock(&irq->lock);
+    for (uint32_t gsi = IOAPIC_PINS; gsi < MINI_KVM_MAX_GSI && count > 0; gsi++) {
+        run = irq_used(irq, gsi) ? 0 : run + 1;
+        if (run == count) {
+            *first_gsi = gsi + 1 - count;
+            for (uint32_t i = *first_gsi; i <= gsi; i++) {
+                irq_set_used(irq, i, true);
+            }
+            ret = MINI_KVM_SUCCESS;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&irq->lock);
+
+    if (ret != MINI_KVM_SUCCESS) {
+        ERROR("unable to allocate %u MSI GSIs", count);
+    }
+    return ret;
+}
+
+void mini_kvm_irq_free(MiniKvmIrq *irq, uint32_t gsi, uint32_t count) {
+    pthread_mutex_lock(&irq->lock);
+    for (uint32_t i = gsi; i < gsi + count && i < MINI_KVM_MAX_GSI; i++) {
+        if (i >= ISA_IRQS) {
+            irq_remove_msi(irq, i);
+            irq_set_used(irq, i, false);
+        }
+    }
+    pthread_mutex_unlock(&irq->lock);
+}
+
+MiniKVMError mini_kvm_irq_set_msi(MiniKvmIrq *irq, uint32_t gsi, uint64_t address, uint32_t data) {
+    struct kvm_irq_routing_msi msi = {
+        .address_lo = address & 0xffffffff, .address_hi = address >> 32, .data = data};
+    struct kvm_irq_routing_entry *entry = NULL;
+
+    pthread_mutex_lock(&irq->lock);
+    if (gsi < IOAPIC_PINS || gsi >= MINI_KVM_MAX_GSI || !irq_used(irq, gsi)) {
+        pthread_mutex_unlock(&irq->lock);
+        ERROR("GSI %u is not an allocated MSI GSI", gsi);
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    entry = irq_find_msi(irq, gsi);
+    if (address == 0) {
+        irq_remove_msi(irq, gsi);
+    } else if (entry == NULL) {
+        irq_add_route(irq, (struct kvm_irq_routing_entry){
+                               .gsi = gsi, .type = KVM_IRQ_ROUTING_MSI, .u.msi = msi});
+    } else if (memcmp(&entry->u.msi, &msi, sizeof(msi)) != 0) {
+        entry->u.msi = msi;
+        irq->dirty = true;
+    }
+    pthread_mutex_unlock(&irq->lock);
+
+    return MINI_KVM_SUCCESS;
+}
+
+MiniKVMError mini_kvm_irq_commit(MiniKvmIrq *irq) {
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+
+    pthread_mutex_lock(&irq->lock);
+    if (irq->dirty) {
+        if (ioctl(irq->vm_fd, KVM_SET_GSI_ROUTING, irq->routing) < 0) {
+            ERROR("failed to set irq routing (%s)", strerror(errno));
+            ret = MINI_KVM_FAILED_IOCTL;
+        } else {
+            irq->dirty = false;
+            TRACE("irq routing installed (%u routes)", irq->routing->nr);
+        }
+    }
+    pthread_mutex_unlock(&irq->lock);
+
+    return ret;
+}
+
+MiniKVMError mini_kvm_irq_bind_eventfd(MiniKvmIrq *irq, uint32_t gsi, int32_t fd, bool bind) {
+    struct kvm_irqfd irqfd = {.fd = fd, .gsi = gsi, .flags = bind ? 0 : KVM_IRQFD_FLAG_DEASSIGN};
+
+    if (ioctl(irq->vm_fd, KVM_IRQFD, &irqfd) < 0) {
+        ERROR("failed to %s eventfd of GSI %u (%s)", bind ? "bind" : "unbind", gsi,
+              strerror(errno));
+        return MINI_KVM_FAILED_IOCTL;
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+MiniKVMError mini_kvm_irq_set_level(MiniKvmIrq *irq, uint32_t gsi, bool level) {
+    struct kvm_irq_level irq_level = {.irq = gsi, .level = level};
+
+    if (ioctl(irq->vm_fd, KVM_IRQ_LINE, &irq_level) < 0) {
+        ERROR("failed to set the level of GSI %u (%s)", gsi, strerror(errno));
+        return MINI_KVM_FAILED_IOCTL;
+    }
+
+    return MINI_KVM_SUCCESS;
+}
@@ -0,0 +1,52 @@
+#ifndef MINI_KVM_IRQ_H
+#define MINI_KVM_IRQ_H
+
+#include <inttypes.h>
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "core/errors.h"
+
+// Interrupt routing
+//
+// GSIs 0 to 23 are the IOAPIC pins, the ISA ones (0 to 15) are also wired to the PIC, like the
+// default routing of KVM. Devices allocate the GSIs they signal: a free IOAPIC pin for a legacy
+// line or one GSI per queue for MSI vectors. An MSI GSI is routed once the guest programs its
+// message, the destination APIC ID is part of it so each queue interrupts the vcpu the guest chose.
+// Route changes are batched in memory and installed with KVM_SET_GSI_ROUTING by
+// mini_kvm_irq_commit, KVM replaces the whole table and waits for a grace period on each update.
+
+#define MINI_KVM_MAX_GSI 1024
+
+typedef struct MiniKvmIrq {
+    int32_t vm_fd;
+    pthread_mutex_t lock;
+    uint64_t used[MINI_KVM_MAX_GSI / 64]; // allocated GSIs
+    struct kvm_irq_routing *routing;     // ISA_IRQS + MINI_KVM_MAX_GSI entries
+    bool dirty;                          // routing changed since the last commit
+} MiniKvmIrq;
+
+// build the default routing, the IOAPIC pins are reserved
+MiniKVMError mini_kvm_irq_init(MiniKvmIrq *irq, int32_t vm_fd);
+void mini_kvm_irq_clean(MiniKvmIrq *irq);
+
+// reserve a free IOAPIC pin above the ISA interrupts, its GSI is the pin number
+MiniKVMError mini_kvm_irq_alloc_pin(MiniKvmIrq *irq, uint32_t *gsi);
+// reserve count consecutive GSIs for the MSI vectors of a device, unrouted until set_msi
+MiniKVMError mini_kvm_irq_alloc_msi(MiniKvmIrq *irq, uint32_t count, uint32_t *first_gsi);
+// release GSIs and their MSI routes
+void mini_kvm_irq_free(MiniKvmIrq *irq, uint32_t gsi, uint32_t count);
+// route an MSI GSI to the message programmed by the guest, a zero address (masked vector) removes
+// the route
+MiniKVMError mini_kvm_irq_set_msi(MiniKvmIrq *irq, uint32_t gsi, uint64_t address, uint32_t data);
+// install the routing table in KVM if it changed since the last commit
+MiniKVMError mini_kvm_irq_commit(MiniKvmIrq *irq);
+
+// raise gsi from the kernel each time fd is written, device threads signal their queues without
+// going through the VMM
+MiniKVMError mini_kvm_irq_bind_eventfd(MiniKvmIrq *irq, uint32_t gsi, int32_t fd, bool bind);
+// set the level of an IOAPIC pin, a level of 1 on an MSI GSI sends the message
+MiniKVMError mini_kvm_irq_set_level(MiniKvmIrq *irq, uint32_t gsi, bool level);
+
+#endif /* MINI_KVM_IRQ_H */
@@ -1,22 +1,27 @@
+#include <asm/kvm_para.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/kvm.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "core/constants.h"
 #include "core/core.h"
 #include "core/errors.h"
 #include "core/logger.h"
+#include "core/probes.h"
 #include "kvm.h"
 
 #define TSS_ADDR 0xfffbd000
@@ -33,44 +38,176 @@ static const int32_t MINI_KVM_CAPS[] = {KVM_CAP_USER_MEMORY, KVM_CAP_SET_TSS_ADD
 static const char *MINI_KVM_CAPS_STR[] = {"KVM_CAP_USER_MEMORY", "KVM_CAP_SET_TSS_ADDR",
                                           "KVM_CAP_EXT_CPUID"};
 static const char *VM_STATE_STR[] = {"paused", "running", "shutdown"};
+static const char *EXIT_REASON_STR[MINI_KVM_STATS_EXIT_REASONS] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq window open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_SET_TPR] = "set tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr access",
+    [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal error",
+    [KVM_EXIT_SYSTEM_EVENT] = "system event",
+    [KVM_EXIT_IOAPIC_EOI] = "ioapic eoi",
+    [KVM_EXIT_HYPERV] = "hyperv",
+    [KVM_EXIT_X86_RDMSR] = "rdmsr",
+    [KVM_EXIT_X86_WRMSR] = "wrmsr",
+    [KVM_EXIT_DIRTY_RING_FULL] = "dirty ring full",
+    [KVM_EXIT_AP_RESET_HOLD] = "ap reset hold",
+    [KVM_EXIT_X86_BUS_LOCK] = "bus lock",
+    [KVM_EXIT_XEN] = "xen",
+    [KVM_EXIT_NOTIFY] = "notify",
+    [MINI_KVM_STATS_EXIT_REASONS - 1] = "other",
+};
+
+static void kvm_kick_signal_handler(__attribute__((unused)) int signum) {}
+
+// SIGVMKICK is blocked in every thread (vcpu threads inherit the mask from the main thread), it
+// only gets unblocked while a vcpu is in KVM_RUN so a kick can never be lost between the requests
+// check and the guest entry: a pending kick makes KVM_RUN return immediately with EINTR.
+static MiniKVMError kvm_setup_kick_signal() {
+    struct sigaction action = {0};
+    sigset_t set;
+
+    action.sa_handler = kvm_kick_signal_handler;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGVMKICK, &action, NULL) < 0) {
+        ERROR("failed to install vcpu kick handler (%s)", strerror(errno));
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGVMKICK);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+        ERROR("failed to block vcpu kick signal");
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    return MINI_KVM_SUCCESS;
+}
 
 static MiniKVMError kvm_setup_irq(Kvm *kvm) {
-    if (ioctl(kvm->vm_fd, KVM_CREATE_IRQCHIP) < -1) {
+    if (ioctl(kvm->vm_fd, KVM_CREATE_IRQCHIP) < 0) {
         ERROR("failed to create irq chip (%s)", strerror(errno));
         return MINI_KVM_FAILED_IOCTL;
     }
 
-    if (ioctl(kvm->vm_fd, KVM_CREATE_PIT2, &kvm->pit_config) < -1) {
-        ERROR("failed to create irq chip (%s)", strerror(errno));
+    if (ioctl(kvm->vm_fd, KVM_CREATE_PIT2, &kvm->pit_config) < 0) {
+        ERROR("failed to create pit (%s)", strerror(errno));
         return MINI_KVM_FAILED_IOCTL;
     }
+
+    if (mini_kvm_irq_init(&kvm->irq, kvm->vm_fd) != MINI_KVM_SUCCESS) {
+        return MINI_KVM_FAILED_ALLOCATION;
+    }
     INFO("irq setup finalized");
 
     return MINI_KVM_SUCCESS;
 }
 
+// let the guests use the TSC and kvmclock as their clock source. kvmclock is advertised as stable
+// when the vcpus can be given the same TSC offset (see kvm_sync_tsc), and the TSC as invariant when
+// the host one is. A frequency set with --tsc-khz is also published in the timing leaf.
+static void kvm_setup_clock_cpuid(Kvm *kvm) {
+    struct kvm_cpuid_entry2 *signature = mini_kvm_find_cpuid(kvm, KVM_CPUID_SIGNATURE, 0);
+    struct kvm_cpuid_entry2 *features = mini_kvm_find_cpuid(kvm, KVM_CPUID_FEATURES, 0);
+    struct kvm_cpuid_entry2 *power = mini_kvm_find_cpuid(kvm, CPUID_EXT_POWER, 0);
+    uint32_t host[4] = {0};
+
+    native_cpuid(CPUID_EXT_MAX, host);
+    if (host[CPUID_EAX] >= CPUID_EXT_POWER) {
+        native_cpuid(CPUID_EXT_POWER, host);
+        if (power != NULL && (host[CPUID_EDX] & CPUID_EXT_POWER_EDX_INVTSC)) {
+            power->edx |= CPUID_EXT_POWER_EDX_INVTSC;
+        }
+    }
+
+    if (signature == NULL || features == NULL) {
+        WARN("kvm: paravirtual CPUID leaves not supported, guests cannot use kvmclock");
+        return;
+    }
+    features->eax |= 1 << KVM_FEATURE_CLOCKSOURCE2;
+    if (ioctl(kvm->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_VCPU_ATTRIBUTES) > 0) {
+        features->eax |= 1 << KVM_FEATURE_CLOCKSOURCE_STABLE_BIT;
+    } else {
+        // KVM reports the bit as supported, it is only true once the offsets are synced
+        WARN("kvm: vcpu TSC offsets cannot be synced, kvmclock is not advertised as stable");
+        features->eax &= ~(1 << KVM_FEATURE_CLOCKSOURCE_STABLE_BIT);
+    }
+
+    if (kvm->tsc_khz != 0 && kvm->cpuid->nent < MAX_CPUID_ENTRIES &&
+        mini_kvm_find_cpuid(kvm, CPUID_TIMING_INFO, 0) == NULL) {
+        kvm->cpuid->entries[kvm->cpuid->nent++] = (struct kvm_cpuid_entry2){
+            .function = CPUID_TIMING_INFO, .eax = kvm->tsc_khz, .ebx = KVM_APIC_BUS_KHZ};
+        signature->eax = (signature->eax < CPUID_TIMING_INFO) ? CPUID_TIMING_INFO : signature->eax;
+    }
+}
+
 MiniKVMError mini_kvm_setup_kvm(Kvm *kvm, uint64_t mem_size) {
     int32_t kvm_version;
 
     kvm->vcpus = vec_new_VCpu();
     kvm->state = MINI_KVM_PAUSED;
     kvm->paused = 0;
-    pthread_mutex_init(&kvm->lock, NULL);
+    pthread_rwlock_init(&kvm->lock, NULL);
     pthread_cond_init(&kvm->pause_cond, NULL);
     pthread_mutex_init(&kvm->pause_lock, NULL);
+    mini_kvm_serial_init(&kvm->serial);
 
     kvm->kvm_fd = open("/dev/kvm", O_RDWR | O_CLOEXEC);
     if (kvm->kvm_fd < 0) {
-        ERROR("failed to open kvm device : s%", strerror(errno));
+        ERROR("failed to open kvm device : %s", strerror(errno));
         return MINI_KVM_NO_DEVICE;
     }
+    mini_kvm_startup_end(&kvm->startup, MINI_KVM_STARTUP_KVM_OPEN);
     INFO("/dev/kvm device opened");
 
+    if (kvm_setup_kick_signal() != MINI_KVM_SUCCESS) {
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    kvm->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (kvm->event_fd < 0) {
+        ERROR("failed to create VM eventfd (%s)", strerror(errno));
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    kvm->snapshots = aligned_alloc(64, MINI_KVM_MAX_VCPUS * sizeof(VCpuSnapshot));
+    if (kvm->snapshots == NULL) {
+        ERROR("failed to allocate vcpu snapshots");
+        return MINI_KVM_FAILED_ALLOCATION;
+    }
+    memset(kvm->snapshots, 0, MINI_KVM_MAX_VCPUS * sizeof(VCpuSnapshot));
+
+    kvm->stats = aligned_alloc(64, MINI_KVM_MAX_VCPUS * sizeof(VCpuStats));
+    kvm->stats_base = aligned_alloc(64, MINI_KVM_MAX_VCPUS * sizeof(VCpuStats));
+    if (kvm->stats == NULL || kvm->stats_base == NULL) {
+        ERROR("failed to allocate vcpu stats");
+        return MINI_KVM_FAILED_ALLOCATION;
+    }
+    memset(kvm->stats, 0, MINI_KVM_MAX_VCPUS * sizeof(VCpuStats));
+    memset(kvm->stats_base, 0, MINI_KVM_MAX_VCPUS * sizeof(VCpuStats));
+
     if ((kvm_version = ioctl(kvm->kvm_fd, KVM_GET_API_VERSION, 0)) != KVM_API_VERSION) {
         ERROR("wrong kvm api version expected %d, got %d", kvm_version, KVM_API_VERSION);
         return MINI_KVM_WRONG_VERSION;
     }
 
+    // opt-in, every exit then pays for the register copy and the snapshot publish
+    if (kvm->sync_regs && (ioctl(kvm->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS) &
+                           (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS)) !=
+                              (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS)) {
+        WARN("KVM_CAP_SYNC_REGS is not supported, registers are only read on request");
+        kvm->sync_regs = false;
+    }
+
     kvm->vm_fd = ioctl(kvm->kvm_fd, KVM_CREATE_VM, 0);
     if (kvm->vm_fd < 0) {
         ERROR("failed to create Virtual machine file descriptor : %s", strerror(errno));
@@ -78,6 +215,31 @@ MiniKVMError mini_kvm_setup_kvm(Kvm *kvm, uint64_t mem_size) {
     }
     INFO("KVM virtual machine created");
 
+    kvm->vcpu_mmap_size = ioctl(kvm->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+    if (kvm->vcpu_mmap_size <= 0) {
+        ERROR("failed to get vcpu mem size (%s)", strerror(errno));
+        return MINI_KVM_FAILED_VM_CREATION;
+    }
+
+    // queried once, every vcpu gets the same table
+    kvm->cpuid =
+        calloc(1, sizeof(struct kvm_cpuid2) + MAX_CPUID_ENTRIES * sizeof(struct kvm_cpuid_entry2));
+    if (kvm->cpuid == NULL) {
+        ERROR("failed to allocate cpuid table");
+        return MINI_KVM_FAILED_ALLOCATION;
+    }
+    kvm->cpuid->nent = MAX_CPUID_ENTRIES;
+    if (ioctl(kvm->kvm_fd, KVM_GET_SUPPORTED_CPUID, kvm->cpuid) < 0) {
+        ERROR("kvm: failed to get supported cpuid (%s)", strerror(errno));
+        return MINI_KVM_FAILED_IOCTL;
+    }
+    kvm_setup_clock_cpuid(kvm);
+
+    // without TSC scaling KVM only accepts frequencies close to the host one
+    if (kvm->tsc_khz != 0 && ioctl(kvm->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_TSC_CONTROL) <= 0) {
+        WARN("kvm: TSC scaling unsupported, the TSC frequency must match the host one");
+    }
+
     for (uint32_t i = 0; MINI_KVM_CAPS[i] != -1; i++) {
         if ((ioctl(kvm->kvm_fd, KVM_CHECK_EXTENSION, MINI_KVM_CAPS[i])) < 0) {
             ERROR("kvm capabilites unsupported : %s", MINI_KVM_CAPS_STR[i]);
@@ -86,7 +248,7 @@ MiniKVMError mini_kvm_setup_kvm(Kvm *kvm, uint64_t mem_size) {
     }
 
     if (check_cpu_vendor(GenuineIntel)) {
-        INFO("Running on an Intel CPU, set TSS addr to 0x%llx", TSS_ADDR);
+        INFO("Running on an Intel CPU, set TSS addr to 0x%x", TSS_ADDR);
         if (ioctl(kvm->kvm_fd, KVM_SET_TSS_ADDR, TSS_ADDR), 0) {
             ERROR("failed to set TSS ADDR : %s", strerror(errno));
             return MINI_KVM_FAILED_IOCTL;
@@ -126,63 +288,213 @@ MiniKVMError mini_kvm_setup_kvm(Kvm *kvm, uint64_t mem_size) {
         return MINI_KVM_FAILED_VM_CREATION;
     }
 
+    if (mini_kvm_binstats_open(&kvm->binstats, kvm->vm_fd) != MINI_KVM_SUCCESS) {
+        return MINI_KVM_FAILED_VM_CREATION;
+    }
+
     return MINI_KVM_SUCCESS;
 }
 
-MiniKVMError mini_kvm_add_vcpu(Kvm *kvm) {
-    if (kvm == NULL) {
-        ERROR("cannot create vcpu VCPU without initializing KVM");
+// create and set up vcpu id in its slot, vcpus only share the read-only VM state so several of
+// them are created at once
+static MiniKVMError kvm_create_vcpu(Kvm *kvm, VCpu *vcpu, uint32_t id) {
+    vcpu->id = id;
+    vcpu->fd = -1;
+    vcpu->snapshot = &kvm->snapshots[vcpu->id];
+    vcpu->stats = &kvm->stats[vcpu->id];
+    vcpu->kick_fd = eventfd(0, EFD_CLOEXEC);
+    if (vcpu->kick_fd < 0) {
+        ERROR("failed to create vcpu %d kick eventfd (%s)", vcpu->id, strerror(errno));
         return MINI_KVM_FAILED_VCPU_CREATION;
     }
 
-    VCpu vcpu = {0};
-    vcpu.id = kvm->vcpus->len;
-    vcpu.fd = ioctl(kvm->vm_fd, KVM_CREATE_VCPU, vcpu.id);
-    if (vcpu.fd < 0) {
-        ERROR("failed to create vcpu %d (%s)", vcpu.id, strerror(errno));
+    vcpu->fd = ioctl(kvm->vm_fd, KVM_CREATE_VCPU, vcpu->id);
+    if (vcpu->fd < 0) {
+        ERROR("failed to create vcpu %d (%s)", vcpu->id, strerror(errno));
         return MINI_KVM_FAILED_VCPU_CREATION;
     }
 
-    vcpu.mem_region_size = ioctl(kvm->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-    if (vcpu.mem_region_size <= 0) {
-        ERROR("failed to get vcpu mem size (%s)", strerror(errno));
+    vcpu->mem_region_size = kvm->vcpu_mmap_size;
+    vcpu->kvm_run =
+        mmap(NULL, vcpu->mem_region_size, PROT_READ | PROT_WRITE, MAP_SHARED, vcpu->fd, 0);
+    if (vcpu->kvm_run == MAP_FAILED) {
+        ERROR("failed to create kvm run struct for vcpu %d (%s)", vcpu->id, strerror(errno));
+        vcpu->kvm_run = NULL;
         return MINI_KVM_FAILED_VCPU_CREATION;
     }
 
-    vcpu.kvm_run = mmap(NULL, vcpu.mem_region_size, PROT_READ | PROT_WRITE, MAP_SHARED, vcpu.fd, 0);
-    if (vcpu.kvm_run == MAP_FAILED) {
-        ERROR("failed to create kvm run struct for vcpu %d (%s)", vcpu.id, strerror(errno));
+    // let KVM copy the registers in kvm_run on every exit, snapshots then need no ioctl
+    if (kvm->sync_regs) {
+        vcpu->kvm_run->kvm_valid_regs = KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS;
+    }
+
+    if (mini_kvm_setup_vcpu(kvm, vcpu, BOOTLOADER_ADDR) != MINI_KVM_SUCCESS) {
         return MINI_KVM_FAILED_VCPU_CREATION;
     }
 
-    if (mini_kvm_setup_vcpu(kvm, &vcpu, BOOTLOADER_ADDR) != MINI_KVM_SUCCESS) {
+    if (mini_kvm_binstats_open(&vcpu->binstats, vcpu->fd) != MINI_KVM_SUCCESS) {
         return MINI_KVM_FAILED_VCPU_CREATION;
     }
-    INFO("VCPU %d initialized", vcpu.id);
-    vec_append(kvm->vcpus, vcpu);
+    INFO("VCPU %d initialized", vcpu->id);
 
     return MINI_KVM_SUCCESS;
 }
 
-static void mini_kvm_vcpu_signal_handler(int signum) {
-    if (signum == SIGVMPAUSE) {
-        TRACE("pause signal received");
-    } else if (signum == SIGVMRESUME) {
-        TRACE("resume signal received");
+static void kvm_release_vcpu(VCpu *vcpu) {
+    if (vcpu->kvm_run != NULL) {
+        munmap(vcpu->kvm_run, vcpu->mem_region_size);
     }
+    if (vcpu->fd >= 0) {
+        close(vcpu->fd);
+    }
+    if (vcpu->kick_fd >= 0) {
+        close(vcpu->kick_fd);
+    }
+    mini_kvm_binstats_close(&vcpu->binstats);
+    free(vcpu->trace);
 }
 
-static MiniKVMError kvm_setup_cpuid(Kvm *kvm, VCpu *vcpu) {
-    struct kvm_cpuid2 *cpuid =
-        calloc(1, sizeof(struct kvm_cpuid2) + MAX_CPUID_ENTRIES * sizeof(struct kvm_cpuid_entry2));
-    cpuid->nent = MAX_CPUID_ENTRIES;
+struct VcpuCreateArgs {
+    Kvm *kvm;
+    VCpu *vcpus;
+    uint32_t first_id;
+    uint32_t count;
+    _Atomic uint32_t next;
+    _Atomic int32_t ret;
+};
 
-    if (ioctl(kvm->kvm_fd, KVM_GET_SUPPORTED_CPUID, cpuid) < 0) {
-        ERROR("kvm: failed to get supported cpuid (%s)", strerror(errno));
-        return MINI_KVM_FAILED_IOCTL;
+// give the vcpus from first the TSC offset of vcpu 0, all TSCs then read the same value at the same
+// time. Without KVM_VCPU_TSC_OFFSET the vcpus rely on KVM, which matches the offsets of vcpus
+// created within a second of each other. Returns false when an offset was not synced.
+static bool kvm_sync_tsc(Kvm *kvm, uint32_t first) {
+    uint64_t offset = 0;
+    struct kvm_device_attr attr = {
+        .group = KVM_VCPU_TSC_CTRL, .attr = KVM_VCPU_TSC_OFFSET, .addr = (uint64_t)&offset};
+    VCpu *boot = &kvm->vcpus->tab[0];
+    bool synced = true;
+
+    if (ioctl(boot->fd, KVM_HAS_DEVICE_ATTR, &attr) < 0) {
+        INFO("kvm: TSC offset attribute unsupported, vcpus keep the offsets set by KVM");
+        return false;
+    }
+    if (ioctl(boot->fd, KVM_GET_DEVICE_ATTR, &attr) < 0) {
+        WARN("failed to get vcpu %d TSC offset (%s)", boot->id, strerror(errno));
+        return false;
+    }
+
+    for (uint32_t i = (first == 0) ? 1 : first; i < kvm->vcpus->len; i++) {
+        if (ioctl(kvm->vcpus->tab[i].fd, KVM_SET_DEVICE_ATTR, &attr) < 0) {
+            WARN("failed to set vcpu %d TSC offset (%s)", i, strerror(errno));
+            synced = false;
+        }
+    }
+    return synced;
+}
+
+// the new vcpus have not run yet, their CPUID can still be replaced. The running ones keep theirs.
+static void kvm_clear_stable_clock(Kvm *kvm, uint32_t first) {
+    struct kvm_cpuid_entry2 *features = mini_kvm_find_cpuid(kvm, KVM_CPUID_FEATURES, 0);
+
+    if (features == NULL || !(features->eax & (1 << KVM_FEATURE_CLOCKSOURCE_STABLE_BIT))) {
+        return;
+    }
+    WARN("kvm: vcpu TSC offsets are not synced, kvmclock is not advertised as stable");
+    features->eax &= ~(1 << KVM_FEATURE_CLOCKSOURCE_STABLE_BIT);
+    for (uint32_t i = first; i < kvm->vcpus->len; i++) {
+        if (ioctl(kvm->vcpus->tab[i].fd, KVM_SET_CPUID2, kvm->cpuid) < 0) {
+            WARN("failed to set vcpu %d cpuid (%s)", i, strerror(errno));
+        }
+    }
+}
+
+static void *kvm_create_vcpus_worker(void *args) {
+    struct VcpuCreateArgs *create = args;
+    uint64_t start_ns = 0;
+    uint32_t index = 0;
+
+    while ((index = atomic_fetch_add(&create->next, 1)) < create->count) {
+        start_ns = mini_kvm_now_ns();
+        if (kvm_create_vcpu(create->kvm, &create->vcpus[index], create->first_id + index) !=
+            MINI_KVM_SUCCESS) {
+            atomic_store(&create->ret, MINI_KVM_FAILED_VCPU_CREATION);
+            break;
+        }
+        create->kvm->startup.vcpu_ns[create->first_id + index] = mini_kvm_now_ns() - start_ns;
+    }
+
+    return NULL;
+}
+
+MiniKVMError mini_kvm_add_vcpus(Kvm *kvm, uint32_t count) {
+    struct VcpuCreateArgs create = {.kvm = kvm, .count = count};
+    pthread_t workers[MINI_KVM_VCPU_CREATE_THREADS];
+    uint32_t nb_workers = 0, nb_started = 0;
+    int64_t online = sysconf(_SC_NPROCESSORS_ONLN);
+    int32_t err = 0;
+
+    if (kvm == NULL) {
+        ERROR("cannot create vcpu VCPU without initializing KVM");
+        return MINI_KVM_FAILED_VCPU_CREATION;
+    }
+
+    if (kvm->vcpus->len + count > MINI_KVM_MAX_VCPUS) {
+        ERROR("cannot create more than %d vcpus", MINI_KVM_MAX_VCPUS);
+        return MINI_KVM_FAILED_VCPU_CREATION;
+    }
+
+    create.first_id = kvm->vcpus->len;
+    create.vcpus = calloc(count, sizeof(VCpu));
+    if (create.vcpus == NULL) {
+        ERROR("failed to allocate %u vcpus", count);
+        return MINI_KVM_FAILED_ALLOCATION;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        create.vcpus[i].fd = -1;
+        create.vcpus[i].kick_fd = -1;
     }
 
-    if (ioctl(vcpu->fd, KVM_SET_CPUID2, cpuid) < 0) {
+    // KVM_CREATE_VCPU is serialized by KVM, the mmap and the register and cpuid ioctls are not.
+    // The calling thread is one of the workers.
+    nb_workers = (online > 0 && (uint64_t)online < count) ? online : count;
+    nb_workers = (nb_workers > MINI_KVM_VCPU_CREATE_THREADS) ? MINI_KVM_VCPU_CREATE_THREADS
+                                                             : nb_workers;
+    for (; nb_started + 1 < nb_workers; nb_started++) {
+        err = pthread_create(&workers[nb_started], NULL, kvm_create_vcpus_worker, &create);
+        if (err != 0) {
+            WARN("failed to start vcpu creation worker (%s)", strerror(err));
+            break;
+        }
+    }
+    kvm_create_vcpus_worker(&create);
+    for (uint32_t i = 0; i < nb_started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    if (atomic_load(&create.ret) != MINI_KVM_SUCCESS) {
+        for (uint32_t i = 0; i < count; i++) {
+            kvm_release_vcpu(&create.vcpus[i]);
+        }
+        free(create.vcpus);
+        return MINI_KVM_FAILED_VCPU_CREATION;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        vec_append(kvm->vcpus, create.vcpus[i]);
+    }
+    kvm->startup.vcpu_count = kvm->vcpus->len;
+    free(create.vcpus);
+    if (!kvm_sync_tsc(kvm, create.first_id)) {
+        kvm_clear_stable_clock(kvm, create.first_id);
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+MiniKVMError mini_kvm_add_vcpu(Kvm *kvm) { return mini_kvm_add_vcpus(kvm, 1); }
+
+// the table is shared by every vcpu, KVM_SET_CPUID2 only reads it
+static MiniKVMError kvm_setup_cpuid(Kvm *kvm, VCpu *vcpu) {
+    if (ioctl(vcpu->fd, KVM_SET_CPUID2, kvm->cpuid) < 0) {
         ERROR("kvm: failed to set cpuid (%s)", strerror(errno));
         return MINI_KVM_FAILED_IOCTL;
     }
@@ -190,21 +502,63 @@ static MiniKVMError kvm_setup_cpuid(Kvm *kvm, VCpu *vcpu) {
     return MINI_KVM_SUCCESS;
 }
 
+struct kvm_cpuid_entry2 *mini_kvm_find_cpuid(Kvm *kvm, uint32_t function, uint32_t index) {
+    for (uint32_t i = 0; kvm->cpuid != NULL && i < kvm->cpuid->nent; i++) {
+        struct kvm_cpuid_entry2 *entry = &kvm->cpuid->entries[i];
+
+        if (entry->function == function && entry->index == index) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// page directory mapping the GiB number gib with 2 MiB pages
+static uint64_t kvm_setup_pd(Kvm *kvm, uint64_t gib) {
+    uint64_t pd_addr =
+        (gib == 0) ? PLM4_ADDR + 2 * PAGE_SIZE : BOOT_PD_ADDR + (gib - 1) * PAGE_SIZE;
+    uint64_t *pd = (uint64_t *)((uint8_t *)kvm->mem + pd_addr);
+
+    for (uint64_t i = 0; i < PT_ENTRIES; i++) {
+        pd[i] = ((gib << 30) + (i << 21)) | PT_PAGE_SIZE | PT_PRESENT | PT_RW;
+    }
+
+    return pd_addr;
+}
+
+// identity map all guest memory, with 1 GiB pages when the guest CPUID has pdpe1gb and 2 MiB pages
+// otherwise. A single PDPT covers 512 GiB.
 static MiniKVMError kvm_setup_pages(Kvm *kvm) {
-    uint64_t plm4_addr = PLM4_ADDR;
-    uint64_t pdpt_addr = plm4_addr + PAGE_SIZE;
-    uint64_t pdt_addr = pdpt_addr + PAGE_SIZE;
+    uint64_t *plm4 = (uint64_t *)((uint8_t *)kvm->mem + PLM4_ADDR);
+    uint64_t *pdpt = plm4 + PT_ENTRIES;
+    uint64_t gibs = (kvm->mem_size + (1UL << 30) - 1) >> 30;
+    struct kvm_cpuid_entry2 *ext = mini_kvm_find_cpuid(kvm, CPUID_EXT_FEATURES, 0);
+    bool gbpages = ext != NULL && (ext->edx & CPUID_EXT_EDX_PDPE1GB);
 
     if (kvm->mem_size < MINIMUM_MEMORY_REQUIRED) {
-        ERROR("failed to setup pages: not enough memory, please allocation a least %lu bytes",
+        ERROR("failed to setup pages: not enough memory, please allocation a least %d bytes",
               MINIMUM_MEMORY_REQUIRED);
         return MINI_KVM_NOT_ENOUGH_MEMORY;
     }
-    memset((void *)kvm->mem + plm4_addr, 0, PAGE_SIZE * 3);
 
-    *(uint64_t *)((void *)kvm->mem + plm4_addr) = (pdpt_addr & PT_ADDR_MASK) | PT_PRESENT | PT_RW;
-    *(uint64_t *)((void *)kvm->mem + pdpt_addr) = (pdt_addr & PT_ADDR_MASK) | PT_PRESENT | PT_RW;
-    *(uint64_t *)((void *)kvm->mem + pdt_addr) = PT_PAGE_SIZE | PT_PRESENT | PT_RW;
+    if (gibs > PT_ENTRIES) {
+        WARN("boot page tables only map the first %d GiB of guest memory", PT_ENTRIES);
+        gibs = PT_ENTRIES;
+    }
+    if (!gbpages && gibs > BOOT_PD_MAX + 1) {
+        WARN("no 1 GiB pages, boot page tables only map the first %d GiB of guest memory",
+             BOOT_PD_MAX + 1);
+        gibs = BOOT_PD_MAX + 1;
+    }
+
+    memset(plm4, 0, PAGE_SIZE * 2);
+    plm4[0] = ((PLM4_ADDR + PAGE_SIZE) & PT_ADDR_MASK) | PT_PRESENT | PT_RW;
+    for (uint64_t gib = 0; gib < gibs; gib++) {
+        pdpt[gib] = gbpages ? (gib << 30) | PT_PAGE_SIZE | PT_PRESENT | PT_RW
+                            : (kvm_setup_pd(kvm, gib) & PT_ADDR_MASK) | PT_PRESENT | PT_RW;
+    }
+    INFO("%lu GiB identity mapped with %s pages", gibs, gbpages ? "1 GiB" : "2 MiB");
 
     return MINI_KVM_SUCCESS;
 }
@@ -220,7 +574,7 @@ MiniKVMError mini_kvm_configure_paging(Kvm *kvm) {
     struct kvm_segment code_seg = {
         .base = 0,
         .limit = 0xffffffff,
-        .selector = 1 << 3,
+        .selector = 2 << 3,
         .present = 1,
         .type = 11,
         .dpl = 0,
@@ -231,8 +585,17 @@ MiniKVMError mini_kvm_configure_paging(Kvm *kvm) {
     };
 
     struct kvm_segment data_seg = code_seg;
-    data_seg.selector = 2 << 3;
+    data_seg.selector = 3 << 3;
     data_seg.type = 0x3;
+    data_seg.db = 1;
+    data_seg.l = 0;
+
+    // the GDT describes the loaded segments, the Linux boot protocol expects the code segment at
+    // 0x10 and the data segments at 0x18
+    uint64_t *gdt = (uint64_t *)((uint8_t *)kvm->mem + BOOT_GDT_ADDR);
+    gdt[0] = gdt[1] = 0;
+    gdt[2] = 0x00af9b000000ffff; // 64 bits code
+    gdt[3] = 0x00cf93000000ffff; // data
 
     // Enable paging only the first cpu, the kernel will configure other VCPU later
     VCpu *vcpu = &kvm->vcpus->tab[0];
@@ -242,6 +605,9 @@ MiniKVMError mini_kvm_configure_paging(Kvm *kvm) {
     vcpu->sregs.efer = EFER_LME | EFER_LMA;
     vcpu->sregs.cs = code_seg;
     vcpu->sregs.ds = vcpu->sregs.es = vcpu->sregs.fs = vcpu->sregs.gs = data_seg;
+    vcpu->sregs.ss = data_seg;
+    vcpu->sregs.gdt.base = BOOT_GDT_ADDR;
+    vcpu->sregs.gdt.limit = 4 * sizeof(uint64_t) - 1;
 
     if (ioctl(vcpu->fd, KVM_SET_SREGS, &vcpu->sregs) < 0) {
         ERROR("failed to set sregs in %s (%s)", __FUNCTION__, strerror(errno));
@@ -257,7 +623,7 @@ MiniKVMError mini_kvm_setup_vcpu(Kvm *kvm, VCpu *vcpu, uint64_t start_addr) {
 
     memset(&vcpu->regs, 0, sizeof(struct kvm_regs));
     vcpu->regs.rip = start_addr;
-    vcpu->regs.rsp = kvm->mem_size - 1;
+    vcpu->regs.rsp = kvm->mem_size; // the first push writes the last aligned quad word of RAM
     vcpu->regs.rbp = vcpu->regs.rsp;
     vcpu->regs.rflags = 0b01;
     ret = ioctl(vcpu->fd, KVM_SET_REGS, &vcpu->regs);
@@ -287,33 +653,119 @@ MiniKVMError mini_kvm_setup_vcpu(Kvm *kvm, VCpu *vcpu, uint64_t start_addr) {
     }
     INFO("VCPU %d sregs set", vcpu->id);
 
+    if (kvm->tsc_khz != 0 && ioctl(vcpu->fd, KVM_SET_TSC_KHZ, kvm->tsc_khz) < 0) {
+        ERROR("failed to set vcpu %d TSC frequency to %u kHz (%s)", vcpu->id, kvm->tsc_khz,
+              strerror(errno));
+        return MINI_KVM_FAILED_VCPU_CREATION;
+    }
+
     if (kvm_setup_cpuid(kvm, vcpu) != MINI_KVM_SUCCESS) {
         return MINI_KVM_FAILED_VCPU_CREATION;
     }
     INFO("VCPU %d cpuid set", vcpu->id);
 
+    // application processors wait for the INIT and startup IPIs the guest sends to bring them up
+    if (vcpu->id != 0) {
+        struct kvm_mp_state mp_state = {.mp_state = KVM_MP_STATE_INIT_RECEIVED};
+
+        if (ioctl(vcpu->fd, KVM_SET_MP_STATE, &mp_state) < 0) {
+            ERROR("failed to set vcpu %d mp state (%s)", vcpu->id, strerror(errno));
+            return MINI_KVM_FAILED_VCPU_CREATION;
+        }
+    }
+
     return MINI_KVM_SUCCESS;
 }
 
-static MiniKVMError mini_kvm_handle_io(struct kvm_run *kvm_run) {
-    MiniKVMError ret = MINI_KVM_SUCCESS;
-    char *p = (char *)kvm_run;
+MiniKVMError mini_kvm_set_entry(Kvm *kvm, uint64_t entry, uint64_t boot_params) {
+    VCpu *vcpu = &kvm->vcpus->tab[0];
 
-    if (kvm_run->io.direction == KVM_EXIT_IO_OUT) {
-        switch (kvm_run->io.port) {
-        case 0x3f8:
-            write(1, p + kvm_run->io.data_offset, 1);
-            fflush(stdout);
-            break;
+    vcpu->regs.rip = entry;
+    vcpu->regs.rsi = boot_params;
+    if (ioctl(vcpu->fd, KVM_SET_REGS, &vcpu->regs) < 0) {
+        ERROR("failed to set vcpu %d entry point (%s)", vcpu->id, strerror(errno));
+        return MINI_KVM_FAILED_IOCTL;
+    }
+    INFO("VCPU %d starts at 0x%lx", vcpu->id, entry);
 
-        default:
-            ERROR("mini_kvm: unhandled out io port on port %x", kvm_run->io.port);
-            ret = MINI_KVM_INTERNAL_ERROR;
-            break;
+    return MINI_KVM_SUCCESS;
+}
+
+MiniKVMError mini_kvm_set_entry_32(Kvm *kvm, uint32_t entry, uint32_t start_info) {
+    VCpu *vcpu = &kvm->vcpus->tab[0];
+    uint64_t *gdt = (uint64_t *)((uint8_t *)kvm->mem + BOOT_GDT_ADDR);
+
+    struct kvm_segment code_seg = {
+        .limit = 0xffffffff, .selector = 2 << 3, .present = 1, .type = 11, .db = 1, .s = 1, .g = 1};
+    struct kvm_segment data_seg = code_seg;
+    data_seg.selector = 3 << 3;
+    data_seg.type = 0x3;
+
+    // the busy 32 bits TSS the ABI asks for, no task switch ever reads it
+    struct kvm_segment tss_seg = {.limit = 0x67, .present = 1, .type = 11};
+
+    gdt[2] = 0x00cf9b000000ffff; // 32 bits code
+    vcpu->sregs.cr0 = CR0_PE;
+    vcpu->sregs.cr3 = vcpu->sregs.cr4 = vcpu->sregs.efer = 0;
+    vcpu->sregs.cs = code_seg;
+    vcpu->sregs.ds = vcpu->sregs.es = vcpu->sregs.fs = vcpu->sregs.gs = data_seg;
+    vcpu->sregs.ss = data_seg;
+    vcpu->sregs.tr = tss_seg;
+    if (ioctl(vcpu->fd, KVM_SET_SREGS, &vcpu->sregs) < 0) {
+        ERROR("failed to set vcpu %d protected mode sregs (%s)", vcpu->id, strerror(errno));
+        return MINI_KVM_FAILED_IOCTL;
+    }
+
+    vcpu->regs.rip = entry;
+    vcpu->regs.rbx = start_info;
+    vcpu->regs.rflags = 0x2;
+    if (ioctl(vcpu->fd, KVM_SET_REGS, &vcpu->regs) < 0) {
+        ERROR("failed to set vcpu %d entry point (%s)", vcpu->id, strerror(errno));
+        return MINI_KVM_FAILED_IOCTL;
+    }
+    INFO("VCPU %d starts in protected mode at 0x%x", vcpu->id, entry);
+
+    return MINI_KVM_SUCCESS;
+}
+
+static void kvm_request_shutdown(Kvm *kvm);
+
+static MiniKVMError mini_kvm_handle_io(Kvm *kvm, struct kvm_run *kvm_run) {
+    uint8_t *data = (uint8_t *)kvm_run + kvm_run->io.data_offset;
+    bool out = kvm_run->io.direction == KVM_EXIT_IO_OUT;
+    uint16_t port = kvm_run->io.port;
+    char result[32];
+    uint32_t value = 0;
+    int32_t len = 0;
+
+    // string instructions repeat the access count times, data holds all the values
+    for (uint32_t i = 0; i < kvm_run->io.count; i++, data += kvm_run->io.size) {
+        if (port >= MINI_KVM_SERIAL_PORT && port < MINI_KVM_SERIAL_PORT + MINI_KVM_SERIAL_PORTS) {
+            mini_kvm_serial_io(&kvm->serial, port - MINI_KVM_SERIAL_PORT, out, data);
+            continue;
+        }
+
+        if (out && port == MINI_KVM_BENCH_NOP_PORT) {
+            continue;
+        } else if (out && port == MINI_KVM_BENCH_RESULT_PORT) {
+            memcpy(&value, data, kvm_run->io.size);
+            len = snprintf(result, sizeof(result), "bench result: %u\n", value);
+            if (len < 0 || write(STDOUT_FILENO, result, len) != len) {
+                WARN("failed to write bench result %u (%s)", value, strerror(errno));
+            }
+        } else if (out && port == MINI_KVM_BENCH_EXIT_PORT) {
+            INFO("guest requested the VM shutdown");
+            kvm_request_shutdown(kvm);
+        } else {
+            // nothing behind the port, reads float high and writes are dropped
+            TRACE("mini_kvm: unhandled %s on io port 0x%x", out ? "out" : "in", port);
+            if (!out) {
+                memset(data, 0xff, kvm_run->io.size);
+            }
         }
     }
 
-    return ret;
+    return MINI_KVM_SUCCESS;
 }
 
 MiniKVMError mini_kvm_start_vm(Kvm *kvm) {
@@ -324,81 +776,321 @@ MiniKVMError mini_kvm_start_vm(Kvm *kvm) {
         return MINI_KVM_INTERNAL_ERROR;
     }
 
+    INFO("starting running vm");
+    kvm->state = MINI_KVM_RUNNING;
     for (uint32_t vcpu_index = 0; vcpu_index < kvm->vcpus->len; vcpu_index++) {
         ret = mini_kvm_vcpu_run(kvm, vcpu_index);
         if (ret != MINI_KVM_SUCCESS) {
+            kvm->state = MINI_KVM_SHUTDOWN;
+            mini_kvm_kick_vcpus(kvm, MINI_KVM_REQ_SHUTDOWN);
             break;
         }
     }
 
-    INFO("starting running vm");
-    kvm->state = MINI_KVM_RUNNING;
     return ret;
 }
 
+// the signal mask applied during KVM_RUN is the thread mask without SIGVMKICK
+static MiniKVMError kvm_vcpu_setup_signal_mask(VCpu *vcpu) {
+    struct kvm_signal_mask *mask = NULL;
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+    sigset_t set;
+
+    pthread_sigmask(SIG_BLOCK, NULL, &set);
+    sigdelset(&set, SIGVMKICK);
+
+    // the kernel sigset is 64 bits wide, glibc sigset_t is larger but starts with the same bits
+    mask = calloc(1, sizeof(struct kvm_signal_mask) + sizeof(uint64_t));
+    if (mask == NULL) {
+        ERROR("failed to allocate vcpu %d signal mask", vcpu->id);
+        return MINI_KVM_FAILED_ALLOCATION;
+    }
+    mask->len = sizeof(uint64_t);
+    memcpy(mask->sigset, &set, sizeof(uint64_t));
+    if (ioctl(vcpu->fd, KVM_SET_SIGNAL_MASK, mask) < 0) {
+        ERROR("failed to set vcpu %d signal mask (%s)", vcpu->id, strerror(errno));
+        ret = MINI_KVM_FAILED_IOCTL;
+    }
+
+    free(mask);
+    return ret;
+}
+
+// consume pending kicks, otherwise the blocked signal stays pending and every KVM_RUN would
+// return EINTR straight away
+static void kvm_vcpu_eat_kicks() {
+    struct timespec timeout = {0};
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGVMKICK);
+    while (sigtimedwait(&set, NULL, &timeout) > 0) {
+    }
+}
+
+// publish the vcpu registers in its snapshot slot, must run on the vcpu thread. Right after
+// KVM_RUN the registers are copied from kvm_run when KVM syncs them, otherwise they are fetched.
+static void kvm_vcpu_publish(Kvm *kvm, VCpu *vcpu, bool after_run) {
+    VCpuSnapshot *snapshot = vcpu->snapshot;
+    uint64_t seq = atomic_load_explicit(&snapshot->seq, memory_order_relaxed);
+
+    if (!after_run || !kvm->sync_regs) {
+        if (ioctl(vcpu->fd, KVM_GET_REGS, &vcpu->regs) < 0 ||
+            ioctl(vcpu->fd, KVM_GET_SREGS, &vcpu->sregs) < 0) {
+            WARN("failed to get vcpu %d registers (%s)", vcpu->id, strerror(errno));
+            return;
+        }
+    }
+
+    atomic_store_explicit(&snapshot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    if (after_run && kvm->sync_regs) {
+        memcpy(&snapshot->regs, &vcpu->kvm_run->s.regs.regs, sizeof(struct kvm_regs));
+        memcpy(&snapshot->sregs, &vcpu->kvm_run->s.regs.sregs, sizeof(struct kvm_sregs));
+    } else {
+        memcpy(&snapshot->regs, &vcpu->regs, sizeof(struct kvm_regs));
+        memcpy(&snapshot->sregs, &vcpu->sregs, sizeof(struct kvm_sregs));
+    }
+    atomic_store_explicit(&snapshot->seq, seq + 2, memory_order_release);
+}
+
+// single writer counters, a relaxed load and store is enough and avoids a locked instruction
+static inline void kvm_stats_add(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline void kvm_stats_record(uint64_t *buckets, uint64_t *total, uint64_t ns) {
+    uint32_t bucket = (ns == 0) ? 0 : 63 - __builtin_clzl(ns);
+
+    bucket = (bucket >= MINI_KVM_STATS_BUCKETS) ? MINI_KVM_STATS_BUCKETS - 1 : bucket;
+    kvm_stats_add(&buckets[bucket], 1);
+    kvm_stats_add(total, ns);
+}
+
+// record an exit in the vcpu trace ring, io and mmio exits keep their address and access
+static inline void kvm_vcpu_trace(VCpu *vcpu, uint64_t entry_tsc, uint64_t exit_tsc, bool intr) {
+    struct kvm_run *run = vcpu->kvm_run;
+    uint16_t reason = intr ? KVM_EXIT_INTR : run->exit_reason, info = 0;
+    uint64_t addr = 0;
+
+    if (reason == KVM_EXIT_IO) {
+        addr = run->io.port;
+        info = run->io.size | ((run->io.direction == KVM_EXIT_IO_OUT) ? MINI_KVM_TRACE_WRITE : 0);
+    } else if (reason == KVM_EXIT_MMIO) {
+        addr = run->mmio.phys_addr;
+        info = run->mmio.len | (run->mmio.is_write ? MINI_KVM_TRACE_WRITE : 0);
+    }
+    mini_kvm_trace_record(vcpu->trace, entry_tsc, exit_tsc, reason, addr, info);
+}
+
+// read the tracing flag before KVM_RUN. The vcpu flag is set before the VM flag is read again, so
+// a session start that cleared the VM flag either sees the vcpu flag or the vcpu sees it cleared
+static inline bool kvm_vcpu_tracing(Kvm *kvm, VCpu *vcpu) {
+    if (!atomic_load_explicit(&kvm->tracing, memory_order_acquire)) {
+        // the previous exit is recorded, the ring can be reset. The vcpu is the only writer.
+        if (atomic_load_explicit(&vcpu->tracing, memory_order_relaxed)) {
+            atomic_store_explicit(&vcpu->tracing, false, memory_order_release);
+        }
+        return false;
+    }
+
+    atomic_store(&vcpu->tracing, true);
+    if (!atomic_load(&kvm->tracing)) {
+        atomic_store_explicit(&vcpu->tracing, false, memory_order_release);
+        return false;
+    }
+    return true;
+}
+
+// park the vcpu until the VM leaves the paused state, wake ups go through the kick eventfd
+static void kvm_vcpu_park(Kvm *kvm, VCpu *vcpu) {
+    uint64_t counter = 0;
+
+    kvm_vcpu_publish(kvm, vcpu, false);
+
+    pthread_mutex_lock(&kvm->pause_lock);
+    kvm->paused++;
+    pthread_cond_broadcast(&kvm->pause_cond);
+    pthread_mutex_unlock(&kvm->pause_lock);
+    TRACE("vcpu %d parked", vcpu->id);
+    MINI_KVM_PROBE(vcpu_park, vcpu->id);
+
+    while (kvm->state == MINI_KVM_PAUSED) {
+        if (read(vcpu->kick_fd, &counter, sizeof(uint64_t)) < 0 && errno != EINTR) {
+            ERROR("failed to wait on vcpu %d kick eventfd (%s)", vcpu->id, strerror(errno));
+            break;
+        }
+
+        if (atomic_fetch_and(&vcpu->requests, ~MINI_KVM_REQ_SNAPSHOT) & MINI_KVM_REQ_SNAPSHOT) {
+            kvm_vcpu_publish(kvm, vcpu, false);
+        }
+    }
+
+    pthread_mutex_lock(&kvm->pause_lock);
+    kvm->paused--;
+    pthread_mutex_unlock(&kvm->pause_lock);
+    TRACE("vcpu %d unparked", vcpu->id);
+    MINI_KVM_PROBE(vcpu_unpark, vcpu->id);
+}
+
+static void kvm_vcpu_handle_requests(Kvm *kvm, VCpu *vcpu) {
+    uint64_t requests = atomic_exchange(&vcpu->requests, 0);
+
+    if (requests & MINI_KVM_REQ_SHUTDOWN) {
+        return;
+    }
+
+    if (requests & MINI_KVM_REQ_SNAPSHOT) {
+        kvm_vcpu_publish(kvm, vcpu, false);
+    }
+
+    if ((requests & MINI_KVM_REQ_PAUSE) && kvm->state == MINI_KVM_PAUSED) {
+        kvm_vcpu_park(kvm, vcpu);
+    }
+}
+
+static void kvm_request_shutdown(Kvm *kvm) {
+    uint64_t counter = 1;
+
+    kvm->state = MINI_KVM_SHUTDOWN;
+    mini_kvm_kick_vcpus(kvm, MINI_KVM_REQ_SHUTDOWN);
+    if (write(kvm->event_fd, &counter, sizeof(uint64_t)) < 0) {
+        WARN("unable to signal the VM shutdown (%s)", strerror(errno));
+    }
+
+    // a pause request may be waiting for this vcpu to park
+    pthread_mutex_lock(&kvm->pause_lock);
+    pthread_cond_broadcast(&kvm->pause_cond);
+    pthread_mutex_unlock(&kvm->pause_lock);
+}
+
 static void *kvm_vcpu_thread_run(void *args) {
     struct VcpuRunArgs *vcpu_args = (struct VcpuRunArgs *)args;
     Kvm *kvm = vcpu_args->kvm;
     VCpu *vcpu = vcpu_args->vcpu;
-    MiniKVMError ret = 0;
+    VCpuStats *stats = vcpu->stats;
+    uint64_t entry_ns = 0, exit_ns = 0, entry_tsc = 0, exit_tsc = 0;
+    uint32_t exit_reason = 0, exit_index = 0;
+    bool tracing = false, started = false;
+    int32_t ret = 0;
 
-    signal(SIGVMPAUSE, mini_kvm_vcpu_signal_handler);
-    signal(SIGVMRESUME, mini_kvm_vcpu_signal_handler);
-    signal(SIGVMSHUTDOWN, mini_kvm_vcpu_signal_handler);
+    free(vcpu_args);
+    if (kvm_vcpu_setup_signal_mask(vcpu) != MINI_KVM_SUCCESS) {
+        kvm_request_shutdown(kvm);
+        return NULL;
+    }
 
+    kvm_vcpu_publish(kvm, vcpu, false);
     vcpu->running = 1;
     while (kvm->state != MINI_KVM_SHUTDOWN) {
+        if (atomic_load(&vcpu->requests) != 0) {
+            // a parked vcpu does not write in its ring
+            atomic_store_explicit(&vcpu->tracing, false, memory_order_release);
+            kvm_vcpu_handle_requests(kvm, vcpu);
+            continue;
+        }
+
+        // the ring is allocated before tracing is enabled
+        tracing = kvm_vcpu_tracing(kvm, vcpu);
+        entry_tsc = tracing ? mini_kvm_rdtsc() : 0;
+        if (!started) {
+            started = true;
+            if (mini_kvm_startup_first_run(&kvm->startup) && kvm->profile_startup) {
+                mini_kvm_startup_print(&kvm->startup, stderr);
+            }
+        }
+        entry_ns = mini_kvm_now_ns();
+        MINI_KVM_PROBE(run_entry, vcpu->id);
+        ret = ioctl(vcpu->fd, KVM_RUN, 0);
+        exit_ns = mini_kvm_now_ns();
+        exit_tsc = tracing ? mini_kvm_rdtsc() : 0;
+        kvm_stats_record(stats->run_ns, &stats->run_total_ns, exit_ns - entry_ns);
+        if (kvm->sync_regs) {
+            kvm_vcpu_publish(kvm, vcpu, true);
+        }
 
-        if (kvm->state == MINI_KVM_PAUSED) {
-            while (kvm->paused) {
-                pthread_cond_wait(&kvm->pause_cond, &kvm->pause_lock);
+        if (ret < 0 && (errno == EINTR || errno == EAGAIN)) {
+            MINI_KVM_PROBE(run_exit, vcpu->id, KVM_EXIT_INTR, ret);
+            kvm_vcpu_eat_kicks();
+            kvm_stats_add(&stats->exits[KVM_EXIT_INTR], 1);
+            kvm_stats_record(stats->handle_ns, &stats->handle_total_ns,
+                             mini_kvm_now_ns() - exit_ns);
+            if (tracing) {
+                kvm_vcpu_trace(vcpu, entry_tsc, exit_tsc, true);
             }
             continue;
         }
 
-        ret = ioctl(vcpu->fd, KVM_RUN);
         if (ret < 0) {
             ERROR("failed to run VM (%s)", strerror(errno));
-            kvm->state = MINI_KVM_SHUTDOWN;
+            kvm_request_shutdown(kvm);
             break;
         }
 
-        int32_t exit_reason = vcpu->kvm_run->exit_reason;
+        exit_reason = vcpu->kvm_run->exit_reason;
+        MINI_KVM_PROBE(run_exit, vcpu->id, exit_reason, ret);
+        exit_index = (exit_reason < MINI_KVM_STATS_EXIT_REASONS) ? exit_reason
+                                                                 : MINI_KVM_STATS_EXIT_REASONS - 1;
+        kvm_stats_add(&stats->exits[exit_index], 1);
         switch (exit_reason) {
         case KVM_EXIT_HLT:
+            MINI_KVM_PROBE(exit_hlt, vcpu->id);
             TRACE("KVM: exit hlt");
-            kvm->state = MINI_KVM_SHUTDOWN;
+            kvm_request_shutdown(kvm);
             break;
         case KVM_EXIT_IO:
-            if (mini_kvm_handle_io(vcpu->kvm_run) != MINI_KVM_SUCCESS) {
-                kvm->state = MINI_KVM_SHUTDOWN;
+            MINI_KVM_PROBE(exit_io, vcpu->id, vcpu->kvm_run->io.port, vcpu->kvm_run->io.size,
+                           vcpu->kvm_run->io.direction, vcpu->kvm_run->io.count);
+            if (mini_kvm_handle_io(kvm, vcpu->kvm_run) != MINI_KVM_SUCCESS) {
+                kvm_request_shutdown(kvm);
             }
             break;
         case KVM_EXIT_SHUTDOWN:
+            MINI_KVM_PROBE(exit_shutdown, vcpu->id);
             ERROR("KVM: exit shutdown");
-            kvm->state = MINI_KVM_SHUTDOWN;
+            kvm_request_shutdown(kvm);
             break;
         case KVM_EXIT_INTERNAL_ERROR:
+            MINI_KVM_PROBE(exit_internal_error, vcpu->id, vcpu->kvm_run->internal.suberror);
             ERROR("KVM: exit internal error");
-            kvm->state = MINI_KVM_SHUTDOWN;
+            kvm_request_shutdown(kvm);
             ioctl(vcpu->fd, KVM_GET_REGS, &vcpu->regs);
             mini_kvm_print_regs(&vcpu->regs);
             break;
+        case KVM_EXIT_MMIO:
+            // no device is memory mapped, writes are dropped and reads return zeros
+            MINI_KVM_PROBE(exit_mmio, vcpu->id, vcpu->kvm_run->mmio.phys_addr,
+                           vcpu->kvm_run->mmio.len, vcpu->kvm_run->mmio.is_write);
+            if (!vcpu->kvm_run->mmio.is_write) {
+                memset(vcpu->kvm_run->mmio.data, 0, sizeof(vcpu->kvm_run->mmio.data));
+            }
+            break;
         case KVM_EXIT_INTR:
+            MINI_KVM_PROBE(exit_intr, vcpu->id);
             TRACE("KVM: exit INTR");
             break;
         case KVM_EXIT_FAIL_ENTRY:
+            MINI_KVM_PROBE(exit_fail_entry, vcpu->id,
+                           vcpu->kvm_run->fail_entry.hardware_entry_failure_reason);
             ERROR("KVM: exit failed entry");
-            kvm->state = MINI_KVM_SHUTDOWN;
+            kvm_request_shutdown(kvm);
             break;
         case KVM_EXIT_UNKNOWN:
+            MINI_KVM_PROBE(exit_unknown, vcpu->id, vcpu->kvm_run->hw.hardware_exit_reason);
             TRACE("KVM: exit unknown");
             break;
         default:
-            TRACE("KVM: exit unhandled %d", exit_reason);
+            MINI_KVM_PROBE(exit_other, vcpu->id, exit_reason);
+            TRACE("KVM: exit unhandled %u", exit_reason);
             break;
         }
+        kvm_stats_record(stats->handle_ns, &stats->handle_total_ns, mini_kvm_now_ns() - exit_ns);
+        if (tracing) {
+            kvm_vcpu_trace(vcpu, entry_tsc, exit_tsc, false);
+        }
     }
+    atomic_store_explicit(&vcpu->tracing, false, memory_order_release);
+    vcpu->running = 0;
 
     return NULL;
 }
@@ -419,25 +1111,135 @@ MiniKVMError mini_kvm_vcpu_run(Kvm *kvm, int32_t id) {
     return ret;
 }
 
-void mini_kvm_send_sig(Kvm *kvm, int32_t signum) {
-    if (kvm->vcpus->len == 0) {
-        return;
+void mini_kvm_vcpu_kick(VCpu *vcpu, uint64_t requests) {
+    uint64_t counter = 1;
+
+    atomic_fetch_or(&vcpu->requests, requests);
+    // wake the vcpu if it is parked and force it out of guest mode if it is in KVM_RUN
+    if (write(vcpu->kick_fd, &counter, sizeof(uint64_t)) < 0) {
+        WARN("unable to kick vcpu %d (%s)", vcpu->id, strerror(errno));
+    }
+    if (vcpu->thread) {
+        pthread_kill(vcpu->thread, SIGVMKICK);
+    }
+}
+
+void mini_kvm_vcpu_snapshot(VCpu *vcpu, struct kvm_regs *regs, struct kvm_sregs *sregs) {
+    VCpuSnapshot *snapshot = vcpu->snapshot;
+    uint64_t seq = atomic_load_explicit(&snapshot->seq, memory_order_acquire);
+    uint64_t deadline = mini_kvm_now_ns() + MINI_KVM_SNAPSHOT_TIMEOUT_NS;
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 10000};
+
+    // wait for an update started after the request, an update in progress may be stale. The last
+    // published snapshot is returned on timeout.
+    uint64_t target = seq + ((seq & 1) ? 3 : 2);
+    if (vcpu->running) {
+        mini_kvm_vcpu_kick(vcpu, MINI_KVM_REQ_SNAPSHOT);
+        while (atomic_load_explicit(&snapshot->seq, memory_order_acquire) < target &&
+               vcpu->running && mini_kvm_now_ns() < deadline) {
+            nanosleep(&delay, NULL);
+        }
+    }
+
+    do {
+        seq = atomic_load_explicit(&snapshot->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(regs, &snapshot->regs, sizeof(struct kvm_regs));
+        memcpy(sregs, &snapshot->sregs, sizeof(struct kvm_sregs));
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || atomic_load_explicit(&snapshot->seq, memory_order_relaxed) != seq);
+}
+
+void mini_kvm_vcpu_stats(Kvm *kvm, VCpu *vcpu, VCpuStats *stats, bool reset) {
+    uint64_t *current = (uint64_t *)vcpu->stats, *base = (uint64_t *)&kvm->stats_base[vcpu->id];
+    uint64_t *out = (uint64_t *)stats, value = 0;
+
+    // the vcpu counters are never cleared, a reset moves the base the stats are reported from
+    for (size_t i = 0; i < sizeof(VCpuStats) / sizeof(uint64_t); i++) {
+        value = __atomic_load_n(&current[i], __ATOMIC_RELAXED);
+        out[i] = value - base[i];
+        base[i] = reset ? value : base[i];
     }
+}
 
+// a new session resets the rings, wait for the vcpus still recording the exit of a run started
+// during the previous session. They are kicked so a vcpu waiting in KVM_RUN records it now.
+static void kvm_trace_quiesce(Kvm *kvm) {
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 10000};
+
+    atomic_store(&kvm->tracing, false);
+    mini_kvm_kick_vcpus(kvm, 0);
+    for (uint64_t i = 0; i < kvm->vcpus->len; i++) {
+        VCpu *vcpu = &kvm->vcpus->tab[i];
+
+        while (atomic_load(&vcpu->tracing) && vcpu->running) {
+            nanosleep(&delay, NULL);
+        }
+    }
+}
+
+MiniKVMError mini_kvm_trace_start(Kvm *kvm) {
+    kvm_trace_quiesce(kvm);
+    for (uint64_t i = 0; i < kvm->vcpus->len; i++) {
+        VCpu *vcpu = &kvm->vcpus->tab[i];
+
+        if (vcpu->trace == NULL && (vcpu->trace = mini_kvm_trace_ring_alloc()) == NULL) {
+            ERROR("failed to allocate vcpu %d trace ring", vcpu->id);
+            return MINI_KVM_FAILED_ALLOCATION;
+        }
+        mini_kvm_trace_ring_reset(vcpu->trace);
+    }
+    atomic_store_explicit(&kvm->tracing, true, memory_order_release);
+
+    // vcpus check the flag before KVM_RUN, kick them so their current run is not missed
+    mini_kvm_kick_vcpus(kvm, 0);
+
+    return MINI_KVM_SUCCESS;
+}
+
+void mini_kvm_trace_stop(Kvm *kvm) { atomic_store(&kvm->tracing, false); }
+
+void mini_kvm_kick_vcpus(Kvm *kvm, uint64_t requests) {
     for (uint32_t i = 0; i < kvm->vcpus->len; i++) {
-        pthread_kill(kvm->vcpus->tab[i].thread, signum);
+        mini_kvm_vcpu_kick(&kvm->vcpus->tab[i], requests);
     }
 }
 
-void mini_kvm_pause_vm(Kvm *kvm) {
+// pause the VM and wait for every vcpu to be parked, only a running VM can be paused so a
+// shutdown in progress is never overwritten
+MiniKVMError mini_kvm_pause_vm(Kvm *kvm) {
+    VMState expected = MINI_KVM_RUNNING;
+
+    if (!atomic_compare_exchange_strong(&kvm->state, &expected, MINI_KVM_PAUSED)) {
+        return MINI_KVM_STATUS_CMD_VM_NOT_RUNNING;
+    }
+    MINI_KVM_PROBE(vm_pause, kvm->vcpus->len);
+    mini_kvm_kick_vcpus(kvm, MINI_KVM_REQ_PAUSE);
+
     pthread_mutex_lock(&kvm->pause_lock);
-    kvm->paused = 1;
+    while (kvm->paused < kvm->vcpus->len && kvm->state == MINI_KVM_PAUSED) {
+        pthread_cond_wait(&kvm->pause_cond, &kvm->pause_lock);
+    }
+    pthread_mutex_unlock(&kvm->pause_lock);
+    MINI_KVM_PROBE(vm_paused, kvm->paused);
+
+    return MINI_KVM_SUCCESS;
 }
 
-void mini_kvm_resume_vm(Kvm *kvm) {
-    kvm->paused = 0;
-    pthread_cond_signal(&kvm->pause_cond);
-    pthread_mutex_unlock(&kvm->pause_lock);
+MiniKVMError mini_kvm_resume_vm(Kvm *kvm) {
+    VMState expected = MINI_KVM_PAUSED;
+
+    if (!atomic_compare_exchange_strong(&kvm->state, &expected, MINI_KVM_RUNNING)) {
+        return MINI_KVM_STATUS_CMD_VM_NOT_PAUSED;
+    }
+    MINI_KVM_PROBE(vm_resume, kvm->vcpus->len);
+    mini_kvm_kick_vcpus(kvm, 0);
+
+    return MINI_KVM_SUCCESS;
 }
 
 void mini_kvm_clean_kvm(Kvm *kvm) {
@@ -447,8 +1249,7 @@ void mini_kvm_clean_kvm(Kvm *kvm) {
             if (vcpu.thread) {
                 pthread_join(kvm->vcpus->tab[i].thread, NULL);
             }
-            munmap(kvm->vcpus->tab[i].kvm_run, kvm->vcpus->tab[i].mem_region_size);
-            close(kvm->vcpus->tab[i].fd);
+            kvm_release_vcpu(&kvm->vcpus->tab[i]);
         }
         vec_free(kvm->vcpus);
     }
@@ -463,6 +1264,13 @@ void mini_kvm_clean_kvm(Kvm *kvm) {
         munmap(kvm->mem, kvm->mem_size);
     }
 
+    mini_kvm_binstats_close(&kvm->binstats);
+    free(kvm->snapshots);
+    free(kvm->stats);
+    free(kvm->stats_base);
+    free(kvm->cpuid);
+    mini_kvm_irq_clean(&kvm->irq);
+    close(kvm->event_fd);
     close(kvm->kvm_fd);
     close(kvm->vm_fd);
     free(kvm);
@@ -470,6 +1278,11 @@ void mini_kvm_clean_kvm(Kvm *kvm) {
 
 const char *mini_kvm_vm_state_str(VMState state) { return VM_STATE_STR[state]; }
 
+const char *mini_kvm_exit_reason_str(uint32_t reason) {
+    reason = (reason < MINI_KVM_STATS_EXIT_REASONS) ? reason : MINI_KVM_STATS_EXIT_REASONS - 1;
+    return (EXIT_REASON_STR[reason] != NULL) ? EXIT_REASON_STR[reason] : "reserved";
+}
+
 void mini_kvm_print_regs(struct kvm_regs *regs) {
     fprintf(stdout, "rax 0x%016llx\trbx 0x%016llx\trcx 0x%016llx\trdx 0x%016llx\n", regs->rax,
             regs->rbx, regs->rcx, regs->rdx);
@@ -487,35 +1300,31 @@ void mini_kvm_print_sregs(struct kvm_sregs *sregs) {
             sregs->cr2, sregs->cr3, sregs->cr4);
 }
 
-void mini_kvm_dump_mem(Kvm *kvm, int32_t out, uint64_t start, uint64_t end, uint32_t word_size,
-                       uint32_t bytes_per_line) {
-    uint32_t nb_lines = 0;
-    uint8_t *start_ptr = NULL;
+static void kvm_print_histogram(const char *name, uint64_t *buckets, uint64_t total_ns) {
+    uint64_t count = 0;
 
-    // align start and end to word_size
-    start = start - start % word_size;
-    end = (end % word_size == 0) ? end : end - end % word_size + word_size;
-    start_ptr = ((uint8_t *)kvm->mem + start);
-
-    end = (kvm->mem_size < (int64_t)end) ? (uint64_t)kvm->mem_size : end;
-    nb_lines = (end - start) / (bytes_per_line) + ((end - start) % (bytes_per_line) != 0);
-
-    dprintf(out, "mem dump: @%lu -> @%lu\n", start, end);
-    for (uint32_t line = 0; line < nb_lines; line++) {
-        dprintf(out, "0x%08lx\t", start + line * (bytes_per_line));
-
-        for (uint32_t word = 0; word < bytes_per_line; word += word_size) {
-            uint32_t offset = word + bytes_per_line * line;
-            if (offset + start > end) {
-                break;
-            }
+    for (uint32_t i = 0; i < MINI_KVM_STATS_BUCKETS; i++) {
+        count += buckets[i];
+    }
 
-            for (int32_t word_offset = word_size - 1; word_offset >= 0; word_offset--) {
-                dprintf(out, "%02hx", start_ptr[offset + word_offset]);
-            }
-            dprintf(out, " ");
+    fprintf(stdout, "%s: %lu samples, mean %lu ns\n", name, count,
+            (count == 0) ? 0 : total_ns / count);
+    for (uint32_t i = 0; i < MINI_KVM_STATS_BUCKETS; i++) {
+        if (buckets[i] == 0) {
+            continue;
         }
+        fprintf(stdout, "  [%10lu, %10lu) ns %12lu %6.2f%%\n", 1UL << i, 1UL << (i + 1),
+                buckets[i], 100.0 * buckets[i] / count);
+    }
+}
 
-        dprintf(out, "\n");
+void mini_kvm_print_stats(VCpuStats *stats) {
+    fprintf(stdout, "exits:\n");
+    for (uint32_t i = 0; i < MINI_KVM_STATS_EXIT_REASONS; i++) {
+        if (stats->exits[i] != 0) {
+            fprintf(stdout, "  %-16s %12lu\n", mini_kvm_exit_reason_str(i), stats->exits[i]);
+        }
     }
+    kvm_print_histogram("time in guest", stats->run_ns, stats->run_total_ns);
+    kvm_print_histogram("time in exit handling", stats->handle_ns, stats->handle_total_ns);
 }
@@ -5,16 +5,52 @@
 #include <linux/kvm.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 
 #include "core/containers.h"
 #include "core/errors.h"
+#include "kvm/binstats.h"
+#include "kvm/irq.h"
+#include "kvm/serial.h"
+#include "kvm/startup.h"
+#include "kvm/trace.h"
 
 typedef enum VMState { MINI_KVM_PAUSED = 0, MINI_KVM_RUNNING, MINI_KVM_SHUTDOWN } VMState;
 
-#define SIGVMPAUSE (SIGRTMIN + 0)
-#define SIGVMRESUME (SIGRTMIN + 1)
-#define SIGVMSHUTDOWN (SIGRTMIN + 2)
+// signal used to kick a vcpu thread out of KVM_RUN, it is blocked outside of guest mode and only
+// unblocked inside KVM_RUN (see KVM_SET_SIGNAL_MASK)
+#define SIGVMKICK (SIGRTMIN + 0)
+
+// vcpu requests, posted in VCpu.requests and handled by the vcpu thread outside of guest mode
+#define MINI_KVM_REQ_PAUSE (1UL << 0)
+#define MINI_KVM_REQ_SHUTDOWN (1UL << 1)
+#define MINI_KVM_REQ_SNAPSHOT (1UL << 2)
+
+// wait at most this long for a vcpu to publish a fresh snapshot
+#define MINI_KVM_SNAPSHOT_TIMEOUT_NS (100 * 1000 * 1000UL)
+
+// last register state published by a vcpu thread. The vcpu thread is the only writer, readers use
+// the seqlock protocol: seq is odd while an update is in progress and a copy is consistent if seq
+// did not change while it was made. Slots are cache line aligned so vcpus never share lines.
+typedef struct VCpuSnapshot {
+    _Atomic uint64_t seq;
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+} __attribute__((aligned(64))) VCpuSnapshot;
+
+#define MINI_KVM_STATS_EXIT_REASONS 40 // KVM_EXIT_* values, larger ones share the last counter
+#define MINI_KVM_STATS_BUCKETS 32      // bucket i counts durations in [2^i, 2^(i+1)) ns
+
+// exit counters and latency histograms of a vcpu. Only the vcpu thread writes them (relaxed
+// atomics, no locked instruction), readers may see a slightly stale but never torn value.
+typedef struct VCpuStats {
+    uint64_t exits[MINI_KVM_STATS_EXIT_REASONS];
+    uint64_t run_ns[MINI_KVM_STATS_BUCKETS];    // time spent in KVM_RUN
+    uint64_t handle_ns[MINI_KVM_STATS_BUCKETS]; // time spent handling the exit
+    uint64_t run_total_ns;
+    uint64_t handle_total_ns;
+} __attribute__((aligned(64))) VCpuStats;
 
 typedef struct VCpu {
     int32_t fd;
@@ -27,7 +63,17 @@ typedef struct VCpu {
     struct kvm_sregs sregs;
 
     pthread_t thread;
-    int32_t running;
+    _Atomic int32_t running; // set by the vcpu thread, polled by the control threads
+
+    // pending MINI_KVM_REQ_* bits and eventfd used to wake the vcpu when it is parked
+    _Atomic uint64_t requests;
+    int32_t kick_fd;
+
+    VCpuSnapshot *snapshot;
+    VCpuStats *stats;
+    MiniKvmBinStats binstats;
+    MiniKvmTraceRing *trace; // allocated by the first trace session
+    atomic_bool tracing;     // the exit of the current run may still be recorded in the ring
 } VCpu;
 
 typedef struct Kvm {
@@ -42,13 +88,28 @@ typedef struct Kvm {
     uint64_t *mem;
     struct kvm_userspace_memory_region u_region;
     struct kvm_pit_config pit_config;
+    MiniKvmIrq irq;
+    MiniKvmBinStats binstats;
+    atomic_bool tracing; // vcpus record their exits in their trace ring
 
     vec_VCpu *vcpus;
-    pthread_mutex_t lock;
+    VCpuSnapshot *snapshots;  // MINI_KVM_MAX_VCPUS slots
+    bool sync_regs;           // publish the registers synced in kvm_run after each exit, opt-in
+    int32_t vcpu_mmap_size;   // size of the kvm_run mapping of a vcpu
+    struct kvm_cpuid2 *cpuid; // supported CPUID, set on every vcpu
+    uint32_t tsc_khz;         // guest TSC frequency, 0 keeps the host frequency
+    uint64_t rsdp_addr;       // ACPI root pointer given to Linux kernels, 0 without ACPI tables
+    VCpuStats *stats;         // MINI_KVM_MAX_VCPUS slots, written by the vcpu threads
+    VCpuStats *stats_base;    // value of the stats at the last reset, written by the control thread
+    pthread_rwlock_t lock; // held for writing by commands that change the VM state
     int32_t sock;
+    int32_t event_fd; // signaled by the vcpus to wake the main loop (shutdown, hlt, ...)
+    MiniKvmStartupProfile startup;
+    MiniKvmSerial serial;
+    bool profile_startup; // print the startup profile when the first vcpu enters KVM_RUN
 
-    VMState state;
-    uint64_t paused;
+    _Atomic VMState state; // pause and resume only move it from RUNNING or PAUSED
+    uint64_t paused; // number of parked vcpus, protected by pause_lock
     pthread_cond_t pause_cond;
     pthread_mutex_t pause_lock;
 } Kvm;
@@ -56,19 +117,38 @@ typedef struct Kvm {
 MiniKVMError mini_kvm_setup_kvm(Kvm *kvm, uint64_t mem_size);
 void mini_kvm_clean_kvm(Kvm *kvm);
 MiniKVMError mini_kvm_add_vcpu(Kvm *kvm);
+// create count vcpus in parallel, either all of them are added or none
+MiniKVMError mini_kvm_add_vcpus(Kvm *kvm, uint32_t count);
 MiniKVMError mini_kvm_setup_vcpu(Kvm *kvm, VCpu *vcpu, uint64_t start_addr);
 MiniKVMError mini_kvm_configure_paging(Kvm *kvm);
+// entry of the CPUID table set on the vcpus, NULL if the leaf is not reported
+struct kvm_cpuid_entry2 *mini_kvm_find_cpuid(Kvm *kvm, uint32_t function, uint32_t index);
+// set the address where the first vcpu starts executing, rsi holds boot_params for Linux kernels
+MiniKVMError mini_kvm_set_entry(Kvm *kvm, uint64_t entry, uint64_t boot_params);
+// start the first vcpu in 32 bits protected mode without paging, as the PVH boot ABI requires
+MiniKVMError mini_kvm_set_entry_32(Kvm *kvm, uint32_t entry, uint32_t start_info);
 MiniKVMError mini_kvm_start_vm(Kvm *vm);
 MiniKVMError mini_kvm_vcpu_run(Kvm *kvm, int32_t id);
 
-void mini_kvm_send_sig(Kvm *kvm, int32_t signum);
-void mini_kvm_pause_vm(Kvm *kvm);
-void mini_kvm_resume_vm(Kvm *kvm);
+void mini_kvm_vcpu_kick(VCpu *vcpu, uint64_t requests);
+void mini_kvm_kick_vcpus(Kvm *kvm, uint64_t requests);
+MiniKVMError mini_kvm_pause_vm(Kvm *kvm);
+MiniKVMError mini_kvm_resume_vm(Kvm *kvm);
+// copy a consistent snapshot of the vcpu registers, running vcpus are asked to publish a fresh one
+void mini_kvm_vcpu_snapshot(VCpu *vcpu, struct kvm_regs *regs, struct kvm_sregs *sregs);
+
+// rings are kept once allocated, a vcpu may still be recording its last exit when tracing stops.
+// Starting a session, even while one is active, waits for that exit before resetting the rings.
+MiniKVMError mini_kvm_trace_start(Kvm *kvm);
+void mini_kvm_trace_stop(Kvm *kvm);
+
+// copy the vcpu stats since the last reset, reset also starts a new measure period
+void mini_kvm_vcpu_stats(Kvm *kvm, VCpu *vcpu, VCpuStats *stats, bool reset);
 
 const char *mini_kvm_vm_state_str(VMState state);
+const char *mini_kvm_exit_reason_str(uint32_t reason);
 void mini_kvm_print_regs(struct kvm_regs *regs);
 void mini_kvm_print_sregs(struct kvm_sregs *sregs);
-void mini_kvm_dump_mem(Kvm *kvm, int32_t out, uint64_t start, uint64_t end, uint32_t word_size,
-                       uint32_t byte_per_line);
+void mini_kvm_print_stats(VCpuStats *stats);
 
 #endif /* MINI_KVM_STRUCT */
@@ -0,0 +1,449 @@
+#include "loader.h"
+
+#include <asm/bootparam.h>
+#include <elf.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "core/constants.h"
+#include "core/logger.h"
+#include "kvm/acpi.h"
+
+#define ELF_MAX_PHDRS 64
+
+#define LINUX_SETUP_HEADER_OFFSET 0x1f1
+#define LINUX_SETUP_HEADER_END_BASE 0x202 // the jump at 0x200 lands after the header
+#define LINUX_HEADER_MAGIC 0x53726448    // "HdrS"
+#define LINUX_BOOT_FLAG 0xaa55
+#define LINUX_MIN_VERSION 0x20c // first version with xloadflags
+#define LINUX_ENTRY_64_OFFSET 0x200
+#define LINUX_LOADER_UNDEFINED 0xff
+#define LINUX_E820_RAM 1
+#define LINUX_RAM_RANGES 4 // gaps between the reserved ranges
+#define LINUX_CMDLINE_SIZE 2048 // COMMAND_LINE_SIZE, PVH kernels do not report it
+
+#define XEN_ELFNOTE_PHYS32_ENTRY 18
+#define PVH_MAX_NOTES_SIZE 0x10000
+
+typedef struct LoaderRange {
+    uint64_t start;
+    uint64_t end;
+    const char *name;
+} LoaderRange;
+
+// guest memory that is not RAM for the kernel, in address order: what the VMM fills before the
+// kernel is loaded, the legacy hole and the pages KVM and the in-kernel APICs take over. Kernel
+// segments must not overlap it and Linux does not get it in its memory map.
+static const LoaderRange RESERVED_RANGES[] = {
+    {0, BOOTLOADER_ADDR, "boot GDT and page tables"},
+    {BOOT_PD_ADDR, BOOT_PD_ADDR + BOOT_PD_MAX * PAGE_SIZE, "boot page directories"},
+    {LINUX_EBDA_ADDR, ACPI_RSDP_ADDR, "EBDA and legacy video and ROM area"},
+    {ACPI_RSDP_ADDR, MPTABLE_ADDR, "ACPI tables"},
+    {MPTABLE_ADDR, LINUX_KERNEL_ADDR, "MP table"},
+    {IOAPIC_ADDR, 1UL << 32, "IOAPIC, local APIC and KVM TSS"},
+};
+#define NB_RESERVED_RANGES (sizeof(RESERVED_RANGES) / sizeof(RESERVED_RANGES[0]))
+
+static MiniKVMError loader_read(int32_t fd, uint8_t *dst, uint64_t offset, uint64_t len) {
+    ssize_t ret = 0;
+
+    for (uint64_t done = 0; done < len; done += ret) {
+        ret = pread(fd, dst + done, len - done, offset + done);
+        if (ret <= 0) {
+            ERROR("unable to read kernel image (%s)", ret < 0 ? strerror(errno) : "eof");
+            return MINI_KVM_INTERNAL_ERROR;
+        }
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+MiniKVMError mini_kvm_load_file(Kvm *kvm, int32_t fd, uint64_t offset, uint64_t len,
+                                uint64_t addr) {
+    uint8_t *dst = (uint8_t *)kvm->mem + addr;
+    uint64_t head = (PAGE_SIZE - addr % PAGE_SIZE) % PAGE_SIZE, map_len = 0;
+
+    if (addr > (uint64_t)kvm->mem_size || len > kvm->mem_size - addr) {
+        ERROR("%lu bytes do not fit in guest memory at 0x%lx", len, addr);
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    head = (head > len) ? len : head;
+    map_len = (len - head) & ~(PAGE_SIZE - 1UL);
+    if (map_len == 0 || offset % PAGE_SIZE != addr % PAGE_SIZE) {
+        return loader_read(fd, dst, offset, len);
+    }
+
+    if (mmap(dst + head, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+             offset + head) == MAP_FAILED) {
+        WARN("unable to map kernel image (%s), copying it", strerror(errno));
+        return loader_read(fd, dst, offset, len);
+    }
+
+    if (loader_read(fd, dst, offset, head) != MINI_KVM_SUCCESS) {
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+    return loader_read(fd, dst + head + map_len, offset + head + map_len, len - head - map_len);
+}
+
+bool mini_kvm_is_elf(int32_t fd) {
+    uint8_t ident[SELFMAG];
+
+    return pread(fd, ident, SELFMAG, 0) == SELFMAG && memcmp(ident, ELFMAG, SELFMAG) == 0;
+}
+
+static MiniKVMError elf_check_header(Elf64_Ehdr *ehdr, uint64_t size) {
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+        ehdr->e_machine != EM_X86_64) {
+        ERROR("kernel is not a little endian x86_64 ELF64 image");
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    if (ehdr->e_phentsize != sizeof(Elf64_Phdr) || ehdr->e_phnum == 0 ||
+        ehdr->e_phnum > ELF_MAX_PHDRS || ehdr->e_phoff > size ||
+        ehdr->e_phnum * sizeof(Elf64_Phdr) > size - ehdr->e_phoff) {
+        ERROR("invalid ELF program headers");
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+static MiniKVMError elf_check_segment(Kvm *kvm, Elf64_Phdr *phdr, uint64_t size) {
+    if (phdr->p_filesz > phdr->p_memsz || phdr->p_offset > size ||
+        phdr->p_filesz > size - phdr->p_offset) {
+        ERROR("invalid ELF segment at 0x%lx", phdr->p_paddr);
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    if (phdr->p_paddr > (uint64_t)kvm->mem_size || phdr->p_memsz > kvm->mem_size - phdr->p_paddr) {
+        ERROR("ELF segment 0x%lx-0x%lx is outside of guest memory [0, 0x%lx)", phdr->p_paddr,
+              phdr->p_paddr + phdr->p_memsz, kvm->mem_size);
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    // the segments are copied last, they would silently overwrite the tables written before them
+    for (uint32_t i = 0; i < NB_RESERVED_RANGES; i++) {
+        if (phdr->p_paddr < RESERVED_RANGES[i].end &&
+            phdr->p_paddr + phdr->p_memsz > RESERVED_RANGES[i].start) {
+            ERROR("ELF segment 0x%lx-0x%lx overlaps the %s at 0x%lx-0x%lx", phdr->p_paddr,
+                  phdr->p_paddr + phdr->p_memsz, RESERVED_RANGES[i].name,
+                  RESERVED_RANGES[i].start, RESERVED_RANGES[i].end);
+            return MINI_KVM_INTERNAL_ERROR;
+        }
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+static MiniKVMError elf_read_headers(int32_t fd, uint64_t size, Elf64_Ehdr *ehdr,
+                                     Elf64_Phdr *phdrs) {
+    if (size < sizeof(Elf64_Ehdr) ||
+        loader_read(fd, (uint8_t *)ehdr, 0, sizeof(Elf64_Ehdr)) != MINI_KVM_SUCCESS ||
+        elf_check_header(ehdr, size) != MINI_KVM_SUCCESS) {
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    return loader_read(fd, (uint8_t *)phdrs, ehdr->e_phoff, ehdr->e_phnum * sizeof(Elf64_Phdr));
+}
+
+MiniKVMError mini_kvm_load_elf(Kvm *kvm, int32_t fd, uint64_t size, uint64_t *entry) {
+    Elf64_Phdr phdrs[ELF_MAX_PHDRS];
+    Elf64_Ehdr ehdr;
+    bool entry_found = false;
+
+    if (elf_read_headers(fd, size, &ehdr, phdrs) != MINI_KVM_SUCCESS) {
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    for (uint32_t i = 0; i < ehdr.e_phnum; i++) {
+        if (phdrs[i].p_type != PT_LOAD || phdrs[i].p_memsz == 0) {
+            continue;
+        }
+
+        if (elf_check_segment(kvm, &phdrs[i], size) != MINI_KVM_SUCCESS ||
+            mini_kvm_load_file(kvm, fd, phdrs[i].p_offset, phdrs[i].p_filesz, phdrs[i].p_paddr) !=
+                MINI_KVM_SUCCESS) {
+            return MINI_KVM_INTERNAL_ERROR;
+        }
+        INFO("ELF segment loaded at 0x%lx (%lu bytes, %lu in file)", phdrs[i].p_paddr,
+             phdrs[i].p_memsz, phdrs[i].p_filesz);
+
+        // the guest starts with an identity mapping, the entry point is run at its physical address
+        if (ehdr.e_entry >= phdrs[i].p_vaddr &&
+            ehdr.e_entry - phdrs[i].p_vaddr < phdrs[i].p_memsz) {
+            *entry = phdrs[i].p_paddr + (ehdr.e_entry - phdrs[i].p_vaddr);
+            entry_found = true;
+        }
+    }
+
+    if (!entry_found) {
+        ERROR("ELF entry point 0x%lx is not in a loaded segment", ehdr.e_entry);
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    return MINI_KVM_SUCCESS;
+}
+
+bool mini_kvm_is_bzimage(int32_t fd) {
+    struct setup_header hdr;
+
+    return pread(fd, &hdr, sizeof(hdr), LINUX_SETUP_HEADER_OFFSET) == sizeof(hdr) &&
+           hdr.header == LINUX_HEADER_MAGIC && hdr.boot_flag == LINUX_BOOT_FLAG;
+}
+
+// the RAM given to Linux is the guest memory between the reserved ranges, in address order
+static uint32_t linux_ram_ranges(Kvm *kvm, LoaderRange *ranges) {
+    uint64_t start = 0, end = 0, mem_end = kvm->mem_size;
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i <= NB_RESERVED_RANGES && start < mem_end; i++) {
+        end = (i < NB_RESERVED_RANGES) ? RESERVED_RANGES[i].start : mem_end;
+        end = (end > mem_end) ? mem_end : end;
+        if (start < end && count < LINUX_RAM_RANGES) {
+            ranges[count++] = (LoaderRange){start, end, "RAM"};
+        }
+        start = (i < NB_RESERVED_RANGES) ? RESERVED_RANGES[i].end : mem_end;
+    }
+
+    return count;
+}
+
+static MiniKVMError linux_copy_cmdline(Kvm *kvm, const char *cmdline, uint64_t max_size) {
+    uint64_t len = strlen(cmdline);
+
+    if (len + 1 > max_size) {
+        ERROR("command line is longer than %lu bytes", max_size);
+        return MINI_KVM_ARGS_FAILED;
+    }
+    memcpy((uint8_t *)kvm->mem + LINUX_CMDLINE_ADDR, cmdline, len + 1);
+
+    return MINI_KVM_SUCCESS;
+}
+
+// the initrd goes at the highest page aligned address below top, above the kernel
+static MiniKVMError linux_load_initrd(Kvm *kvm, MiniKvmLinuxBoot *boot, uint64_t top,
+                                      uint64_t kernel_end, uint64_t *addr) {
+    top = (top > (uint64_t)kvm->mem_size) ? (uint64_t)kvm->mem_size : top;
+    *addr = (boot->initrd_size > top) ? 0 : (top - boot->initrd_size) & ~(PAGE_SIZE - 1UL);
+    if (*addr < kernel_end) {
+        ERROR("initrd of %lu bytes does not fit between the kernel and 0x%lx", boot->initrd_size,
+              top);
+        return MINI_KVM_NOT_ENOUGH_MEMORY;
+    }
+
+    if (mini_kvm_load_file(kvm, boot->initrd_fd, 0, boot->initrd_size, *addr) !=
+        MINI_KVM_SUCCESS) {
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+    INFO("initrd loaded at 0x%lx (%lu bytes)", *addr, boot->initrd_size);
+
+    return MINI_KVM_SUCCESS;
+}
+
+MiniKVMError mini_kvm_load_bzimage(Kvm *kvm, int32_t fd, uint64_t size, MiniKvmLinuxBoot *boot,
+                                   uint64_t *entry) {
+    struct boot_params *params =
+        (struct boot_params *)((uint8_t *)kvm->mem + LINUX_BOOT_PARAMS_ADDR);
+    uint64_t setup_size = 0, kernel_size = 0, kernel_end = 0, hdr_len = 0, initrd_addr = 0;
+    LoaderRange ranges[LINUX_RAM_RANGES];
+    struct setup_header hdr;
+    uint32_t count = 0;
+
+    if (loader_read(fd, (uint8_t *)&hdr, LINUX_SETUP_HEADER_OFFSET, sizeof(hdr)) !=
+        MINI_KVM_SUCCESS) {
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    if (hdr.version < LINUX_MIN_VERSION || !(hdr.xloadflags & XLF_KERNEL_64)) {
+        ERROR("kernel does not support the 64 bits boot protocol (version 0x%x)", hdr.version);
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    // the real mode setup code is not used, the protected mode kernel starts after it
+    setup_size = ((hdr.setup_sects == 0) ? 4 : hdr.setup_sects) * 512 + 512;
+    if (setup_size >= size) {
+        ERROR("invalid setup size %lu for a %lu bytes kernel", setup_size, size);
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+    kernel_size = size - setup_size;
+    kernel_end = LINUX_KERNEL_ADDR + ((hdr.init_size > kernel_size) ? hdr.init_size : kernel_size);
+    if (kernel_end > (uint64_t)kvm->mem_size) {
+        ERROR("the kernel needs %lu bytes of memory", kernel_end);
+        return MINI_KVM_NOT_ENOUGH_MEMORY;
+    }
+
+    if (linux_copy_cmdline(kvm, boot->cmdline, hdr.cmdline_size) != MINI_KVM_SUCCESS) {
+        return MINI_KVM_ARGS_FAILED;
+    }
+
+    if (mini_kvm_load_file(kvm, fd, setup_size, kernel_size, LINUX_KERNEL_ADDR) !=
+        MINI_KVM_SUCCESS) {
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+    INFO("Linux kernel loaded at 0x%x (%lu bytes, protocol 0x%x)", LINUX_KERNEL_ADDR, kernel_size,
+         hdr.version);
+
+    // boot_params starts as a copy of the setup header, its length is given by the jump at 0x200
+    hdr_len = LINUX_SETUP_HEADER_END_BASE + (hdr.jump >> 8) - LINUX_SETUP_HEADER_OFFSET;
+    hdr_len = (hdr_len > sizeof(hdr)) ? sizeof(hdr) : hdr_len;
+    memset(params, 0, sizeof(struct boot_params));
+    memcpy(&params->hdr, &hdr, hdr_len);
+    params->hdr.type_of_loader = LINUX_LOADER_UNDEFINED;
+    params->hdr.cmd_line_ptr = LINUX_CMDLINE_ADDR;
+    params->acpi_rsdp_addr = kvm->rsdp_addr;
+
+    if (boot->initrd_fd >= 0) {
+        if (linux_load_initrd(kvm, boot, (uint64_t)hdr.initrd_addr_max + 1, kernel_end,
+                              &initrd_addr) != MINI_KVM_SUCCESS) {
+            return MINI_KVM_INTERNAL_ERROR;
+        }
+        params->hdr.ramdisk_image = initrd_addr;
+        params->hdr.ramdisk_size = boot->initrd_size;
+    }
+
+    count = linux_ram_ranges(kvm, ranges);
+    for (uint32_t i = 0; i < count; i++) {
+        params->e820_table[i] = (struct boot_e820_entry){ranges[i].start,
+                                                         ranges[i].end - ranges[i].start,
+                                                         LINUX_E820_RAM};
+    }
+    params->e820_entries = count;
+
+    *entry = LINUX_KERNEL_ADDR + LINUX_ENTRY_64_OFFSET;
+    return MINI_KVM_SUCCESS;
+}
+
+// find the 32 bits entry point of the Xen PVH boot ABI in the PT_NOTE segments
+static bool elf_find_pvh_entry(int32_t fd, uint64_t size, uint64_t *entry) {
+    Elf64_Phdr phdrs[ELF_MAX_PHDRS];
+    Elf64_Ehdr ehdr;
+    uint8_t *notes = NULL;
+    bool found = false;
+
+    if (elf_read_headers(fd, size, &ehdr, phdrs) != MINI_KVM_SUCCESS) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < ehdr.e_phnum && !found; i++) {
+        if (phdrs[i].p_type != PT_NOTE || phdrs[i].p_filesz > PVH_MAX_NOTES_SIZE ||
+            phdrs[i].p_offset > size || phdrs[i].p_filesz > size - phdrs[i].p_offset) {
+            continue;
+        }
+
+        notes = malloc(phdrs[i].p_filesz);
+        if (notes == NULL ||
+            loader_read(fd, notes, phdrs[i].p_offset, phdrs[i].p_filesz) != MINI_KVM_SUCCESS) {
+            free(notes);
+            return false;
+        }
+
+        // each note is a header followed by its name and description, both 4 bytes aligned
+        for (uint64_t off = 0; off + sizeof(Elf64_Nhdr) <= phdrs[i].p_filesz && !found;) {
+            Elf64_Nhdr *nhdr = (Elf64_Nhdr *)(notes + off);
+            uint64_t name = off + sizeof(Elf64_Nhdr);
+            uint64_t desc = name + ((nhdr->n_namesz + 3UL) & ~3UL);
+
+            off = desc + ((nhdr->n_descsz + 3UL) & ~3UL);
+            if (off > phdrs[i].p_filesz) {
+                break;
+            }
+
+            if (nhdr->n_type == XEN_ELFNOTE_PHYS32_ENTRY && nhdr->n_namesz == 4 &&
+                memcmp(notes + name, "Xen", 4) == 0 &&
+                (nhdr->n_descsz == 4 || nhdr->n_descsz == 8)) {
+                *entry = 0;
+                memcpy(entry, notes + desc, nhdr->n_descsz);
+                found = true;
+            }
+        }
+        free(notes);
+    }
+
+    return found;
+}
+
+bool mini_kvm_is_pvh(int32_t fd, uint64_t size) {
+    uint64_t entry = 0;
+
+    return mini_kvm_is_elf(fd) && elf_find_pvh_entry(fd, size, &entry);
+}
+
+static uint64_t elf_end(int32_t fd, uint64_t size) {
+    Elf64_Phdr phdrs[ELF_MAX_PHDRS];
+    Elf64_Ehdr ehdr;
+    uint64_t end = 0;
+
+    if (elf_read_headers(fd, size, &ehdr, phdrs) != MINI_KVM_SUCCESS) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < ehdr.e_phnum; i++) {
+        if (phdrs[i].p_type == PT_LOAD && phdrs[i].p_paddr + phdrs[i].p_memsz > end) {
+            end = phdrs[i].p_paddr + phdrs[i].p_memsz;
+        }
+    }
+
+    return end;
+}
+
+MiniKVMError mini_kvm_load_pvh(Kvm *kvm, int32_t fd, uint64_t size, MiniKvmLinuxBoot *boot,
+                               uint64_t *entry) {
+    uint8_t *mem = (uint8_t *)kvm->mem;
+    struct hvm_start_info *start_info = (struct hvm_start_info *)(mem + PVH_START_INFO_ADDR);
+    struct hvm_memmap_table_entry *memmap = (struct hvm_memmap_table_entry *)(start_info + 1);
+    struct hvm_modlist_entry *module = (struct hvm_modlist_entry *)(memmap + LINUX_RAM_RANGES);
+    uint64_t elf_entry = 0, initrd_addr = 0;
+    LoaderRange ranges[LINUX_RAM_RANGES];
+    uint32_t count = 0;
+
+    // the memory map and the initrd placement assume guest memory reaches past the legacy hole
+    if (kvm->mem_size <= LINUX_KERNEL_ADDR) {
+        ERROR("Linux needs more than 0x%x bytes of memory", LINUX_KERNEL_ADDR);
+        return MINI_KVM_NOT_ENOUGH_MEMORY;
+    }
+
+    if (!elf_find_pvh_entry(fd, size, entry)) {
+        ERROR("kernel has no PVH entry point");
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    // the segments are loaded like any ELF image, only the entry point and its state differ
+    if (mini_kvm_load_elf(kvm, fd, size, &elf_entry) != MINI_KVM_SUCCESS ||
+        linux_copy_cmdline(kvm, boot->cmdline, LINUX_CMDLINE_SIZE) != MINI_KVM_SUCCESS) {
+        return MINI_KVM_INTERNAL_ERROR;
+    }
+
+    memset(start_info, 0, sizeof(struct hvm_start_info));
+    start_info->magic = XEN_HVM_START_MAGIC_VALUE;
+    start_info->version = 1; // with a memory map
+    start_info->cmdline_paddr = LINUX_CMDLINE_ADDR;
+    start_info->rsdp_paddr = kvm->rsdp_addr;
+
+    count = linux_ram_ranges(kvm, ranges);
+    for (uint32_t i = 0; i < count; i++) {
+        memmap[i] = (struct hvm_memmap_table_entry){.addr = ranges[i].start,
+                                                    .size = ranges[i].end - ranges[i].start,
+                                                    .type = XEN_HVM_MEMMAP_TYPE_RAM};
+    }
+    start_info->memmap_paddr = PVH_START_INFO_ADDR + sizeof(struct hvm_start_info);
+    start_info->memmap_entries = count;
+
+    // the initrd is the first and only module
+    if (boot->initrd_fd >= 0) {
+        if (linux_load_initrd(kvm, boot, kvm->mem_size, elf_end(fd, size), &initrd_addr) !=
+            MINI_KVM_SUCCESS) {
+            return MINI_KVM_INTERNAL_ERROR;
+        }
+        memset(module, 0, sizeof(struct hvm_modlist_entry));
+        module->paddr = initrd_addr;
+        module->size = boot->initrd_size;
+        start_info->modlist_paddr = (uint8_t *)module - mem;
+        start_info->nr_modules = 1;
+    }
+    INFO("PVH kernel loaded, entry at 0x%lx", *entry);
+
+    return MINI_KVM_SUCCESS;
+}
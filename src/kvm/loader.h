@@ -0,0 +1,80 @@
+#ifndef MINI_KVM_LOADER_H
+#define MINI_KVM_LOADER_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "core/errors.h"
+#include "kvm/kvm.h"
+
+// Kernel image loaders
+//
+// Images are mapped copy-on-write over guest RAM whenever the file and guest offsets agree within
+// a page: VMs booting the same image share its page cache pages and only copy the ones the guest
+// writes to. Partial pages at the ends of a range are read in place.
+
+// place len bytes of the file at offset at the guest physical address addr
+MiniKVMError mini_kvm_load_file(Kvm *kvm, int32_t fd, uint64_t offset, uint64_t len,
+                                uint64_t addr);
+
+// return true if the file starts with the ELF magic
+bool mini_kvm_is_elf(int32_t fd);
+// place the PT_LOAD segments of an x86_64 ELF64 image at their physical address, the bss is left
+// to the zero pages of guest RAM. entry is e_entry translated to a physical address.
+MiniKVMError mini_kvm_load_elf(Kvm *kvm, int32_t fd, uint64_t size, uint64_t *entry);
+
+typedef struct MiniKvmLinuxBoot {
+    const char *cmdline;
+    int32_t initrd_fd; // -1 without initrd
+    uint64_t initrd_size;
+} MiniKvmLinuxBoot;
+
+// return true if the file has a Linux setup header
+bool mini_kvm_is_bzimage(int32_t fd);
+// load the protected mode kernel at LINUX_KERNEL_ADDR, the command line at LINUX_CMDLINE_ADDR and
+// the initrd at the top of memory, then build boot_params at LINUX_BOOT_PARAMS_ADDR. entry is the
+// 64 bits entry point, it runs with the address of boot_params in rsi.
+MiniKVMError mini_kvm_load_bzimage(Kvm *kvm, int32_t fd, uint64_t size, MiniKvmLinuxBoot *boot,
+                                   uint64_t *entry);
+
+// Xen PVH boot ABI, the start info and its tables are passed to the kernel in ebx
+#define XEN_HVM_START_MAGIC_VALUE 0x336ec578
+#define XEN_HVM_MEMMAP_TYPE_RAM 1
+
+struct hvm_start_info {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t nr_modules;
+    uint64_t modlist_paddr;
+    uint64_t cmdline_paddr;
+    uint64_t rsdp_paddr;
+    uint64_t memmap_paddr; // version 1
+    uint32_t memmap_entries;
+    uint32_t reserved;
+};
+
+struct hvm_modlist_entry {
+    uint64_t paddr;
+    uint64_t size;
+    uint64_t cmdline_paddr;
+    uint64_t reserved;
+};
+
+struct hvm_memmap_table_entry {
+    uint64_t addr;
+    uint64_t size;
+    uint32_t type;
+    uint32_t reserved;
+};
+
+// return true if the file is an ELF image with a XEN_ELFNOTE_PHYS32_ENTRY note, like an
+// uncompressed vmlinux
+bool mini_kvm_is_pvh(int32_t fd, uint64_t size);
+// load the segments of a PVH kernel, its command line and its initrd as a module, then build
+// hvm_start_info at PVH_START_INFO_ADDR. entry is the 32 bits protected mode entry point, it runs
+// with the address of hvm_start_info in ebx.
+MiniKVMError mini_kvm_load_pvh(Kvm *kvm, int32_t fd, uint64_t size, MiniKvmLinuxBoot *boot,
+                               uint64_t *entry);
+
+#endif /* MINI_KVM_LOADER_H */
@@ -0,0 +1,97 @@
+#include "serial.h"
+
+#include <unistd.h>
+
+#define UART_RBR_THR 0
+#define UART_IER_DLM 1
+#define UART_IIR 2
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+#define UART_SCR 7
+
+#define UART_LCR_DLAB 0x80
+#define UART_MCR_LOOP 0x10
+#define UART_IIR_NO_INT 0x01
+#define UART_LSR_TEMT_THRE 0x60
+#define UART_MSR_DCD_DSR_CTS 0xb0
+
+// in loopback mode the modem control outputs are wired to the modem status inputs: DTR to DSR,
+// RTS to CTS, OUT1 to RI and OUT2 to DCD
+static uint8_t serial_loopback_msr(uint8_t mcr) {
+    return ((mcr & 0x1) << 5) | ((mcr & 0x2) << 3) | ((mcr & 0x4) << 4) | ((mcr & 0x8) << 4);
+}
+
+static void serial_write(MiniKvmSerial *serial, uint16_t offset, uint8_t value) {
+    bool dlab = serial->lcr & UART_LCR_DLAB;
+
+    switch (offset) {
+    case UART_RBR_THR:
+        if (dlab) {
+            serial->dll = value;
+        } else if (!(serial->mcr & UART_MCR_LOOP)) {
+            write(STDOUT_FILENO, &value, 1);
+        }
+        break;
+    case UART_IER_DLM:
+        if (dlab) {
+            serial->dlm = value;
+        } else {
+            serial->ier = value & 0x0f;
+        }
+        break;
+    case UART_LCR:
+        serial->lcr = value;
+        break;
+    case UART_MCR:
+        serial->mcr = value & 0x1f;
+        break;
+    case UART_SCR:
+        serial->scr = value;
+        break;
+    default:
+        break;
+    }
+}
+
+static uint8_t serial_read(MiniKvmSerial *serial, uint16_t offset) {
+    bool dlab = serial->lcr & UART_LCR_DLAB;
+
+    switch (offset) {
+    case UART_RBR_THR:
+        return dlab ? serial->dll : 0;
+    case UART_IER_DLM:
+        return dlab ? serial->dlm : serial->ier;
+    case UART_IIR:
+        return UART_IIR_NO_INT;
+    case UART_LCR:
+        return serial->lcr;
+    case UART_MCR:
+        return serial->mcr;
+    case UART_LSR:
+        return UART_LSR_TEMT_THRE;
+    case UART_MSR:
+        return (serial->mcr & UART_MCR_LOOP) ? serial_loopback_msr(serial->mcr)
+                                             : UART_MSR_DCD_DSR_CTS;
+    case UART_SCR:
+        return serial->scr;
+    default:
+        return 0xff;
+    }
+}
+
+void mini_kvm_serial_init(MiniKvmSerial *serial) {
+    *serial = (MiniKvmSerial){0};
+    pthread_mutex_init(&serial->lock, NULL);
+}
+
+void mini_kvm_serial_io(MiniKvmSerial *serial, uint16_t offset, bool write, uint8_t *data) {
+    pthread_mutex_lock(&serial->lock);
+    if (write) {
+        serial_write(serial, offset, *data);
+    } else {
+        *data = serial_read(serial, offset);
+    }
+    pthread_mutex_unlock(&serial->lock);
+}
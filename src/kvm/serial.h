@@ -0,0 +1,32 @@
+#ifndef MINI_KVM_SERIAL_H
+#define MINI_KVM_SERIAL_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+// Minimal 16450 UART on COM1
+//
+// Enough for a polled console: the transmitter is always empty, every byte written to THR goes to
+// stdout, the receiver never has data and no interrupt is raised. The other registers keep what the
+// guest writes so the 8250 driver probe (scratch register, loopback) recognizes the UART. There is
+// no FIFO, the driver reports a 16450. Every vcpu can access the port, the registers are locked.
+
+#define MINI_KVM_SERIAL_PORT 0x3f8
+#define MINI_KVM_SERIAL_PORTS 8
+
+typedef struct MiniKvmSerial {
+    pthread_mutex_t lock;
+    uint8_t ier;
+    uint8_t lcr;
+    uint8_t mcr;
+    uint8_t scr;
+    uint8_t dll;
+    uint8_t dlm;
+} MiniKvmSerial;
+
+void mini_kvm_serial_init(MiniKvmSerial *serial);
+// handle a one byte access to the port at offset from MINI_KVM_SERIAL_PORT
+void mini_kvm_serial_io(MiniKvmSerial *serial, uint16_t offset, bool write, uint8_t *data);
+
+#endif /* MINI_KVM_SERIAL_H */
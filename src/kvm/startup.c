@@ -0,0 +1,45 @@
+#include "startup.h"
+
+#include "core/core.h"
+
+static const char *STARTUP_PHASE_STR[MINI_KVM_STARTUP_PHASES] = {
+    "args", "kvm open", "setup kvm", "vcpus", "paging", "tables", "load kernel", "filesystem",
+    "control", "first run",
+};
+
+void mini_kvm_startup_start(MiniKvmStartupProfile *profile) {
+    *profile = (MiniKvmStartupProfile){0};
+    profile->start_ns = mini_kvm_now_ns();
+}
+
+void mini_kvm_startup_end(MiniKvmStartupProfile *profile, MiniKvmStartupPhase phase) {
+    profile->end_ns[phase] = mini_kvm_now_ns();
+}
+
+bool mini_kvm_startup_first_run(MiniKvmStartupProfile *profile) {
+    uint64_t expected = 0;
+
+    return __atomic_compare_exchange_n(&profile->end_ns[MINI_KVM_STARTUP_FIRST_RUN], &expected,
+                                       mini_kvm_now_ns(), false, __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED);
+}
+
+void mini_kvm_startup_print(MiniKvmStartupProfile *profile, FILE *out) {
+    uint64_t last_ns = profile->start_ns, end_ns = 0;
+
+    fprintf(out, "  %-12s %13s %13s\n", "phase", "duration", "elapsed");
+    for (uint32_t phase = 0; phase < MINI_KVM_STARTUP_PHASES; phase++) {
+        end_ns = __atomic_load_n(&profile->end_ns[phase], __ATOMIC_RELAXED);
+        if (end_ns == 0) {
+            fprintf(out, "  %-12s %10s\n", STARTUP_PHASE_STR[phase], "-");
+            continue;
+        }
+
+        fprintf(out, "  %-12s %10.3f ms %10.3f ms\n", STARTUP_PHASE_STR[phase],
+                (end_ns - last_ns) / 1e6, (end_ns - profile->start_ns) / 1e6);
+        last_ns = end_ns;
+        for (uint32_t i = 0; phase == MINI_KVM_STARTUP_VCPUS && i < profile->vcpu_count; i++) {
+            fprintf(out, "    vcpu %-5u %10.3f ms\n", i, profile->vcpu_ns[i] / 1e6);
+        }
+    }
+}
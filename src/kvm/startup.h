@@ -0,0 +1,40 @@
+#ifndef MINI_KVM_STARTUP_H
+#define MINI_KVM_STARTUP_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "core/constants.h"
+
+// startup phases of mkvm run, each one ends when the next one starts
+typedef enum MiniKvmStartupPhase {
+    MINI_KVM_STARTUP_ARGS = 0,    // argument parsing, opens the kernel and initrd files
+    MINI_KVM_STARTUP_KVM_OPEN,    // open /dev/kvm
+    MINI_KVM_STARTUP_SETUP_KVM,   // rest of mini_kvm_setup_kvm (VM, memory, irq chip)
+    MINI_KVM_STARTUP_VCPUS,       // mini_kvm_add_vcpus, see vcpu_ns for each vcpu
+    MINI_KVM_STARTUP_PAGING,      // mini_kvm_configure_paging
+    MINI_KVM_STARTUP_TABLES,      // ACPI and MP tables
+    MINI_KVM_STARTUP_LOAD_KERNEL, // copy-on-write mapping of the kernel in guest memory
+    MINI_KVM_STARTUP_FILESYSTEM,  // VM directory and pidfile
+    MINI_KVM_STARTUP_CONTROL,     // control socket and server
+    MINI_KVM_STARTUP_FIRST_RUN,   // vcpu threads creation until the first KVM_RUN
+    MINI_KVM_STARTUP_PHASES,
+} MiniKvmStartupPhase;
+
+// monotonic timestamps in ns, 0 when the phase did not end. The first vcpu entering KVM_RUN ends
+// the last phase, it is the closest the VMM gets to the first guest instruction.
+typedef struct MiniKvmStartupProfile {
+    uint64_t start_ns;
+    uint64_t end_ns[MINI_KVM_STARTUP_PHASES];
+    uint64_t vcpu_ns[MINI_KVM_MAX_VCPUS]; // creation time of each vcpu, they overlap
+    uint32_t vcpu_count;
+} MiniKvmStartupProfile;
+
+void mini_kvm_startup_start(MiniKvmStartupProfile *profile);
+void mini_kvm_startup_end(MiniKvmStartupProfile *profile, MiniKvmStartupPhase phase);
+// end the first run phase, returns true for the first caller only
+bool mini_kvm_startup_first_run(MiniKvmStartupProfile *profile);
+void mini_kvm_startup_print(MiniKvmStartupProfile *profile, FILE *out);
+
+#endif /* MINI_KVM_STARTUP_H */
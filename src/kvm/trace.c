@@ -0,0 +1,40 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+MiniKvmTraceRing *mini_kvm_trace_ring_alloc() {
+    MiniKvmTraceRing *ring = aligned_alloc(64, sizeof(MiniKvmTraceRing));
+
+    if (ring != NULL) {
+        memset(ring, 0, sizeof(MiniKvmTraceRing));
+    }
+    return ring;
+}
+
+void mini_kvm_trace_ring_reset(MiniKvmTraceRing *ring) {
+    atomic_store_explicit(&ring->head, 0, memory_order_release);
+}
+
+uint32_t mini_kvm_trace_ring_copy(MiniKvmTraceRing *ring, MiniKvmTraceEvent *events) {
+    uint64_t start = 0, end = atomic_load_explicit(&ring->head, memory_order_acquire), head = 0;
+    uint32_t count = 0;
+
+    start = (end > MINI_KVM_TRACE_EVENTS) ? end - MINI_KVM_TRACE_EVENTS : 0;
+    for (uint64_t i = start; i < end; i++) {
+        events[i - start] = ring->events[i % MINI_KVM_TRACE_EVENTS];
+    }
+
+    // events written during the copy overwrote the oldest slots, the writer may also be filling
+    // the slot of the next event
+    atomic_thread_fence(memory_order_acquire);
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head + 1 > start + MINI_KVM_TRACE_EVENTS) {
+        count = head + 1 - (start + MINI_KVM_TRACE_EVENTS);
+        count = (count > end - start) ? end - start : count;
+        memmove(events, events + count, (end - start - count) * sizeof(MiniKvmTraceEvent));
+        return end - start - count;
+    }
+
+    return end - start;
+}
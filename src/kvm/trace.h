@@ -0,0 +1,56 @@
+#ifndef MINI_KVM_TRACE_H
+#define MINI_KVM_TRACE_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <x86intrin.h>
+
+// vcpu exit trace rings
+//
+// Each vcpu owns a ring of fixed size events, it is the only writer and overwrites the oldest
+// events once the ring is full. Recording is a few stores and a release increment of head, readers
+// copy the ring at any time and drop the slots that may have been overwritten during the copy.
+
+#define MINI_KVM_TRACE_EVENTS 16384 // per vcpu, a ring fits in a single control socket frame
+
+typedef struct MiniKvmTraceEvent {
+    uint64_t entry_tsc; // TSC before KVM_RUN
+    uint64_t exit_tsc;  // TSC after KVM_RUN
+    uint64_t addr;      // io port or mmio address
+    uint32_t handle_cycles;
+    uint16_t reason; // KVM_EXIT_*
+    uint16_t info;   // access size, MINI_KVM_TRACE_WRITE for io out and mmio writes
+} MiniKvmTraceEvent;
+
+#define MINI_KVM_TRACE_WRITE (1 << 15)
+
+typedef struct MiniKvmTraceRing {
+    _Atomic uint64_t head; // number of events ever recorded
+    MiniKvmTraceEvent events[MINI_KVM_TRACE_EVENTS];
+} MiniKvmTraceRing;
+
+static inline uint64_t mini_kvm_rdtsc() { return __rdtsc(); }
+
+static inline void mini_kvm_trace_record(MiniKvmTraceRing *ring, uint64_t entry_tsc,
+                                         uint64_t exit_tsc, uint16_t reason, uint64_t addr,
+                                         uint16_t info) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    MiniKvmTraceEvent *event = &ring->events[head % MINI_KVM_TRACE_EVENTS];
+
+    event->entry_tsc = entry_tsc;
+    event->exit_tsc = exit_tsc;
+    event->addr = addr;
+    event->handle_cycles = mini_kvm_rdtsc() - exit_tsc;
+    event->reason = reason;
+    event->info = info;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+MiniKvmTraceRing *mini_kvm_trace_ring_alloc();
+void mini_kvm_trace_ring_reset(MiniKvmTraceRing *ring);
+// copy the recorded events from the oldest to the newest, returns the number of events copied. The
+// slot the writer may be filling is skipped, a full ring yields MINI_KVM_TRACE_EVENTS - 1 events.
+uint32_t mini_kvm_trace_ring_copy(MiniKvmTraceRing *ring, MiniKvmTraceEvent *events);
+
+#endif /* MINI_KVM_TRACE_H */
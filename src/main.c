@@ -7,11 +7,12 @@
 
 const MiniKVMCommand commands[] = {{"pause", mini_kvm_pause},       {"resume", mini_kvm_resume},
                                    {"run", mini_kvm_run},           {"status", mini_kvm_status},
-                                   {"shutdown", mini_kvm_shutdown}, {NULL, NULL}};
+                                   {"shutdown", mini_kvm_shutdown}, {"trace", mini_kvm_trace},
+                                   {NULL, NULL}};
 
 void print_help() {
     printf("USAGE:\n");
-    printf("\tmini_kvm <run|pause|resume|shutdown|status>\n");
+    printf("\tmini_kvm <run|pause|resume|shutdown|status|trace>\n");
 }
 
 MiniKVMError handle_command(int32_t argc, char **argv) {
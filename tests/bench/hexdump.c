@@ -0,0 +1,80 @@
+#include "core/hexdump.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "core/core.h"
+
+#define BENCH_SIZE (64UL << 20)
+#define BENCH_LEGACY_SIZE (1UL << 20)
+
+// formatter used before the buffered one, a dprintf per byte
+static void legacy_dump(int32_t out, const uint8_t *data, uint64_t len, uint32_t word_size,
+                        uint32_t bytes_per_line) {
+    uint32_t nb_lines = len / bytes_per_line + (len % bytes_per_line != 0);
+
+    for (uint32_t line = 0; line < nb_lines; line++) {
+        dprintf(out, "0x%08lx\t", line * (uint64_t)bytes_per_line);
+
+        for (uint32_t word = 0; word < bytes_per_line; word += word_size) {
+            uint32_t offset = word + bytes_per_line * line;
+            if (offset >= len) {
+                break;
+            }
+
+            for (int32_t word_offset = word_size - 1; word_offset >= 0; word_offset--) {
+                dprintf(out, "%02hx", data[offset + word_offset]);
+            }
+            dprintf(out, " ");
+        }
+
+        dprintf(out, "\n");
+    }
+}
+
+static double bench_hexdump(int32_t out, const uint8_t *data, uint32_t word_size,
+                            uint32_t bytes_per_line, bool ascii, bool simd) {
+    MiniKvmHexDump dump;
+    uint64_t start = 0;
+
+    mini_kvm_hexdump_disable_simd(!simd);
+    mini_kvm_hexdump_init(&dump, out, word_size, bytes_per_line, ascii);
+    start = mini_kvm_now_ns();
+    mini_kvm_hexdump_write(&dump, data, 0, BENCH_SIZE);
+    mini_kvm_hexdump_close(&dump);
+
+    return (BENCH_SIZE / 1e6) / ((mini_kvm_now_ns() - start) / 1e9);
+}
+
+int main(void) {
+    uint8_t *data = malloc(BENCH_SIZE);
+    int32_t out = open("/dev/null", O_WRONLY);
+    uint64_t start = 0;
+
+    for (uint64_t i = 0; i < BENCH_SIZE; i++) {
+        data[i] = rand();
+    }
+
+    start = mini_kvm_now_ns();
+    legacy_dump(out, data, BENCH_LEGACY_SIZE, 2, 16);
+    printf("%-32s %10.1f MB/s\n", "legacy dprintf",
+           (BENCH_LEGACY_SIZE / 1e6) / ((mini_kvm_now_ns() - start) / 1e9));
+
+    for (uint32_t word_size = 1; word_size <= 8; word_size <<= 1) {
+        printf("word size %u\n", word_size);
+        printf("  %-30s %10.1f MB/s\n", "buffered scalar",
+               bench_hexdump(out, data, word_size, 16, false, false));
+        printf("  %-30s %10.1f MB/s\n", "buffered simd",
+               bench_hexdump(out, data, word_size, 16, false, true));
+        printf("  %-30s %10.1f MB/s\n", "buffered simd + ascii",
+               bench_hexdump(out, data, word_size, 16, true, true));
+        printf("  %-30s %10.1f MB/s\n", "buffered simd, 64 bytes lines",
+               bench_hexdump(out, data, word_size, 64, false, true));
+    }
+
+    close(out);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include "core/logger.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "core/core.h"
+
+#define BENCH_RECORDS 200000 // per thread
+#define BENCH_MAX_THREADS 8
+#define BENCH_BURST 64 // records logged between two pauses of the bursty threads
+#define BENCH_BURST_RECORDS 20000
+
+typedef struct BenchThread {
+    pthread_t thread;
+    uint32_t id;
+    bool bursts;
+    uint64_t log_ns;   // time spent in the log calls
+    uint64_t flush_ns; // time until the records were written out
+} BenchThread;
+
+// what a vcpu exit loop logs, either continuously or in bursts that leave the consumer time to
+// catch up, only the log calls are timed
+static void *bench_thread_run(void *arg) {
+    BenchThread *thread = arg;
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 1000000};
+    uint64_t start = mini_kvm_now_ns(), burst_start = start;
+    uint64_t records = thread->bursts ? BENCH_BURST_RECORDS : BENCH_RECORDS;
+
+    for (uint64_t i = 0; i < records; i++) {
+        TRACE("vcpu %u: exit %s port 0x%lx size %d", thread->id, "io", 0x3f8 + (i & 7), 1);
+        if (thread->bursts && i % BENCH_BURST == BENCH_BURST - 1) {
+            thread->log_ns += mini_kvm_now_ns() - burst_start;
+            nanosleep(&pause, NULL);
+            burst_start = mini_kvm_now_ns();
+        }
+    }
+    thread->log_ns = thread->bursts ? thread->log_ns : mini_kvm_now_ns() - start;
+    logger_flush();
+    thread->flush_ns = mini_kvm_now_ns() - start;
+
+    return NULL;
+}
+
+static void bench_logger(const char *name, uint32_t nb_threads, bool bursts) {
+    BenchThread threads[BENCH_MAX_THREADS] = {0};
+    uint64_t log_ns = 0, flush_ns = 0, records = (uint64_t)nb_threads * BENCH_RECORDS;
+
+    for (uint32_t i = 0; i < nb_threads; i++) {
+        threads[i].id = i;
+        threads[i].bursts = bursts;
+        pthread_create(&threads[i].thread, NULL, bench_thread_run, &threads[i]);
+    }
+    for (uint32_t i = 0; i < nb_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        log_ns = (threads[i].log_ns > log_ns) ? threads[i].log_ns : log_ns;
+        flush_ns = (threads[i].flush_ns > flush_ns) ? threads[i].flush_ns : flush_ns;
+    }
+
+    if (bursts) {
+        printf("  %-8s %u threads, bursts %8.1f ns/call\n", name, nb_threads,
+               (double)log_ns / BENCH_BURST_RECORDS);
+        return;
+    }
+    printf("  %-8s %u threads %10.2f Mrec/s logged %10.2f Mrec/s written\n", name, nb_threads,
+           records / (log_ns / 1e3), records / (flush_ns / 1e3));
+}
+
+int main(void) {
+    uint64_t start = 0;
+
+    logger_init("/dev/null");
+    logger_set_level(LogTrace);
+
+    printf("logger throughput, %d records per thread\n", BENCH_RECORDS);
+    for (uint32_t nb_threads = 1; nb_threads <= BENCH_MAX_THREADS; nb_threads <<= 1) {
+        bench_logger("sync", nb_threads, false);
+        bench_logger("sync", nb_threads, true);
+    }
+
+    logger_start();
+    for (uint32_t nb_threads = 1; nb_threads <= BENCH_MAX_THREADS; nb_threads <<= 1) {
+        bench_logger("async", nb_threads, false);
+        bench_logger("async", nb_threads, true);
+    }
+
+    logger_set_level(LogInfo);
+    start = mini_kvm_now_ns();
+    for (uint64_t i = 0; i < 100 * BENCH_RECORDS; i++) {
+        TRACE("vcpu %u: exit %s port 0x%lx size %d", 0, "io", i, 1);
+    }
+    printf("  %-8s %10.2f ns/call\n", "disabled",
+           (double)(mini_kvm_now_ns() - start) / (100 * BENCH_RECORDS));
+
+    logger_stop();
+    return 0;
+}
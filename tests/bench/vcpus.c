@@ -0,0 +1,72 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "core/constants.h"
+#include "core/core.h"
+#include "core/logger.h"
+#include "kvm/kvm.h"
+
+#define SKIP_RETURN_CODE 77
+#define BENCH_MEM_SIZE (1UL << 20)
+#define BENCH_ROUNDS 5
+
+// best time to bring up nb_vcpus vcpus in a fresh VM, one at a time or all at once
+static double bench_vcpus(uint32_t nb_vcpus, bool parallel) {
+    uint64_t best_ns = ~0UL, start = 0, elapsed = 0;
+    MiniKVMError ret = MINI_KVM_SUCCESS;
+    Kvm *kvm = NULL;
+
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++) {
+        kvm = calloc(1, sizeof(Kvm));
+        if (mini_kvm_setup_kvm(kvm, BENCH_MEM_SIZE) != MINI_KVM_SUCCESS) {
+            mini_kvm_clean_kvm(kvm);
+            return -1;
+        }
+
+        start = mini_kvm_now_ns();
+        if (parallel) {
+            ret = mini_kvm_add_vcpus(kvm, nb_vcpus);
+        }
+        for (uint32_t i = 0; !parallel && i < nb_vcpus && ret == MINI_KVM_SUCCESS; i++) {
+            ret = mini_kvm_add_vcpu(kvm);
+        }
+        elapsed = mini_kvm_now_ns() - start;
+        mini_kvm_clean_kvm(kvm);
+
+        if (ret != MINI_KVM_SUCCESS) {
+            return -1;
+        }
+        best_ns = (elapsed < best_ns) ? elapsed : best_ns;
+    }
+
+    return best_ns / 1e6;
+}
+
+int main(void) {
+    double sequential = 0, parallel = 0;
+    int32_t fd = open("/dev/kvm", O_RDWR);
+
+    if (fd < 0) {
+        printf("/dev/kvm is not available, skipping\n");
+        return SKIP_RETURN_CODE;
+    }
+    close(fd);
+    logger_set_level(LogError);
+
+    printf("vcpu bring-up, best of %d rounds, %ld online cpus\n", BENCH_ROUNDS,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    for (uint32_t nb_vcpus = 1; nb_vcpus <= MINI_KVM_MAX_VCPUS; nb_vcpus <<= 1) {
+        sequential = bench_vcpus(nb_vcpus, false);
+        parallel = bench_vcpus(nb_vcpus, true);
+        if (sequential < 0 || parallel < 0) {
+            printf("failed to create %u vcpus\n", nb_vcpus);
+            return 1;
+        }
+        printf("  %2u vcpus  sequential %8.3f ms  parallel %8.3f ms\n", nb_vcpus, sequential,
+               parallel);
+    }
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include "core/hexdump.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HEXDUMP_TEST_SIZE 4099
+
+static const uint32_t WORD_SIZES[] = {1, 2, 4, 8};
+static const uint32_t LINE_SIZES[] = {8, 16, 24, 32, 64, 72};
+
+// straightforward formatter the optimized one is checked against
+static size_t reference_dump(char *out, const uint8_t *data, uint64_t addr, uint64_t len,
+                             uint32_t word_size, uint32_t bytes_per_line, bool ascii) {
+    size_t pos = 0;
+
+    for (uint64_t line = 0; line < len; line += bytes_per_line) {
+        uint64_t line_len = (len - line < bytes_per_line) ? len - line : bytes_per_line;
+
+        pos += sprintf(out + pos, "0x%08lx\t", addr + line);
+        for (uint64_t word = 0; word < line_len; word += word_size) {
+            for (int32_t byte = word_size - 1; byte >= 0; byte--) {
+                pos += sprintf(out + pos, "%02x", data[line + word + byte]);
+            }
+            out[pos++] = ' ';
+        }
+
+        // the ASCII column of the last line is aligned with the previous ones
+        if (ascii) {
+            for (uint64_t word = line_len; word < bytes_per_line; word += word_size) {
+                pos += sprintf(out + pos, "%*s", 2 * word_size + 1, "");
+            }
+
+            out[pos++] = '|';
+            for (uint64_t i = 0; i < line_len; i++) {
+                uint8_t c = data[line + i];
+                out[pos++] = (c >= 0x20 && c < 0x7f) ? c : '.';
+            }
+            out[pos++] = '|';
+        }
+        out[pos++] = '\n';
+    }
+
+    return pos;
+}
+
+static int32_t check_dump(const uint8_t *data, uint64_t addr, uint64_t len, uint32_t word_size,
+                          uint32_t bytes_per_line, bool ascii, bool simd) {
+    static char expected[16 * HEXDUMP_TEST_SIZE], result[16 * HEXDUMP_TEST_SIZE];
+    MiniKvmHexDump dump;
+    FILE *out = tmpfile();
+    size_t expected_len = 0, result_len = 0;
+
+    mini_kvm_hexdump_disable_simd(!simd);
+    if (out == NULL || mini_kvm_hexdump_init(&dump, fileno(out), word_size, bytes_per_line,
+                                             ascii) != MINI_KVM_SUCCESS) {
+        printf("unable to initialize hexdump\n");
+        return 1;
+    }
+
+    // split the input to check lines started by a previous write
+    mini_kvm_hexdump_write(&dump, data, addr, len / 2 - (len / 2) % bytes_per_line);
+    mini_kvm_hexdump_write(&dump, data + len / 2 - (len / 2) % bytes_per_line,
+                           addr + len / 2 - (len / 2) % bytes_per_line,
+                           len - (len / 2 - (len / 2) % bytes_per_line));
+    mini_kvm_hexdump_close(&dump);
+
+    expected_len = reference_dump(expected, data, addr, len, word_size, bytes_per_line, ascii);
+    rewind(out);
+    result_len = fread(result, 1, sizeof(result), out);
+    fclose(out);
+
+    if (result_len != expected_len || memcmp(result, expected, expected_len) != 0) {
+        printf("hexdump mismatch word_size=%u bytes_per_line=%u ascii=%d simd=%d len=%lu\n",
+               word_size, bytes_per_line, ascii, simd, len);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(void) {
+    MiniKvmHexDump dump;
+    uint8_t data[HEXDUMP_TEST_SIZE];
+    int32_t failures = 0;
+
+    srand(42);
+    for (uint32_t i = 0; i < HEXDUMP_TEST_SIZE; i++) {
+        data[i] = rand();
+    }
+
+    for (uint32_t w = 0; w < sizeof(WORD_SIZES) / sizeof(uint32_t); w++) {
+        for (uint32_t l = 0; l < sizeof(LINE_SIZES) / sizeof(uint32_t); l++) {
+            uint32_t word_size = WORD_SIZES[w], line_size = LINE_SIZES[l];
+            uint64_t len = HEXDUMP_TEST_SIZE - HEXDUMP_TEST_SIZE % word_size;
+
+            for (int32_t mode = 0; mode < 4; mode++) {
+                failures += check_dump(data, 0x4000, len, word_size, line_size, mode & 1, mode & 2);
+                failures += check_dump(data, 0x123456789a, 3 * line_size, word_size, line_size,
+                                       mode & 1, mode & 2);
+            }
+        }
+    }
+
+    if (mini_kvm_hexdump_init(&dump, STDOUT_FILENO, 3, 16, false) == MINI_KVM_SUCCESS ||
+        mini_kvm_hexdump_init(&dump, STDOUT_FILENO, 4, 18, false) == MINI_KVM_SUCCESS ||
+        mini_kvm_hexdump_init(&dump, STDOUT_FILENO, 16, 32, false) == MINI_KVM_SUCCESS) {
+        printf("invalid formats were accepted\n");
+        failures++;
+    }
+
+    return failures != 0;
+}
@@ -0,0 +1,108 @@
+#include "core/logger.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_PATH_TEMPLATE "/tmp/mini_kvm_logger_XXXXXX"
+#define THREAD_RECORDS 10000
+
+static char expected[64][256];
+static uint32_t nb_expected = 0;
+
+// log a record and keep what printf would have written
+#define LOG_TEST(...)                                                                              \
+    {                                                                                              \
+        INFO(__VA_ARGS__);                                                                         \
+        snprintf(expected[nb_expected++], sizeof(expected[0]), __VA_ARGS__);                       \
+    }
+
+static void *thread_run(void *arg) {
+    for (uint32_t i = 0; i < THREAD_RECORDS; i++) {
+        TRACE("thread %lu record %u", (uint64_t)arg, i);
+    }
+    return NULL;
+}
+
+int main(void) {
+    char path[] = LOG_PATH_TEMPLATE, line[512];
+    uint32_t index = 0, thread_records[2] = {0}, record = 0;
+    uint64_t thread_id = 0;
+    const char *long_str = NULL;
+    const char *null_str = NULL;
+    pthread_t threads[2];
+    int32_t fd = mkstemp(path);
+    FILE *file = NULL;
+    char *message = NULL;
+    int32_t ret = 0;
+
+    close(fd);
+    logger_init(path);
+    logger_set_level(LogTrace);
+    logger_start();
+
+    long_str = "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+    LOG_TEST("no argument");
+    LOG_TEST("100%% literal %%");
+    LOG_TEST("int %d %i %u %x %X %o %c", -42, 7, 4000000000U, 0xbeef, 0xbeef, 8, 'z');
+    LOG_TEST("long %ld %lu %lx %llu %zu", -1L, 18446744073709551615UL, 0xdeadbeefcafeUL, 1ULL,
+             (size_t)12);
+    LOG_TEST("short %hhu %hd %hx", (unsigned char)255, (short)-3, (unsigned short)0xffff);
+    LOG_TEST("width [%8d] [%-8u] [%08lx] [%+d] [% d] [%#x]", 12, 34, 0xabcUL, 5, 6, 0x10);
+    LOG_TEST("double %f %.2f %e %g %10.3f", 3.5, 2.0 / 3, 1e10, 0.1, -1.25);
+    LOG_TEST("string %s [%10s] [%-6s] [%.3s] %s", "abc", "right", "left", "truncated", long_str);
+    LOG_TEST("pointer %p", (void *)0x1234);
+    LOG_TEST("star [%*d] [%.*s]", 5, 42, 2, "abc");
+    LOG_TEST("null %s", null_str);
+
+    // records of several threads are all written, in order for each thread
+    for (uint64_t i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, thread_run, (void *)i);
+    }
+    for (uint32_t i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    logger_stop();
+
+    file = fopen(path, "r");
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        message = strstr(line, "logger.c:");
+        message = (message != NULL) ? strchr(message, ' ') + 1 : NULL;
+        if (message == NULL) {
+            printf("malformed line: %s\n", line);
+            ret = 1;
+            break;
+        }
+
+        if (sscanf(message, "thread %lu record %u", &thread_id, &record) == 2) {
+            if (thread_id > 1 || record != thread_records[thread_id]++) {
+                printf("thread %lu: record %u out of order\n", thread_id, record);
+                ret = 1;
+                break;
+            }
+            continue;
+        }
+
+        if (index >= nb_expected || strcmp(message, expected[index]) != 0) {
+            printf("expected \"%s\", got \"%s\"\n", index < nb_expected ? expected[index] : "",
+                   message);
+            ret = 1;
+            break;
+        }
+        index++;
+    }
+    fclose(file);
+    unlink(path);
+
+    if (ret == 0 && (index != nb_expected || thread_records[0] != THREAD_RECORDS ||
+                     thread_records[1] != THREAD_RECORDS)) {
+        printf("missing records: %u/%u, thread records %u %u\n", index, nb_expected,
+               thread_records[0], thread_records[1]);
+        ret = 1;
+    }
+
+    return ret;
+}
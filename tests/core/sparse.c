@@ -0,0 +1,101 @@
+#include "core/sparse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPARSE_TEST_PAGES 4096
+#define SPARSE_TEST_SIZE (SPARSE_TEST_PAGES * MINI_KVM_SPARSE_PAGE_SIZE)
+
+static int32_t check_is_zero() {
+    uint8_t data[1024] = {0};
+
+    for (size_t len = 0; len <= sizeof(data); len += 7) {
+        if (!mini_kvm_is_zero(data, len)) {
+            printf("mini_kvm_is_zero failed on %lu zero bytes\n", len);
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 0x80;
+        if (mini_kvm_is_zero(data, sizeof(data)) || mini_kvm_is_zero(data + i, 1)) {
+            printf("mini_kvm_is_zero missed a byte at %lu\n", i);
+            return 1;
+        }
+        data[i] = 0;
+    }
+
+    return 0;
+}
+
+int main(void) {
+    MiniKvmSparseWriter writer;
+    MiniKvmSparseStats stats;
+    MiniKvmSparseChunk *chunk = NULL;
+    uint8_t *data = calloc(1, SPARSE_TEST_SIZE), *result = malloc(SPARSE_TEST_SIZE);
+    uint64_t data_pages = 0, offset = 0;
+    char path[] = "/tmp/mini_kvm_sparse_XXXXXX";
+    struct stat st;
+    int32_t fd = mkstemp(path), ret = 0;
+
+    if (check_is_zero() != 0) {
+        return 1;
+    }
+
+    // runs of data pages of various lengths
+    srand(42);
+    for (uint64_t page = 0; page < SPARSE_TEST_PAGES; page++) {
+        if (rand() % 4 == 0) {
+            data[page * MINI_KVM_SPARSE_PAGE_SIZE + rand() % MINI_KVM_SPARSE_PAGE_SIZE] = 1;
+            data_pages++;
+        }
+    }
+
+    if (fd < 0 || mini_kvm_sparse_writer_init(&writer, fd, SPARSE_TEST_SIZE, 4) != 0) {
+        printf("unable to initialize sparse writer\n");
+        return 1;
+    }
+
+    while (offset < SPARSE_TEST_SIZE) {
+        chunk = mini_kvm_sparse_writer_get(&writer);
+        chunk->offset = offset;
+        chunk->len = (rand() % 64 + 1) * MINI_KVM_SPARSE_PAGE_SIZE + rand() % 2;
+        chunk->len = (chunk->len < SPARSE_TEST_SIZE - offset) ? chunk->len
+                                                               : SPARSE_TEST_SIZE - offset;
+        memcpy(chunk->data, data + offset, chunk->len);
+        mini_kvm_sparse_writer_submit(&writer, chunk);
+        offset += chunk->len;
+    }
+
+    if (mini_kvm_sparse_writer_finish(&writer, &stats) != MINI_KVM_SUCCESS) {
+        printf("sparse writer failed\n");
+        ret = 1;
+    }
+
+    // a data page split between two chunks may have a zero half left as a hole
+    if (stats.data_bytes + stats.hole_bytes != SPARSE_TEST_SIZE ||
+        stats.data_bytes > data_pages * MINI_KVM_SPARSE_PAGE_SIZE) {
+        printf("unexpected stats: %lu data bytes, %lu hole bytes\n", stats.data_bytes,
+               stats.hole_bytes);
+        ret = 1;
+    }
+
+    if (pread(fd, result, SPARSE_TEST_SIZE, 0) != SPARSE_TEST_SIZE ||
+        memcmp(data, result, SPARSE_TEST_SIZE) != 0) {
+        printf("sparse file content does not match\n");
+        ret = 1;
+    }
+
+    fstat(fd, &st);
+    printf("%lu bytes file, %lu bytes allocated, %lu bytes written\n", st.st_size,
+           st.st_blocks * 512, stats.data_bytes);
+
+    close(fd);
+    unlink(path);
+    free(data);
+    free(result);
+    return ret;
+}
@@ -0,0 +1,567 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "commands/status.h"
+#include "core/constants.h"
+#include "core/core.h"
+#include "core/logger.h"
+#include "ipc/ipc.h"
+#include "kvm/binstats.h"
+
+#define SKIP_RETURN_CODE 77
+#define LOAD_CLIENTS 256
+#define LOAD_MUTATORS 4
+#define LOAD_ROUNDS 20
+#define LOAD_STARTUP_TIMEOUT_MS 5000
+#define LOAD_SEQUENTIAL_ROUNDS 20000
+#define LOAD_PIPELINE_DEPTH 32
+
+static char vm_name[64];
+static volatile int failures = 0;
+static volatile int done = 0;
+
+static int32_t send_cmd(int32_t sock, MiniKvmStatusCommandType type, MiniKvmStatusResult *res) {
+    MiniKvmStatusCommand cmd = {0};
+
+    cmd.type = type;
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, res) != 0 || res->error != MINI_KVM_SUCCESS ||
+        res->cmd_type != type) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// read-only client, issues status requests as fast as possible
+static void *reader_run(__attribute__((unused)) void *args) {
+    struct sockaddr_un addr = {0};
+    MiniKvmStatusResult res;
+    int32_t sock = mini_kvm_ipc_connect(vm_name, &addr);
+
+    if (sock < 0) {
+        __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < LOAD_ROUNDS; i++) {
+        if (send_cmd(sock, MINI_KVM_COMMAND_SHOW_STATE, &res) < 0) {
+            __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    close(sock);
+    return NULL;
+}
+
+// pause or resume, the mutators race each other so the VM may already be in the target state
+static int32_t send_transition(int32_t sock, MiniKvmStatusCommandType type, MiniKVMError rejected) {
+    MiniKvmStatusCommand cmd = {0};
+    MiniKvmStatusResult res;
+
+    cmd.type = type;
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) != 0 || res.cmd_type != type ||
+        (res.error != MINI_KVM_SUCCESS && res.error != rejected)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// mutating client, pauses and resumes the VM while the readers are running
+static void *mutator_run(__attribute__((unused)) void *args) {
+    struct sockaddr_un addr = {0};
+    int32_t sock = mini_kvm_ipc_connect(vm_name, &addr);
+
+    if (sock < 0) {
+        __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        if (send_transition(sock, MINI_KVM_COMMAND_PAUSE, MINI_KVM_STATUS_CMD_VM_NOT_RUNNING) < 0 ||
+            send_transition(sock, MINI_KVM_COMMAND_RESUME, MINI_KVM_STATUS_CMD_VM_NOT_PAUSED) < 0) {
+            __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    close(sock);
+    return NULL;
+}
+
+// single client issuing requests back to back, measures the round-trip latency of the protocol
+static int32_t sequential_run() {
+    struct sockaddr_un addr = {0};
+    MiniKvmStatusResult res;
+    uint64_t start = 0, elapsed = 0;
+    int32_t sock = mini_kvm_ipc_connect(vm_name, &addr);
+
+    if (sock < 0) {
+        return -1;
+    }
+
+    start = mini_kvm_now_ns();
+    for (uint32_t i = 0; i < LOAD_SEQUENTIAL_ROUNDS; i++) {
+        if (send_cmd(sock, MINI_KVM_COMMAND_SHOW_STATE, &res) < 0) {
+            close(sock);
+            return -1;
+        }
+    }
+    elapsed = mini_kvm_now_ns() - start;
+    close(sock);
+
+    printf("1 client x %d requests in %.3f ms (%.0f round-trips/s)\n", LOAD_SEQUENTIAL_ROUNDS,
+           elapsed / 1e6, LOAD_SEQUENTIAL_ROUNDS / (elapsed / 1e9));
+    return 0;
+}
+
+// single client keeping LOAD_PIPELINE_DEPTH requests in flight, replies must come back in order
+static int32_t pipelined_run() {
+    struct sockaddr_un addr = {0};
+    MiniKvmStatusCommand cmd = {.type = MINI_KVM_COMMAND_SHOW_STATE};
+    MiniKvmStatusResult res;
+    uint64_t start = 0, elapsed = 0;
+    uint32_t sent = 0, id = 0;
+    int32_t ret = -1;
+    int32_t sock = mini_kvm_ipc_connect(vm_name, &addr);
+
+    if (sock < 0) {
+        return -1;
+    }
+
+    start = mini_kvm_now_ns();
+    for (uint32_t received = 0; received < LOAD_SEQUENTIAL_ROUNDS; received++) {
+        while (sent < LOAD_SEQUENTIAL_ROUNDS && sent - received < LOAD_PIPELINE_DEPTH) {
+            if (mini_kvm_ipc_send_request(sock, sent++, &cmd) < 0) {
+                goto out;
+            }
+        }
+
+        if (mini_kvm_ipc_recv_result(sock, &id, &res) < 0 || id != received ||
+            res.error != MINI_KVM_SUCCESS) {
+            goto out;
+        }
+    }
+    elapsed = mini_kvm_now_ns() - start;
+
+    // an unknown command is rejected, the reply echoes its type
+    cmd.type = MINI_KVM_COMMAND_COUNT;
+    if (mini_kvm_ipc_send_request(sock, sent, &cmd) < 0 ||
+        mini_kvm_ipc_recv_result(sock, &id, &res) < 0 || id != sent ||
+        res.error != MINI_KVM_IPC_PROTOCOL_ERROR || res.cmd_type != MINI_KVM_COMMAND_COUNT) {
+        printf("unknown command was not rejected with its type\n");
+        goto out;
+    }
+    ret = 0;
+
+    printf("1 client x %d requests, %d in flight, in %.3f ms (%.0f round-trips/s)\n",
+           LOAD_SEQUENTIAL_ROUNDS, LOAD_PIPELINE_DEPTH, elapsed / 1e6,
+           LOAD_SEQUENTIAL_ROUNDS / (elapsed / 1e9));
+
+out:
+    close(sock);
+    return ret;
+}
+
+// dump the loaded kernel back through the memory stream and check the reply framing still holds
+static int32_t dump_run(const char *kernel) {
+    struct sockaddr_un addr = {0};
+    MiniKvmStatusCommand cmd = {.type = MINI_KVM_COMMAND_DUMP_MEM};
+    MiniKvmStatusResult res;
+    uint8_t expected[4096], dumped[4096];
+    int32_t ret = -1, sock = -1, fd = -1;
+    ssize_t len = 0;
+
+    if ((fd = open(kernel, O_RDONLY)) < 0 || (len = read(fd, expected, sizeof(expected))) <= 0) {
+        goto out;
+    }
+
+    cmd.mem_range[0] = BOOTLOADER_ADDR;
+    cmd.mem_range[1] = BOOTLOADER_ADDR + len;
+    cmd.mem_range[2] = 1;
+    cmd.mem_range[3] = 16;
+    if ((sock = mini_kvm_ipc_connect(vm_name, &addr)) < 0 ||
+        send_cmd(sock, MINI_KVM_COMMAND_PAUSE, &res) < 0 ||
+        mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS ||
+        res.mem_range[1] - res.mem_range[0] != len ||
+        mini_kvm_ipc_recv_data(sock, dumped, len) < 0) {
+        goto out;
+    }
+
+    if (memcmp(expected, dumped, len) != 0) {
+        printf("dumped memory does not match the kernel image\n");
+        goto out;
+    }
+
+    // a line longer than a stream chunk is rejected instead of streaming nothing forever
+    cmd.mem_range[3] = 2 << 20;
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 ||
+        res.error != MINI_KVM_STATUS_CMD_INVALID_MEM_RANGE) {
+        printf("a %ld bytes dump line was not rejected\n", cmd.mem_range[3]);
+        goto out;
+    }
+
+    // only a running VM can be paused
+    cmd.type = MINI_KVM_COMMAND_PAUSE;
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 ||
+        res.error != MINI_KVM_STATUS_CMD_VM_NOT_RUNNING) {
+        printf("pausing a paused VM was not rejected\n");
+        goto out;
+    }
+
+    if (send_cmd(sock, MINI_KVM_COMMAND_SHOW_STATE, &res) < 0 || res.state != MINI_KVM_PAUSED ||
+        send_cmd(sock, MINI_KVM_COMMAND_RESUME, &res) < 0) {
+        goto out;
+    }
+    ret = 0;
+
+out:
+    if (sock >= 0) {
+        close(sock);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ret;
+}
+
+// the guest prints its message (one io exit per byte) then halts, a reset clears the counters
+static int32_t stats_run() {
+    struct sockaddr_un addr = {0};
+    MiniKvmStatusCommand cmd = {.type = MINI_KVM_COMMAND_RESET_STATS, .vcpus = ~0UL};
+    MiniKvmStatusResult res;
+    int32_t ret = -1, sock = mini_kvm_ipc_connect(vm_name, &addr);
+
+    if (sock < 0) {
+        return -1;
+    }
+
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS ||
+        res.vcpus != 1 || res.stats[0].exits[KVM_EXIT_IO] != strlen("Hello world\n") ||
+        res.stats[0].run_total_ns == 0) {
+        goto out;
+    }
+
+    cmd.type = MINI_KVM_COMMAND_SHOW_STATS;
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS ||
+        res.vcpus != 1 || res.stats[0].exits[KVM_EXIT_IO] != 0) {
+        goto out;
+    }
+    ret = 0;
+
+out:
+    close(sock);
+    return ret;
+}
+
+// KVM binary stats of the VM and the vcpu are sampled without debugfs, the guest exits did count
+static int32_t kvm_stats_run() {
+    struct sockaddr_un addr = {0};
+    MiniKvmStatusCommand cmd = {.type = MINI_KVM_COMMAND_SHOW_KVM_STATS, .vcpus = ~0UL};
+    MiniKvmStatusResult res = {0};
+    const uint64_t *exits = NULL;
+    int32_t ret = -1, sock = mini_kvm_ipc_connect(vm_name, &addr);
+
+    if (sock < 0) {
+        return -1;
+    }
+
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS ||
+        res.vcpus != 1) {
+        goto out;
+    }
+
+    // older kernels have no binary stats
+    exits = mini_kvm_binstats_find(res.kvm_stats, res.kvm_stats_len, 0, "exits", NULL);
+    if (res.kvm_stats_len != 0 && (exits == NULL || *exits < strlen("Hello world\n"))) {
+        goto out;
+    }
+    ret = 0;
+
+out:
+    mini_kvm_status_clean_result(&res);
+    close(sock);
+    return ret;
+}
+
+// every startup phase of the running VM ended, in order
+static int32_t startup_run() {
+    struct sockaddr_un addr = {0};
+    MiniKvmStatusResult res = {0};
+    uint64_t last_ns = 0;
+    int32_t ret = -1, sock = mini_kvm_ipc_connect(vm_name, &addr);
+
+    if (sock < 0) {
+        return -1;
+    }
+
+    if (send_cmd(sock, MINI_KVM_COMMAND_SHOW_STARTUP, &res) < 0 || res.startup.vcpu_count != 1) {
+        goto out;
+    }
+
+    last_ns = res.startup.start_ns;
+    for (uint32_t phase = 0; phase < MINI_KVM_STARTUP_PHASES; phase++) {
+        if (res.startup.end_ns[phase] < last_ns) {
+            goto out;
+        }
+        last_ns = res.startup.end_ns[phase];
+    }
+    ret = 0;
+
+out:
+    close(sock);
+    return ret;
+}
+
+// the CPUID table of the vcpus carries the paravirtual leaves
+static int32_t cpuid_run() {
+    struct sockaddr_un addr = {0};
+    MiniKvmStatusResult res = {0};
+    int32_t ret = -1, sock = mini_kvm_ipc_connect(vm_name, &addr);
+
+    if (sock < 0) {
+        return -1;
+    }
+
+    if (send_cmd(sock, MINI_KVM_COMMAND_SHOW_CPUID, &res) < 0 || res.cpuid_len == 0) {
+        goto out;
+    }
+    for (uint32_t i = 0; i < res.cpuid_len; i++) {
+        ret = (res.cpuid[i].function == 0x40000000) ? 0 : ret;
+    }
+
+out:
+    mini_kvm_status_clean_result(&res);
+    close(sock);
+    return ret;
+}
+
+// the halted vcpu leaves KVM_RUN when it is kicked, the kicks show up in its trace ring
+static int32_t trace_run() {
+    struct sockaddr_un addr = {0};
+    MiniKvmStatusCommand cmd = {.type = MINI_KVM_COMMAND_TRACE_START};
+    MiniKvmStatusResult res = {0};
+    int32_t ret = -1, sock = mini_kvm_ipc_connect(vm_name, &addr);
+
+    if (sock < 0) {
+        return -1;
+    }
+
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS ||
+        res.vcpus != 1) {
+        goto out;
+    }
+
+    // restarting an active session waits for the vcpus before resetting the rings
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS) {
+        goto out;
+    }
+
+    cmd.type = MINI_KVM_COMMAND_SHOW_REGS;
+    cmd.vcpus = 1;
+    for (uint32_t i = 0; i < 8; i++) {
+        if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS) {
+            goto out;
+        }
+    }
+
+    cmd.type = MINI_KVM_COMMAND_TRACE_STOP;
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS) {
+        goto out;
+    }
+
+    // kicks landing outside of KVM_RUN are coalesced, the exact number of exits may vary
+    cmd.type = MINI_KVM_COMMAND_TRACE_FETCH;
+    if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS ||
+        res.trace_len == 0) {
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < res.trace_len; i++) {
+        MiniKvmTraceEvent *event = &res.trace[i];
+        if (event->reason != KVM_EXIT_INTR || event->exit_tsc < event->entry_tsc) {
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    mini_kvm_status_clean_result(&res);
+    close(sock);
+    return ret;
+}
+
+// registers are read while the guest runs, the vcpu publishes them without pausing the VM
+static int32_t regs_run() {
+    struct sockaddr_un addr = {0};
+    MiniKvmStatusCommand cmd = {.type = MINI_KVM_COMMAND_SHOW_REGS, .vcpus = ~0UL};
+    MiniKvmStatusResult res;
+    int32_t ret = -1, sock = mini_kvm_ipc_connect(vm_name, &addr);
+
+    if (sock < 0) {
+        return -1;
+    }
+
+    if (send_cmd(sock, MINI_KVM_COMMAND_SHOW_STATE, &res) < 0 || res.state != MINI_KVM_RUNNING) {
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < 64; i++) {
+        if (mini_kvm_ipc_send_cmd(sock, &cmd, &res) < 0 || res.error != MINI_KVM_SUCCESS ||
+            res.vcpus != 1 || res.regs[0].rip == 0 || res.sregs[0].cr0 == 0) {
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    close(sock);
+    return ret;
+}
+
+static pid_t spawn_vm(const char *mkvm, const char *kernel) {
+    char kernel_arg[512], name_arg[128];
+    int32_t null_fd = -1;
+    pid_t pid = fork();
+
+    if (pid != 0) {
+        return pid;
+    }
+
+    null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    snprintf(kernel_arg, sizeof(kernel_arg), "--kernel=%s", kernel);
+    snprintf(name_arg, sizeof(name_arg), "--name=%s", vm_name);
+    execl(mkvm, mkvm, "run", "--mem=1M", kernel_arg, name_arg, NULL);
+    exit(1);
+}
+
+static int32_t wait_vm() {
+    struct sockaddr_un addr = {0};
+    int32_t sock = -1;
+
+    logger_set_level(LogDisable);
+    for (uint32_t waited = 0; waited < LOAD_STARTUP_TIMEOUT_MS; waited += 10) {
+        if (mini_kvm_check_vm(vm_name) == 0 && (sock = mini_kvm_ipc_connect(vm_name, &addr)) >= 0) {
+            close(sock);
+            logger_set_level(LogInfo);
+            return 0;
+        }
+        usleep(10000);
+    }
+
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    pthread_t readers[LOAD_CLIENTS], mutators[LOAD_MUTATORS];
+    struct sockaddr_un addr = {0};
+    MiniKvmStatusResult res;
+    uint64_t start = 0, elapsed = 0;
+    int32_t sock = -1, status = 0;
+    pid_t pid = 0;
+
+    if (argc < 3) {
+        printf("usage: %s <mkvm> <kernel>\n", argv[0]);
+        return 1;
+    }
+
+    if (access("/dev/kvm", R_OK | W_OK) != 0) {
+        printf("/dev/kvm is not available, skipping\n");
+        return SKIP_RETURN_CODE;
+    }
+
+    snprintf(vm_name, sizeof(vm_name), "ipc_load_%d", getpid());
+    pid = spawn_vm(argv[1], argv[2]);
+    if (pid < 0 || wait_vm() < 0) {
+        printf("failed to start VM %s\n", vm_name);
+        kill(pid, SIGKILL);
+        return 1;
+    }
+
+    if (sequential_run() < 0) {
+        printf("sequential requests failed\n");
+        failures++;
+    }
+
+    if (pipelined_run() < 0) {
+        printf("pipelined requests failed\n");
+        failures++;
+    }
+
+    if (stats_run() < 0) {
+        printf("vcpu stats failed\n");
+        failures++;
+    }
+
+    if (kvm_stats_run() < 0) {
+        printf("kvm binary stats failed\n");
+        failures++;
+    }
+
+    if (startup_run() < 0) {
+        printf("startup profile failed\n");
+        failures++;
+    }
+
+    if (cpuid_run() < 0) {
+        printf("cpuid table failed\n");
+        failures++;
+    }
+
+    if (trace_run() < 0) {
+        printf("exit trace failed\n");
+        failures++;
+    }
+
+    if (regs_run() < 0) {
+        printf("live register snapshots failed\n");
+        failures++;
+    }
+
+    if (dump_run(argv[2]) < 0) {
+        printf("memory dump failed\n");
+        failures++;
+    }
+
+    start = mini_kvm_now_ns();
+    for (uint32_t i = 0; i < LOAD_MUTATORS; i++) {
+        pthread_create(&mutators[i], NULL, mutator_run, NULL);
+    }
+    for (uint32_t i = 0; i < LOAD_CLIENTS; i++) {
+        pthread_create(&readers[i], NULL, reader_run, NULL);
+    }
+    for (uint32_t i = 0; i < LOAD_CLIENTS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    elapsed = mini_kvm_now_ns() - start;
+
+    __atomic_store_n(&done, 1, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < LOAD_MUTATORS; i++) {
+        pthread_join(mutators[i], NULL);
+    }
+
+    printf("%d clients x %d requests in %.3f ms (%.0f round-trips/s), %d failures\n", LOAD_CLIENTS,
+           LOAD_ROUNDS, elapsed / 1e6, LOAD_CLIENTS * LOAD_ROUNDS / (elapsed / 1e9), failures);
+
+    if ((sock = mini_kvm_ipc_connect(vm_name, &addr)) < 0 ||
+        send_cmd(sock, MINI_KVM_COMMAND_SHUTDOWN, &res) < 0) {
+        printf("failed to shutdown VM %s\n", vm_name);
+        kill(pid, SIGKILL);
+        failures++;
+    }
+    close(sock);
+    waitpid(pid, &status, 0);
+
+    return failures != 0;
+}
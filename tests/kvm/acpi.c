@@ -0,0 +1,111 @@
+#include "kvm/acpi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define GUEST_MEM_SIZE (2UL << 20)
+#define NB_VCPUS 4
+
+static uint8_t checksum(const void *data, uint64_t len) {
+    uint8_t sum = 0;
+
+    for (uint64_t i = 0; i < len; i++) {
+        sum += ((const uint8_t *)data)[i];
+    }
+    return sum;
+}
+
+// every table of the XSDT has a valid checksum, the MADT lists each vcpu and the IOAPIC
+static int32_t check_acpi(Kvm *kvm) {
+    const uint8_t *mem = (uint8_t *)kvm->mem;
+    const AcpiRsdp *rsdp = (AcpiRsdp *)(mem + kvm->rsdp_addr);
+    const AcpiHeader *xsdt = (AcpiHeader *)(mem + rsdp->xsdt_addr);
+    const uint64_t *tables = (uint64_t *)(xsdt + 1);
+    uint32_t lapics = 0, ioapics = 0;
+
+    if (kvm->rsdp_addr != ACPI_RSDP_ADDR || memcmp(rsdp->signature, "RSD PTR ", 8) != 0 ||
+        checksum(rsdp, 20) != 0 || checksum(rsdp, sizeof(AcpiRsdp)) != 0) {
+        printf("invalid RSDP\n");
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < (xsdt->length - sizeof(AcpiHeader)) / sizeof(uint64_t); i++) {
+        const AcpiHeader *table = (AcpiHeader *)(mem + tables[i]);
+
+        if (checksum(table, table->length) != 0) {
+            printf("invalid checksum for table %.4s\n", table->signature);
+            return 1;
+        }
+        if (memcmp(table->signature, "APIC", 4) != 0) {
+            continue;
+        }
+
+        for (const uint8_t *entry = (uint8_t *)table + sizeof(AcpiMadt);
+             entry < (uint8_t *)table + table->length; entry += entry[1]) {
+            lapics += entry[0] == ACPI_MADT_LAPIC && ((AcpiMadtLapic *)entry)->apic_id == lapics;
+            ioapics += entry[0] == ACPI_MADT_IOAPIC;
+        }
+    }
+
+    if (checksum(xsdt, xsdt->length) != 0 || lapics != NB_VCPUS || ioapics != 1) {
+        printf("MADT has %u local APICs and %u IOAPICs\n", lapics, ioapics);
+        return 1;
+    }
+    return 0;
+}
+
+static int32_t check_mptable(Kvm *kvm) {
+    const uint8_t *mem = (uint8_t *)kvm->mem;
+    const MpFloating *floating = (MpFloating *)(mem + MPTABLE_ADDR);
+    const MpConfig *config = (MpConfig *)(mem + floating->config_addr);
+    const uint8_t *entry = (uint8_t *)(config + 1);
+    uint32_t processors = 0;
+
+    if (memcmp(floating->signature, "_MP_", 4) != 0 || checksum(floating, 16) != 0 ||
+        memcmp(config->signature, "PCMP", 4) != 0 || checksum(config, config->length) != 0) {
+        printf("invalid MP table checksums\n");
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < config->entries; i++) {
+        processors += entry[0] == MP_PROCESSOR;
+        entry += (entry[0] == MP_PROCESSOR) ? sizeof(MpProcessor) : sizeof(MpInterrupt);
+    }
+    if (processors != NB_VCPUS || entry != (uint8_t *)config + config->length) {
+        printf("MP table has %u processors\n", processors);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    VCpu vcpus[NB_VCPUS] = {0};
+    vec_VCpu vec = {vcpus, NB_VCPUS, NB_VCPUS};
+    Kvm kvm = {.mem_size = GUEST_MEM_SIZE, .vcpus = &vec};
+    int32_t ret = 0;
+
+    for (uint32_t i = 0; i < NB_VCPUS; i++) {
+        vcpus[i].id = i;
+    }
+    kvm.mem =
+        mmap(NULL, GUEST_MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (kvm.mem == MAP_FAILED || mini_kvm_setup_acpi(&kvm) != 0 ||
+        mini_kvm_setup_mptable(&kvm) != 0) {
+        printf("failed to write the tables\n");
+        return 1;
+    }
+    ret |= check_acpi(&kvm);
+    ret |= check_mptable(&kvm);
+
+    // the tables live in the BIOS area, smaller VMs have none
+    kvm.mem_size = 512 << 10;
+    if (mini_kvm_setup_acpi(&kvm) != 0 || kvm.rsdp_addr != 0) {
+        printf("ACPI tables were written past the end of memory\n");
+        ret |= 1;
+    }
+
+    munmap(kvm.mem, GUEST_MEM_SIZE);
+    return ret;
+}
@@ -0,0 +1,101 @@
+#include "core/constants.h"
+#include "kvm/kvm.h"
+
+#include <asm/kvm_para.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define SKIP_RETURN_CODE 77
+#define NB_VCPUS 4
+
+// frequency of the host TSC as reported for a new vcpu, KVM accepts it even without TSC scaling
+static int32_t host_tsc_khz(int32_t kvm_fd) {
+    int32_t vm_fd = ioctl(kvm_fd, KVM_CREATE_VM, 0), vcpu_fd = -1, khz = -1;
+
+    if (vm_fd >= 0 && (vcpu_fd = ioctl(vm_fd, KVM_CREATE_VCPU, 0)) >= 0) {
+        khz = ioctl(vcpu_fd, KVM_GET_TSC_KHZ);
+        close(vcpu_fd);
+    }
+    close(vm_fd);
+    return khz;
+}
+
+// kvmclock is advertised as stable only when the TSC offsets are synced, and the timing leaf holds
+// the TSC frequency
+static int32_t check_cpuid(Kvm *kvm) {
+    struct kvm_cpuid_entry2 *signature = mini_kvm_find_cpuid(kvm, KVM_CPUID_SIGNATURE, 0);
+    struct kvm_cpuid_entry2 *features = mini_kvm_find_cpuid(kvm, KVM_CPUID_FEATURES, 0);
+    struct kvm_cpuid_entry2 *timing = mini_kvm_find_cpuid(kvm, CPUID_TIMING_INFO, 0);
+    struct kvm_device_attr attr = {.group = KVM_VCPU_TSC_CTRL, .attr = KVM_VCPU_TSC_OFFSET};
+    bool synced = ioctl(kvm->vcpus->tab[0].fd, KVM_HAS_DEVICE_ATTR, &attr) == 0;
+
+    if (features == NULL || !(features->eax & (1 << KVM_FEATURE_CLOCKSOURCE2)) ||
+        !(features->eax & (1 << KVM_FEATURE_CLOCKSOURCE_STABLE_BIT)) != !synced) {
+        printf("kvmclock stability does not match the TSC offset sync (%d)\n", synced);
+        return 1;
+    }
+    if (timing == NULL || timing->eax != kvm->tsc_khz || signature->eax < CPUID_TIMING_INFO) {
+        printf("timing leaf missing\n");
+        return 1;
+    }
+    return 0;
+}
+
+// every vcpu runs at the requested frequency with the TSC offset of vcpu 0
+static int32_t check_tsc(Kvm *kvm) {
+    uint64_t offset = 0, first = 0;
+    struct kvm_device_attr attr = {
+        .group = KVM_VCPU_TSC_CTRL, .attr = KVM_VCPU_TSC_OFFSET, .addr = (uint64_t)&offset};
+
+    for (uint32_t i = 0; i < kvm->vcpus->len; i++) {
+        VCpu *vcpu = &kvm->vcpus->tab[i];
+
+        if ((uint32_t)ioctl(vcpu->fd, KVM_GET_TSC_KHZ) != kvm->tsc_khz) {
+            printf("vcpu %u does not run at %u kHz\n", i, kvm->tsc_khz);
+            return 1;
+        }
+        if (ioctl(vcpu->fd, KVM_GET_DEVICE_ATTR, &attr) < 0) {
+            printf("TSC offset attribute unsupported, skipping the offset check\n");
+            return 0;
+        }
+        first = (i == 0) ? offset : first;
+        if (offset != first) {
+            printf("vcpu %u TSC offset %lu differs from vcpu 0 (%lu)\n", i, offset, first);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(void) {
+    int32_t kvm_fd = open("/dev/kvm", O_RDWR | O_CLOEXEC), khz = 0, ret = 0;
+    Kvm *kvm = NULL;
+
+    if (kvm_fd < 0) {
+        printf("no /dev/kvm, skipping the clock checks\n");
+        return SKIP_RETURN_CODE;
+    }
+    khz = host_tsc_khz(kvm_fd);
+    close(kvm_fd);
+    if (khz <= 0) {
+        printf("failed to get the host TSC frequency\n");
+        return 1;
+    }
+
+    kvm = calloc(1, sizeof(Kvm));
+    kvm->tsc_khz = khz;
+    if (mini_kvm_setup_kvm(kvm, MINIMUM_MEMORY_REQUIRED) != 0 ||
+        mini_kvm_add_vcpus(kvm, NB_VCPUS) != 0) {
+        printf("failed to create the VM\n");
+        mini_kvm_clean_kvm(kvm);
+        return 1;
+    }
+    ret |= check_cpuid(kvm);
+    ret |= check_tsc(kvm);
+
+    mini_kvm_clean_kvm(kvm);
+    return ret;
+}
@@ -0,0 +1,127 @@
+#include "kvm/cpuid.h"
+
+#include <asm/kvm_para.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "core/constants.h"
+
+#define NB_LEAVES 11
+#define NB_FEATURE_LEAVES 5
+#define KVM_PV_FEATURES 0x01007efb // paravirtual features reported by KVM 6.x
+#define BASELINE_EDX 0x078bfbff    // leaf 0x1 edx of every x86-64 CPU
+#define XSAVE_AVX512_SIZE 2688     // legacy region, header, AVX and AVX-512 components
+
+// every feature bit set, like a host supporting all the features, and the XSAVE components of a
+// host with AVX-512 and PKRU
+static void fill_table(struct kvm_cpuid2 *cpuid) {
+    static const uint32_t functions[NB_FEATURE_LEAVES] = {0x1, 0x7, CPUID_EXT_FEATURES,
+                                                          CPUID_EXT_POWER, KVM_CPUID_FEATURES};
+    static const struct kvm_cpuid_entry2 others[NB_LEAVES - NB_FEATURE_LEAVES] = {
+        {.function = 0x7, .index = 1, .eax = ~0U, .edx = ~0U},
+        {.function = CPUID_XSAVE, .index = 0, .eax = 0x2e7, .ebx = 576, .ecx = 2696},
+        {.function = CPUID_XSAVE, .index = 1, .eax = 0x1f, .ecx = 0x1900},
+        {.function = CPUID_XSAVE, .index = 2, .eax = 256, .ebx = 576},
+        {.function = CPUID_XSAVE, .index = 7, .eax = 1024, .ebx = 1664},
+        {.function = CPUID_XSAVE, .index = 9, .eax = 8, .ebx = 2688},
+    };
+
+    cpuid->nent = NB_LEAVES;
+    for (uint32_t i = 0; i < NB_FEATURE_LEAVES; i++) {
+        cpuid->entries[i] = (struct kvm_cpuid_entry2){
+            .function = functions[i], .eax = ~0U, .ebx = ~0U, .ecx = ~0U, .edx = ~0U};
+    }
+    cpuid->entries[NB_FEATURE_LEAVES - 1].eax = KVM_PV_FEATURES;
+    cpuid->entries[NB_FEATURE_LEAVES - 1].edx = 0;
+    for (uint32_t i = NB_FEATURE_LEAVES; i < NB_LEAVES; i++) {
+        cpuid->entries[i] = others[i - NB_FEATURE_LEAVES];
+    }
+}
+
+// the host model keeps the table, overrides only change their own bits
+static int32_t check_host(Kvm *kvm) {
+    struct kvm_cpuid_entry2 *leaf1 = mini_kvm_find_cpuid(kvm, 0x1, 0);
+    struct kvm_cpuid_entry2 *pv = mini_kvm_find_cpuid(kvm, KVM_CPUID_FEATURES, 0);
+
+    if (mini_kvm_cpuid_apply(kvm, "host,-x2apic,-kvm-pv-unhalt,+kvm-hint-dedicated") != 0 ||
+        leaf1->ecx != ~(1U << 21) ||
+        pv->eax != (KVM_PV_FEATURES & ~(1U << KVM_FEATURE_PV_UNHALT)) ||
+        pv->edx != (1U << KVM_HINTS_REALTIME)) {
+        printf("host overrides were not applied\n");
+        return 1;
+    }
+    return 0;
+}
+
+// a named model only keeps the baseline and its features, unknown bits are cleared
+static int32_t check_model(Kvm *kvm) {
+    struct kvm_cpuid_entry2 *leaf1 = mini_kvm_find_cpuid(kvm, 0x1, 0);
+    struct kvm_cpuid_entry2 *leaf7 = mini_kvm_find_cpuid(kvm, 0x7, 0);
+    struct kvm_cpuid_entry2 *ext = mini_kvm_find_cpuid(kvm, CPUID_EXT_FEATURES, 0);
+    struct kvm_cpuid_entry2 *pv = mini_kvm_find_cpuid(kvm, KVM_CPUID_FEATURES, 0);
+    struct kvm_cpuid_entry2 *xsave = NULL;
+
+    if (mini_kvm_cpuid_apply(kvm, "x86-64-v2,+avx2") != 0) {
+        printf("x86-64-v2 was rejected\n");
+        return 1;
+    }
+    if (!(leaf1->ecx & (1 << 20)) || (leaf1->ecx & (1 << 28)) || leaf1->edx != BASELINE_EDX ||
+        leaf7->ebx != (1 << 5) || leaf7->ecx != 0 || leaf7->edx != 0 ||
+        mini_kvm_find_cpuid(kvm, 0x7, 1)->eax != 0 ||
+        ext->ecx != (1 << 0) || ext->edx != 0x20100800) {
+        printf("x86-64-v2 CPU features are wrong\n");
+        return 1;
+    }
+    if (!(pv->eax & (1 << KVM_FEATURE_PV_SEND_IPI)) || !(pv->eax & (1 << KVM_FEATURE_STEAL_TIME)) ||
+        pv->eax & (1 << KVM_FEATURE_POLL_CONTROL)) {
+        printf("x86-64-v2 paravirtual features are wrong\n");
+        return 1;
+    }
+    xsave = mini_kvm_find_cpuid(kvm, CPUID_XSAVE, 0);
+    if (kvm->cpuid->nent != NB_FEATURE_LEAVES + 3 || xsave->eax != 0x3 || xsave->ecx != 576 ||
+        mini_kvm_find_cpuid(kvm, CPUID_XSAVE, 1)->eax != 0) {
+        printf("x86-64-v2 XSAVE components are wrong\n");
+        return 1;
+    }
+
+    // AVX and AVX-512 components are kept, PKRU is not
+    fill_table(kvm->cpuid);
+    xsave = mini_kvm_find_cpuid(kvm, CPUID_XSAVE, 0);
+    if (mini_kvm_cpuid_apply(kvm, "x86-64-v4") != 0 || xsave->eax != 0xe7 ||
+        xsave->ecx != XSAVE_AVX512_SIZE || kvm->cpuid->nent != NB_LEAVES - 1 ||
+        mini_kvm_find_cpuid(kvm, CPUID_XSAVE, 9) != NULL ||
+        mini_kvm_find_cpuid(kvm, CPUID_XSAVE, 1)->ecx != 0) {
+        printf("x86-64-v4 XSAVE components are wrong\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int32_t check_errors(Kvm *kvm) {
+    static const char *const specs[] = {"pentium", "host,avx", "host,+avx9",
+                                        "host,+kvm-msi-ext-dest-id", ""};
+
+    for (uint32_t i = 0; i < sizeof(specs) / sizeof(specs[0]); i++) {
+        fill_table(kvm->cpuid);
+        if (mini_kvm_cpuid_apply(kvm, specs[i]) == 0) {
+            printf("invalid CPU model %s was accepted\n", specs[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(void) {
+    Kvm kvm = {0};
+    int32_t ret = 0;
+
+    kvm.cpuid = calloc(1, sizeof(struct kvm_cpuid2) + NB_LEAVES * sizeof(struct kvm_cpuid_entry2));
+    fill_table(kvm.cpuid);
+    ret |= check_host(&kvm);
+    fill_table(kvm.cpuid);
+    ret |= check_model(&kvm);
+    ret |= check_errors(&kvm);
+
+    free(kvm.cpuid);
+    return ret;
+}
@@ -0,0 +1,116 @@
+#include "kvm/irq.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define SKIP_RETURN_CODE 77
+#define DEFAULT_ROUTES 40 // 24 IOAPIC pins and 16 PIC inputs
+#define QUEUES 4
+
+static uint32_t msi_routes(MiniKvmIrq *irq) {
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < irq->routing->nr; i++) {
+        count += irq->routing->entries[i].type == KVM_IRQ_ROUTING_MSI;
+    }
+    return count;
+}
+
+// allocation and routing table updates, no VM needed
+static int32_t check_allocator(MiniKvmIrq *irq) {
+    uint32_t pin = 0, first = 0, second = 0, reused = 0;
+
+    if (irq->routing->nr != DEFAULT_ROUTES || irq->dirty) {
+        printf("default routing has %u routes\n", irq->routing->nr);
+        return 1;
+    }
+
+    if (mini_kvm_irq_alloc_pin(irq, &pin) != 0 || pin != 16 ||
+        mini_kvm_irq_alloc_msi(irq, QUEUES, &first) != 0 || first != 24 ||
+        mini_kvm_irq_alloc_msi(irq, QUEUES, &second) != 0 || second != first + QUEUES) {
+        printf("unexpected GSIs pin=%u first=%u second=%u\n", pin, first, second);
+        return 1;
+    }
+
+    // one vector per queue, each one targets a different APIC ID
+    for (uint32_t i = 0; i < QUEUES; i++) {
+        if (mini_kvm_irq_set_msi(irq, first + i, 0xfee00000 | (i << 12), 0x40 + i) != 0) {
+            printf("failed to route GSI %u\n", first + i);
+            return 1;
+        }
+    }
+    if (msi_routes(irq) != QUEUES || !irq->dirty ||
+        mini_kvm_irq_set_msi(irq, pin, 0xfee00000, 0) == 0) {
+        printf("MSI routes were not added\n");
+        return 1;
+    }
+
+    // masking a vector removes its route, freeing a range removes the remaining ones
+    mini_kvm_irq_set_msi(irq, first, 0, 0);
+    mini_kvm_irq_free(irq, first, QUEUES);
+    if (msi_routes(irq) != 0 || mini_kvm_irq_alloc_msi(irq, 2, &reused) != 0 || reused != first) {
+        printf("freed GSIs were not released\n");
+        return 1;
+    }
+    mini_kvm_irq_free(irq, reused, 2);
+    mini_kvm_irq_free(irq, second, QUEUES);
+    mini_kvm_irq_free(irq, pin, 1);
+
+    return 0;
+}
+
+// install routes and an irqfd in a VM with an in kernel irqchip
+static int32_t check_kvm(void) {
+    int32_t kvm_fd = open("/dev/kvm", O_RDWR | O_CLOEXEC), vm_fd = -1, fd = -1, ret = 1;
+    uint64_t one = 1;
+    uint32_t gsi = 0;
+    MiniKvmIrq irq = {0};
+
+    if (kvm_fd < 0) {
+        printf("no /dev/kvm, skipping the KVM checks\n");
+        return SKIP_RETURN_CODE;
+    }
+    vm_fd = ioctl(kvm_fd, KVM_CREATE_VM, 0);
+    if (vm_fd < 0 || ioctl(vm_fd, KVM_CREATE_IRQCHIP) < 0 || mini_kvm_irq_init(&irq, vm_fd) != 0) {
+        printf("failed to create a VM\n");
+        goto out;
+    }
+
+    fd = eventfd(0, EFD_CLOEXEC);
+    if (mini_kvm_irq_alloc_msi(&irq, 1, &gsi) != 0 ||
+        mini_kvm_irq_set_msi(&irq, gsi, 0xfee00000, 0x40) != 0 || mini_kvm_irq_commit(&irq) != 0 ||
+        mini_kvm_irq_bind_eventfd(&irq, gsi, fd, true) != 0 || write(fd, &one, 8) != 8 ||
+        mini_kvm_irq_set_level(&irq, gsi, true) != 0 ||
+        mini_kvm_irq_bind_eventfd(&irq, gsi, fd, false) != 0) {
+        printf("KVM rejected the routing\n");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    mini_kvm_irq_clean(&irq);
+    close(fd);
+    close(vm_fd);
+    close(kvm_fd);
+    return ret;
+}
+
+int main(void) {
+    MiniKvmIrq irq = {0};
+    int32_t ret = 0;
+
+    if (mini_kvm_irq_init(&irq, -1) != 0) {
+        return 1;
+    }
+    ret |= check_allocator(&irq);
+    mini_kvm_irq_clean(&irq);
+
+    // the allocator checks still fail the test when the KVM ones are skipped
+    if (ret != 0) {
+        return ret;
+    }
+    return check_kvm();
+}
@@ -0,0 +1,298 @@
+#include "core/constants.h"
+#include "kvm/loader.h"
+
+#include <asm/bootparam.h>
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define GUEST_MEM_SIZE (4UL << 20)
+#define IMAGE_SIZE 0x8000
+#define BZIMAGE_SETUP_SIZE 0x400 // one setup sector after the boot sector
+#define INITRD_SIZE 0x1800
+#define PVH_ENTRY 0x100040
+
+// each segment takes a different path: page aligned and mapped, smaller than a page with a bss, and
+// unaligned with a mapped middle page. The first one is linked at a higher half virtual address.
+static const Elf64_Phdr SEGMENTS[] = {
+    {.p_type = PT_LOAD, .p_offset = 0x1000, .p_vaddr = 0xffffffff80100000, .p_paddr = 0x100000,
+     .p_filesz = 0x3000, .p_memsz = 0x3000},
+    {.p_type = PT_LOAD, .p_offset = 0x4123, .p_vaddr = 0x200123, .p_paddr = 0x200123,
+     .p_filesz = 0x200, .p_memsz = 0x2000},
+    {.p_type = PT_LOAD, .p_offset = 0x5800, .p_vaddr = 0x300800, .p_paddr = 0x300800,
+     .p_filesz = 0x2000, .p_memsz = 0x2000},
+};
+#define NB_SEGMENTS (sizeof(SEGMENTS) / sizeof(Elf64_Phdr))
+
+// addresses of the first segment overlapping memory reserved by the VMM, the last one starts in
+// RAM and ends in the ACPI tables
+static const uint64_t RESERVED[] = {0x1000, BOOT_PD_ADDR + 0x2000, 0xf0000, 0xde000};
+#define NB_RESERVED (sizeof(RESERVED) / sizeof(RESERVED[0]))
+
+// RAM given to Linux with GUEST_MEM_SIZE, the boot tables and the legacy hole are left out
+#define BOOT_PD_END (BOOT_PD_ADDR + BOOT_PD_MAX * PAGE_SIZE)
+static const uint64_t RAM_RANGES[][2] = {
+    {BOOTLOADER_ADDR, BOOT_PD_ADDR - BOOTLOADER_ADDR},
+    {BOOT_PD_END, LINUX_EBDA_ADDR - BOOT_PD_END},
+    {LINUX_KERNEL_ADDR, GUEST_MEM_SIZE - LINUX_KERNEL_ADDR},
+};
+#define NB_RAM_RANGES (sizeof(RAM_RANGES) / sizeof(RAM_RANGES[0]))
+
+static int32_t write_file(uint8_t *data, uint64_t size) {
+    char path[] = "/tmp/mini_kvm_loader_XXXXXX";
+    int32_t fd = mkstemp(path);
+
+    unlink(path);
+    if (fd < 0 || write(fd, data, size) != (ssize_t)size) {
+        printf("unable to write the test file\n");
+        return -1;
+    }
+    return fd;
+}
+
+static int32_t write_image(uint8_t *image, uint64_t first_paddr) {
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)image;
+    Elf64_Phdr *phdrs = (Elf64_Phdr *)(image + sizeof(Elf64_Ehdr));
+
+    for (uint32_t i = 0; i < IMAGE_SIZE; i++) {
+        image[i] = i * 7 + 1;
+    }
+    memset(ehdr, 0, sizeof(Elf64_Ehdr));
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_type = ET_EXEC;
+    ehdr->e_machine = EM_X86_64;
+    ehdr->e_entry = SEGMENTS[0].p_vaddr + 0x10;
+    ehdr->e_phoff = sizeof(Elf64_Ehdr);
+    ehdr->e_phentsize = sizeof(Elf64_Phdr);
+    ehdr->e_phnum = NB_SEGMENTS;
+    memcpy(phdrs, SEGMENTS, sizeof(SEGMENTS));
+    phdrs[0].p_paddr = first_paddr;
+
+    return write_file(image, IMAGE_SIZE);
+}
+
+static int32_t check_segments(Kvm *kvm, uint8_t *image) {
+    const uint8_t *mem = (uint8_t *)kvm->mem;
+
+    for (uint32_t i = 0; i < NB_SEGMENTS; i++) {
+        const Elf64_Phdr *phdr = &SEGMENTS[i];
+
+        if (memcmp(mem + phdr->p_paddr, image + phdr->p_offset, phdr->p_filesz) != 0) {
+            printf("segment %u does not match the image\n", i);
+            return 1;
+        }
+        for (uint64_t offset = phdr->p_filesz; offset < phdr->p_memsz; offset++) {
+            if (mem[phdr->p_paddr + offset] != 0) {
+                printf("bss of segment %u is not zero at 0x%lx\n", i, offset);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int32_t write_bzimage(uint8_t *image, uint16_t version) {
+    struct setup_header *hdr = (struct setup_header *)(image + 0x1f1);
+
+    for (uint32_t i = 0; i < IMAGE_SIZE; i++) {
+        image[i] = i * 5 + 3;
+    }
+    memset(hdr, 0, sizeof(struct setup_header));
+    hdr->setup_sects = BZIMAGE_SETUP_SIZE / 512 - 1;
+    hdr->boot_flag = 0xaa55;
+    hdr->jump = 0x66eb; // the header ends at 0x268
+    hdr->header = 0x53726448;
+    hdr->version = version;
+    hdr->initrd_addr_max = 0x7fffffff;
+    hdr->xloadflags = XLF_KERNEL_64;
+    hdr->cmdline_size = 0x7ff;
+    hdr->init_size = 0x10000;
+
+    return write_file(image, IMAGE_SIZE);
+}
+
+static int32_t check_bzimage(Kvm *kvm, uint8_t *image, uint8_t *initrd) {
+    const uint8_t *mem = (uint8_t *)kvm->mem;
+    struct boot_params *params = (struct boot_params *)(mem + LINUX_BOOT_PARAMS_ADDR);
+    uint64_t initrd_addr = (kvm->mem_size - INITRD_SIZE) & ~(PAGE_SIZE - 1UL);
+
+    if (memcmp(mem + LINUX_KERNEL_ADDR, image + BZIMAGE_SETUP_SIZE,
+               IMAGE_SIZE - BZIMAGE_SETUP_SIZE) != 0) {
+        printf("the protected mode kernel does not match the image\n");
+        return 1;
+    }
+    if (params->hdr.type_of_loader != 0xff || params->hdr.version != 0x20f ||
+        strcmp((char *)mem + params->hdr.cmd_line_ptr, "console=ttyS0 quiet") != 0) {
+        printf("boot_params setup header is wrong\n");
+        return 1;
+    }
+    if (params->hdr.ramdisk_image != initrd_addr || params->hdr.ramdisk_size != INITRD_SIZE ||
+        memcmp(mem + initrd_addr, initrd, INITRD_SIZE) != 0) {
+        printf("initrd is not at the top of memory\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < NB_RAM_RANGES; i++) {
+        if (params->e820_entries != NB_RAM_RANGES ||
+            params->e820_table[i].addr != RAM_RANGES[i][0] ||
+            params->e820_table[i].size != RAM_RANGES[i][1] || params->e820_table[i].type != 1) {
+            printf("e820 map is wrong\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// one segment at 1 MiB and the PVH entry note, like a vmlinux
+static int32_t write_pvh_image(uint8_t *image) {
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)image;
+    Elf64_Phdr *phdrs = (Elf64_Phdr *)(image + sizeof(Elf64_Ehdr));
+    Elf64_Nhdr *note = (Elf64_Nhdr *)(image + 0x200);
+    uint32_t pvh_entry = PVH_ENTRY;
+
+    close(write_image(image, 0x100000));
+    ehdr->e_phnum = 2;
+    phdrs[1] = (Elf64_Phdr){.p_type = PT_NOTE, .p_offset = 0x200, .p_filesz = 20};
+    *note = (Elf64_Nhdr){.n_namesz = 4, .n_descsz = 4, .n_type = 18}; // XEN_ELFNOTE_PHYS32_ENTRY
+    memcpy(note + 1, "Xen", 4);
+    memcpy((uint8_t *)(note + 1) + 4, &pvh_entry, 4);
+
+    return write_file(image, IMAGE_SIZE);
+}
+
+static int32_t check_pvh(Kvm *kvm, uint8_t *initrd) {
+    const uint8_t *mem = (uint8_t *)kvm->mem;
+    struct hvm_start_info *start_info = (struct hvm_start_info *)(mem + PVH_START_INFO_ADDR);
+    struct hvm_memmap_table_entry *memmap =
+        (struct hvm_memmap_table_entry *)(mem + start_info->memmap_paddr);
+    struct hvm_modlist_entry *module =
+        (struct hvm_modlist_entry *)(mem + start_info->modlist_paddr);
+
+    if (start_info->magic != XEN_HVM_START_MAGIC_VALUE || start_info->version != 1 ||
+        strcmp((char *)mem + start_info->cmdline_paddr, "console=ttyS0 quiet") != 0) {
+        printf("hvm_start_info is wrong\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < NB_RAM_RANGES; i++) {
+        if (start_info->memmap_entries != NB_RAM_RANGES || memmap[i].addr != RAM_RANGES[i][0] ||
+            memmap[i].size != RAM_RANGES[i][1] || memmap[i].type != XEN_HVM_MEMMAP_TYPE_RAM) {
+            printf("PVH memory map is wrong\n");
+            return 1;
+        }
+    }
+    if (start_info->nr_modules != 1 || module->size != INITRD_SIZE ||
+        memcmp(mem + module->paddr, initrd, INITRD_SIZE) != 0) {
+        printf("the initrd module is wrong\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(void) {
+    uint8_t *image = malloc(IMAGE_SIZE), reread = 0;
+    Kvm kvm = {.mem_size = GUEST_MEM_SIZE};
+    uint64_t entry = 0;
+    int32_t ret = 0, fd = -1;
+
+    kvm.mem = mmap(NULL, GUEST_MEM_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (kvm.mem == MAP_FAILED || (fd = write_image(image, SEGMENTS[0].p_paddr)) < 0) {
+        return 1;
+    }
+
+    if (!mini_kvm_is_elf(fd) || mini_kvm_load_elf(&kvm, fd, IMAGE_SIZE, &entry) != 0) {
+        printf("failed to load the image\n");
+        return 1;
+    }
+    ret |= check_segments(&kvm, image);
+    if (entry != SEGMENTS[0].p_paddr + 0x10) {
+        printf("entry is 0x%lx, expected 0x%lx\n", entry, SEGMENTS[0].p_paddr + 0x10);
+        ret |= 1;
+    }
+
+    // guest writes to mapped pages stay private
+    ((uint8_t *)kvm.mem)[SEGMENTS[0].p_paddr] = 0;
+    if (pread(fd, &reread, 1, SEGMENTS[0].p_offset) != 1 || reread != image[SEGMENTS[0].p_offset]) {
+        printf("a guest write reached the image file\n");
+        ret |= 1;
+    }
+    close(fd);
+
+    // segments cannot cover what the VMM wrote before them: boot page tables and directories,
+    // ACPI and MP tables
+    for (uint32_t i = 0; i < NB_RESERVED; i++) {
+        fd = write_image(image, RESERVED[i]);
+        if (fd < 0 || mini_kvm_load_elf(&kvm, fd, IMAGE_SIZE, &entry) == 0) {
+            printf("a segment at 0x%lx over reserved memory was loaded\n", RESERVED[i]);
+            ret |= 1;
+        }
+        close(fd);
+    }
+
+    uint8_t initrd[INITRD_SIZE];
+    MiniKvmLinuxBoot boot = {"console=ttyS0 quiet", -1, INITRD_SIZE};
+
+    memset(initrd, 0x5a, INITRD_SIZE);
+    fd = write_bzimage(image, 0x20f);
+    boot.initrd_fd = write_file(initrd, INITRD_SIZE);
+    if (fd < 0 || boot.initrd_fd < 0 || !mini_kvm_is_bzimage(fd) ||
+        mini_kvm_load_bzimage(&kvm, fd, IMAGE_SIZE, &boot, &entry) != 0) {
+        printf("failed to load the bzImage\n");
+        return 1;
+    }
+    ret |= check_bzimage(&kvm, image, initrd);
+    if (entry != LINUX_KERNEL_ADDR + 0x200) {
+        printf("bzImage entry is 0x%lx\n", entry);
+        ret |= 1;
+    }
+    close(fd);
+
+    // kernels before the 2.12 protocol have no 64 bits entry point
+    fd = write_bzimage(image, 0x20a);
+    if (fd < 0 || mini_kvm_load_bzimage(&kvm, fd, IMAGE_SIZE, &boot, &entry) == 0) {
+        printf("a bzImage without 64 bits entry point was loaded\n");
+        ret |= 1;
+    }
+    close(fd);
+
+    // the 32 bits PVH entry point is used instead of e_entry
+    fd = write_pvh_image(image);
+    if (fd < 0 || !mini_kvm_is_pvh(fd, IMAGE_SIZE) ||
+        mini_kvm_load_pvh(&kvm, fd, IMAGE_SIZE, &boot, &entry) != 0) {
+        printf("failed to load the PVH image\n");
+        return 1;
+    }
+    ret |= check_pvh(&kvm, initrd);
+    if (entry != PVH_ENTRY) {
+        printf("PVH entry is 0x%lx, expected 0x%x\n", entry, PVH_ENTRY);
+        ret |= 1;
+    }
+
+    // Linux needs memory past the legacy hole for its memory map
+    kvm.mem_size = LINUX_KERNEL_ADDR;
+    if (mini_kvm_load_pvh(&kvm, fd, IMAGE_SIZE, &boot, &entry) == 0) {
+        printf("a kernel was loaded in %lu bytes of memory\n", kvm.mem_size);
+        ret |= 1;
+    }
+    kvm.mem_size = GUEST_MEM_SIZE;
+    close(fd);
+
+    fd = write_image(image, SEGMENTS[0].p_paddr);
+    if (fd < 0 || mini_kvm_is_pvh(fd, IMAGE_SIZE)) {
+        printf("an ELF image without PVH note was detected as PVH\n");
+        ret |= 1;
+    }
+    close(fd);
+    close(boot.initrd_fd);
+
+    munmap(kvm.mem, GUEST_MEM_SIZE);
+    free(image);
+    return ret;
+}
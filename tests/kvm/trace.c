@@ -0,0 +1,50 @@
+#include "kvm/trace.h"
+
+#include <linux/kvm.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// events carry their index in entry_tsc so the copy order can be checked, the slot of the next
+// event is never trusted so a full ring copies one event less than its size
+static int32_t check_copy(MiniKvmTraceRing *ring, MiniKvmTraceEvent *events, uint64_t recorded) {
+    uint64_t expected = (recorded >= MINI_KVM_TRACE_EVENTS) ? MINI_KVM_TRACE_EVENTS - 1 : recorded;
+    uint32_t count = mini_kvm_trace_ring_copy(ring, events);
+
+    if (count != expected) {
+        printf("%lu events recorded, %u copied, expected %lu\n", recorded, count, expected);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (events[i].entry_tsc != recorded - count + i || events[i].reason != KVM_EXIT_IO) {
+            printf("event %u is %lu, expected %lu\n", i, events[i].entry_tsc,
+                   recorded - count + i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int main(void) {
+    MiniKvmTraceRing *ring = mini_kvm_trace_ring_alloc();
+    MiniKvmTraceEvent *events = malloc(MINI_KVM_TRACE_EVENTS * sizeof(MiniKvmTraceEvent));
+    uint64_t recorded = 0;
+    int32_t ret = 0;
+
+    ret |= check_copy(ring, events, 0);
+    for (; recorded < 3 * MINI_KVM_TRACE_EVENTS + 17; recorded++) {
+        mini_kvm_trace_record(ring, recorded, mini_kvm_rdtsc(), KVM_EXIT_IO, 0x3f8, 1);
+        if (recorded == 100 || recorded == MINI_KVM_TRACE_EVENTS) {
+            ret |= check_copy(ring, events, recorded + 1);
+        }
+    }
+    ret |= check_copy(ring, events, recorded);
+
+    mini_kvm_trace_ring_reset(ring);
+    ret |= check_copy(ring, events, 0);
+
+    free(events);
+    free(ring);
+    return ret;
+}
@@ -9,6 +9,8 @@ void print_args(MiniKvmRunArgs *args) {
     printf("vcpu=%u\n", args->vcpu);
     printf("mem_size=%lu\n", args->mem_size);
     printf("name=%s\n", args->name);
+    printf("cpu=%s\n", args->cpu);
+    printf("sync_regs=%d\n", args->sync_regs);
 }
 
 int main(int argc, char **argv) {